@@ -0,0 +1,96 @@
+#ifndef ACD_H
+#define ACD_H
+
+#include <stddef.h>
+
+#include "tu_ext.h"
+
+/*
+ * Automatic call distribution: numbers that queue callers for a group of
+ * agents.
+ *
+ * A caller who dials the number of a queue gets ring back and waits, first
+ * come first served, until an agent is idle (registered and on hook); that
+ * agent then rings.  While waiting, the caller is told its position in the
+ * queue ("QUEUED <position>") on entering and every ACD_UPDATE_INTERVAL
+ * seconds.  If the agent hangs up instead of answering, the caller gets
+ * dial tone back, as when an extension dialed does so.
+ *
+ * Each queue keeps its idle agents in a list, the agent idle the longest
+ * first, which the TU module keeps up to date through the availability hook
+ * (see tu_set_availability_hook()); matching a caller with an agent takes
+ * constant time.  A dispatcher thread does the matching, woken when a
+ * caller arrives or an agent becomes idle, and sends the position updates.
+ *
+ * The queues are defined by the configuration (see config.h).  Each queue
+ * has a mutex of its own, which is never held while taking any other lock
+ * but the dispatcher's; the table of queues is replaced under a read-write
+ * lock, and callers waiting in a queue that remains keep their place.
+ */
+
+/*
+ * Maximum number of agents of a queue.
+ */
+#define ACD_MAX_AGENTS 4096
+
+/*
+ * Interval between position updates, in seconds.
+ */
+#define ACD_UPDATE_INTERVAL 5
+
+/*
+ * Definition of a queue.
+ */
+typedef struct acd_def {
+    EXTNUM number;                  // Number of the queue
+    size_t n;                       // Number of agents
+    EXTNUM *agents;                 // Extensions of the agents, all different
+} ACD_DEF;
+
+/*
+ * Replace all queues.  The agents of the new queues are initially all
+ * unavailable; their availability must be reported again (see
+ * pbx_resync_availability()).  Callers waiting in a queue that is removed
+ * get a busy signal.  The dispatcher thread is started with the first
+ * queue.
+ *
+ * @param defs  Definitions of the queues (copied).
+ * @param n  Number of queues (0 to remove all queues).
+ * @return 0 if successful, -1 if memory could not be allocated (the queues
+ * are then all removed).
+ */
+int acd_configure(const ACD_DEF *defs, size_t n);
+
+/*
+ * Remove all queues and stop the dispatcher thread.
+ */
+void acd_fini(void);
+
+/*
+ * Record that an extension has become idle or not, in every queue of which
+ * it is an agent.  This is called from the availability hook installed by
+ * the PBX, with TU mutexes held.
+ */
+void acd_set_available(EXTNUM ext, int available);
+
+/*
+ * Put a caller with dial tone in a queue.
+ *
+ * @param queue  Number of the queue.
+ * @param caller  The TU calling.
+ * @return 0 if the caller was queued (or, having no dial tone, was just
+ * told its state), -1 if there is no such queue.
+ */
+int acd_enter(EXTNUM queue, TU *caller);
+
+/*
+ * Remove a caller that has hung up from the queue in which it was waiting,
+ * so that it no longer counts as waiting.  This is the abandon hook
+ * installed by the PBX (see tu_set_abandon_hook()).
+ *
+ * @param caller  The TU that hung up.
+ * @param token  The token with which it was waiting.
+ */
+void acd_abandon(TU *caller, const void *token);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdatomic.h>
+
+/*
+ * Admission control of client connections.
+ *
+ * Each connection accepted is checked against three limits before anything
+ * is spent on it (a thread, a TU, a registration):
+ *
+ *   - admission_max_conns: connections open at once;
+ *   - admission_conn_rate: new connections per second, in bursts of up to
+ *     as many (a token bucket, see ratelimit.h);
+ *   - admission_max_setup: calls in setup, that is, TUs hearing ring back
+ *     while the TU called rings or the call waits in a queue.
+ *
+ * A connection over any of them is told "BUSY" and closed at once, so that
+ * a storm of connections is shed at the cost of an accept and a write,
+ * without holding up the clients already connected.  Each limit is 0 for
+ * none, and may be changed at any time (see config.h).
+ *
+ * The statistics report the load against the limits: conns_open and
+ * conns_max, calls_setup and calls_setup_max, conns_accepted and
+ * conn_rate_max, and conns_rejected.
+ */
+extern atomic_ulong admission_max_conns;
+extern atomic_ulong admission_conn_rate;
+extern atomic_ulong admission_max_setup;
+
+/*
+ * Set the limits, and report them in the statistics.
+ *
+ * @param max_conns  Maximum number of connections open, or 0.
+ * @param conn_rate  Maximum new connections per second, or 0.
+ * @param max_setup  Maximum number of calls in setup, or 0.
+ */
+void admission_limit(unsigned long max_conns, unsigned long conn_rate,
+                     unsigned long max_setup);
+
+/*
+ * Decide whether to take on a connection just accepted.  If not, "BUSY" is
+ * written to it (without waiting) and it is closed.  Must only be called
+ * by the thread accepting connections.
+ *
+ * @param fd  File descriptor of the connection.
+ * @return 0 if the connection is admitted, and is then counted as open
+ * until admission_release() is called for it; -1 if it has been rejected.
+ */
+int admission_admit(int fd);
+
+/*
+ * Stop counting a connection admitted as open, once it is closed (or could
+ * not be set up after all).
+ */
+void admission_release(void);
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stddef.h>
+
+#include "server.h"
+#include "tu_ext.h"
+
+/*
+ * Parsing of the command lines sent by clients.
+ *
+ * The commands defined by server.h keep their TU_COMMAND values; commands
+ * added by this server are numbered after them.
+ */
+typedef enum service_command {
+    CMD_PICKUP = TU_PICKUP_CMD,
+    CMD_HANGUP = TU_HANGUP_CMD,
+    CMD_DIAL = TU_DIAL_CMD,
+    CMD_CHAT = TU_CHAT_CMD,
+    CMD_STATS,
+    CMD_EXT,
+    CMD_CAMP,
+    CMD_PAGE,
+    CMD_WATCH,
+    CMD_PING,
+    CMD_INVALID
+} SERVICE_COMMAND;
+
+/*
+ * A parsed command line.  Arguments are not copied: they point into the
+ * line that was parsed, which must outlive this structure.
+ */
+typedef struct command {
+    SERVICE_COMMAND cmd;            // The command
+    EXTNUM ext;                     // Extension to dial, camp on, move to or watch, or -1
+                                    // if malformed
+    const char *arg;                // Message for chat or page (NUL-terminated), or number
+                                    // for dial, camp or ext
+    size_t arg_len;                 // Length of the message or number
+} COMMAND;
+
+/*
+ * Parse a command line.  The line must be NUL-terminated and must not
+ * include the end-of-line sequence.
+ *
+ * The command word is recognized by a switch on its length and first byte
+ * (and, for "chat" and "camp" and for "page" and "ping", its second byte).  The extension for "dial",
+ * "camp", "ext" or "watch" must be a decimal number that fits in an EXTNUM; otherwise
+ * ext is set to -1, so that dialing it gets the ERROR response.
+ * The number is also left in arg as typed, for the dial plan, which accepts
+ * numbers such as "*7100" that are not extensions.
+ *
+ * @param line  The command line.
+ * @param len  Length of the line.
+ * @param cp  Structure to receive the result.
+ * @return 0 if the line is a valid command, -1 otherwise (cp->cmd is then
+ * CMD_INVALID).
+ */
+int command_parse(const char *line, size_t len, COMMAND *cp);
+
+/*
+ * Get the name of a command, for tracing.
+ */
+const char *command_name(SERVICE_COMMAND cmd);
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef CONF_H
+#define CONF_H
+
+#include "tu_ext.h"
+
+/*
+ * Conference rooms: calls joining any number of TUs, in which each chat
+ * message goes to every member but its sender.
+ *
+ * A TU with dial tone joins a room by dialing a number that the dial plan
+ * maps to it (see dialplan.h), and leaves by hanging up.  A room exists
+ * while it has members.
+ *
+ * The members of a room are kept in an array of slots, which chat messages
+ * are sent through without any lock: the message is formatted once into a
+ * shared buffer (see outq.h) and a reference to it is queued for each member,
+ * without taking the mutex of any TU.  Joining fills a free slot, leaving
+ * empties one, and either takes only the lock of the room, so neither holds
+ * up the delivery of messages to the other members.  When the array is full
+ * it is replaced by one twice as large, and the old array, like a TU that
+ * has left, is released only after a grace period (see epoch.h).
+ */
+typedef struct conf_room CONF_ROOM;
+
+/*
+ * Maximum number of members of a room.
+ */
+#define CONF_MAX_MEMBERS 1024
+
+/*
+ * Join a TU that has dial tone to a room, which is created if it does not
+ * exist (see tu_join()).
+ *
+ * @param number  Number of the room.
+ * @param tu  The TU joining.
+ * @return 0 if the TU joined, -1 otherwise.
+ */
+int conf_join(EXTNUM number, TU *tu);
+
+/*
+ * Get the number of a room.
+ */
+EXTNUM conf_number(const CONF_ROOM *room);
+
+/*
+ * Take or release a reference to a room.  Each member holds one, so a
+ * member may take another without any lock; the room is freed with the
+ * last.
+ */
+void conf_hold(CONF_ROOM *room);
+void conf_release(CONF_ROOM *room);
+
+/*
+ * Send a chat message to every member of a room but its sender.  No lock
+ * may be held.
+ *
+ * @param room  The room, of which the caller holds a reference.
+ * @param sender  The TU sending the message.
+ * @param msg  The message (without "CHAT" or a line terminator).
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+int conf_chat(CONF_ROOM *room, TU *sender, const char *msg);
+
+/*
+ * Add a TU to the members of a room, or remove it.  These are called by the
+ * TU module with the TU mutex held, which orders them with the other changes
+ * to the TU; conf_retire() must be called once it has been released.
+ *
+ * conf_enter() gives the member the caller's reference to the room, and
+ * takes a reference to the TU.  It fails if the room is full.
+ *
+ * @param old  Set to the array of slots replaced, if any, or NULL.
+ * @return 0 if successful, -1 otherwise.
+ */
+int conf_enter(CONF_ROOM *room, TU *tu, void **old);
+void conf_exit(CONF_ROOM *room, TU *tu);
+
+/*
+ * Complete a change of membership, when no lock is held: free an array of
+ * slots replaced, and release the reference to a TU that left, once no
+ * chat message can be using them.
+ *
+ * @param old  Array of slots replaced by conf_enter(), or NULL.
+ * @param left  TU removed by conf_exit(), or NULL.
+ */
+void conf_retire(void *old, TU *left);
+
+#endif
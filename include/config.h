@@ -0,0 +1,139 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+
+#include "dialplan.h"
+#include "hunt.h"
+#include "acd.h"
+
+/*
+ * Run-time configuration: the dial plan and the limits that can be changed
+ * without restarting the server.
+ *
+ * The configuration is read from the file given with -c, and read again
+ * when the server receives SIGUSR1.  A new configuration is parsed and
+ * compiled completely before it is published with a single atomic pointer
+ * swap, so readers never wait and never see a half-built configuration.
+ * Readers use the configuration within an epoch critical section (see
+ * epoch.h), and the configuration it replaces is freed once every such
+ * section in progress has ended.
+ *
+ * Besides the rules of the dial plan (see dialplan.h), the file may set
+ * limits:
+ *
+ *   limit queue <bytes>    Output queue high-water mark (as -q)
+ *   limit line <bytes>     Maximum command line length (as -l), for new clients
+ *   limit commands <n>     Commands per second of each client (0: no limit)
+ *   limit chat <bytes>     Chat and page bytes per second of each client (0: no limit)
+ *   limit connections <n>  Client connections open at once (0: no limit)
+ *   limit accept <n>       New client connections per second (0: no limit)
+ *   limit setup <n>        Calls in setup for admitting connections (0: no limit)
+ *
+ * A limit that the file does not set has the value given on the command
+ * line (or its default).  The last three are enforced by admission control
+ * (see admission.h), and are off by default.
+ *
+ * And the time after which a TU left in a state is hung up (see
+ * tu_timeouts), with 0 for no limit:
+ *
+ *   timeout ringing <milliseconds>     Ring with no answer
+ *   timeout dialtone <milliseconds>    Dial tone with nothing dialed
+ *   timeout busy <milliseconds>        Busy signal
+ *
+ * and the times after which a silent client connection is probed with TCP
+ * keepalives or shut down (see keepalive.h):
+ *
+ *   timeout keepalive <milliseconds>   service_keepalive_ms
+ *   timeout idle <milliseconds>        service_idle_ms
+ *
+ * A timeout that the file does not set has its default value.
+ *
+ * The file may also define hunt groups (see hunt.h):
+ *
+ *   group <number> ringall|roundrobin|lru <extension>...
+ *
+ * Dialing the number of a group rings its available members, all at once or
+ * one chosen in round-robin or least-recently-used order.  The number of a
+ * group must not have a rule of its own in the dial plan.
+ *
+ * And it may define call queues (see acd.h):
+ *
+ *   queue <number> <agent>...
+ *
+ * Dialing the number of a queue makes the caller wait for the first of the
+ * agents to be idle.  As for a group, the number must have no other rule.
+ */
+typedef struct config {
+    DIALPLAN *dialplan;             // Dial plan (never NULL)
+    size_t queue_limit;             // Output queue high-water mark
+    size_t line_limit;              // Maximum command line length
+    unsigned long cmd_rate;         // Commands per second of a client (0 for no limit)
+    unsigned long chat_rate;        // Message bytes per second of a client (0 for no limit)
+    unsigned long max_conns;        // Admission limits (0 for none)
+    unsigned long conn_rate;
+    unsigned long max_setup;
+    unsigned long ring_timeout;     // Timeouts (milliseconds, 0 for none)
+    unsigned long dial_timeout;
+    unsigned long busy_timeout;
+    unsigned long keepalive_timeout;
+    unsigned long idle_timeout;
+    HUNT_DEF *groups;               // Hunt groups
+    size_t ngroups;                 // Number of hunt groups
+    ACD_DEF *queues;                // Call queues
+    size_t nqueues;                 // Number of call queues
+} CONFIG;
+
+/*
+ * Record the values of the limits given on the command line, which apply
+ * when the configuration file does not set them.  Must be called before
+ * any configuration is loaded.
+ */
+void config_init(void);
+
+/*
+ * Read and compile a configuration file.  Errors are reported on standard
+ * error with the line at fault.
+ *
+ * @return  The configuration, or NULL if the file cannot be read or is
+ * invalid.
+ */
+CONFIG *config_load(const char *path);
+
+/*
+ * Free a configuration that has not been published.
+ */
+void config_free(CONFIG *cf);
+
+/*
+ * Make a configuration current, replacing any previous one, which is freed
+ * after a grace period.  The limits, timeouts, hunt groups and queues it
+ * sets take effect immediately.
+ */
+void config_publish(CONFIG *cf);
+
+/*
+ * Get the current configuration.  Must be called within an epoch critical
+ * section, and the configuration must not be used after it ends.
+ *
+ * @return  The configuration, or NULL if none has been published.
+ */
+const CONFIG *config_get(void);
+
+/*
+ * Load a configuration file and publish it, as on SIGUSR1.  The time taken
+ * is recorded in the statistics.  If the file is invalid, the current
+ * configuration is kept.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int config_reload(const char *path);
+
+/*
+ * Retire the current configuration and remove the hunt groups and the
+ * queues, whose waiting callers get a busy signal.  No configuration can be
+ * published afterward.
+ */
+void config_fini(void);
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef DIALPLAN_H
+#define DIALPLAN_H
+
+#include <stddef.h>
+
+#include "tu_ext.h"
+
+/*
+ * Dial plan: rules that route a dialed number by its prefix.
+ *
+ * Numbers are strings of the symbols 0-9, '*' and '#'.  The rules are
+ * compiled into a trie whose nodes are stored in a single array, each
+ * holding a bitmap of the symbols for which it has children and the index
+ * of the first of them (the children of a node are contiguous).  A lookup
+ * therefore takes one step per symbol dialed, whatever the number of rules.
+ *
+ * A compiled dial plan is never modified, so any number of threads may use
+ * it at once.
+ */
+typedef struct dialplan DIALPLAN;
+
+/*
+ * What a rule does with a number that it matches.
+ */
+typedef enum dialplan_action {
+    DP_ALIAS,       // The number (exactly) rings an extension
+    DP_ROUTE,       // Any number with the prefix rings an extension (e.g. a trunk)
+    DP_MAP,         // The prefix and an extension N ring extension base + N
+    DP_PICKUP,      // The prefix and an extension answer the call ringing there
+    DP_GROUP,       // The number (exactly) rings a hunt group (see hunt.h)
+    DP_QUEUE,       // The number (exactly) queues for an agent (see acd.h)
+    DP_CONFERENCE   // The prefix and a number N join conference room N (see conf.h)
+} DIALPLAN_ACTION;
+
+/*
+ * A rule, as given to dialplan_compile().
+ */
+typedef struct dialplan_rule {
+    DIALPLAN_ACTION action;         // What to do
+    const char *prefix;             // Number or prefix matched (NUL-terminated)
+    EXTNUM ext;                     // Extension, base for DP_MAP, or group or queue for
+                                    // DP_GROUP and DP_QUEUE (unused for DP_PICKUP
+                                    // and DP_CONFERENCE)
+} DIALPLAN_RULE;
+
+/*
+ * The outcome of looking up a number.
+ */
+typedef struct dialplan_match {
+    DIALPLAN_ACTION action;         // Action of the rule that matched
+    EXTNUM ext;                     // Extension to ring, or to pick up from, group, queue
+                                    // or conference room
+} DIALPLAN_MATCH;
+
+/*
+ * Maximum length of a prefix, in symbols.
+ */
+#define DIALPLAN_MAX_PREFIX 32
+
+/*
+ * Compile a set of rules.  The rules are copied, so the caller may free
+ * them afterwards.
+ *
+ * @param rules  The rules.
+ * @param n  Number of rules.
+ * @param dup  If not NULL and two rules have the same prefix, set to the
+ * index of the later of them.
+ * @return  The dial plan, or NULL if a prefix is invalid, two rules have the
+ * same prefix, or memory could not be allocated.
+ */
+DIALPLAN *dialplan_compile(const DIALPLAN_RULE *rules, size_t n, size_t *dup);
+
+/*
+ * Parse a rule, given as the words of a line of a configuration file:
+ *
+ *   alias <number> <extension>
+ *   route <prefix> <extension>
+ *   map <prefix> <base>
+ *   pickup <prefix>
+ *   conference <prefix>
+ *
+ * DP_GROUP and DP_QUEUE rules are made from the definitions of hunt groups
+ * and queues instead (see config.h).
+ *
+ * @param words  The words.
+ * @param n  Number of words.
+ * @param rule  Set to the rule.  Its prefix points to words[1].
+ * @param err  Set to a description of the problem if the words are not a
+ * valid rule.
+ * @return 0 if successful, -1 otherwise.
+ */
+int dialplan_parse_rule(char **words, int n, DIALPLAN_RULE *rule, const char **err);
+
+/*
+ * Free a dial plan.
+ */
+void dialplan_free(DIALPLAN *dp);
+
+/*
+ * Get the number of rules in a dial plan.
+ */
+size_t dialplan_rules(const DIALPLAN *dp);
+
+/*
+ * Route a dialed number.  Of the rules that match it, the one with the
+ * longest prefix applies.  An alias or group only matches the whole number, and
+ * DP_MAP, DP_PICKUP and DP_CONFERENCE rules only match if the prefix is
+ * followed by an extension or room number.
+ *
+ * @param digits  The number dialed (need not be NUL-terminated).
+ * @param len  Its length.
+ * @param m  Set to the outcome if a rule matches.
+ * @return 0 if a rule matches, -1 otherwise.
+ */
+int dialplan_lookup(const DIALPLAN *dp, const char *digits, size_t len,
+                    DIALPLAN_MATCH *m);
+
+/*
+ * Convert a string of decimal digits to an extension number.
+ *
+ * @return  The number, or -1 if the string is empty, contains anything but
+ * digits, or is too large.
+ */
+EXTNUM dialplan_number(const char *digits, size_t len);
+
+#endif
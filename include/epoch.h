@@ -0,0 +1,45 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch-based reclamation.
+ *
+ * Readers that follow shared pointers without taking a lock bracket their
+ * accesses with epoch_enter() and epoch_exit().  A writer that has unlinked
+ * an object passes it to epoch_retire() instead of destroying it directly;
+ * the destructor is run only once every reader that might still hold the
+ * pointer has left its critical section.
+ *
+ * Critical sections may nest, and must not block indefinitely, since that
+ * would hold up the reclamation of every retired object.
+ */
+
+/*
+ * Enter a read-side critical section.
+ */
+void epoch_enter(void);
+
+/*
+ * Leave a read-side critical section.  This may run the destructors of
+ * objects whose grace period has ended, so it must not be called with any
+ * lock held that those destructors need.
+ */
+void epoch_exit(void);
+
+/*
+ * Arrange for a destructor to be called on an object once all the read-side
+ * critical sections in progress have ended.  The same restrictions on the
+ * locks held apply as for epoch_exit().
+ *
+ * @param fn  The destructor.
+ * @param arg  The object.
+ */
+void epoch_retire(void (*fn)(void *), void *arg);
+
+/*
+ * Wait until the destructors of all the objects retired so far have been
+ * run.  Must not be called from within a critical section.
+ */
+void epoch_barrier(void);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef EXTALLOC_H
+#define EXTALLOC_H
+
+#include <stddef.h>
+
+/*
+ * Extension number allocator.
+ *
+ * Free extension numbers are tracked in a hierarchical bitmap: each bit of
+ * the bottom level stands for one number, and each bit of a higher level
+ * says whether the corresponding word of the level below has any bit set.
+ * With 64-bit words, finding the lowest free number takes one count of
+ * trailing zeros per level (three levels cover 262144 numbers, four cover
+ * over sixteen million), and claiming or releasing a number touches at most
+ * one word per level.
+ *
+ * An EXTALLOC does no locking of its own; the owner must serialize access.
+ */
+typedef struct extalloc EXTALLOC;
+
+/*
+ * Largest capacity supported.
+ */
+#define EXTALLOC_MAX_CAPACITY (1 << 24)
+
+/*
+ * Create an allocator for the numbers 0 to capacity - 1, all initially free.
+ *
+ * @return  The allocator, or NULL if capacity is out of range or memory could
+ * not be allocated.
+ */
+EXTALLOC *extalloc_init(size_t capacity);
+
+void extalloc_fini(EXTALLOC *ea);
+
+/*
+ * Allocate the lowest free number.
+ *
+ * @return  The number, or -1 if all are in use.
+ */
+int extalloc_get(EXTALLOC *ea);
+
+/*
+ * Allocate a specific number.
+ *
+ * @return 0 if the number was free and is now allocated, -1 if it is in use
+ * or out of range.
+ */
+int extalloc_claim(EXTALLOC *ea, int ext);
+
+/*
+ * Release a number previously allocated.
+ */
+void extalloc_put(EXTALLOC *ea, int ext);
+
+/*
+ * Get the number of numbers that the allocator can hand out.
+ */
+size_t extalloc_capacity(EXTALLOC *ea);
+
+#endif
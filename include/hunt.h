@@ -0,0 +1,90 @@
+#ifndef HUNT_H
+#define HUNT_H
+
+#include <stddef.h>
+
+#include "tu_ext.h"
+
+/*
+ * Hunt groups: numbers that ring a group of extensions.
+ *
+ * A group either rings all its available members at once, the first to
+ * pick up taking the call, or rings one member chosen in round-robin or
+ * least-recently-used order.  A member is available while it is registered
+ * and on hook.  The TU module reports every change in availability (see
+ * tu_set_availability_hook()), and each group keeps its available members
+ * in a two-level bitmap, for round-robin order and ringing all, and in a
+ * list ordered by the time they became available or were last chosen, for
+ * least-recently-used order.  Either way a member is chosen in constant time.
+ *
+ * The groups are defined by the configuration (see config.h).  Each group
+ * has a mutex of its own, which is never held while taking any other lock;
+ * the table of groups is replaced under a read-write lock.
+ */
+
+/*
+ * How a group chooses the members to ring.
+ */
+typedef enum hunt_policy {
+    HUNT_RING_ALL,                  // Ring every available member
+    HUNT_ROUND_ROBIN,               // Ring the next available member after the last chosen
+    HUNT_LRU                        // Ring the member available for longest
+} HUNT_POLICY;
+
+/*
+ * Maximum number of members in a group, and in a group that rings all its
+ * members at once.
+ */
+#define HUNT_MAX_MEMBERS 4096
+#define HUNT_MAX_RING_ALL TU_MAX_RING
+
+/*
+ * Definition of a group.
+ */
+typedef struct hunt_def {
+    EXTNUM number;                  // Number of the group
+    HUNT_POLICY policy;             // How to choose members
+    size_t n;                       // Number of members
+    EXTNUM *members;                // Extensions of the members, all different
+} HUNT_DEF;
+
+/*
+ * Parse the name of a policy.
+ *
+ * @return  The policy, or -1 if the name is unknown.
+ */
+int hunt_policy(const char *name);
+
+/*
+ * Replace all groups.  The members of the new groups are initially all
+ * unavailable; their availability must be reported again (see
+ * pbx_resync_availability()).
+ *
+ * @param defs  Definitions of the groups (copied).
+ * @param n  Number of groups (0 to remove all groups).
+ * @return 0 if successful, -1 if memory could not be allocated (the groups
+ * are then all removed).
+ */
+int hunt_configure(const HUNT_DEF *defs, size_t n);
+
+/*
+ * Record that an extension has become available or unavailable, in every
+ * group of which it is a member.  This is the hook called by the TU module,
+ * and may be called with TU mutexes held.
+ */
+void hunt_set_available(EXTNUM ext, int available);
+
+/*
+ * Choose the members of a group to ring.  For HUNT_RING_ALL, these are all
+ * the available members; otherwise the member chosen is considered used, so
+ * that the next call goes to another member.
+ *
+ * @param group  Number of the group.
+ * @param exts  Array to receive the extensions of the members chosen.
+ * @param max  Size of the array (at least HUNT_MAX_RING_ALL).
+ * @return  The number of members chosen (0 if none is available), or -1 if
+ * there is no such group.
+ */
+int hunt_select(EXTNUM group, EXTNUM *exts, int max);
+
+#endif
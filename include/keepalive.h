@@ -0,0 +1,58 @@
+#ifndef KEEPALIVE_H
+#define KEEPALIVE_H
+
+/*
+ * Liveness of client connections.
+ *
+ * A client whose host vanishes without closing its connection (it crashes,
+ * loses power or is cut off) leaves behind a ghost: a connection on which
+ * nothing will ever arrive, and a registered extension that can still be
+ * rung.  Ghosts are found in two ways:
+ *
+ *   - The kernel probes a connection that has been silent for
+ *     service_keepalive_ms (see service.h) with TCP keepalives, every
+ *     KEEPALIVE_INTERVAL seconds, and gives up after KEEPALIVE_PROBES
+ *     unanswered probes; output left unacknowledged as long is given up on
+ *     as well.  Reading from the connection then fails.
+ *
+ *   - If service_idle_ms is not 0, a connection on which nothing at all has
+ *     been received for that long is shut down.  A client that has nothing
+ *     to say but wants to stay connected sends "ping", which is answered
+ *     with "PONG".  Each connection has a timer in the timing wheel (see
+ *     timer.h), which is not touched as input arrives: when it expires, it
+ *     is armed again for the rest of the time if there has been input since
+ *     it was armed.
+ *
+ * Either way, the connection is then closed as if the client had closed it,
+ * so its TU is hung up and unregistered in the usual way.
+ */
+
+/*
+ * Interval between TCP keepalive probes, in seconds, and number of probes
+ * unanswered after which a connection is dropped.
+ */
+#define KEEPALIVE_INTERVAL 10
+#define KEEPALIVE_PROBES 3
+
+/*
+ * Period over which the rate of ghosts reaped is reported, in milliseconds.
+ */
+#define KEEPALIVE_RATE_PERIOD 60000
+
+/*
+ * Set up TCP keepalive on a client connection, according to the current
+ * value of service_keepalive_ms.  Failures are ignored: the connection is
+ * just not probed.
+ *
+ * @param fd  File descriptor of the connection.
+ */
+void keepalive_tune(int fd);
+
+/*
+ * Count a ghost reaped.  The total is reported as ghosts_reaped in the
+ * statistics, and the number reaped during the last full period of
+ * KEEPALIVE_RATE_PERIOD as ghosts_per_minute.
+ */
+void keepalive_reaped(void);
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef LINEBUF_H
+#define LINEBUF_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Line-oriented input buffer for a client connection.
+ *
+ * Input is read straight into a fixed-size ring buffer, which is scanned
+ * for line terminators with memchr() (vectorized by the C library).  All
+ * the complete lines delivered by one read can then be taken from the
+ * buffer one after another, without copying them in the usual case and
+ * without allocating any memory after the buffer has been created.
+ *
+ * A line longer than the limit given when the buffer was created is
+ * rejected: it is discarded, and counted, rather than causing the buffer
+ * to grow.
+ *
+ * A LINEBUF does no locking of its own; the owner must serialize access.
+ */
+typedef struct linebuf LINEBUF;
+
+/*
+ * Create a line buffer.
+ *
+ * @param max  Maximum length of a line, not counting its terminator.
+ * @return  The new buffer, or NULL if memory could not be allocated.
+ */
+LINEBUF *linebuf_create(size_t max);
+
+void linebuf_destroy(LINEBUF *lb);
+
+/*
+ * Receive input from a socket into the free space of a buffer.
+ *
+ * @param fd  The socket.
+ * @param flags  Flags for recvmsg() (e.g. MSG_DONTWAIT).
+ * @return  Number of bytes received, 0 on EOF, or -1 on error (with errno
+ * set as by recvmsg()).
+ */
+ssize_t linebuf_recv(LINEBUF *lb, int fd, int flags);
+
+/*
+ * Copy input that has already been received by other means into the free
+ * space of a buffer.
+ *
+ * @return  Number of bytes copied, which may be less than len if the buffer
+ * is full.  Lines must then be taken with linebuf_next() to make room.
+ */
+size_t linebuf_put(LINEBUF *lb, const char *data, size_t len);
+
+/*
+ * Take the next complete line from a buffer.  The line terminator ("\n" or
+ * "\r\n") is removed and the line is NUL-terminated.
+ *
+ * @param lenp  If not NULL, set to the length of the line.
+ * @return  The line, which remains valid until the next call on the buffer,
+ * or NULL if the buffer holds no complete line.
+ */
+char *linebuf_next(LINEBUF *lb, size_t *lenp);
+
+/*
+ * Check whether a buffer holds a complete line, without taking it.
+ *
+ * @return  1 if so, 0 otherwise.
+ */
+int linebuf_ready(LINEBUF *lb);
+
+/*
+ * Get the number of over-long lines that have been rejected by a buffer,
+ * and reset the count.
+ */
+unsigned linebuf_rejected(LINEBUF *lb);
+
+#endif
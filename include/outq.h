@@ -0,0 +1,141 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdatomic.h>
+
+/*
+ * Outbound message queue.
+ *
+ * Each TU queues the messages destined for its client here rather than
+ * writing them to the network while it holds its mutex.  The queue is
+ * drained later, without blocking, by whichever thread is responsible
+ * for the client's output.
+ *
+ * An OUTQ does no locking of its own; the owner must serialize access.
+ */
+
+/*
+ * Messages no longer than this are stored in the queue itself, so queueing
+ * a state-change notification does not allocate.
+ */
+#define OUTQ_INLINE 48
+
+/*
+ * Default limit on the number of bytes queued for a single client.
+ */
+#define OUTQ_DEFAULT_HIWAT (64 * 1024)
+
+/*
+ * A message shared by several queues, such as a chat message sent to every
+ * member of a conference: it is formatted once, and each queue holding it
+ * has a reference instead of a copy.  It is never modified once queued.
+ */
+typedef struct outq_buf {
+    atomic_uint refs;               // Number of references
+    size_t len;                     // Length of the message
+    char data[];                    // The message
+} OUTQ_BUF;
+
+typedef struct outq_msg {
+    size_t len;                     // Length of the message
+    size_t off;                     // Number of bytes already sent
+    char *ext;                      // Message data if not stored inline
+    OUTQ_BUF *buf;                  // Shared message data, if any (referenced)
+    char small[OUTQ_INLINE];        // Message data if short enough
+} OUTQ_MSG;
+
+typedef struct outq {
+    OUTQ_MSG *msgs;                 // Circular array of queued messages
+    unsigned head;                  // Index of the oldest message
+    unsigned count;                 // Number of messages queued
+    unsigned cap;                   // Capacity of the array (power of 2)
+    size_t bytes;                   // Number of bytes not yet sent
+} OUTQ;
+
+/*
+ * Counts of the work done by outq_send() or outq_drain(), so that callers
+ * can tell how many messages went out per write.
+ */
+typedef struct outq_counts {
+    unsigned writes;                // Writes (or buffers filled)
+    unsigned msgs;                  // Messages completely written
+} OUTQ_COUNTS;
+
+/*
+ * High-water mark: the maximum number of bytes that may be queued for a
+ * client.  A client whose queue would grow beyond this is disconnected as
+ * a slow consumer.  It may be changed at any time (see config.h).
+ */
+extern atomic_size_t outq_hiwat;
+
+void outq_init(OUTQ *q);
+void outq_fini(OUTQ *q);
+
+/*
+ * Append a copy of a message to a queue.
+ *
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+int outq_push(OUTQ *q, const char *data, size_t len);
+
+/*
+ * Append a shared message to a queue, which takes a reference to it.
+ *
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+int outq_push_buf(OUTQ *q, OUTQ_BUF *buf);
+
+/*
+ * Allocate a shared message, with one reference held by the caller, who
+ * fills in its data.
+ *
+ * @param len  Length of the message.
+ * @return  The message, or NULL if memory could not be allocated.
+ */
+OUTQ_BUF *outq_buf_new(size_t len);
+
+/*
+ * Release a reference to a shared message, which is freed with the last.
+ */
+void outq_buf_release(OUTQ_BUF *buf);
+
+/*
+ * Describe the unsent data at the head of a queue with an I/O vector.
+ *
+ * @param iov  Array to be filled in.
+ * @param max  Number of elements in the array.
+ * @return  Number of elements filled in.
+ */
+int outq_iov(OUTQ *q, struct iovec *iov, int max);
+
+/*
+ * Remove a number of bytes from the head of a queue, after they have been
+ * sent.
+ *
+ * @return  Number of messages completely removed.
+ */
+unsigned outq_consume(OUTQ *q, size_t n);
+
+/*
+ * Copy up to a given number of bytes from the head of a queue into a buffer
+ * and remove them from the queue.
+ *
+ * @param counts  If not NULL, updated with the work done.
+ * @return  Number of bytes copied.
+ */
+size_t outq_drain(OUTQ *q, char *buf, size_t max, OUTQ_COUNTS *counts);
+
+/*
+ * Send as much of the queued data as the socket will take without blocking.
+ * All queued messages (up to a limit) are gathered into each sendmsg() call.
+ *
+ * @param counts  If not NULL, updated with the work done.
+ * @return  Number of bytes sent (possibly 0 if the socket is full), or -1
+ * if an error other than EAGAIN occurred.
+ */
+ssize_t outq_send(OUTQ *q, int fd, OUTQ_COUNTS *counts);
+
+#endif
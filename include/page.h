@@ -0,0 +1,47 @@
+#ifndef PAGE_H
+#define PAGE_H
+
+#include <stddef.h>
+
+#include "pbx.h"
+#include "tu_ext.h"
+
+/*
+ * Paging: an announcement sent to every registered TU that is on hook.
+ *
+ * A page takes a snapshot of the registered TUs (see pbx_snapshot()), which
+ * holds the PBX mutex only while the TUs are listed, and formats the message
+ * once into a shared buffer (see outq.h).  A pager thread then delivers it,
+ * a batch of TUs at a time, while the client that paged carries on; each TU
+ * on hook is sent "PAGE <message>", and a TU whose client cannot take it
+ * just misses it, without holding up the others.  Once every TU has been
+ * tried, the client that paged is told "PAGED <count> <microseconds>": the
+ * number of TUs the message was queued for and the time taken, from the
+ * page to the last of them.
+ *
+ * Pages are delivered one after another, in the order they were made.
+ */
+
+/*
+ * Number of TUs a page is delivered to in one batch.
+ */
+#define PAGE_BATCH 64
+
+/*
+ * Page every registered TU on hook but the one paging.  The pager thread is
+ * started with the first page.
+ *
+ * @param pbx  The PBX.
+ * @param from  The TU paging.
+ * @param msg  The message (without "PAGE" or a line terminator).
+ * @param len  Its length.
+ * @return 0 if the page is under way, -1 if memory could not be allocated.
+ */
+int page_send(PBX *pbx, TU *from, const char *msg, size_t len);
+
+/*
+ * Finish delivering the pages made so far and stop the pager thread.
+ */
+void page_fini(void);
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef PBX_EXT_H
+#define PBX_EXT_H
+
+#include <stddef.h>
+
+#include "pbx.h"
+#include "tu_ext.h"
+
+/*
+ * Additional PBX operations, beyond those declared in pbx.h.
+ *
+ * Extension numbers are not tied to file descriptors.  TUs are found by
+ * number in a hash table (see registry.h), so numbers may be sparse and up
+ * to 18 digits long.  Numbers for new TUs are handed out by an allocator
+ * (see extalloc.h) from the range 0 to pbx_max_extensions - 1, and
+ * pbx_max_extensions replaces PBX_MAX_EXTENSIONS as the limit on the number
+ * of TUs.
+ */
+
+/*
+ * Default number of extensions supported by a PBX.
+ */
+#define PBX_DEFAULT_EXTENSIONS 262144
+
+/*
+ * Number of extensions supported by the PBX.  Must be set before pbx_init()
+ * is called.
+ */
+extern size_t pbx_max_extensions;
+
+/*
+ * Register a TU with a PBX under the lowest free extension number.
+ *
+ * @param pbx  The PBX.
+ * @param tu  The TU to be registered.
+ * @return  The extension assigned, or -1 if there is no free extension or
+ * the PBX is shutting down.
+ */
+int pbx_register_next(PBX *pbx, TU *tu);
+
+/*
+ * Move a registered TU to an extension chosen by its client.  This is only
+ * possible while the TU is on hook.  Either way, the client is notified of
+ * its current state (and so of its extension number).
+ *
+ * @param pbx  The PBX.
+ * @param tu  The TU to be moved.
+ * @param ext  The extension requested.
+ * @return 0 if the TU has been moved, -1 if the extension is in use or out
+ * of range or the TU is not on hook.
+ */
+int pbx_renumber(PBX *pbx, TU *tu, EXTNUM ext);
+
+/*
+ * Register a TU under any extension number (pbx_register() is limited to
+ * numbers that fit in an int).
+ *
+ * @return 0 if successful, -1 if the number is in use or invalid, or the
+ * PBX is full or shutting down.
+ */
+int pbx_register_number(PBX *pbx, TU *tu, EXTNUM ext);
+
+/*
+ * Dial any extension number (pbx_dial() is limited to numbers that fit in
+ * an int).  An unknown number gets the ERROR state, as with pbx_dial().
+ */
+int pbx_dial_number(PBX *pbx, TU *tu, EXTNUM ext);
+
+/*
+ * Dial a number as typed by a client, which may include '*' and '#'.  The
+ * number is first looked up in the dial plan of the current configuration
+ * (see config.h), if there is one; if no rule
+ * matches, it is taken as an extension number.  A number that the dial
+ * plan gives to a hunt group rings the members the group chooses (see
+ * hunt.h).  pbx_dial() and pbx_dial_number() go through here too.
+ *
+ * @param digits  The number (need not be NUL-terminated).
+ * @param len  Its length.
+ * @return 0 if successful, -1 otherwise.
+ */
+int pbx_dial_digits(PBX *pbx, TU *tu, const char *digits, size_t len);
+
+/*
+ * Camp on the extension that a number rings, as typed by a client (see
+ * tu_camp()).  The number goes through the dial plan as for
+ * pbx_dial_digits(); one that does not ring a single extension is dialed.
+ *
+ * @param digits  The number (need not be NUL-terminated).
+ * @param len  Its length.
+ * @return 0 if successful, -1 otherwise.
+ */
+int pbx_camp_digits(PBX *pbx, TU *tu, const char *digits, size_t len);
+
+/*
+ * List the TUs currently registered with a PBX, in time proportional to
+ * their number.  A reference is taken to each TU listed, which the caller
+ * must release with tu_unref() before freeing the array.
+ *
+ * @param pbx  The PBX.
+ * @param tusp  Set to an array, allocated with malloc(), of the TUs.
+ * @return  Number of TUs in the array.
+ */
+size_t pbx_snapshot(PBX *pbx, TU ***tusp);
+
+/*
+ * Report every registered TU that is available for calls to the hunt groups
+ * and queues again, as after they have been replaced (see hunt_configure()
+ * and acd_configure()).
+ */
+void pbx_resync_availability(PBX *pbx);
+
+/*
+ * Find the TU registered under an extension.  A reference is taken to it,
+ * which the caller must release with tu_unref().
+ *
+ * @return  The TU, or NULL if no TU has the extension.
+ */
+TU *pbx_lookup(PBX *pbx, EXTNUM ext);
+
+#endif
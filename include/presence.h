@@ -0,0 +1,72 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include "pbx.h"
+#include "tu_ext.h"
+
+/*
+ * Presence: clients watching the state of extensions, as the busy lamp
+ * field of a receptionist's console does.
+ *
+ * A client that watches an extension is sent "STATE <extension> <state>",
+ * where the state is named as in the notifications ("ON HOOK", "RINGING",
+ * ...) or is "UNREGISTERED" if no TU has the extension, once when it starts
+ * watching and then whenever the state of the extension changes.
+ *
+ * The extensions being watched are kept in a registry (see registry.h) that
+ * maps each to its watchers.  The TU module reports each state change of a
+ * registered TU with presence_changed(), which costs one atomic load when no
+ * extension is watched and one lookup in the registry otherwise, and only
+ * schedules the extension if it is watched.  The watchers are told when the
+ * batch of TU operations ends, without any TU mutex held, and only of the
+ * latest state: changes made in the same batch, or while the extension was
+ * already scheduled, are coalesced, and a state they already have is not
+ * sent again.  Each event is formatted once and shared by the output queues
+ * of all the watchers (see outq.h).
+ */
+
+/*
+ * State of an extension that no TU has.
+ */
+#define PRESENCE_NONE (-1)
+
+/*
+ * Maximum number of extensions that one TU may watch.
+ */
+#define PRESENCE_MAX_WATCH 1024
+
+/*
+ * Make a TU watch an extension, and tell it the current state of the
+ * extension.  Watching an extension again just tells the state again.
+ *
+ * @param pbx  The PBX, in which the extension is looked up.
+ * @param watcher  The TU watching.
+ * @param ext  The extension to watch.
+ * @return 0 if successful, -1 if the extension is invalid, the TU watches
+ * too many extensions already, or memory could not be allocated.
+ */
+int presence_watch(PBX *pbx, TU *watcher, EXTNUM ext);
+
+/*
+ * Stop a TU watching any extension, as its client has disconnected.
+ */
+void presence_unwatch_all(TU *watcher);
+
+/*
+ * Report the state of an extension.  This is called by the TU module with
+ * the TU mutex held, within a batch (see tu_batch_begin()).
+ *
+ * @param ext  The extension.
+ * @param state  Its state (a TU_STATE), or PRESENCE_NONE.
+ */
+void presence_changed(EXTNUM ext, int state);
+
+/*
+ * Tell the watchers of the extensions reported by the calling thread since
+ * the last call.  This is called by the TU module when a batch ends, with no
+ * lock held, if presence_due() is nonzero.
+ */
+int presence_due(void);
+void presence_flush(void);
+
+#endif
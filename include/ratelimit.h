@@ -0,0 +1,43 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+/*
+ * Token buckets, limiting the rate of something (e.g. the commands of a
+ * client) to a number of units per second, with bursts of up to a given
+ * number of units.
+ *
+ * A bucket holds tokens, in thousandths of a unit, and is refilled at the
+ * rate, in thousandths per millisecond, each time tokens are taken from it,
+ * from the time elapsed since the last time.  A bucket is used by a single
+ * thread at a time (e.g. the one servicing the connection it belongs to),
+ * so it needs no lock and no atomic operation: taking tokens is a few
+ * arithmetic operations on the bucket.
+ */
+typedef struct rate_bucket {
+    unsigned long tokens;           // Tokens held, in thousandths of a unit
+    unsigned long stamp;            // Time of the last refill (milliseconds)
+} RATE_BUCKET;
+
+/*
+ * Initialize a bucket, which is full.
+ *
+ * @param b  The bucket.
+ * @param now  The current time, in milliseconds.
+ */
+void rate_init(RATE_BUCKET *b, unsigned long now);
+
+/*
+ * Take tokens from a bucket, if it holds enough.
+ *
+ * @param b  The bucket.
+ * @param rate  Units per second, or 0 for no limit.
+ * @param burst  Number of units the bucket holds when full.
+ * @param n  Number of units to take.
+ * @param now  The current time, in milliseconds.
+ * @return 0 if the tokens were taken (or there is no limit), -1 if the
+ * bucket does not hold enough (none are then taken).
+ */
+int rate_take(RATE_BUCKET *b, unsigned long rate, unsigned long burst, unsigned long n,
+              unsigned long now);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+/*
+ * Event-driven server mode.
+ *
+ * Instead of creating one thread per client, a fixed number of "reactor"
+ * threads is started.  Each reactor waits with epoll(7) on the connections
+ * it owns and services whichever of them have input available.
+ */
+
+/*
+ * Start the reactor threads.
+ *
+ * @param nthreads  Number of reactor threads to start.  If this is zero or
+ * negative, one thread is started per online processor.
+ * @return 0 if successful, -1 otherwise.
+ */
+int reactor_start(int nthreads);
+
+/*
+ * Hand a newly accepted client connection to one of the reactors.
+ * The TU for the client is created and registered with the PBX before
+ * this function returns.
+ *
+ * @param fd  File descriptor of the client connection.
+ * @return 0 if successful, -1 otherwise, in which case fd has been closed.
+ */
+int reactor_add(int fd);
+
+/*
+ * Stop the reactor threads and wait for them to exit.
+ * This should be called only after pbx_shutdown() has returned, so that
+ * all client connections have already been closed.
+ */
+void reactor_stop(void);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Registry mapping 64-bit extension numbers to values.
+ *
+ * The registry is an open-addressing hash table with linear probing over
+ * a flat array of slots, so a lookup usually touches a single cache line.
+ * When the table gets too full a larger one is allocated, and the entries
+ * are moved across a few slots at a time by subsequent insertions and
+ * removals, so that no single registration stalls for a whole rehash.
+ *
+ * Lookups take no lock: they must be done within an epoch critical section
+ * (see epoch.h), and a value found is only guaranteed to remain valid until
+ * the end of that section.  Insertions and removals must be serialized by
+ * the caller.
+ */
+typedef struct registry REGISTRY;
+
+/*
+ * Value that can never be used as a key.
+ */
+#define REGISTRY_NO_KEY UINT64_MAX
+
+/*
+ * Create an empty registry.
+ *
+ * @param hint  Number of entries expected (the table grows as needed).
+ * @return  The registry, or NULL if memory could not be allocated.
+ */
+REGISTRY *registry_init(size_t hint);
+
+/*
+ * Free a registry.  There must be no concurrent lookups.
+ */
+void registry_fini(REGISTRY *reg);
+
+/*
+ * Look up the value for a key.  Must be called within an epoch critical
+ * section.
+ *
+ * @return  The value, or NULL if the key is not present.
+ */
+void *registry_lookup(REGISTRY *reg, uint64_t key);
+
+/*
+ * Add an entry.
+ *
+ * @param value  The value, which must not be NULL.
+ * @return 0 if successful, -1 if the key is already present or memory
+ * could not be allocated.
+ */
+int registry_insert(REGISTRY *reg, uint64_t key, void *value);
+
+/*
+ * Remove an entry.
+ *
+ * @return  The value removed, or NULL if the key was not present.
+ */
+void *registry_remove(REGISTRY *reg, uint64_t key);
+
+/*
+ * Get the number of entries.
+ */
+size_t registry_count(REGISTRY *reg);
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "tu.h"
+
+/*
+ * Client connection state used by the event-driven server modes.
+ *
+ * The event-driven modes multiplex many connections over a small number of
+ * threads, so the state for each connection has to be kept in an object that
+ * outlives any one call into the service code.  The thread-per-client mode
+ * uses the same object for the lifetime of its thread.
+ *
+ * NOTE: This type is opaque, in the same way as PBX and TU.
+ */
+typedef struct service_conn SERVICE_CONN;
+
+/*
+ * Default limit on the length of a command line.
+ */
+#define SERVICE_DEFAULT_MAXLINE 1024
+
+/*
+ * Maximum length of a command line, not counting its terminator.  A longer
+ * line is rejected: it is discarded without being dispatched.  It may be
+ * changed at any time (see config.h), but only applies to connections
+ * opened afterwards.
+ */
+extern atomic_size_t service_max_line;
+
+/*
+ * Defaults for the times below.
+ */
+#define SERVICE_DEFAULT_KEEPALIVE 60000
+#define SERVICE_DEFAULT_IDLE 0
+
+/*
+ * Time, in milliseconds, for which a client connection may be silent before
+ * the kernel starts probing it with TCP keepalives, or 0 not to probe (see
+ * keepalive.h).  It applies to connections opened afterwards.
+ */
+extern atomic_ulong service_keepalive_ms;
+
+/*
+ * Time, in milliseconds, for which a client may send nothing at all before
+ * its connection is shut down, or 0 for no limit.  It applies to
+ * connections opened afterwards, and to the others as their timers expire.
+ */
+extern atomic_ulong service_idle_ms;
+
+/*
+ * Limits on the rate at which each client connection may send commands
+ * (per second) and the bytes of chat and page messages (per second), or 0
+ * for no limit.  Each connection has a token bucket for each, holding one
+ * second's worth (and for messages, at least a line's worth), checked
+ * before each command is carried out; a command over either limit is
+ * dropped.  "hangup" is never dropped.
+ */
+extern atomic_ulong service_cmd_rate;
+extern atomic_ulong service_chat_rate;
+
+/*
+ * Create a TU for a newly accepted client connection and register it with
+ * the PBX.
+ *
+ * @param fd  File descriptor of the client connection.
+ * @return  The new connection object, or NULL if the TU could not be created
+ * or registered.  In the latter case, the file descriptor has been closed.
+ */
+SERVICE_CONN *service_conn_open(int fd);
+
+/*
+ * Get the file descriptor of a client connection.
+ */
+int service_conn_fileno(SERVICE_CONN *conn);
+
+/*
+ * Number of commands of a connection carried out in each round of an
+ * event-driven server mode, before moving on to the next connection with
+ * commands waiting.  A client pipelining a flood of commands thus gets no
+ * more turns than any other on the thread servicing it, which goes round
+ * the connections with commands left over (see service_conn_pending()) and
+ * reads no more from one of them until it has none.
+ */
+#define SERVICE_CMD_BUDGET 16
+
+/*
+ * Read whatever input is currently available on a client connection without
+ * blocking, and dispatch up to SERVICE_CMD_BUDGET of the command lines that
+ * it completes.  The rest are left for service_conn_run().  It must not be
+ * called while the connection has commands left over.
+ *
+ * @param conn  The client connection.
+ * @return  1 if the connection remains open, 0 if EOF or an error was seen,
+ * in which case the connection should be closed with service_conn_close().
+ */
+int service_conn_read(SERVICE_CONN *conn);
+
+/*
+ * Dispatch input that has already been read from a client connection by
+ * some other means (e.g. completion of an asynchronous read).  As much of
+ * it as there is room for is taken, and up to SERVICE_CMD_BUDGET of the
+ * command lines that it completes are dispatched; the rest are left for a
+ * later turn, and a trailing partial line is kept until more input arrives.
+ * Input not taken must be given again (before any that follows it) once
+ * the connection has no commands left over.
+ *
+ * @param conn  The client connection.
+ * @param data  The input bytes.
+ * @param len  Number of input bytes.
+ * @return  Number of input bytes taken.
+ */
+size_t service_conn_input(SERVICE_CONN *conn, const char *data, size_t len);
+
+/*
+ * Check whether a client connection has commands left over from its last
+ * turn.
+ *
+ * @return 1 if so, 0 otherwise.
+ */
+int service_conn_pending(SERVICE_CONN *conn);
+
+/*
+ * Give a client connection with commands left over its next turn,
+ * dispatching up to SERVICE_CMD_BUDGET of them.
+ */
+void service_conn_run(SERVICE_CONN *conn);
+
+/*
+ * Record that a client connection has been found dead (e.g. by TCP
+ * keepalive), rather than closed by its client, before it is closed.
+ */
+void service_conn_lost(SERVICE_CONN *conn);
+
+/*
+ * Handle the disconnection of a client: hang up and unregister its TU,
+ * and free the connection object.
+ */
+void service_conn_close(SERVICE_CONN *conn);
+
+#endif
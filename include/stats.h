@@ -0,0 +1,80 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+/*
+ * Counters describing the operation of the PBX.
+ *
+ * Counters are updated with relaxed atomic operations from any thread, and
+ * can be read by a client with the "stats" command.
+ */
+typedef struct pbx_stats {
+    atomic_ulong notify_msgs;       // Messages queued for clients
+    atomic_ulong notify_writes;     // Writes used to send them
+    atomic_ulong notify_coalesced;  // Messages sent in the same write as another
+    atomic_ulong lines_rejected;    // Over-long command lines rejected
+    atomic_ulong tus_registered;    // TUs currently registered (a gauge)
+    atomic_ulong dialplan_routed;   // Numbers dialed that matched a dial plan rule
+    atomic_ulong config_reloads;    // Configurations reloaded (on SIGUSR1)
+    atomic_ulong config_reload_failures;  // Reloads rejected (file invalid)
+    atomic_ulong config_reload_us;  // Time taken by the last reload (microseconds)
+    atomic_ulong config_reload_max_us;    // Longest time taken by a reload
+    atomic_ulong acd_waiting;       // Callers waiting in queues (a gauge)
+    atomic_ulong acd_dispatched;    // Callers offered to an agent
+    atomic_ulong acd_abandoned;     // Callers who hung up while waiting
+    atomic_ulong acd_wait_us;       // Time waited by the last caller offered (microseconds)
+    atomic_ulong acd_wait_max_us;   // Longest time waited by a caller offered
+    atomic_ulong camp_waiting;      // TUs camped on a busy TU (a gauge)
+    atomic_ulong camp_completed;    // TUs camped rung back once the TU was free
+    atomic_ulong camp_rejected;     // Attempts to camp on a TU with too many camped
+    atomic_ulong conf_rooms;        // Conference rooms with members (a gauge)
+    atomic_ulong conf_members;      // TUs in conference rooms (a gauge)
+    atomic_ulong conf_chats;        // Chat messages sent to conference rooms
+    atomic_ulong conf_deliveries;   // Copies of them queued for members
+    atomic_ulong pages;             // Pages delivered
+    atomic_ulong page_deliveries;   // TUs on hook a page was queued for
+    atomic_ulong page_failures;     // TUs on hook whose client could not take a page
+    atomic_ulong page_us;           // Time taken by the last page (microseconds)
+    atomic_ulong page_max_us;       // Longest time taken by a page
+    atomic_ulong presence_watches;  // Extensions watched, by each watcher (a gauge)
+    atomic_ulong presence_events;   // State events queued for watchers
+    atomic_ulong presence_coalesced;  // State reports folded into a later event
+    atomic_ulong timers;            // Timers armed (a gauge)
+    atomic_ulong timeouts;          // TUs hung up for being left too long in a state
+    atomic_ulong ghosts_reaped;     // Dead client connections closed
+    atomic_ulong ghosts_per_minute; // Of them, closed during the last full minute
+    atomic_ulong cmds_dropped;      // Commands dropped over the command rate limit
+    atomic_ulong chats_throttled;   // Chat and page messages dropped over the byte rate limit
+    atomic_ulong conns_open;        // Client connections admitted and not yet closed (a gauge)
+    atomic_ulong conns_max;         // Limit on them, or 0
+    atomic_ulong conns_accepted;    // Client connections admitted
+    atomic_ulong conn_rate_max;     // Limit on them per second, or 0
+    atomic_ulong conns_rejected;    // Client connections turned away with "BUSY"
+    atomic_ulong calls_setup;       // TUs hearing ring back (a gauge)
+    atomic_ulong calls_setup_max;   // Limit on them for admitting connections, or 0
+} PBX_STATS;
+
+extern PBX_STATS pbx_stats;
+
+#define STATS_ADD(field, n) \
+    atomic_fetch_add_explicit(&pbx_stats.field, (n), memory_order_relaxed)
+#define STATS_SUB(field, n) \
+    atomic_fetch_sub_explicit(&pbx_stats.field, (n), memory_order_relaxed)
+#define STATS_SET(field, v) \
+    atomic_store_explicit(&pbx_stats.field, (v), memory_order_relaxed)
+#define STATS_INC(field) STATS_ADD(field, 1)
+#define STATS_DEC(field) STATS_SUB(field, 1)
+
+/*
+ * Format the current values of all counters, one "STATS <name> <value>"
+ * line each, followed by a "STATS END" line.
+ *
+ * @param buf  Buffer to receive the text.
+ * @param size  Size of the buffer.
+ * @return  Length of the text (which is truncated if it does not fit).
+ */
+size_t stats_format(char *buf, size_t size);
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/*
+ * Timers, kept in a hierarchical timing wheel.
+ *
+ * Time is counted in ticks of TIMER_TICK_MS milliseconds.  The wheel has
+ * TIMER_LEVELS levels of TIMER_SLOTS slots each: a timer due within
+ * TIMER_SLOTS ticks is put in the slot of the first level for its tick, and
+ * a timer due later in a slot of a higher level, each slot of which covers
+ * TIMER_SLOTS times as many ticks as one of the level below.  When the
+ * first level has gone round, the next slot of the level above is emptied
+ * into the levels below it.  Each slot is a doubly linked list of timers,
+ * which are embedded in the objects they time, so arming and cancelling a
+ * timer take constant time and no memory is allocated.
+ *
+ * A single timer thread, started when the first timer is armed, advances
+ * the wheel and runs the function of each timer that expires, without any
+ * lock held.  It sleeps while no timer is armed.  A timer may be armed or
+ * cancelled from any thread, even while its function is running; arming
+ * and cancelling take a mutex that is never held while taking another lock,
+ * so they may be done with any lock held.
+ */
+
+/*
+ * Length of a tick, in milliseconds.
+ */
+#define TIMER_TICK_MS 10
+
+/*
+ * Number of slots in each level of the wheel (a power of two), and number
+ * of levels.  Timers can be armed for up to TIMER_SLOTS^TIMER_LEVELS ticks
+ * (about 46 hours); longer delays are cut to that.
+ */
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 4
+
+struct timer;
+
+/*
+ * Function run when a timer expires.
+ *
+ * @param t  The timer, which is no longer armed, and may be armed again.
+ * @param data  The value given when it was armed.
+ */
+typedef void (*TIMER_FN)(struct timer *t, unsigned long data);
+
+/*
+ * A timer.  The fields are private to the timer module.
+ */
+typedef struct timer {
+    struct timer *next, *prev;      // Timers in the same slot, or NULL if not armed
+    uint64_t expires;               // Tick at which it expires
+    TIMER_FN fn;                    // Function run when it expires
+    unsigned long data;             // Argument for it
+} TIMER;
+
+/*
+ * Initialize a timer, which is not armed.
+ *
+ * @param t  The timer.
+ * @param fn  Function to run each time it expires.
+ */
+void timer_init(TIMER *t, TIMER_FN fn);
+
+/*
+ * Arm a timer, or arm it again for a new time if it is armed already.
+ *
+ * @param t  The timer.
+ * @param ms  Delay, in milliseconds, rounded up to whole ticks.
+ * @param data  Value to pass to its function.
+ * @return 1 if the timer was armed already, 0 if not, or -1 if the timer
+ * thread could not be started (the timer is then not armed).
+ */
+int timer_arm(TIMER *t, unsigned long ms, unsigned long data);
+
+/*
+ * Cancel a timer.  Its function may still be run if it has just expired.
+ *
+ * @param t  The timer.
+ * @return 1 if the timer was armed, 0 otherwise.
+ */
+int timer_cancel(TIMER *t);
+
+/*
+ * Stop the timer thread, after running the function of any timer that is
+ * expiring.  The timers still armed are run at once, as if they expired.
+ */
+void timer_fini(void);
+
+#endif
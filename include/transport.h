@@ -0,0 +1,34 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stddef.h>
+
+#include "tu.h"
+
+/*
+ * Function through which an alternative transport (e.g. an asynchronous I/O
+ * backend) may take over the flushing of a TU's output queue from the
+ * writer thread of the TU module.  It is called, without any TU mutex held,
+ * each time a message has been queued for a client.
+ *
+ * @param tu  The TU with queued output.
+ * @param fd  File descriptor of the client connection.
+ * @return 0 if the transport will drain the queue with tu_output_drain(),
+ * or -1 if the TU module should flush it itself.
+ */
+typedef int (*TU_TRANSPORT)(TU *tu, int fd);
+
+/*
+ * Install the transport to be used for all subsequent client output, or
+ * NULL to have the TU module flush output itself.
+ */
+void tu_set_transport(TU_TRANSPORT fn);
+
+/*
+ * Remove up to max bytes of queued output from a TU, copying them into buf.
+ *
+ * @return  Number of bytes removed.
+ */
+size_t tu_output_drain(TU *tu, char *buf, size_t max);
+
+#endif
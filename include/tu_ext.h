@@ -0,0 +1,277 @@
+#ifndef TU_EXT_H
+#define TU_EXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+
+#include "tu.h"
+
+/*
+ * Additional TU operations, beyond those declared in tu.h.
+ */
+
+/*
+ * Extension number.  Extensions are not limited to the range of an int as
+ * in tu.h and pbx.h: DID-style numbers of up to 18 digits may be used.
+ * A negative number means "no extension".
+ */
+typedef int64_t EXTNUM;
+#define EXTNUM_MAX INT64_MAX
+#define PRIext PRId64
+
+struct conf_room;
+struct outq_buf;
+
+/*
+ * Time, in milliseconds, after which a TU left in a state is hung up as if
+ * by its client, indexed by state, or 0 for no limit.  A TU left ringing
+ * stops ringing, and its caller gets dial tone back; a TU left with dial
+ * tone or a busy signal goes on hook.  Only TU_RINGING, TU_DIAL_TONE and
+ * TU_BUSY_SIGNAL have one; it is set by the configuration (see config.h),
+ * and applies to the TUs entering the state afterward.
+ */
+extern atomic_ulong tu_timeouts[];
+
+#define TU_DEFAULT_RING_TIMEOUT 60000
+#define TU_DEFAULT_DIAL_TIMEOUT 30000
+#define TU_DEFAULT_BUSY_TIMEOUT 30000
+
+/*
+ * Get the extension number of a TU, which tu_extension() can only return
+ * if it fits in an int.
+ *
+ * @return  The number, or -1 if the TU has not been given one.
+ */
+EXTNUM tu_number(TU *tu);
+
+/*
+ * Set the extension number of a TU, as tu_set_extension() does, for any
+ * number.
+ */
+int tu_set_number(TU *tu, EXTNUM ext);
+
+/*
+ * Take a reference to a TU that may concurrently be losing its last one,
+ * as when it has been found in a table that is read without locking.  The
+ * memory of the TU must remain valid for the duration of the call (e.g.
+ * because of an epoch critical section), even if the TU is being destroyed.
+ *
+ * @param tu  The TU.
+ * @param reason  String describing the reason for taking the reference.
+ * @return 1 if a reference was taken, 0 if the TU is being destroyed.
+ */
+int tu_try_ref(TU *tu, char *reason);
+
+/*
+ * In a build with REF_TRACE defined (as by "make debug"), report on
+ * standard error every TU still alive, with its most recent reference
+ * count changes and the reasons given for them.  Otherwise, do nothing.
+ */
+void tu_trace_report(void);
+
+/*
+ * Send an arbitrary message (e.g. a reply to a query command) to the client
+ * of a TU, in order with its state-change notifications.  The message is
+ * queued and written without blocking.
+ *
+ * @param tu  The TU whose client is to receive the message.
+ * @param msg  The message, including its line terminator.
+ * @param len  Length of the message.
+ * @return 0 if successful, -1 if the message was discarded.
+ */
+int tu_send(TU *tu, const char *msg, size_t len);
+
+/*
+ * Change the extension number of a TU, if it is on hook.  Either way, the
+ * client is notified of the current state of the TU.  The caller is
+ * responsible for the extension being free (see pbx_renumber()).
+ *
+ * @return 0 if the extension was changed, -1 if the TU is not on hook.
+ */
+int tu_renumber(TU *tu, EXTNUM ext);
+
+/*
+ * Answer, from a TU that has dial tone, the call ringing at another TU
+ * (directed call pickup).  The caller is connected to the TU instead, and
+ * the TU that was ringing goes back on hook.  If no call is ringing there,
+ * the TU goes to the ERROR state, as when dialing an unknown number.
+ *
+ * @param tu  The TU answering the call.
+ * @param target  The TU that is ringing.
+ * @return 0 if the call was answered, -1 otherwise.
+ */
+int tu_pickup_call(TU *tu, TU *target);
+
+/*
+ * Maximum number of TUs that one call can ring at once.
+ */
+#define TU_MAX_RING 64
+
+/*
+ * Dial, from a TU that has dial tone, several TUs at once.  Every one of
+ * them that is on hook rings, and the first to pick up is connected to the
+ * caller while the others stop ringing.  If none of them is on hook, the
+ * caller gets a busy signal.  The call stops ringing a TU that hangs up; if
+ * all do, the caller gets dial tone back.
+ *
+ * @param tu  The calling TU.
+ * @param members  The TUs to ring, all different.
+ * @param n  Number of TUs to ring, at most TU_MAX_RING.
+ * @return 0 if successful, -1 otherwise.
+ */
+int tu_dial_group(TU *tu, TU **members, int n);
+
+/*
+ * Maximum number of TUs that can be camped on one TU at once.
+ */
+#define TU_MAX_CAMP 8
+
+/*
+ * Camp on a TU: from a TU that has dial tone or a busy signal, call a
+ * target as tu_dial() does if it is free, or else wait, with a busy signal,
+ * until it goes on hook.  The TU is then rung back automatically: the target
+ * rings and the TU has ring back, as if it had just dialed.  The TUs camped
+ * on a target are served in the order they camped, one each time it goes on
+ * hook, and at most TU_MAX_CAMP may wait; when the target is full, the TU
+ * just gets a busy signal.  A TU that camps is told "CAMPED <extension>".
+ * Hanging up stops a TU waiting, and a target that is unregistered releases
+ * the TUs camped on it, which keep their busy signal.
+ *
+ * @param tu  The TU camping.
+ * @param target  The TU to camp on, or NULL if the number is unknown.
+ * @return 0 if successful, -1 otherwise.
+ */
+int tu_camp(TU *tu, TU *target);
+
+/*
+ * Calls waiting in a queue for an agent (see acd.h).  The queue identifies
+ * each waiting call by a token of its own, which must not be reused while
+ * the call may still be waiting.
+ *
+ * tu_queue() makes a TU that has dial tone wait: it gets ring back until an
+ * agent answers, and gets dial tone back if the agent it is offered hangs
+ * up instead.  A TU without dial tone is just told its state.
+ *
+ * @return 0 if the TU is waiting, -1 otherwise.
+ */
+int tu_queue(TU *tu, const void *token);
+
+/*
+ * Tell a waiting TU its position in the queue ("QUEUED <position>").
+ *
+ * @return 0 if the TU is still waiting with this token, -1 if it has hung
+ * up or been offered to an agent.
+ */
+int tu_queue_update(TU *tu, const void *token, int position);
+
+/*
+ * Offer a waiting TU to an agent, which rings.  The call then proceeds as a
+ * call dialed from the TU.
+ *
+ * @return 0 if the agent rings, -1 if the TU is no longer waiting with this
+ * token, 1 if the agent is not on hook.
+ */
+int tu_queue_connect(TU *tu, const void *token, TU *agent);
+
+/*
+ * Stop a TU waiting, as its queue has been removed.  It gets a busy signal.
+ */
+void tu_queue_cancel(TU *tu, const void *token);
+
+/*
+ * Function told when a TU waiting in a queue hangs up, so that the queue can
+ * let go of the call at once rather than find out later.  It is called with
+ * no TU mutex held.
+ *
+ * @param tu  The TU that hung up, referenced for the duration of the call.
+ * @param token  The token with which it was waiting.
+ */
+typedef void (*TU_ABANDON_HOOK)(TU *tu, const void *token);
+
+/*
+ * Install the function told about calls abandoned in queues (NULL for none).
+ */
+void tu_set_abandon_hook(TU_ABANDON_HOOK fn);
+
+/*
+ * Join a TU that has dial tone to a conference room (see conf.h): it is
+ * connected to the room rather than to a peer, and is told "CONNECTED
+ * <room>".  Its chat messages then go to every other member, and hanging up
+ * leaves the room.  If the room is full the TU gets a busy signal, and a TU
+ * without dial tone is just told its state.
+ *
+ * @param tu  The TU joining.
+ * @param room  The room, of which the caller holds a reference that the TU
+ * keeps as a member if it joins.
+ * @return 0 if the TU joined, -1 otherwise.
+ */
+int tu_join(TU *tu, struct conf_room *room);
+
+/*
+ * Send a shared message (see outq.h) to the client of a TU, as tu_send()
+ * does.  The TU mutex is not taken, so a message can be sent to many TUs
+ * without holding any of them up.
+ *
+ * @return 0 if successful, -1 if the message was discarded.
+ */
+int tu_send_shared(TU *tu, struct outq_buf *buf);
+
+/*
+ * Send a shared message to the client of a TU if the TU is on hook, as for
+ * a page (see page.h).
+ *
+ * @return 0 if the message was sent, 1 if the TU is not on hook, -1 if the
+ * message was discarded.
+ */
+int tu_page(TU *tu, struct outq_buf *buf);
+
+/*
+ * Function told whenever a TU becomes available for calls, by being
+ * registered and on hook, or stops being available.  It is called with the
+ * TU mutex (and possibly those of other TUs) held, so it must not perform
+ * TU operations.
+ *
+ * @param ext  The extension number of the TU.
+ * @param available  Nonzero if the TU has become available.
+ */
+typedef void (*TU_AVAILABILITY_HOOK)(EXTNUM ext, int available);
+
+/*
+ * Install the function told about the availability of TUs (NULL for none).
+ * Must be called before any TU is registered.
+ */
+void tu_set_availability_hook(TU_AVAILABILITY_HOOK fn);
+
+/*
+ * Make a TU unavailable for calls, as it is being unregistered.  A TU is
+ * registered (and so may be available) from the time it is given a number.
+ */
+void tu_withdraw(TU *tu);
+
+/*
+ * Report a TU to the availability hook again if it is available, as after
+ * the hook has forgotten what it was told.
+ */
+void tu_report_availability(TU *tu);
+
+/*
+ * Report the state of a TU to the clients watching its extension again, as
+ * when one starts watching (see presence.h).
+ */
+void tu_report_presence(TU *tu);
+
+/*
+ * Group several TU operations into one batch.  The output they queue for
+ * each client is written only when the outermost batch ends, in a single
+ * write per client and in the order it was produced.  Every TU operation
+ * is itself a batch, so batches nest.
+ *
+ * tu_batch_end() must be called by the thread that called tu_batch_begin(),
+ * without any TU mutex held.
+ */
+void tu_batch_begin(void);
+void tu_batch_end(void);
+
+#endif
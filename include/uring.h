@@ -0,0 +1,30 @@
+#ifndef URING_H
+#define URING_H
+
+#include <signal.h>
+
+/*
+ * io_uring transport backend.
+ *
+ * All socket I/O is done by a single thread through one io_uring instance:
+ * a multishot accept on the listening socket, multishot receives into a ring
+ * of provided buffers for client input, and linked sends for the state-change
+ * notifications produced by the TU module.  Submissions are batched, so a
+ * burst of small lines costs one io_uring_enter() rather than a read() or
+ * write() each.
+ */
+
+/*
+ * Service the PBX using io_uring until a stop flag is set and all client
+ * connections have been closed.
+ *
+ * @param server_fd  The listening socket.
+ * @param stop  Flag (set from a signal handler) that requests shutdown.
+ * @return 0 if the server ran and has shut down, or -1 if io_uring (or one
+ * of the features required) is not supported by the running kernel.  In the
+ * latter case nothing has been done and the caller may fall back to another
+ * server mode.
+ */
+int uring_serve(int server_fd, volatile sig_atomic_t *stop);
+
+#endif
@@ -0,0 +1,702 @@
+/*
+ * Automatic call distribution.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "acd.h"
+#include "pbx_ext.h"
+#include "registry.h"
+#include "stats.h"
+#include "debug.h"
+
+/*
+ * Maximum number of callers offered to agents at a time, between which the
+ * queue is unlocked.
+ */
+#define ACD_BATCH 64
+
+/*
+ * A caller waiting in a queue.  Its address is the token by which the TU
+ * module knows the call is waiting (see tu_queue()); the sequence number
+ * tells it from a later entry that happens to be given the same address.
+ */
+struct acd_call {
+    TU *caller;                     // The TU waiting, referenced
+    uint64_t seq;                   // Sequence number of the entry
+    struct timespec since;          // When the caller entered the queue
+    struct acd_call *next;          // Next caller in the queue
+};
+
+struct acd_queue {
+    pthread_mutex_t lock;           // Protects everything below but n and agents
+    EXTNUM number;                  // Number of the queue
+    unsigned n;                     // Number of agents
+    EXTNUM *agents;                 // Extensions of the agents
+    char *idle;                     // Whether each agent is in the idle list
+    int *idle_prev;                 // Links of the idle list, by agent
+    int *idle_next;
+    int idle_head;                  // Idle agents, idle the longest first,
+    int idle_tail;                  //  or -1 if none
+    struct acd_call *head;          // Callers waiting, first come first
+    struct acd_call *tail;
+    unsigned waiting;               // Number of callers waiting
+    int pending;                    // Queue handed to the dispatcher for matching
+};
+
+/*
+ * Agency of an extension in a queue.  An extension may be an agent of
+ * several queues; its agencies are chained.
+ */
+struct acd_agent {
+    struct acd_queue *queue;
+    unsigned index;                 // Index of the agent in the queue
+    struct acd_agent *next;         // Next agency of the same extension
+};
+
+struct acd_table {
+    REGISTRY *queues;               // Queues by number
+    REGISTRY *agents;               // First agency by extension
+    struct acd_queue *q;            // The queues
+    size_t nq;
+    struct acd_agent *a;            // The agencies
+};
+
+/*
+ * The current table is replaced under the write lock, and used under the
+ * read lock.
+ */
+static pthread_rwlock_t acd_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct acd_table *table = NULL;
+
+/*
+ * Whether there are any queues, so that availability changes cost nothing
+ * when there are none (see hunt.c).
+ */
+static atomic_int have_queues = 0;
+
+static atomic_uint_fast64_t next_seq = 0;
+
+/*
+ * The dispatcher thread, and the numbers of the queues it has to match
+ * callers with agents in.  The work lock is taken last of all.
+ */
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond;
+static EXTNUM *work;                // Numbers of the queues to match in
+static size_t nwork, work_size;
+static int started, stopping;
+static pthread_t dispatcher;
+
+static void table_free(struct acd_table *t) {
+    if (t == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < t->nq; i++) {
+        struct acd_queue *q = &t->q[i];
+        pthread_mutex_destroy(&q->lock);
+        free(q->agents);
+        free(q->idle);
+        free(q->idle_prev);
+        free(q->idle_next);
+    }
+    if (t->queues != NULL) {
+        registry_fini(t->queues);
+    }
+    if (t->agents != NULL) {
+        registry_fini(t->agents);
+    }
+    free(t->q);
+    free(t->a);
+    free(t);
+}
+
+static struct acd_table *table_build(const ACD_DEF *defs, size_t n) {
+    struct acd_table *t = calloc(1, sizeof(struct acd_table));
+    if (t == NULL) {
+        return NULL;
+    }
+    size_t na = 0;
+    for (size_t i = 0; i < n; i++) {
+        na += defs[i].n;
+    }
+    t->queues = registry_init(n);
+    t->agents = registry_init(na);
+    t->q = calloc(n ? n : 1, sizeof(struct acd_queue));
+    t->a = calloc(na ? na : 1, sizeof(struct acd_agent));
+    if (t->queues == NULL || t->agents == NULL || t->q == NULL || t->a == NULL) {
+        table_free(t);
+        return NULL;
+    }
+
+    struct acd_agent *a = t->a;
+    for (size_t i = 0; i < n; i++) {
+        struct acd_queue *q = &t->q[i];
+        const ACD_DEF *d = &defs[i];
+        pthread_mutex_init(&q->lock, NULL);
+        t->nq++;
+        q->number = d->number;
+        q->n = d->n;
+        q->idle_head = q->idle_tail = -1;
+        q->agents = malloc(d->n * sizeof(EXTNUM));
+        q->idle = calloc(d->n, 1);
+        q->idle_prev = malloc(d->n * sizeof(int));
+        q->idle_next = malloc(d->n * sizeof(int));
+        if (d->n == 0 || d->n > ACD_MAX_AGENTS || q->agents == NULL || q->idle == NULL ||
+            q->idle_prev == NULL || q->idle_next == NULL ||
+            registry_insert(t->queues, d->number, q) == -1) {
+            table_free(t);
+            return NULL;
+        }
+        memcpy(q->agents, d->agents, d->n * sizeof(EXTNUM));
+
+        for (unsigned j = 0; j < d->n; j++, a++) {
+            a->queue = q;
+            a->index = j;
+            struct acd_agent *first = registry_lookup(t->agents, d->agents[j]);
+            if (first != NULL) {
+                a->next = first->next;
+                first->next = a;
+            } else if (registry_insert(t->agents, d->agents[j], a) == -1) {
+                table_free(t);
+                return NULL;
+            }
+        }
+    }
+    return t;
+}
+
+static void idle_unlink(struct acd_queue *q, int i) {
+    int prev = q->idle_prev[i];
+    int next = q->idle_next[i];
+    if (prev >= 0) {
+        q->idle_next[prev] = next;
+    } else {
+        q->idle_head = next;
+    }
+    if (next >= 0) {
+        q->idle_prev[next] = prev;
+    } else {
+        q->idle_tail = prev;
+    }
+    q->idle[i] = 0;
+}
+
+static void idle_append(struct acd_queue *q, int i) {
+    q->idle_prev[i] = q->idle_tail;
+    q->idle_next[i] = -1;
+    if (q->idle_tail >= 0) {
+        q->idle_next[q->idle_tail] = i;
+    } else {
+        q->idle_head = i;
+    }
+    q->idle_tail = i;
+    q->idle[i] = 1;
+}
+
+static void call_push_back(struct acd_queue *q, struct acd_call *c) {
+    c->next = NULL;
+    if (q->tail != NULL) {
+        q->tail->next = c;
+    } else {
+        q->head = c;
+    }
+    q->tail = c;
+    q->waiting++;
+    STATS_INC(acd_waiting);
+}
+
+static void call_push_front(struct acd_queue *q, struct acd_call *c) {
+    c->next = q->head;
+    q->head = c;
+    if (q->tail == NULL) {
+        q->tail = c;
+    }
+    q->waiting++;
+    STATS_INC(acd_waiting);
+}
+
+static struct acd_call *call_pop(struct acd_queue *q) {
+    struct acd_call *c = q->head;
+    q->head = c->next;
+    if (q->head == NULL) {
+        q->tail = NULL;
+    }
+    q->waiting--;
+    STATS_DEC(acd_waiting);
+    return c;
+}
+
+static void call_free(struct acd_call *c, char *reason) {
+    tu_unref(c->caller, reason);
+    free(c);
+}
+
+/*
+ * Give a queue to the dispatcher to match its callers with its idle agents,
+ * unless it has been already.  Must be called with the queue locked.
+ */
+static void queue_wake(struct acd_queue *q) {
+    if (q->pending) {
+        return;
+    }
+    pthread_mutex_lock(&work_lock);
+    if (nwork == work_size) {
+        size_t size = work_size ? 2 * work_size : 16;
+        EXTNUM *w = realloc(work, size * sizeof(EXTNUM));
+        if (w == NULL) {
+            // the next agent to become idle will try again
+            pthread_mutex_unlock(&work_lock);
+            return;
+        }
+        work = w;
+        work_size = size;
+    }
+    work[nwork++] = q->number;
+    q->pending = 1;
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&work_lock);
+}
+
+void acd_set_available(EXTNUM ext, int available) {
+    if (!atomic_load_explicit(&have_queues, memory_order_relaxed) || ext < 0) {
+        return;
+    }
+    pthread_rwlock_rdlock(&acd_lock);
+    if (table != NULL) {
+        for (struct acd_agent *a = registry_lookup(table->agents, ext); a != NULL; a = a->next) {
+            struct acd_queue *q = a->queue;
+            pthread_mutex_lock(&q->lock);
+            if (available && !q->idle[a->index]) {
+                idle_append(q, a->index);
+                if (q->head != NULL) {
+                    queue_wake(q);
+                }
+            } else if (!available && q->idle[a->index]) {
+                idle_unlink(q, a->index);
+            }
+            pthread_mutex_unlock(&q->lock);
+        }
+    }
+    pthread_rwlock_unlock(&acd_lock);
+}
+
+/*
+ * Offer the callers waiting in a queue to its idle agents, longest waiting
+ * to longest idle, until either runs out.  A caller whose agent turns out
+ * not to be on hook (its change of state not having been reported yet) goes
+ * back to the head of the queue; a round in which every offer fails ends
+ * the matching, which the next agent to become idle starts again.
+ */
+static void queue_match(EXTNUM number) {
+    int progress = 1;
+    while (progress) {
+        struct acd_call *calls[ACD_BATCH];
+        EXTNUM agents[ACD_BATCH];
+        int results[ACD_BATCH];
+        int n = 0;
+
+        pthread_rwlock_rdlock(&acd_lock);
+        struct acd_queue *q = table != NULL ? registry_lookup(table->queues, number) : NULL;
+        if (q != NULL) {
+            pthread_mutex_lock(&q->lock);
+            q->pending = 0;
+            while (q->head != NULL && q->idle_head >= 0 && n < ACD_BATCH) {
+                int i = q->idle_head;
+                idle_unlink(q, i);
+                agents[n] = q->agents[i];
+                calls[n++] = call_pop(q);
+            }
+            pthread_mutex_unlock(&q->lock);
+        }
+        pthread_rwlock_unlock(&acd_lock);
+        if (n == 0) {
+            return;
+        }
+
+        progress = 0;
+        for (int i = 0; i < n; i++) {
+            struct acd_call *c = calls[i];
+            TU *agent = pbx_lookup(pbx, agents[i]);
+            results[i] = agent != NULL ? tu_queue_connect(c->caller, c, agent) : 1;
+            if (results[i] == 0) {
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                unsigned long us = (now.tv_sec - c->since.tv_sec) * 1000000UL +
+                                   (now.tv_nsec - c->since.tv_nsec) / 1000;
+                STATS_INC(acd_dispatched);
+                STATS_SET(acd_wait_us, us);
+                if (us > atomic_load_explicit(&pbx_stats.acd_wait_max_us, memory_order_relaxed)) {
+                    STATS_SET(acd_wait_max_us, us);
+                }
+                progress = 1;
+            } else if (results[i] == -1) {
+                // the caller hung up: the agent is still idle
+                STATS_INC(acd_abandoned);
+                tu_report_availability(agent);
+                progress = 1;
+            }
+            if (agent != NULL) {
+                tu_unref(agent, "queue_match: done with agent");
+            }
+        }
+
+        // back to the head of the queue in the same order, or out if it is gone
+        struct acd_call *cancelled = NULL;
+        pthread_rwlock_rdlock(&acd_lock);
+        q = table != NULL ? registry_lookup(table->queues, number) : NULL;
+        if (q != NULL) {
+            pthread_mutex_lock(&q->lock);
+        }
+        for (int i = n - 1; i >= 0; i--) {
+            if (results[i] != 1) {
+                continue;
+            } else if (q != NULL) {
+                call_push_front(q, calls[i]);
+            } else {
+                calls[i]->next = cancelled;
+                cancelled = calls[i];
+            }
+        }
+        if (q != NULL) {
+            pthread_mutex_unlock(&q->lock);
+        }
+        pthread_rwlock_unlock(&acd_lock);
+
+        while (cancelled != NULL) {
+            struct acd_call *c = cancelled;
+            cancelled = c->next;
+            tu_queue_cancel(c->caller, c);
+            call_free(c, "queue_match: queue removed");
+        }
+        for (int i = 0; i < n; i++) {
+            if (results[i] != 1) {
+                call_free(calls[i], "queue_match: caller leaves queue");
+            }
+        }
+    }
+}
+
+/*
+ * A caller to be told its position, as recorded while the queues were
+ * locked.
+ */
+struct acd_position {
+    TU *caller;                     // Referenced
+    const struct acd_call *token;   // Not to be dereferenced
+    uint64_t seq;
+    EXTNUM queue;
+    int position;
+    int gone;
+};
+
+static int compare_position(const void *a, const void *b) {
+    const struct acd_position *x = a;
+    const struct acd_position *y = b;
+    return x->token < y->token ? -1 : x->token > y->token;
+}
+
+/*
+ * Tell every waiting caller its position, and remove from the queues those
+ * that turn out to have hung up.
+ */
+static void queue_update(void) {
+    struct acd_position *p = NULL;
+    size_t n = 0;
+
+    pthread_rwlock_rdlock(&acd_lock);
+    if (table != NULL) {
+        size_t total = 0;
+        for (size_t i = 0; i < table->nq; i++) {
+            pthread_mutex_lock(&table->q[i].lock);
+            total += table->q[i].waiting;
+            pthread_mutex_unlock(&table->q[i].lock);
+        }
+        p = total > 0 ? malloc(total * sizeof(struct acd_position)) : NULL;
+        for (size_t i = 0; p != NULL && i < table->nq; i++) {
+            struct acd_queue *q = &table->q[i];
+            pthread_mutex_lock(&q->lock);
+            int position = 1;
+            for (struct acd_call *c = q->head; c != NULL && n < total; c = c->next) {
+                tu_ref(c->caller, "queue_update: telling position");
+                p[n++] = (struct acd_position){ c->caller, c, c->seq, q->number, position++, 0 };
+            }
+            pthread_mutex_unlock(&q->lock);
+        }
+    }
+    pthread_rwlock_unlock(&acd_lock);
+    if (n == 0) {
+        free(p);
+        return;
+    }
+
+    size_t ngone = 0;
+    for (size_t i = 0; i < n; i++) {
+        p[i].gone = tu_queue_update(p[i].caller, p[i].token, p[i].position) == -1;
+        ngone += p[i].gone;
+        tu_unref(p[i].caller, "queue_update: done with caller");
+    }
+
+    if (ngone > 0) {
+        qsort(p, n, sizeof(struct acd_position), compare_position);
+        struct acd_call *gone = NULL;
+        pthread_rwlock_rdlock(&acd_lock);
+        for (size_t i = 0; table != NULL && i < table->nq; i++) {
+            struct acd_queue *q = &table->q[i];
+            pthread_mutex_lock(&q->lock);
+            struct acd_call **cp = &q->head;
+            struct acd_call *prev = NULL;
+            while (*cp != NULL) {
+                struct acd_call *c = *cp;
+                struct acd_position key = { .token = c };
+                struct acd_position *f = bsearch(&key, p, n, sizeof(struct acd_position), compare_position);
+                if (f != NULL && f->gone && f->seq == c->seq) {
+                    *cp = c->next;
+                    if (q->tail == c) {
+                        q->tail = prev;
+                    }
+                    q->waiting--;
+                    STATS_DEC(acd_waiting);
+                    c->next = gone;
+                    gone = c;
+                } else {
+                    prev = c;
+                    cp = &c->next;
+                }
+            }
+            pthread_mutex_unlock(&q->lock);
+        }
+        pthread_rwlock_unlock(&acd_lock);
+
+        while (gone != NULL) {
+            struct acd_call *c = gone;
+            gone = c->next;
+            STATS_INC(acd_abandoned);
+            call_free(c, "queue_update: caller hung up");
+        }
+    }
+    free(p);
+}
+
+/*
+ * Thread function for the dispatcher.
+ */
+static void *acd_dispatch(void *arg) {
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    next.tv_sec += ACD_UPDATE_INTERVAL;
+
+    pthread_mutex_lock(&work_lock);
+    while (!stopping) {
+        if (nwork == 0) {
+            pthread_cond_timedwait(&work_cond, &work_lock, &next);
+        }
+        while (nwork > 0 && !stopping) {
+            EXTNUM number = work[--nwork];
+            pthread_mutex_unlock(&work_lock);
+            queue_match(number);
+            pthread_mutex_lock(&work_lock);
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (!stopping && (now.tv_sec > next.tv_sec ||
+                          (now.tv_sec == next.tv_sec && now.tv_nsec >= next.tv_nsec))) {
+            pthread_mutex_unlock(&work_lock);
+            queue_update();
+            pthread_mutex_lock(&work_lock);
+            next = now;
+            next.tv_sec += ACD_UPDATE_INTERVAL;
+        }
+    }
+    pthread_mutex_unlock(&work_lock);
+    return NULL;
+}
+
+static int start_dispatcher(void) {
+    pthread_mutex_lock(&work_lock);
+    int ret = 0;
+    if (!started) {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&work_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        stopping = 0;
+        // signals are for the threads that expect them, not the dispatcher
+        sigset_t all, saved;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &saved);
+        int err = pthread_create(&dispatcher, NULL, acd_dispatch, NULL);
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+        if (err != 0) {
+            pthread_cond_destroy(&work_cond);
+            ret = -1;
+        } else {
+            started = 1;
+        }
+    }
+    pthread_mutex_unlock(&work_lock);
+    return ret;
+}
+
+int acd_configure(const ACD_DEF *defs, size_t n) {
+    struct acd_table *t = NULL;
+    int ret = 0;
+    if (n > 0) {
+        t = start_dispatcher() == 0 ? table_build(defs, n) : NULL;
+        ret = t != NULL ? 0 : -1;
+    }
+
+    // callers waiting in a queue that remains keep their place
+    struct acd_call *cancelled = NULL;
+    pthread_rwlock_wrlock(&acd_lock);
+    struct acd_table *old = table;
+    for (size_t i = 0; old != NULL && i < old->nq; i++) {
+        struct acd_queue *oq = &old->q[i];
+        if (oq->head == NULL) {
+            continue;
+        }
+        struct acd_queue *q = t != NULL ? registry_lookup(t->queues, oq->number) : NULL;
+        if (q != NULL) {
+            q->head = oq->head;
+            q->tail = oq->tail;
+            q->waiting = oq->waiting;
+        } else {
+            oq->tail->next = cancelled;
+            cancelled = oq->head;
+            STATS_SUB(acd_waiting, oq->waiting);
+        }
+    }
+    table = t;
+    atomic_store(&have_queues, t != NULL);
+    pthread_rwlock_unlock(&acd_lock);
+
+    table_free(old);
+    while (cancelled != NULL) {
+        struct acd_call *c = cancelled;
+        cancelled = c->next;
+        tu_queue_cancel(c->caller, c);
+        call_free(c, "acd_configure: queue removed");
+    }
+    return ret;
+}
+
+void acd_fini(void) {
+    acd_configure(NULL, 0);
+
+    pthread_mutex_lock(&work_lock);
+    int join = started;
+    stopping = 1;
+    if (started) {
+        pthread_cond_signal(&work_cond);
+    }
+    pthread_mutex_unlock(&work_lock);
+    if (join) {
+        pthread_join(dispatcher, NULL);
+        pthread_cond_destroy(&work_cond);
+    }
+
+    pthread_mutex_lock(&work_lock);
+    started = 0;
+    free(work);
+    work = NULL;
+    nwork = work_size = 0;
+    pthread_mutex_unlock(&work_lock);
+}
+
+int acd_enter(EXTNUM number, TU *caller) {
+    if (!atomic_load_explicit(&have_queues, memory_order_relaxed) || number < 0) {
+        return -1;
+    }
+    struct acd_call *c = malloc(sizeof(struct acd_call));
+    if (c == NULL) {
+        return -1;
+    }
+    pthread_rwlock_rdlock(&acd_lock);
+    int found = table != NULL && registry_lookup(table->queues, number) != NULL;
+    pthread_rwlock_unlock(&acd_lock);
+    if (!found || tu_queue(caller, c) == -1) {
+        free(c);
+        return found ? 0 : -1;
+    }
+
+    tu_ref(caller, "acd_enter: caller waits in queue");
+    c->caller = caller;
+    c->seq = atomic_fetch_add(&next_seq, 1);
+    clock_gettime(CLOCK_MONOTONIC, &c->since);
+
+    int position = 0;
+    pthread_rwlock_rdlock(&acd_lock);
+    struct acd_queue *q = table != NULL ? registry_lookup(table->queues, number) : NULL;
+    if (q != NULL) {
+        pthread_mutex_lock(&q->lock);
+        call_push_back(q, c);
+        position = q->waiting;
+        pthread_mutex_unlock(&q->lock);
+    }
+    pthread_rwlock_unlock(&acd_lock);
+
+    if (q == NULL) {
+        // removed meanwhile
+        tu_queue_cancel(caller, c);
+        call_free(c, "acd_enter: queue removed");
+        return 0;
+    }
+    debug("Caller ext=%" PRIext " waits in queue %" PRIext " at position %d.", tu_number(caller), number, position);
+    tu_queue_update(caller, c, position);
+
+    // told its position first, the caller may now be offered to an agent
+    pthread_rwlock_rdlock(&acd_lock);
+    q = table != NULL ? registry_lookup(table->queues, number) : NULL;
+    if (q != NULL) {
+        pthread_mutex_lock(&q->lock);
+        if (q->head != NULL && q->idle_head >= 0) {
+            queue_wake(q);
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+    pthread_rwlock_unlock(&acd_lock);
+    return 0;
+}
+
+void acd_abandon(TU *caller, const void *token) {
+    if (!atomic_load_explicit(&have_queues, memory_order_relaxed)) {
+        return;
+    }
+    // The token is only compared: it is an entry of a queue if it is found
+    // in one, and otherwise it may already have been freed
+    struct acd_call *gone = NULL;
+    pthread_rwlock_rdlock(&acd_lock);
+    for (size_t i = 0; table != NULL && gone == NULL && i < table->nq; i++) {
+        struct acd_queue *q = &table->q[i];
+        pthread_mutex_lock(&q->lock);
+        struct acd_call *prev = NULL;
+        for (struct acd_call **cp = &q->head; *cp != NULL; cp = &prev->next) {
+            if (*cp == token && (*cp)->caller == caller) {
+                gone = *cp;
+                *cp = gone->next;
+                if (q->tail == gone) {
+                    q->tail = prev;
+                }
+                q->waiting--;
+                STATS_DEC(acd_waiting);
+                break;
+            }
+            prev = *cp;
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+    pthread_rwlock_unlock(&acd_lock);
+
+    if (gone != NULL) {
+        debug("Caller ext=%" PRIext " hung up while waiting in a queue.", tu_number(caller));
+        STATS_INC(acd_abandoned);
+        call_free(gone, "acd_abandon: caller hung up");
+    }
+}
@@ -0,0 +1,82 @@
+/*
+ * Admission control of client connections.
+ */
+#include <time.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "pbx.h"
+#include "admission.h"
+#include "ratelimit.h"
+#include "stats.h"
+#include "debug.h"
+
+atomic_ulong admission_max_conns = 0;
+atomic_ulong admission_conn_rate = 0;
+atomic_ulong admission_max_setup = 0;
+
+/*
+ * New connections, used only by the thread accepting them.  An empty bucket
+ * last refilled at time 0 fills up on first use.
+ */
+static RATE_BUCKET conn_bucket;
+
+static unsigned long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+void admission_limit(unsigned long max_conns, unsigned long conn_rate,
+                     unsigned long max_setup) {
+    atomic_store(&admission_max_conns, max_conns);
+    atomic_store(&admission_conn_rate, conn_rate);
+    atomic_store(&admission_max_setup, max_setup);
+    STATS_SET(conns_max, max_conns);
+    STATS_SET(conn_rate_max, conn_rate);
+    STATS_SET(calls_setup_max, max_setup);
+}
+
+/*
+ * Check the limits.
+ *
+ * @return A description of the limit reached, or NULL if there is none.
+ */
+static const char *admission_check(void) {
+    unsigned long max = atomic_load_explicit(&admission_max_conns, memory_order_relaxed);
+    if (max > 0 && atomic_load_explicit(&pbx_stats.conns_open, memory_order_relaxed) >= max) {
+        return "connections";
+    }
+    max = atomic_load_explicit(&admission_max_setup, memory_order_relaxed);
+    if (max > 0 && atomic_load_explicit(&pbx_stats.calls_setup, memory_order_relaxed) >= max) {
+        return "calls in setup";
+    }
+    // Last, so that a connection rejected anyway takes no token
+    unsigned long rate = atomic_load_explicit(&admission_conn_rate, memory_order_relaxed);
+    if (rate_take(&conn_bucket, rate, rate, 1, now_ms()) == -1) {
+        return "connection rate";
+    }
+    return NULL;
+}
+
+int admission_admit(int fd) {
+    const char *limit = admission_check();
+    if (limit == NULL) {
+        STATS_INC(conns_open);
+        STATS_INC(conns_accepted);
+        return 0;
+    }
+    debug("Rejecting connection on FD %d, over the limit on %s", fd, limit);
+    STATS_INC(conns_rejected);
+    static const char busy[] = "BUSY" EOL;
+    if (send(fd, busy, strlen(busy), MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+        debug("Could not tell FD %d that the PBX is busy", fd);
+    }
+    close(fd);
+    return -1;
+}
+
+void admission_release(void) {
+    STATS_DEC(conns_open);
+}
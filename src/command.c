@@ -0,0 +1,137 @@
+/*
+ * Parsing of client command lines.
+ */
+#include <string.h>
+
+
+#include "command.h"
+
+/*
+ * Names of the commands that are not defined by server.h, in order
+ * starting from CMD_STATS.
+ */
+static const char *extra_command_names[] = {
+    "stats",
+    "ext",
+    "camp",
+    "page",
+    "watch",
+    "ping"
+};
+
+/*
+ * Key on which command words are switched: their length and first byte.
+ * Command words are distinguished by this alone (but for "chat" and "camp",
+ * and "page" and "ping", told apart by their second byte), and a single
+ * comparison confirms the match.
+ */
+#define CMD_KEY(len, c) (((len) << 8) | (unsigned char)(c))
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' || c == '\v';
+}
+
+/*
+ * Parse a non-negative decimal number occupying all of [s, end), rejecting
+ * anything that does not fit in an EXTNUM.
+ *
+ * @return  The number, or -1 if it is malformed or out of range.
+ */
+static EXTNUM parse_ext(const char *s, const char *end) {
+    if (s == end) {
+        return -1;
+    }
+    EXTNUM n = 0;
+    for (; s < end; s++) {
+        unsigned d = (unsigned)(*s - '0');
+        if (d > 9 || n > (EXTNUM_MAX - (EXTNUM)d) / 10) {
+            return -1;
+        }
+        n = n * 10 + d;
+    }
+    return n;
+}
+
+const char *command_name(SERVICE_COMMAND cmd) {
+    if (cmd >= CMD_PICKUP && cmd <= CMD_CHAT) {
+        return tu_command_names[cmd];
+    }
+    if (cmd >= CMD_STATS && cmd < CMD_INVALID) {
+        return extra_command_names[cmd - CMD_STATS];
+    }
+    return "invalid";
+}
+
+int command_parse(const char *line, size_t len, COMMAND *cp) {
+    const char *p = line;
+    const char *end = line + len;
+    cp->cmd = CMD_INVALID;
+    cp->ext = -1;
+    cp->arg = NULL;
+    cp->arg_len = 0;
+
+    // Skip leading whitespace, and find the command word
+    while (p < end && is_space(*p)) {
+        p++;
+    }
+    const char *word = p;
+    while (p < end && !is_space(*p)) {
+        p++;
+    }
+    size_t wlen = p - word;
+    if (wlen == 0 || wlen > 8) {
+        return -1;
+    }
+
+    SERVICE_COMMAND cmd;
+    switch (CMD_KEY(wlen, word[0])) {
+        case CMD_KEY(6, 'p'): cmd = CMD_PICKUP; break;
+        case CMD_KEY(6, 'h'): cmd = CMD_HANGUP; break;
+        case CMD_KEY(4, 'd'): cmd = CMD_DIAL; break;
+        case CMD_KEY(4, 'c'): cmd = word[1] == 'h' ? CMD_CHAT : CMD_CAMP; break;
+        case CMD_KEY(5, 's'): cmd = CMD_STATS; break;
+        case CMD_KEY(3, 'e'): cmd = CMD_EXT; break;
+        case CMD_KEY(4, 'p'): cmd = word[1] == 'a' ? CMD_PAGE : CMD_PING; break;
+        case CMD_KEY(5, 'w'): cmd = CMD_WATCH; break;
+        default: return -1;
+    }
+    if (memcmp(word, command_name(cmd), wlen) != 0) {
+        return -1;
+    }
+
+    // Skip the whitespace separating the argument, if any
+    const char *arg = p;
+    while (arg < end && is_space(*arg)) {
+        arg++;
+    }
+
+    switch (cmd) {
+        case CMD_DIAL:
+        case CMD_CAMP:
+        case CMD_EXT:
+        case CMD_WATCH:
+            if (p == end) {
+                return -1;  // Must be followed by an extension
+            }
+            // Allow trailing whitespace after the extension
+            while (end > arg && is_space(end[-1])) {
+                end--;
+            }
+            cp->ext = parse_ext(arg, end);
+            cp->arg = arg;
+            cp->arg_len = end - arg;
+            break;
+        case CMD_CHAT:
+        case CMD_PAGE:
+            cp->arg = arg;
+            cp->arg_len = end - arg;
+            break;
+        default:
+            if (arg != end) {
+                return -1;  // No arguments expected
+            }
+            break;
+    }
+    cp->cmd = cmd;
+    return 0;
+}
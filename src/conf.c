@@ -0,0 +1,243 @@
+/*
+ * Conference rooms.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "conf.h"
+#include "outq.h"
+#include "epoch.h"
+#include "stats.h"
+#include "debug.h"
+
+/*
+ * Number of slots of a new room, which doubles as it fills up.
+ */
+#define CONF_INITIAL_SLOTS 8
+
+/*
+ * Number of chains in the table of rooms.
+ */
+#define CONF_BUCKETS 256
+
+/*
+ * The members of a room.  A member is added by filling an empty slot, and
+ * removed by emptying its slot, both in place; senders skip empty slots.
+ */
+struct conf_slots {
+    size_t cap;                     // Number of slots
+    _Atomic(TU *) tu[];             // Members (referenced), or NULL
+};
+
+struct conf_room {
+    EXTNUM number;                  // Number of the room
+    atomic_int refs;                // One per member, plus one per holder
+    pthread_mutex_t lock;           // Serializes changes of membership
+    _Atomic(struct conf_slots *) slots;  // The members
+    size_t n;                       // Number of members
+    struct conf_room *next;         // Next room in the same chain
+};
+
+/*
+ * The rooms, chained by number.  A room whose last reference is being
+ * released stays in its chain, with no references, until it is unlinked;
+ * it can no longer be joined meanwhile.  The table is not a registry (see
+ * registry.h), as changing one may run destructors, which could leave a
+ * room and so need the lock.
+ */
+static pthread_mutex_t rooms_lock = PTHREAD_MUTEX_INITIALIZER;
+static CONF_ROOM *rooms[CONF_BUCKETS];
+
+static CONF_ROOM **room_chain(EXTNUM number) {
+    return &rooms[(uint64_t)number % CONF_BUCKETS];
+}
+
+static struct conf_slots *slots_new(size_t cap) {
+    struct conf_slots *s = malloc(sizeof(struct conf_slots) + cap * sizeof(TU *));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->cap = cap;
+    for (size_t i = 0; i < cap; i++) {
+        atomic_init(&s->tu[i], NULL);
+    }
+    return s;
+}
+
+/*
+ * Find a room and take a reference to it, creating it if it does not
+ * exist.
+ *
+ * @return  The room, or NULL if memory could not be allocated.
+ */
+static CONF_ROOM *room_get(EXTNUM number) {
+    pthread_mutex_lock(&rooms_lock);
+    CONF_ROOM **chain = room_chain(number);
+    for (CONF_ROOM *r = *chain; r != NULL; r = r->next) {
+        if (r->number != number) {
+            continue;
+        }
+        int refs = atomic_load(&r->refs);
+        while (refs > 0 && !atomic_compare_exchange_weak(&r->refs, &refs, refs + 1)) {
+        }
+        if (refs > 0) {
+            pthread_mutex_unlock(&rooms_lock);
+            return r;
+        }
+    }
+
+    CONF_ROOM *r = malloc(sizeof(CONF_ROOM));
+    struct conf_slots *s = slots_new(CONF_INITIAL_SLOTS);
+    if (r == NULL || s == NULL || pthread_mutex_init(&r->lock, NULL) != 0) {
+        pthread_mutex_unlock(&rooms_lock);
+        free(s);
+        free(r);
+        return NULL;
+    }
+    r->number = number;
+    atomic_init(&r->refs, 1);
+    atomic_init(&r->slots, s);
+    r->n = 0;
+    r->next = *chain;
+    *chain = r;
+    pthread_mutex_unlock(&rooms_lock);
+    STATS_INC(conf_rooms);
+    debug("conf: Room %" PRIext " opened.", number);
+    return r;
+}
+
+int conf_join(EXTNUM number, TU *tu) {
+    CONF_ROOM *room = room_get(number);
+    if (room == NULL) {
+        return -1;
+    }
+    if (tu_join(tu, room) == -1) {
+        conf_release(room);
+        return -1;
+    }
+    return 0;
+}
+
+EXTNUM conf_number(const CONF_ROOM *room) {
+    return room->number;
+}
+
+void conf_hold(CONF_ROOM *room) {
+    atomic_fetch_add_explicit(&room->refs, 1, memory_order_relaxed);
+}
+
+void conf_release(CONF_ROOM *room) {
+    if (atomic_fetch_sub_explicit(&room->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    pthread_mutex_lock(&rooms_lock);
+    CONF_ROOM **p = room_chain(room->number);
+    while (*p != room) {
+        p = &(*p)->next;
+    }
+    *p = room->next;
+    pthread_mutex_unlock(&rooms_lock);
+
+    // No member is left, and senders hold references, so nothing can be
+    // using the slots
+    debug("conf: Room %" PRIext " closed.", room->number);
+    free(atomic_load(&room->slots));
+    pthread_mutex_destroy(&room->lock);
+    free(room);
+    STATS_DEC(conf_rooms);
+}
+
+int conf_enter(CONF_ROOM *room, TU *tu, void **old) {
+    *old = NULL;
+    pthread_mutex_lock(&room->lock);
+    struct conf_slots *s = atomic_load_explicit(&room->slots, memory_order_relaxed);
+    if (room->n >= CONF_MAX_MEMBERS) {
+        pthread_mutex_unlock(&room->lock);
+        return -1;
+    }
+    if (room->n == s->cap) {
+        // Full: senders switch to a copy twice as large
+        struct conf_slots *t = slots_new(s->cap * 2);
+        if (t == NULL) {
+            pthread_mutex_unlock(&room->lock);
+            return -1;
+        }
+        for (size_t i = 0; i < s->cap; i++) {
+            atomic_init(&t->tu[i], atomic_load_explicit(&s->tu[i], memory_order_relaxed));
+        }
+        atomic_store_explicit(&room->slots, t, memory_order_release);
+        *old = s;
+        s = t;
+    }
+    size_t i = 0;
+    while (atomic_load_explicit(&s->tu[i], memory_order_relaxed) != NULL) {
+        i++;
+    }
+    tu_ref(tu, "conf_enter: member of conference");
+    atomic_store_explicit(&s->tu[i], tu, memory_order_release);
+    room->n++;
+    pthread_mutex_unlock(&room->lock);
+    STATS_INC(conf_members);
+    return 0;
+}
+
+void conf_exit(CONF_ROOM *room, TU *tu) {
+    pthread_mutex_lock(&room->lock);
+    struct conf_slots *s = atomic_load_explicit(&room->slots, memory_order_relaxed);
+    for (size_t i = 0; i < s->cap; i++) {
+        if (atomic_load_explicit(&s->tu[i], memory_order_relaxed) == tu) {
+            atomic_store_explicit(&s->tu[i], NULL, memory_order_relaxed);
+            room->n--;
+            STATS_DEC(conf_members);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&room->lock);
+}
+
+static void member_release(void *arg) {
+    tu_unref(arg, "conf_retire: left conference");
+}
+
+void conf_retire(void *old, TU *left) {
+    if (old != NULL) {
+        epoch_retire(free, old);
+    }
+    if (left != NULL) {
+        epoch_retire(member_release, left);
+    }
+}
+
+int conf_chat(CONF_ROOM *room, TU *sender, const char *msg) {
+    size_t len = strlen(msg);
+    OUTQ_BUF *buf = outq_buf_new(len + 7);
+    if (buf == NULL) {
+        return -1;
+    }
+    memcpy(buf->data, "CHAT ", 5);
+    memcpy(buf->data + 5, msg, len);
+    memcpy(buf->data + 5 + len, "\r\n", 2);
+
+    // The slots and the members found in them remain valid until the end of
+    // the critical section, even if they are replaced or leave meanwhile
+    unsigned long sent = 0;
+    epoch_enter();
+    tu_batch_begin();
+    struct conf_slots *s = atomic_load_explicit(&room->slots, memory_order_acquire);
+    for (size_t i = 0; i < s->cap; i++) {
+        TU *tu = atomic_load_explicit(&s->tu[i], memory_order_acquire);
+        if (tu != NULL && tu != sender && tu_send_shared(tu, buf) == 0) {
+            sent++;
+        }
+    }
+    tu_batch_end();
+    epoch_exit();
+    outq_buf_release(buf);
+
+    STATS_INC(conf_chats);
+    STATS_ADD(conf_deliveries, sent);
+    return 0;
+}
@@ -0,0 +1,504 @@
+/*
+ * Run-time configuration, reloadable without a restart.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+
+#include "config.h"
+#include "epoch.h"
+#include "pbx.h"
+#include "pbx_ext.h"
+#include "tu_ext.h"
+#include "outq.h"
+#include "service.h"
+#include "admission.h"
+#include "stats.h"
+#include "debug.h"
+
+#define CONFIG_INITIAL_RULES 64
+#define CONFIG_INITIAL_WORDS 8
+
+static _Atomic(CONFIG *) current = NULL;
+
+/*
+ * Serializes writers (reloads and shutdown) with each other.  Readers
+ * never take it.
+ */
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+static int config_finished = 0;
+
+/*
+ * Limits as given on the command line.
+ */
+static size_t default_queue_limit;
+static size_t default_line_limit;
+static unsigned long default_cmd_rate;
+static unsigned long default_chat_rate;
+static unsigned long default_keepalive;
+static unsigned long default_idle;
+
+void config_init(void) {
+    default_queue_limit = atomic_load(&outq_hiwat);
+    default_line_limit = atomic_load(&service_max_line);
+    default_cmd_rate = atomic_load(&service_cmd_rate);
+    default_chat_rate = atomic_load(&service_chat_rate);
+    default_keepalive = atomic_load(&service_keepalive_ms);
+    default_idle = atomic_load(&service_idle_ms);
+}
+
+/*
+ * Parse a "timeout" line.
+ *
+ * @return 0 if successful, -1 otherwise (*err is then set).
+ */
+static int config_timeout(CONFIG *cf, char **words, int n, const char **err) {
+    if (n != 3) {
+        *err = "wrong number of arguments";
+        return -1;
+    }
+    char *end;
+    long v = strtol(words[2], &end, 10);
+    if (*end != '\0' || v < 0) {
+        *err = "invalid timeout";
+        return -1;
+    }
+    if (strcmp(words[1], "ringing") == 0) {
+        cf->ring_timeout = v;
+    } else if (strcmp(words[1], "dialtone") == 0) {
+        cf->dial_timeout = v;
+    } else if (strcmp(words[1], "busy") == 0) {
+        cf->busy_timeout = v;
+    } else if (strcmp(words[1], "keepalive") == 0) {
+        cf->keepalive_timeout = v;
+    } else if (strcmp(words[1], "idle") == 0) {
+        cf->idle_timeout = v;
+    } else {
+        *err = "unknown timeout";
+        return -1;
+    }
+    return 0;
+}
+
+void config_free(CONFIG *cf) {
+    if (cf == NULL) {
+        return;
+    }
+    dialplan_free(cf->dialplan);
+    for (size_t i = 0; i < cf->ngroups; i++) {
+        free(cf->groups[i].members);
+    }
+    free(cf->groups);
+    for (size_t i = 0; i < cf->nqueues; i++) {
+        free(cf->queues[i].agents);
+    }
+    free(cf->queues);
+    free(cf);
+}
+
+static void config_retire(void *arg) {
+    config_free(arg);
+}
+
+/*
+ * Parse a "limit" line.
+ *
+ * @return 0 if successful, -1 otherwise (*err is then set).
+ */
+static int config_limit(CONFIG *cf, char **words, int n, const char **err) {
+    if (n != 3) {
+        *err = "wrong number of arguments";
+        return -1;
+    }
+    char *end;
+    long v = strtol(words[2], &end, 10);
+    if (*end != '\0' || v < 0) {
+        *err = "invalid limit";
+        return -1;
+    }
+    if (v == 0 && (strcmp(words[1], "queue") == 0 || strcmp(words[1], "line") == 0)) {
+        *err = "invalid limit";
+        return -1;
+    }
+    if (strcmp(words[1], "queue") == 0) {
+        cf->queue_limit = v;
+    } else if (strcmp(words[1], "line") == 0) {
+        cf->line_limit = v;
+    } else if (strcmp(words[1], "commands") == 0) {
+        cf->cmd_rate = v;
+    } else if (strcmp(words[1], "chat") == 0) {
+        cf->chat_rate = v;
+    } else if (strcmp(words[1], "connections") == 0) {
+        cf->max_conns = v;
+    } else if (strcmp(words[1], "accept") == 0) {
+        cf->conn_rate = v;
+    } else if (strcmp(words[1], "setup") == 0) {
+        cf->max_setup = v;
+    } else {
+        *err = "unknown limit";
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_extnum(const void *a, const void *b) {
+    EXTNUM x = *(const EXTNUM *)a;
+    EXTNUM y = *(const EXTNUM *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Parse the extensions ending a "group" or "queue" line, which must all be
+ * different.
+ *
+ * @param words  The extensions.
+ * @param m  Number of extensions.
+ * @param duplicate  Error message if an extension is repeated.
+ * @return  The extensions, or NULL (with *err set) if they are invalid.
+ */
+static EXTNUM *config_extensions(char **words, size_t m, const char *duplicate,
+                                  const char **err) {
+    EXTNUM *exts = malloc(m * sizeof(EXTNUM));
+    EXTNUM *sorted = malloc(m * sizeof(EXTNUM));
+    if (exts == NULL || sorted == NULL) {
+        free(exts);
+        free(sorted);
+        *err = "out of memory";
+        return NULL;
+    }
+    for (size_t i = 0; i < m; i++) {
+        exts[i] = dialplan_number(words[i], strlen(words[i]));
+        if (exts[i] < 0) {
+            *err = "invalid extension";
+        }
+    }
+    memcpy(sorted, exts, m * sizeof(EXTNUM));
+    qsort(sorted, m, sizeof(EXTNUM), compare_extnum);
+    for (size_t i = 1; i < m && *err == NULL; i++) {
+        if (sorted[i] == sorted[i - 1]) {
+            *err = duplicate;
+        }
+    }
+    free(sorted);
+    if (*err != NULL) {
+        free(exts);
+        return NULL;
+    }
+    return exts;
+}
+
+/*
+ * Parse a "group" line, adding the group to the configuration.
+ *
+ * @param rule  Set to the dial plan rule for the number of the group.  Its
+ * prefix points to words[1].
+ * @return 0 if successful, -1 otherwise (*err is then set).
+ */
+static int config_group(CONFIG *cf, char **words, int n, DIALPLAN_RULE *rule,
+                        const char **err) {
+    if (n < 4) {
+        *err = "wrong number of arguments";
+        return -1;
+    }
+    EXTNUM number = dialplan_number(words[1], strlen(words[1]));
+    if (number < 0) {
+        *err = "missing or invalid number";
+        return -1;
+    }
+    int policy = hunt_policy(words[2]);
+    if (policy == -1) {
+        *err = "unknown policy";
+        return -1;
+    }
+    size_t m = n - 3;
+    if (m > HUNT_MAX_MEMBERS || (policy == HUNT_RING_ALL && m > HUNT_MAX_RING_ALL)) {
+        *err = "too many members";
+        return -1;
+    }
+
+    HUNT_DEF *groups = realloc(cf->groups, (cf->ngroups + 1) * sizeof(HUNT_DEF));
+    if (groups == NULL) {
+        *err = "out of memory";
+        return -1;
+    }
+    cf->groups = groups;
+    EXTNUM *members = config_extensions(&words[3], m, "duplicate member", err);
+    if (members == NULL) {
+        return -1;
+    }
+
+    cf->groups[cf->ngroups++] = (HUNT_DEF){ number, policy, m, members };
+    rule->action = DP_GROUP;
+    rule->prefix = words[1];
+    rule->ext = number;
+    return 0;
+}
+
+/*
+ * Parse a "queue" line, adding the queue to the configuration.
+ *
+ * @param rule  Set to the dial plan rule for the number of the queue.  Its
+ * prefix points to words[1].
+ * @return 0 if successful, -1 otherwise (*err is then set).
+ */
+static int config_queue(CONFIG *cf, char **words, int n, DIALPLAN_RULE *rule,
+                        const char **err) {
+    if (n < 3) {
+        *err = "wrong number of arguments";
+        return -1;
+    }
+    EXTNUM number = dialplan_number(words[1], strlen(words[1]));
+    if (number < 0) {
+        *err = "missing or invalid number";
+        return -1;
+    }
+    size_t m = n - 2;
+    if (m > ACD_MAX_AGENTS) {
+        *err = "too many agents";
+        return -1;
+    }
+
+    ACD_DEF *queues = realloc(cf->queues, (cf->nqueues + 1) * sizeof(ACD_DEF));
+    if (queues == NULL) {
+        *err = "out of memory";
+        return -1;
+    }
+    cf->queues = queues;
+    EXTNUM *agents = config_extensions(&words[2], m, "duplicate agent", err);
+    if (agents == NULL) {
+        return -1;
+    }
+
+    cf->queues[cf->nqueues++] = (ACD_DEF){ number, m, agents };
+    rule->action = DP_QUEUE;
+    rule->prefix = words[1];
+    rule->ext = number;
+    return 0;
+}
+
+CONFIG *config_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return NULL;
+    }
+    CONFIG *cf = calloc(1, sizeof(CONFIG));
+    if (cf == NULL) {
+        fclose(f);
+        return NULL;
+    }
+    cf->queue_limit = default_queue_limit;
+    cf->line_limit = default_line_limit;
+    cf->cmd_rate = default_cmd_rate;
+    cf->chat_rate = default_chat_rate;
+    cf->ring_timeout = TU_DEFAULT_RING_TIMEOUT;
+    cf->dial_timeout = TU_DEFAULT_DIAL_TIMEOUT;
+    cf->busy_timeout = TU_DEFAULT_BUSY_TIMEOUT;
+    cf->keepalive_timeout = default_keepalive;
+    cf->idle_timeout = default_idle;
+
+    // The rules are collected with their line numbers, then compiled together
+    DIALPLAN_RULE *rules = NULL;
+    int *lines = NULL;
+    size_t n = 0, cap = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    int lineno = 0;
+    const char *err = NULL;
+
+    // Group and queue definitions make lines of any number of words
+    char **words = NULL;
+    int words_cap = 0;
+
+    while (getline(&line, &line_cap, f) != -1) {
+        lineno++;
+        int nwords = 0;
+        char *save;
+        for (char *w = strtok_r(line, " \t\r\n", &save); w != NULL;
+             w = strtok_r(NULL, " \t\r\n", &save)) {
+            if (nwords == words_cap) {
+                words_cap = words_cap ? 2 * words_cap : CONFIG_INITIAL_WORDS;
+                char **ws = realloc(words, words_cap * sizeof(char *));
+                if (ws == NULL) {
+                    err = "out of memory";
+                    break;
+                }
+                words = ws;
+            }
+            words[nwords++] = w;
+        }
+        if (err != NULL) {
+            break;
+        }
+        if (nwords == 0 || words[0][0] == '#') {
+            continue;
+        }
+        if (strcmp(words[0], "limit") == 0) {
+            if (config_limit(cf, words, nwords, &err) == -1) {
+                break;
+            }
+            continue;
+        }
+        if (strcmp(words[0], "timeout") == 0) {
+            if (config_timeout(cf, words, nwords, &err) == -1) {
+                break;
+            }
+            continue;
+        }
+
+        DIALPLAN_RULE rule;
+        if (strcmp(words[0], "group") == 0) {
+            if (config_group(cf, words, nwords, &rule, &err) == -1) {
+                break;
+            }
+        } else if (strcmp(words[0], "queue") == 0) {
+            if (config_queue(cf, words, nwords, &rule, &err) == -1) {
+                break;
+            }
+        } else if (dialplan_parse_rule(words, nwords, &rule, &err) == -1) {
+            break;
+        }
+
+        if (n == cap) {
+            cap = cap ? 2 * cap : CONFIG_INITIAL_RULES;
+            DIALPLAN_RULE *r = realloc(rules, cap * sizeof(DIALPLAN_RULE));
+            int *l = r != NULL ? realloc(lines, cap * sizeof(int)) : NULL;
+            if (r != NULL) {
+                rules = r;
+            }
+            if (l == NULL) {
+                err = "out of memory";
+                break;
+            }
+            lines = l;
+        }
+        // The words are overwritten by the next line
+        rules[n] = rule;
+        rules[n].prefix = strdup(rule.prefix);
+        if (rules[n].prefix == NULL) {
+            err = "out of memory";
+            break;
+        }
+        lines[n++] = lineno;
+    }
+
+    if (err == NULL && ferror(f)) {
+        perror(path);
+        err = "read error";
+    } else if (err == NULL) {
+        size_t dup = n;
+        cf->dialplan = dialplan_compile(rules, n, &dup);
+        if (cf->dialplan == NULL && dup < n) {
+            lineno = lines[dup];
+            err = "number already has a rule";
+        } else if (cf->dialplan == NULL) {
+            lineno = 0;
+            err = "out of memory";
+        }
+    }
+    if (err != NULL) {
+        fprintf(stderr, "%s:%d: %s\n", path, lineno, err);
+        config_free(cf);
+        cf = NULL;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        free((char *)rules[i].prefix);
+    }
+    free(rules);
+    free(lines);
+    free(words);
+    free(line);
+    fclose(f);
+    return cf;
+}
+
+/*
+ * Publish a configuration.  Must be called with config_lock held.
+ */
+static void config_swap(CONFIG *cf) {
+    if (cf != NULL) {
+        atomic_store(&outq_hiwat, cf->queue_limit);
+        atomic_store(&service_max_line, cf->line_limit);
+        atomic_store(&service_cmd_rate, cf->cmd_rate);
+        atomic_store(&service_chat_rate, cf->chat_rate);
+        admission_limit(cf->max_conns, cf->conn_rate, cf->max_setup);
+        atomic_store(&tu_timeouts[TU_RINGING], cf->ring_timeout);
+        atomic_store(&tu_timeouts[TU_DIAL_TONE], cf->dial_timeout);
+        atomic_store(&tu_timeouts[TU_BUSY_SIGNAL], cf->busy_timeout);
+        atomic_store(&service_keepalive_ms, cf->keepalive_timeout);
+        atomic_store(&service_idle_ms, cf->idle_timeout);
+        if (hunt_configure(cf->groups, cf->ngroups) == -1) {
+            warn("Out of memory for hunt groups; they are all removed.");
+        }
+        if (acd_configure(cf->queues, cf->nqueues) == -1) {
+            warn("Out of memory for call queues; they are all removed.");
+        }
+        // The members of the new groups and the agents of the new queues
+        // are available as of now
+        pbx_resync_availability(pbx);
+    }
+    CONFIG *old = atomic_exchange_explicit(&current, cf, memory_order_acq_rel);
+    if (old != NULL) {
+        epoch_retire(config_retire, old);
+    }
+}
+
+void config_publish(CONFIG *cf) {
+    pthread_mutex_lock(&config_lock);
+    if (config_finished) {
+        config_free(cf);
+    } else {
+        config_swap(cf);
+    }
+    pthread_mutex_unlock(&config_lock);
+}
+
+const CONFIG *config_get(void) {
+    return atomic_load_explicit(&current, memory_order_acquire);
+}
+
+static unsigned long elapsed_us(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000UL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+int config_reload(const char *path) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Parse and compile before taking the lock, which only orders publication
+    CONFIG *cf = config_load(path);
+    if (cf == NULL) {
+        STATS_INC(config_reload_failures);
+        warn("Reloading configuration from %s failed; keeping the current one.", path);
+        return -1;
+    }
+    config_publish(cf);
+
+    unsigned long us = elapsed_us(&start);
+    STATS_INC(config_reloads);
+    STATS_SET(config_reload_us, us);
+    if (us > atomic_load_explicit(&pbx_stats.config_reload_max_us, memory_order_relaxed)) {
+        STATS_SET(config_reload_max_us, us);
+    }
+    debug("Reloaded configuration from %s in %lu us.", path, us);
+    return 0;
+}
+
+void config_fini(void) {
+    pthread_mutex_lock(&config_lock);
+    config_finished = 1;
+    CONFIG *old = atomic_exchange(&current, NULL);
+    if (old != NULL) {
+        epoch_retire(config_retire, old);
+    }
+    hunt_configure(NULL, 0);
+    acd_fini();
+    pthread_mutex_unlock(&config_lock);
+}
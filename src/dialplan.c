@@ -0,0 +1,327 @@
+/*
+ * Dial plan compiled into a trie.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+
+#include "dialplan.h"
+
+/*
+ * A node of the trie.  Bit s of map is set if the node has a child for
+ * symbol s; the children are stored consecutively from index first, in
+ * order of symbol, so the child for s is found by counting the bits below
+ * it.
+ */
+struct dp_node {
+    uint32_t first;                 // Index of the first child
+    uint16_t map;                   // Symbols for which there is a child
+    int32_t rule;                   // Index of the rule ending here, or -1
+};
+
+/*
+ * A compiled rule.  The prefix is implied by the position in the trie.
+ */
+struct dp_rule {
+    DIALPLAN_ACTION action;
+    EXTNUM ext;
+};
+
+struct dialplan {
+    struct dp_node *nodes;          // The trie, with its root at index 0
+    size_t nnodes;                  // Number of nodes
+    struct dp_rule *rules;          // Rules, in the order given
+    size_t nrules;                  // Number of rules
+};
+
+/*
+ * A prefix to be entered into the trie, for sorting.
+ */
+struct dp_key {
+    const char *prefix;
+    size_t len;
+    int32_t rule;                   // Index of its rule
+};
+
+/*
+ * Map a symbol to its index: digits first, then '*' and '#'.
+ *
+ * @return  The index, or -1 if the character is not a symbol.
+ */
+static int dp_symbol(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c == '*') {
+        return 10;
+    }
+    if (c == '#') {
+        return 11;
+    }
+    return -1;
+}
+
+static int dp_valid_prefix(const char *s, size_t len) {
+    if (len == 0 || len > DIALPLAN_MAX_PREFIX) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (dp_symbol(s[i]) < 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Order keys by their symbols, so that the keys sharing a prefix are
+ * contiguous and their continuations appear in order of symbol.
+ */
+static int dp_key_cmp(const void *a, const void *b) {
+    const struct dp_key *x = a;
+    const struct dp_key *y = b;
+    size_t n = x->len < y->len ? x->len : y->len;
+    for (size_t i = 0; i < n; i++) {
+        int d = dp_symbol(x->prefix[i]) - dp_symbol(y->prefix[i]);
+        if (d != 0) {
+            return d;
+        }
+    }
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+/*
+ * Fill in a node for keys [lo, hi), which all share their first depth
+ * symbols, and the subtrie below it.  The children of the node are
+ * allocated as a block before any of them is filled in.
+ *
+ * @param next  Index of the next unallocated node.
+ */
+static void dp_build(struct dp_node *nodes, uint32_t *next, uint32_t node,
+                     const struct dp_key *keys, size_t lo, size_t hi, size_t depth) {
+    struct dp_node *x = &nodes[node];
+    x->rule = -1;
+    x->map = 0;
+    x->first = *next;
+    if (lo < hi && keys[lo].len == depth) {
+        x->rule = keys[lo++].rule;
+    }
+    for (size_t i = lo; i < hi; i++) {
+        x->map |= 1u << dp_symbol(keys[i].prefix[depth]);
+    }
+    uint32_t child = *next;
+    *next += __builtin_popcount(x->map);
+
+    for (size_t i = lo; i < hi; ) {
+        int s = dp_symbol(keys[i].prefix[depth]);
+        size_t j = i + 1;
+        while (j < hi && dp_symbol(keys[j].prefix[depth]) == s) {
+            j++;
+        }
+        dp_build(nodes, next, child++, keys, i, j, depth + 1);
+        i = j;
+    }
+}
+
+DIALPLAN *dialplan_compile(const DIALPLAN_RULE *rules, size_t n, size_t *dup) {
+    if (n > INT32_MAX) {
+        return NULL;
+    }
+    DIALPLAN *dp = calloc(1, sizeof(DIALPLAN));
+    struct dp_key *keys = malloc((n ? n : 1) * sizeof(struct dp_key));
+    if (dp == NULL || keys == NULL) {
+        free(keys);
+        free(dp);
+        return NULL;
+    }
+    dp->rules = malloc((n ? n : 1) * sizeof(struct dp_rule));
+    if (dp->rules == NULL) {
+        goto fail;
+    }
+
+    // The trie has at most one node per symbol of each prefix, plus the root
+    size_t max_nodes = 1;
+    for (size_t i = 0; i < n; i++) {
+        size_t len = strlen(rules[i].prefix);
+        if (!dp_valid_prefix(rules[i].prefix, len) ||
+            (rules[i].action != DP_PICKUP && rules[i].action != DP_CONFERENCE &&
+             rules[i].ext < 0)) {
+            goto fail;
+        }
+        keys[i].prefix = rules[i].prefix;
+        keys[i].len = len;
+        keys[i].rule = i;
+        dp->rules[i].action = rules[i].action;
+        dp->rules[i].ext = rules[i].ext;
+        max_nodes += len;
+    }
+    dp->nrules = n;
+    if (max_nodes > UINT32_MAX) {
+        goto fail;
+    }
+
+    qsort(keys, n, sizeof(struct dp_key), dp_key_cmp);
+    for (size_t i = 1; i < n; i++) {
+        if (dp_key_cmp(&keys[i - 1], &keys[i]) == 0) {
+            if (dup != NULL) {
+                *dup = keys[i - 1].rule > keys[i].rule ? keys[i - 1].rule : keys[i].rule;
+            }
+            goto fail;
+        }
+    }
+
+    dp->nodes = malloc(max_nodes * sizeof(struct dp_node));
+    if (dp->nodes == NULL) {
+        goto fail;
+    }
+    uint32_t next = 1;
+    dp_build(dp->nodes, &next, 0, keys, 0, n, 0);
+    dp->nnodes = next;
+
+    // Give back the space reserved for prefixes that turned out to be shared
+    struct dp_node *nodes = realloc(dp->nodes, next * sizeof(struct dp_node));
+    if (nodes != NULL) {
+        dp->nodes = nodes;
+    }
+    free(keys);
+    return dp;
+
+fail:
+    free(keys);
+    dialplan_free(dp);
+    return NULL;
+}
+
+void dialplan_free(DIALPLAN *dp) {
+    if (dp == NULL) {
+        return;
+    }
+    free(dp->nodes);
+    free(dp->rules);
+    free(dp);
+}
+
+size_t dialplan_rules(const DIALPLAN *dp) {
+    return dp->nrules;
+}
+
+EXTNUM dialplan_number(const char *digits, size_t len) {
+    if (len == 0) {
+        return -1;
+    }
+    EXTNUM n = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned d = (unsigned)(digits[i] - '0');
+        if (d > 9 || n > (EXTNUM_MAX - (EXTNUM)d) / 10) {
+            return -1;
+        }
+        n = n * 10 + d;
+    }
+    return n;
+}
+
+/*
+ * Apply a rule whose prefix has been matched to the rest of the number.
+ *
+ * @return 0 if the rule applies, -1 if it does not.
+ */
+static int dp_apply(const struct dp_rule *r, const char *rest, size_t len,
+                    DIALPLAN_MATCH *m) {
+    EXTNUM n;
+    switch (r->action) {
+        case DP_ALIAS:
+        case DP_GROUP:
+        case DP_QUEUE:
+            if (len != 0) {
+                return -1;
+            }
+            n = r->ext;
+            break;
+        case DP_ROUTE:
+            n = r->ext;
+            break;
+        case DP_MAP:
+            n = dialplan_number(rest, len);
+            if (n < 0 || n > EXTNUM_MAX - r->ext) {
+                return -1;
+            }
+            n += r->ext;
+            break;
+        case DP_PICKUP:
+        case DP_CONFERENCE:
+            n = dialplan_number(rest, len);
+            if (n < 0) {
+                return -1;
+            }
+            break;
+        default:
+            return -1;
+    }
+    m->action = r->action;
+    m->ext = n;
+    return 0;
+}
+
+int dialplan_lookup(const DIALPLAN *dp, const char *digits, size_t len,
+                    DIALPLAN_MATCH *m) {
+    const struct dp_node *x = dp->nodes;
+    int ret = -1;
+    for (size_t i = 0; ; i++) {
+        // A match further along the number overrides this one
+        if (x->rule >= 0 && dp_apply(&dp->rules[x->rule], digits + i, len - i, m) == 0) {
+            ret = 0;
+        }
+        if (i == len) {
+            break;
+        }
+        int s = dp_symbol(digits[i]);
+        if (s < 0 || !(x->map & (1u << s))) {
+            break;
+        }
+        x = &dp->nodes[x->first + __builtin_popcount(x->map & ((1u << s) - 1))];
+    }
+    return ret;
+}
+
+/*
+ * Keywords introducing the rules, indexed by action (NULL for the actions
+ * of rules that are not written as such).
+ */
+static const char *dp_keywords[] = {
+    [DP_ALIAS] = "alias",
+    [DP_ROUTE] = "route",
+    [DP_MAP] = "map",
+    [DP_PICKUP] = "pickup",
+    [DP_CONFERENCE] = "conference"
+};
+
+int dialplan_parse_rule(char **words, int n, DIALPLAN_RULE *rule, const char **err) {
+    int action = -1;
+    for (size_t i = 0; i < sizeof(dp_keywords) / sizeof(dp_keywords[0]); i++) {
+        if (dp_keywords[i] != NULL && strcmp(words[0], dp_keywords[i]) == 0) {
+            action = i;
+        }
+    }
+    if (action == -1) {
+        *err = "unknown rule";
+        return -1;
+    }
+    if (n < 2 || !dp_valid_prefix(words[1], strlen(words[1]))) {
+        *err = "missing or invalid number";
+        return -1;
+    }
+    if (n != (action == DP_PICKUP || action == DP_CONFERENCE ? 2 : 3)) {
+        *err = "wrong number of arguments";
+        return -1;
+    }
+    EXTNUM e = n == 3 ? dialplan_number(words[2], strlen(words[2])) : 0;
+    if (e < 0) {
+        *err = "invalid extension";
+        return -1;
+    }
+    rule->action = action;
+    rule->prefix = words[1];
+    rule->ext = e;
+    return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * Epoch-based reclamation.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+
+#include "epoch.h"
+#include "debug.h"
+
+/*
+ * Each thread that has entered a critical section owns a record, which is
+ * returned to a pool when the thread exits.  Records are never freed, so
+ * the list can be walked without locking.
+ */
+struct epoch_thread {
+    atomic_ulong state;             // (epoch << 1) | 1 while in a critical section
+    atomic_int in_use;              // Record is owned by a live thread
+    int depth;                      // Nesting depth of critical sections
+    struct epoch_thread *next;      // Next record in the list
+};
+
+/*
+ * An object awaiting the end of its grace period.
+ */
+struct retired {
+    void (*fn)(void *);             // Destructor
+    void *arg;                      // Object
+    unsigned long epoch;            // Global epoch when it was retired
+    struct retired *next;           // Next object, in order of retirement
+};
+
+static atomic_ulong global_epoch = 0;
+static _Atomic(struct epoch_thread *) threads = NULL;
+static __thread struct epoch_thread *self = NULL;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t self_key;
+
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct retired *limbo_head = NULL;
+static struct retired *limbo_tail = NULL;
+static atomic_ulong limbo_count = 0;
+
+static void thread_exit(void *arg) {
+    struct epoch_thread *t = arg;
+    atomic_store_explicit(&t->state, 0, memory_order_release);
+    atomic_store_explicit(&t->in_use, 0, memory_order_release);
+}
+
+static void key_init(void) {
+    pthread_key_create(&self_key, thread_exit);
+}
+
+/*
+ * Give the calling thread a record, reusing one released by an exited
+ * thread if possible.
+ */
+static struct epoch_thread *thread_register(void) {
+    pthread_once(&key_once, key_init);
+    struct epoch_thread *t;
+    for (t = atomic_load(&threads); t != NULL; t = t->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&t->in_use, &expected, 1)) {
+            break;
+        }
+    }
+    if (t == NULL) {
+        t = calloc(1, sizeof(struct epoch_thread));
+        if (t == NULL) {
+            // Without a record we cannot read safely, and cannot proceed
+            error("epoch: Out of memory registering thread.");
+            abort();
+        }
+        atomic_store(&t->in_use, 1);
+        struct epoch_thread *head = atomic_load(&threads);
+        do {
+            t->next = head;
+        } while (!atomic_compare_exchange_weak(&threads, &head, t));
+    }
+    t->depth = 0;
+    pthread_setspecific(self_key, t);
+    return t;
+}
+
+void epoch_enter(void) {
+    if (self == NULL) {
+        self = thread_register();
+    }
+    if (self->depth++ == 0) {
+        unsigned long e = atomic_load(&global_epoch);
+        // Sequentially consistent, so that the store is visible before any
+        // shared pointer is loaded
+        atomic_store(&self->state, (e << 1) | 1);
+    }
+}
+
+/*
+ * Advance the global epoch if every thread in a critical section has seen
+ * the current one.  Must be called with limbo_lock held.
+ *
+ * @return 1 if the epoch was advanced, 0 otherwise.
+ */
+static int epoch_advance(void) {
+    unsigned long e = atomic_load(&global_epoch);
+    for (struct epoch_thread *t = atomic_load(&threads); t != NULL; t = t->next) {
+        unsigned long s = atomic_load(&t->state);
+        if ((s & 1) && (s >> 1) != e) {
+            return 0;
+        }
+    }
+    return atomic_compare_exchange_strong(&global_epoch, &e, e + 1);
+}
+
+/*
+ * Run the destructors of the objects whose grace period has ended.
+ *
+ * @param wait  Whether to wait for limbo_lock if another thread holds it.
+ */
+static void epoch_reclaim(int wait) {
+    if (wait) {
+        pthread_mutex_lock(&limbo_lock);
+    } else if (pthread_mutex_trylock(&limbo_lock) != 0) {
+        return;
+    }
+    // An object retired in epoch e may be reached by readers that entered
+    // in epoch e - 1 or e, so it is safe once the epoch reaches e + 2.
+    epoch_advance();
+    epoch_advance();
+    unsigned long e = atomic_load(&global_epoch);
+    struct retired *done = limbo_head;
+    struct retired **lastp = &done;
+    unsigned long n = 0;
+    while (*lastp != NULL && (*lastp)->epoch + 2 <= e) {
+        lastp = &(*lastp)->next;
+        n++;
+    }
+    limbo_head = *lastp;
+    if (limbo_head == NULL) {
+        limbo_tail = NULL;
+    }
+    *lastp = NULL;
+    atomic_fetch_sub(&limbo_count, n);
+    pthread_mutex_unlock(&limbo_lock);
+
+    while (done != NULL) {
+        struct retired *r = done;
+        done = r->next;
+        r->fn(r->arg);
+        free(r);
+    }
+}
+
+void epoch_exit(void) {
+    if (--self->depth > 0) {
+        return;
+    }
+    atomic_store_explicit(&self->state, 0, memory_order_release);
+    if (atomic_load_explicit(&limbo_count, memory_order_relaxed) > 0) {
+        epoch_reclaim(0);
+    }
+}
+
+void epoch_retire(void (*fn)(void *), void *arg) {
+    struct retired *r = malloc(sizeof(struct retired));
+    if (r == NULL) {
+        // Better to wait for the grace period here than to free too early
+        warn("epoch: Out of memory retiring object, waiting instead.");
+        unsigned long e = atomic_load(&global_epoch);
+        while (atomic_load(&global_epoch) < e + 2) {
+            pthread_mutex_lock(&limbo_lock);
+            epoch_advance();
+            pthread_mutex_unlock(&limbo_lock);
+            sched_yield();
+        }
+        fn(arg);
+        return;
+    }
+    r->fn = fn;
+    r->arg = arg;
+    r->next = NULL;
+    pthread_mutex_lock(&limbo_lock);
+    r->epoch = atomic_load(&global_epoch);
+    if (limbo_tail != NULL) {
+        limbo_tail->next = r;
+    } else {
+        limbo_head = r;
+    }
+    limbo_tail = r;
+    atomic_fetch_add(&limbo_count, 1);
+    pthread_mutex_unlock(&limbo_lock);
+    epoch_reclaim(0);
+}
+
+void epoch_barrier(void) {
+    while (atomic_load(&limbo_count) > 0) {
+        epoch_reclaim(1);
+        if (atomic_load(&limbo_count) > 0) {
+            sched_yield();
+        }
+    }
+}
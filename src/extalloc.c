@@ -0,0 +1,125 @@
+/*
+ * Extension number allocator.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+
+
+#include "extalloc.h"
+
+#define WORD_BITS 64
+#define MAX_LEVELS 4
+
+/*
+ * Bit i of word w at some level is set if the number (or, above the bottom
+ * level, some number in the group) w * 64 + i is free.  Level 0 is the top
+ * level, and always consists of a single word.
+ */
+struct extalloc {
+    size_t capacity;                // Number of numbers managed
+    int levels;                     // Number of levels in the bitmap
+    uint64_t *bits[MAX_LEVELS];     // The words of each level
+};
+
+EXTALLOC *extalloc_init(size_t capacity) {
+    if (capacity == 0 || capacity > EXTALLOC_MAX_CAPACITY) {
+        return NULL;
+    }
+    EXTALLOC *ea = calloc(1, sizeof(EXTALLOC));
+    if (ea == NULL) {
+        return NULL;
+    }
+    ea->capacity = capacity;
+
+    // Number of bits at each level, from the bottom up
+    size_t nbits[MAX_LEVELS];
+    int levels = 0;
+    size_t n = capacity;
+    do {
+        nbits[levels++] = n;
+        n = (n + WORD_BITS - 1) / WORD_BITS;
+    } while (n > 1);
+    ea->levels = levels;
+
+    for (int l = 0; l < levels; l++) {
+        // Level l from the top corresponds to nbits[levels - 1 - l]
+        size_t bits = nbits[levels - 1 - l];
+        size_t words = (bits + WORD_BITS - 1) / WORD_BITS;
+        ea->bits[l] = malloc(words * sizeof(uint64_t));
+        if (ea->bits[l] == NULL) {
+            extalloc_fini(ea);
+            return NULL;
+        }
+        for (size_t w = 0; w < words; w++) {
+            size_t left = bits - w * WORD_BITS;
+            ea->bits[l][w] = left >= WORD_BITS ? ~(uint64_t)0 : ((uint64_t)1 << left) - 1;
+        }
+    }
+    return ea;
+}
+
+void extalloc_fini(EXTALLOC *ea) {
+    for (int l = 0; l < MAX_LEVELS; l++) {
+        free(ea->bits[l]);
+    }
+    free(ea);
+}
+
+size_t extalloc_capacity(EXTALLOC *ea) {
+    return ea->capacity;
+}
+
+/*
+ * Mark a number as allocated, clearing the bits of the groups that contain
+ * it at the higher levels as they become full.
+ */
+static void mark_used(EXTALLOC *ea, size_t ext) {
+    for (int l = ea->levels - 1; l >= 0; l--) {
+        uint64_t *w = &ea->bits[l][ext / WORD_BITS];
+        *w &= ~((uint64_t)1 << (ext % WORD_BITS));
+        if (*w != 0) {
+            break;  // The group still has a free number
+        }
+        ext /= WORD_BITS;
+    }
+}
+
+int extalloc_get(EXTALLOC *ea) {
+    if (ea->bits[0][0] == 0) {
+        return -1;
+    }
+    size_t ext = 0;
+    for (int l = 0; l < ea->levels; l++) {
+        ext = ext * WORD_BITS + __builtin_ctzll(ea->bits[l][ext]);
+    }
+    mark_used(ea, ext);
+    return (int)ext;
+}
+
+int extalloc_claim(EXTALLOC *ea, int ext) {
+    if (ext < 0 || (size_t)ext >= ea->capacity) {
+        return -1;
+    }
+    uint64_t *w = &ea->bits[ea->levels - 1][ext / WORD_BITS];
+    if (!(*w & ((uint64_t)1 << (ext % WORD_BITS)))) {
+        return -1;
+    }
+    mark_used(ea, ext);
+    return 0;
+}
+
+void extalloc_put(EXTALLOC *ea, int ext) {
+    if (ext < 0 || (size_t)ext >= ea->capacity) {
+        return;
+    }
+    size_t n = ext;
+    for (int l = ea->levels - 1; l >= 0; l--) {
+        uint64_t *w = &ea->bits[l][n / WORD_BITS];
+        int was_full = *w == 0;
+        *w |= (uint64_t)1 << (n % WORD_BITS);
+        if (!was_full) {
+            break;  // The higher levels already show the group as not full
+        }
+        n /= WORD_BITS;
+    }
+}
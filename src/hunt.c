@@ -0,0 +1,315 @@
+/*
+ * Hunt groups.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+
+#include "hunt.h"
+#include "registry.h"
+#include "debug.h"
+
+/*
+ * The available members of a group are kept in a bitmap of up to 64 words,
+ * with a summary word telling which of them are not empty, so the next
+ * available member after a given one is found with two bit scans at most.
+ */
+#define HUNT_WORD_BITS 64
+
+struct hunt_group {
+    pthread_mutex_t lock;           // Protects the availability of members
+    EXTNUM number;                  // Number of the group
+    HUNT_POLICY policy;             // How members are chosen
+    unsigned n;                     // Number of members
+    EXTNUM *members;                // Extensions of the members
+    uint64_t summary;               // Bit w set if avail[w] is not empty
+    uint64_t *avail;                // Bit i set if member i is available
+    unsigned cursor;                // Member chosen last (round robin)
+    int lru_head;                   // Available members, least recently used
+    int lru_tail;                   //  first, or -1 if none
+    int *lru_prev;                  // Links of the list, by member
+    int *lru_next;
+};
+
+/*
+ * Membership of an extension in a group.  An extension may be a member of
+ * several groups; its memberships are chained.
+ */
+struct hunt_member {
+    struct hunt_group *group;
+    unsigned index;                 // Index of the member in the group
+    struct hunt_member *next;       // Next membership of the same extension
+};
+
+struct hunt_table {
+    REGISTRY *groups;               // Groups by number
+    REGISTRY *members;              // First membership by extension
+    struct hunt_group *g;           // The groups
+    size_t ng;
+    struct hunt_member *m;          // The memberships
+};
+
+static const char *policy_names[] = {
+    [HUNT_RING_ALL] = "ringall",
+    [HUNT_ROUND_ROBIN] = "roundrobin",
+    [HUNT_LRU] = "lru"
+};
+
+/*
+ * The current table is replaced under the write lock, and used under the
+ * read lock.
+ */
+static pthread_rwlock_t hunt_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct hunt_table *table = NULL;
+
+/*
+ * Whether there are any groups, so that availability changes cost nothing
+ * when there are none.  A change missed because this was being set is
+ * made up for by the resynchronization that follows hunt_configure().
+ */
+static atomic_int have_groups = 0;
+
+int hunt_policy(const char *name) {
+    for (size_t i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++) {
+        if (strcmp(name, policy_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void table_free(struct hunt_table *t) {
+    if (t == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < t->ng; i++) {
+        struct hunt_group *g = &t->g[i];
+        pthread_mutex_destroy(&g->lock);
+        free(g->members);
+        free(g->avail);
+        free(g->lru_prev);
+        free(g->lru_next);
+    }
+    if (t->groups != NULL) {
+        registry_fini(t->groups);
+    }
+    if (t->members != NULL) {
+        registry_fini(t->members);
+    }
+    free(t->g);
+    free(t->m);
+    free(t);
+}
+
+static struct hunt_table *table_build(const HUNT_DEF *defs, size_t n) {
+    struct hunt_table *t = calloc(1, sizeof(struct hunt_table));
+    if (t == NULL) {
+        return NULL;
+    }
+    size_t nm = 0;
+    for (size_t i = 0; i < n; i++) {
+        nm += defs[i].n;
+    }
+    t->groups = registry_init(n);
+    t->members = registry_init(nm);
+    t->g = calloc(n ? n : 1, sizeof(struct hunt_group));
+    t->m = calloc(nm ? nm : 1, sizeof(struct hunt_member));
+    if (t->groups == NULL || t->members == NULL || t->g == NULL || t->m == NULL) {
+        table_free(t);
+        return NULL;
+    }
+
+    struct hunt_member *m = t->m;
+    for (size_t i = 0; i < n; i++) {
+        struct hunt_group *g = &t->g[i];
+        const HUNT_DEF *d = &defs[i];
+        unsigned words = (d->n + HUNT_WORD_BITS - 1) / HUNT_WORD_BITS;
+        pthread_mutex_init(&g->lock, NULL);
+        t->ng++;
+        g->number = d->number;
+        g->policy = d->policy;
+        g->n = d->n;
+        g->cursor = d->n - 1;
+        g->lru_head = g->lru_tail = -1;
+        g->members = malloc(d->n * sizeof(EXTNUM));
+        g->avail = calloc(words, sizeof(uint64_t));
+        g->lru_prev = malloc(d->n * sizeof(int));
+        g->lru_next = malloc(d->n * sizeof(int));
+        if (d->n == 0 || d->n > HUNT_MAX_MEMBERS ||
+            (d->policy == HUNT_RING_ALL && d->n > HUNT_MAX_RING_ALL) ||
+            g->members == NULL || g->avail == NULL || g->lru_prev == NULL ||
+            g->lru_next == NULL || registry_insert(t->groups, d->number, g) == -1) {
+            table_free(t);
+            return NULL;
+        }
+        memcpy(g->members, d->members, d->n * sizeof(EXTNUM));
+
+        for (unsigned j = 0; j < d->n; j++, m++) {
+            m->group = g;
+            m->index = j;
+            struct hunt_member *first = registry_lookup(t->members, d->members[j]);
+            if (first != NULL) {
+                m->next = first->next;
+                first->next = m;
+            } else if (registry_insert(t->members, d->members[j], m) == -1) {
+                table_free(t);
+                return NULL;
+            }
+        }
+    }
+    return t;
+}
+
+int hunt_configure(const HUNT_DEF *defs, size_t n) {
+    struct hunt_table *t = NULL;
+    int ret = 0;
+    if (n > 0) {
+        t = table_build(defs, n);
+        ret = t != NULL ? 0 : -1;
+    }
+
+    pthread_rwlock_wrlock(&hunt_lock);
+    struct hunt_table *old = table;
+    table = t;
+    atomic_store(&have_groups, t != NULL);
+    pthread_rwlock_unlock(&hunt_lock);
+
+    table_free(old);
+    return ret;
+}
+
+static void lru_unlink(struct hunt_group *g, int i) {
+    int prev = g->lru_prev[i];
+    int next = g->lru_next[i];
+    if (prev >= 0) {
+        g->lru_next[prev] = next;
+    } else {
+        g->lru_head = next;
+    }
+    if (next >= 0) {
+        g->lru_prev[next] = prev;
+    } else {
+        g->lru_tail = prev;
+    }
+}
+
+static void lru_append(struct hunt_group *g, int i) {
+    g->lru_prev[i] = g->lru_tail;
+    g->lru_next[i] = -1;
+    if (g->lru_tail >= 0) {
+        g->lru_next[g->lru_tail] = i;
+    } else {
+        g->lru_head = i;
+    }
+    g->lru_tail = i;
+}
+
+/*
+ * Mark a member available or not.  Must be called with the group locked.
+ */
+static void group_set(struct hunt_group *g, unsigned i, int available) {
+    unsigned w = i / HUNT_WORD_BITS;
+    uint64_t bit = 1ULL << (i % HUNT_WORD_BITS);
+    if (!(g->avail[w] & bit) == !available) {
+        return;
+    }
+    if (available) {
+        g->avail[w] |= bit;
+        g->summary |= 1ULL << w;
+        lru_append(g, i);
+    } else {
+        g->avail[w] &= ~bit;
+        if (g->avail[w] == 0) {
+            g->summary &= ~(1ULL << w);
+        }
+        lru_unlink(g, i);
+    }
+}
+
+/*
+ * Find the first available member at or after a given index.  Must be
+ * called with the group locked.
+ *
+ * @return  Its index, or -1 if there is none.
+ */
+static int group_next(struct hunt_group *g, unsigned from) {
+    unsigned w = from / HUNT_WORD_BITS;
+    if (from >= g->n) {
+        return -1;
+    }
+    uint64_t bits = g->avail[w] & (~0ULL << (from % HUNT_WORD_BITS));
+    if (bits != 0) {
+        return w * HUNT_WORD_BITS + __builtin_ctzll(bits);
+    }
+    uint64_t words = w + 1 < HUNT_WORD_BITS ? g->summary & (~0ULL << (w + 1)) : 0;
+    if (words == 0) {
+        return -1;
+    }
+    w = __builtin_ctzll(words);
+    return w * HUNT_WORD_BITS + __builtin_ctzll(g->avail[w]);
+}
+
+void hunt_set_available(EXTNUM ext, int available) {
+    if (!atomic_load_explicit(&have_groups, memory_order_relaxed) || ext < 0) {
+        return;
+    }
+    pthread_rwlock_rdlock(&hunt_lock);
+    if (table != NULL) {
+        for (struct hunt_member *m = registry_lookup(table->members, ext); m != NULL; m = m->next) {
+            pthread_mutex_lock(&m->group->lock);
+            group_set(m->group, m->index, available);
+            pthread_mutex_unlock(&m->group->lock);
+        }
+    }
+    pthread_rwlock_unlock(&hunt_lock);
+}
+
+int hunt_select(EXTNUM group, EXTNUM *exts, int max) {
+    if (group < 0) {
+        return -1;
+    }
+    pthread_rwlock_rdlock(&hunt_lock);
+    struct hunt_group *g = table != NULL ? registry_lookup(table->groups, group) : NULL;
+    if (g == NULL) {
+        pthread_rwlock_unlock(&hunt_lock);
+        return -1;
+    }
+
+    pthread_mutex_lock(&g->lock);
+    int n = 0;
+    int i;
+    switch (g->policy) {
+        case HUNT_RING_ALL:
+            for (i = group_next(g, 0); i >= 0 && n < max; i = group_next(g, i + 1)) {
+                exts[n++] = g->members[i];
+            }
+            break;
+        case HUNT_ROUND_ROBIN:
+            i = group_next(g, g->cursor + 1);
+            if (i < 0) {
+                i = group_next(g, 0);
+            }
+            if (i >= 0 && max > 0) {
+                g->cursor = i;
+                exts[n++] = g->members[i];
+            }
+            break;
+        case HUNT_LRU:
+            i = g->lru_head;
+            if (i >= 0 && max > 0) {
+                // Now the most recently used
+                lru_unlink(g, i);
+                lru_append(g, i);
+                exts[n++] = g->members[i];
+            }
+            break;
+    }
+    pthread_mutex_unlock(&g->lock);
+
+    pthread_rwlock_unlock(&hunt_lock);
+    debug("Group %" PRIext " chose %d member(s).", group, n);
+    return n;
+}
@@ -0,0 +1,67 @@
+/*
+ * Liveness of client connections.
+ */
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "keepalive.h"
+#include "service.h"
+#include "timer.h"
+#include "stats.h"
+#include "debug.h"
+
+/*
+ * Ghosts reaped in the current period.  The rate timer runs while ghosts
+ * are being reaped, and stops after a period without any.
+ */
+static pthread_mutex_t rate_lock = PTHREAD_MUTEX_INITIALIZER;
+static TIMER rate_timer;
+static unsigned long reaped;
+static int rating;
+
+void keepalive_tune(int fd) {
+    unsigned long ms = atomic_load_explicit(&service_keepalive_ms, memory_order_relaxed);
+    int on = ms > 0;
+    if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) == -1 || !on) {
+        return;
+    }
+    int idle = ms < 1000 ? 1 : ms / 1000;
+    int interval = KEEPALIVE_INTERVAL;
+    int probes = KEEPALIVE_PROBES;
+    unsigned int timeout = (unsigned int)idle * 1000 + interval * probes * 1000;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) == -1 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) == -1 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes)) == -1 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout)) == -1) {
+        debug("keepalive: Could not tune keepalive on FD %d.", fd);
+    }
+}
+
+/*
+ * End a period: report the ghosts reaped during it, and start another one
+ * unless there were none.
+ */
+static void rate_roll(TIMER *t, unsigned long data) {
+    pthread_mutex_lock(&rate_lock);
+    STATS_SET(ghosts_per_minute, reaped);
+    if (reaped > 0) {
+        reaped = 0;
+        timer_arm(t, KEEPALIVE_RATE_PERIOD, 0);
+    } else {
+        rating = 0;
+    }
+    pthread_mutex_unlock(&rate_lock);
+}
+
+void keepalive_reaped(void) {
+    STATS_INC(ghosts_reaped);
+    pthread_mutex_lock(&rate_lock);
+    reaped++;
+    if (!rating) {
+        timer_init(&rate_timer, rate_roll);
+        rating = timer_arm(&rate_timer, KEEPALIVE_RATE_PERIOD, 0) == 0;
+    }
+    pthread_mutex_unlock(&rate_lock);
+}
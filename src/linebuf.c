@@ -0,0 +1,177 @@
+/*
+ * Line-oriented input buffer for client connections.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+
+#include "linebuf.h"
+
+/*
+ * Positions in the buffer are kept as running byte counts, and reduced
+ * modulo the capacity (a power of 2) only when the data is accessed.
+ */
+struct linebuf {
+    size_t cap;         // Capacity of the ring (power of 2)
+    size_t max;         // Maximum length of a line
+    size_t head;        // Position of the first byte not yet taken
+    size_t tail;        // Position after the last byte received
+    size_t scan;        // Position up to which no terminator has been found
+    int discard;        // Discarding the rest of an over-long line
+    unsigned rejected;  // Over-long lines rejected
+    char *line;         // Line reassembled from the ends of the ring
+    char data[];        // The ring itself
+};
+
+LINEBUF *linebuf_create(size_t max) {
+    // Leave room for a whole line, its terminator and at least as much again
+    size_t cap = 64;
+    while (cap < 2 * (max + 2)) {
+        cap *= 2;
+    }
+    LINEBUF *lb = malloc(sizeof(LINEBUF) + cap + max + 1);
+    if (lb == NULL) {
+        return NULL;
+    }
+    lb->cap = cap;
+    lb->max = max;
+    lb->head = lb->tail = lb->scan = 0;
+    lb->discard = 0;
+    lb->rejected = 0;
+    lb->line = lb->data + cap;
+    return lb;
+}
+
+void linebuf_destroy(LINEBUF *lb) {
+    free(lb);
+}
+
+/*
+ * Describe the free space of the ring with (at most two) I/O vectors.
+ */
+static int linebuf_space(LINEBUF *lb, struct iovec *iov) {
+    size_t mask = lb->cap - 1;
+    size_t room = lb->cap - (lb->tail - lb->head);
+    size_t off = lb->tail & mask;
+    size_t first = lb->cap - off < room ? lb->cap - off : room;
+    int n = 0;
+    if (first > 0) {
+        iov[n].iov_base = lb->data + off;
+        iov[n].iov_len = first;
+        n++;
+    }
+    if (room > first) {
+        iov[n].iov_base = lb->data;
+        iov[n].iov_len = room - first;
+        n++;
+    }
+    return n;
+}
+
+ssize_t linebuf_recv(LINEBUF *lb, int fd, int flags) {
+    struct iovec iov[2];
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = linebuf_space(lb, iov);
+    ssize_t n = recvmsg(fd, &mh, flags);
+    if (n > 0) {
+        lb->tail += n;
+    }
+    return n;
+}
+
+size_t linebuf_put(LINEBUF *lb, const char *data, size_t len) {
+    struct iovec iov[2];
+    int n = linebuf_space(lb, iov);
+    size_t total = 0;
+    for (int i = 0; i < n && total < len; i++) {
+        size_t m = len - total < iov[i].iov_len ? len - total : iov[i].iov_len;
+        memcpy(iov[i].iov_base, data + total, m);
+        total += m;
+    }
+    lb->tail += total;
+    return total;
+}
+
+/*
+ * Find the next line terminator at or after the scan position.
+ *
+ * @return  Its position, or lb->tail if there is none.
+ */
+static size_t linebuf_find(LINEBUF *lb) {
+    size_t mask = lb->cap - 1;
+    while (lb->scan < lb->tail) {
+        size_t off = lb->scan & mask;
+        size_t n = lb->tail - lb->scan;
+        if (n > lb->cap - off) {
+            n = lb->cap - off;
+        }
+        char *nl = memchr(lb->data + off, '\n', n);
+        if (nl != NULL) {
+            return lb->scan + (nl - (lb->data + off));
+        }
+        lb->scan += n;
+    }
+    return lb->tail;
+}
+
+char *linebuf_next(LINEBUF *lb, size_t *lenp) {
+    size_t mask = lb->cap - 1;
+    while (1) {
+        size_t nl = linebuf_find(lb);
+        if (nl == lb->tail) {
+            if (lb->tail - lb->head > lb->max) {
+                // Already too long to be accepted: drop it as it arrives
+                if (!lb->discard) {
+                    lb->rejected++;
+                }
+                lb->discard = 1;
+                lb->head = lb->tail;
+            }
+            return NULL;
+        }
+        size_t start = lb->head;
+        size_t len = nl - start;
+        lb->head = lb->scan = nl + 1;
+        if (lb->discard) {
+            lb->discard = 0;
+            continue;
+        }
+        if (len > lb->max) {
+            lb->rejected++;
+            continue;
+        }
+
+        char *line;
+        size_t off = start & mask;
+        if (off + len < lb->cap) {
+            // The line and its terminator are contiguous: use them in place
+            line = lb->data + off;
+        } else {
+            size_t first = lb->cap - off;
+            memcpy(lb->line, lb->data + off, first);
+            memcpy(lb->line + first, lb->data, len - first);
+            line = lb->line;
+        }
+        if (len > 0 && line[len - 1] == '\r') {
+            len--;
+        }
+        line[len] = '\0';
+        if (lenp != NULL) {
+            *lenp = len;
+        }
+        return line;
+    }
+}
+
+int linebuf_ready(LINEBUF *lb) {
+    return linebuf_find(lb) != lb->tail;
+}
+
+unsigned linebuf_rejected(LINEBUF *lb) {
+    unsigned n = lb->rejected;
+    lb->rejected = 0;
+    return n;
+}
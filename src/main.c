@@ -6,45 +6,111 @@
 #include <pthread.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
 #include <arpa/inet.h>
 #include <errno.h>
 
 
 #include "pbx.h"
+#include "pbx_ext.h"
+#include "tu_ext.h"
+#include "extalloc.h"
+#include "config.h"
+#include "page.h"
+#include "timer.h"
 #include "server.h"
+#include "reactor.h"
+#include "uring.h"
+#include "outq.h"
+#include "service.h"
+#include "admission.h"
 #include "debug.h"
 
 static void terminate(int status);
 static void terminate_handler(int signum);
+static void *reload_thread(void *arg);
+static void usage(char *prog);
 volatile sig_atomic_t shutdown_flag = 0;
 int server_fd = -1;
 
+/*
+ * Ways in which client connections can be serviced.
+ */
+typedef enum server_mode {
+    MODE_THREAD,    // One thread per client (the default)
+    MODE_EPOLL,     // Fixed number of epoll reactor threads
+    MODE_URING      // Single io_uring thread, falling back to epoll
+} SERVER_MODE;
+
+static SERVER_MODE server_mode = MODE_THREAD;
+static int reactors_started = 0;
+static char *config_path = NULL;
+static sigset_t reload_signals;
+
 
 /*
  * "PBX" telephone exchange simulation.
  *
- * Usage: pbx <port>
+ * Usage: pbx -p <port> [-m thread|epoll|uring] [-t <reactor threads>] [-q <bytes>]
+ *            [-l <bytes>] [-e <extensions>] [-c <config file>]
  */
 int main(int argc, char* argv[]) {
     int opt;
     char *port_str = NULL;
     int port;
+    int nthreads = 0;
 
     // option processing
-    while ((opt = getopt(argc, argv, "p:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:m:t:q:l:e:c:")) != -1) {
         switch (opt) {
             case 'p':
                 port_str = optarg;
                 break;
+            case 'm':
+                if (strcmp(optarg, "thread") == 0) {
+                    server_mode = MODE_THREAD;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    server_mode = MODE_EPOLL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    server_mode = MODE_URING;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                if (nthreads <= 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'q':
+                if (atol(optarg) <= 0) {
+                    usage(argv[0]);
+                }
+                outq_hiwat = atol(optarg);
+                break;
+            case 'l':
+                if (atol(optarg) <= 0) {
+                    usage(argv[0]);
+                }
+                service_max_line = atol(optarg);
+                break;
+            case 'e':
+                if (atol(optarg) <= 0 || atol(optarg) > EXTALLOC_MAX_CAPACITY) {
+                    usage(argv[0]);
+                }
+                pbx_max_extensions = atol(optarg);
+                break;
+            case 'c':
+                config_path = optarg;
+                break;
             default:
-                fprintf(stderr, "Usage: %s -p <port>\n", argv[0]);
-                exit(EXIT_FAILURE);
+                usage(argv[0]);
         }
     }
 
     if (port_str == NULL) {
-        fprintf(stderr, "Usage: %s -p <port>\n", argv[0]);
-        exit(EXIT_FAILURE);
+        usage(argv[0]);
     }
 
     port = atoi(port_str);
@@ -53,6 +119,13 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    // allow as many client connections as the hard limit permits
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
     // perform required initialization of the PBX module.
     debug("Initializing PBX...");
     pbx = pbx_init();
@@ -61,6 +134,17 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    // load the configuration (dial plan and limits), if any
+    config_init();
+    if (config_path != NULL) {
+        CONFIG *cf = config_load(config_path);
+        if (cf == NULL) {
+            fprintf(stderr, "Failed to load configuration\n");
+            terminate(EXIT_FAILURE);
+        }
+        config_publish(cf);
+    }
+
     // install SIGHUP handler
     struct sigaction sa;
     sa.sa_handler = terminate_handler;
@@ -72,6 +156,21 @@ int main(int argc, char* argv[]) {
         terminate(EXIT_FAILURE);
     }
 
+    // a client that disconnects while being written to must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // SIGUSR1 is only taken by the reload thread, so block it before any
+    // other thread is created
+    sigemptyset(&reload_signals);
+    sigaddset(&reload_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &reload_signals, NULL);
+    pthread_t reload_tid;
+    if (pthread_create(&reload_tid, NULL, reload_thread, NULL) != 0) {
+        perror("pthread_create");
+        terminate(EXIT_FAILURE);
+    }
+    pthread_detach(reload_tid);
+
     // set up the server socket
     server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd == -1) {
@@ -103,7 +202,23 @@ int main(int argc, char* argv[]) {
 
     debug("Server listening on port %d", port);
 
-    // accept connections and create threads
+    if (server_mode == MODE_URING) {
+        if (uring_serve(server_fd, &shutdown_flag) == 0) {
+            terminate(EXIT_SUCCESS);
+        }
+        fprintf(stderr, "io_uring is not supported, falling back to epoll\n");
+        server_mode = MODE_EPOLL;
+    }
+
+    if (server_mode == MODE_EPOLL) {
+        if (reactor_start(nthreads) == -1) {
+            fprintf(stderr, "Failed to start reactor threads\n");
+            terminate(EXIT_FAILURE);
+        }
+        reactors_started = 1;
+    }
+
+    // accept connections and create threads (or hand them to a reactor)
     while (!shutdown_flag) {
         struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
@@ -121,10 +236,21 @@ int main(int argc, char* argv[]) {
             continue;
         }
 
+        // turn the connection away early if the PBX is overloaded
+        if (admission_admit(client_fd) == -1) {
+            continue;
+        }
+
+        if (server_mode == MODE_EPOLL) {
+            reactor_add(client_fd);
+            continue;
+        }
+
         int *fd_ptr = malloc(sizeof(int));
         if (fd_ptr == NULL) {
             perror("malloc");
             close(client_fd);
+            admission_release();
             continue;
         }
         *fd_ptr = client_fd;
@@ -134,6 +260,7 @@ int main(int argc, char* argv[]) {
             perror("pthread_create");
             close(client_fd);
             free(fd_ptr);
+            admission_release();
             continue;
         }
         // the thread will detach itself after retrieving the fd
@@ -143,6 +270,15 @@ int main(int argc, char* argv[]) {
 }
 
 
+/*
+ * Print a usage message and exit.
+ */
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s -p <port> [-m thread|epoll|uring] [-t <reactor threads>] [-q <bytes>] [-l <bytes>] [-e <extensions>] [-c <config file>]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+
 /*
  * Signal handler for SIGHUP to terminate the server.
  */
@@ -152,6 +288,27 @@ static void terminate_handler(int signum) {
 
 
 
+/*
+ * Thread that reloads the configuration file each time the server receives
+ * SIGUSR1, away from the threads serving clients.  The signal is blocked in
+ * every other thread, so it is always delivered here.
+ */
+static void *reload_thread(void *arg) {
+    while (1) {
+        int sig;
+        if (sigwait(&reload_signals, &sig) != 0) {
+            continue;
+        }
+        if (config_path == NULL) {
+            warn("SIGUSR1 received, but no configuration file was given.");
+            continue;
+        }
+        config_reload(config_path);
+    }
+    return NULL;
+}
+
+
 /*
  * Function called to cleanly shut down the server.
  */
@@ -161,7 +318,14 @@ static void terminate(int status) {
         close(server_fd);
         server_fd = -1;
     }
+    config_fini();
     pbx_shutdown(pbx);
+    page_fini();
+    timer_fini();
+    if (reactors_started) {
+        reactor_stop();
+    }
+    tu_trace_report();
     debug("PBX server terminating");
     exit(status);
 }
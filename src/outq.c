@@ -0,0 +1,209 @@
+/*
+ * Outbound message queue for client connections.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+
+#include "outq.h"
+
+#define OUTQ_INITIAL_CAP 8
+#define OUTQ_MAX_IOV 64
+
+atomic_size_t outq_hiwat = OUTQ_DEFAULT_HIWAT;
+
+static char *msg_data(OUTQ_MSG *m) {
+    if (m->buf != NULL) {
+        return m->buf->data;
+    }
+    return m->ext != NULL ? m->ext : m->small;
+}
+
+static void msg_free(OUTQ_MSG *m) {
+    if (m->buf != NULL) {
+        outq_buf_release(m->buf);
+    }
+    free(m->ext);
+}
+
+OUTQ_BUF *outq_buf_new(size_t len) {
+    OUTQ_BUF *buf = malloc(sizeof(OUTQ_BUF) + len);
+    if (buf == NULL) {
+        return NULL;
+    }
+    atomic_init(&buf->refs, 1);
+    buf->len = len;
+    return buf;
+}
+
+void outq_buf_release(OUTQ_BUF *buf) {
+    // The last reference acquires, so that every queue is done with the
+    // data before it is freed
+    if (atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_release) == 1) {
+        atomic_thread_fence(memory_order_acquire);
+        free(buf);
+    }
+}
+
+void outq_init(OUTQ *q) {
+    q->msgs = NULL;
+    q->head = 0;
+    q->count = 0;
+    q->cap = 0;
+    q->bytes = 0;
+}
+
+void outq_fini(OUTQ *q) {
+    while (q->count > 0) {
+        OUTQ_MSG *m = &q->msgs[q->head];
+        msg_free(m);
+        q->head = (q->head + 1) & (q->cap - 1);
+        q->count--;
+    }
+    free(q->msgs);
+    outq_init(q);
+}
+
+/*
+ * Double the capacity of the array of messages, unwrapping it in the process.
+ */
+static int outq_grow(OUTQ *q) {
+    unsigned cap = q->cap ? q->cap * 2 : OUTQ_INITIAL_CAP;
+    OUTQ_MSG *msgs = malloc(cap * sizeof(OUTQ_MSG));
+    if (msgs == NULL) {
+        return -1;
+    }
+    for (unsigned i = 0; i < q->count; i++) {
+        msgs[i] = q->msgs[(q->head + i) & (q->cap - 1)];
+    }
+    free(q->msgs);
+    q->msgs = msgs;
+    q->head = 0;
+    q->cap = cap;
+    return 0;
+}
+
+int outq_push(OUTQ *q, const char *data, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (q->count == q->cap && outq_grow(q) == -1) {
+        return -1;
+    }
+    OUTQ_MSG *m = &q->msgs[(q->head + q->count) & (q->cap - 1)];
+    m->buf = NULL;
+    if (len <= OUTQ_INLINE) {
+        m->ext = NULL;
+        memcpy(m->small, data, len);
+    } else {
+        m->ext = malloc(len);
+        if (m->ext == NULL) {
+            return -1;
+        }
+        memcpy(m->ext, data, len);
+    }
+    m->len = len;
+    m->off = 0;
+    q->count++;
+    q->bytes += len;
+    return 0;
+}
+
+int outq_push_buf(OUTQ *q, OUTQ_BUF *buf) {
+    if (buf->len == 0) {
+        return 0;
+    }
+    if (q->count == q->cap && outq_grow(q) == -1) {
+        return -1;
+    }
+    OUTQ_MSG *m = &q->msgs[(q->head + q->count) & (q->cap - 1)];
+    atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+    m->buf = buf;
+    m->ext = NULL;
+    m->len = buf->len;
+    m->off = 0;
+    q->count++;
+    q->bytes += buf->len;
+    return 0;
+}
+
+int outq_iov(OUTQ *q, struct iovec *iov, int max) {
+    int n = 0;
+    for (unsigned i = 0; i < q->count && n < max; i++) {
+        OUTQ_MSG *m = &q->msgs[(q->head + i) & (q->cap - 1)];
+        iov[n].iov_base = msg_data(m) + m->off;
+        iov[n].iov_len = m->len - m->off;
+        n++;
+    }
+    return n;
+}
+
+unsigned outq_consume(OUTQ *q, size_t n) {
+    unsigned done = 0;
+    while (n > 0 && q->count > 0) {
+        OUTQ_MSG *m = &q->msgs[q->head];
+        size_t left = m->len - m->off;
+        if (n < left) {
+            m->off += n;
+            q->bytes -= n;
+            break;
+        }
+        n -= left;
+        q->bytes -= left;
+        msg_free(m);
+        q->head = (q->head + 1) & (q->cap - 1);
+        q->count--;
+        done++;
+    }
+    return done;
+}
+
+size_t outq_drain(OUTQ *q, char *buf, size_t max, OUTQ_COUNTS *counts) {
+    size_t total = 0;
+    unsigned msgs = 0;
+    while (total < max && q->count > 0) {
+        OUTQ_MSG *m = &q->msgs[q->head];
+        size_t n = m->len - m->off;
+        if (n > max - total) {
+            n = max - total;
+        }
+        memcpy(buf + total, msg_data(m) + m->off, n);
+        total += n;
+        msgs += outq_consume(q, n);
+    }
+    if (counts != NULL && total > 0) {
+        counts->writes++;
+        counts->msgs += msgs;
+    }
+    return total;
+}
+
+ssize_t outq_send(OUTQ *q, int fd, OUTQ_COUNTS *counts) {
+    ssize_t total = 0;
+    while (q->count > 0) {
+        struct iovec iov[OUTQ_MAX_IOV];
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = outq_iov(q, iov, OUTQ_MAX_IOV);
+        ssize_t n = sendmsg(fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        unsigned msgs = outq_consume(q, n);
+        if (counts != NULL) {
+            counts->writes++;
+            counts->msgs += msgs;
+        }
+        total += n;
+    }
+    return total;
+}
@@ -0,0 +1,183 @@
+/*
+ * Paging of the TUs on hook.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdio.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "page.h"
+#include "pbx_ext.h"
+#include "outq.h"
+#include "stats.h"
+#include "debug.h"
+
+/*
+ * A page waiting for the pager thread, or being delivered.
+ */
+struct page {
+    OUTQ_BUF *buf;                  // The message, as sent
+    TU *from;                       // The TU paging (referenced)
+    TU **tus;                       // The TUs registered when it was made (referenced)
+    size_t n;                       // Number of them
+    struct timespec start;          // When it was made
+    struct page *next;              // Next page, in order
+};
+
+/*
+ * The pager thread and the pages it has to deliver, oldest first.
+ */
+static pthread_mutex_t page_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t page_cond = PTHREAD_COND_INITIALIZER;
+static struct page *head, *tail;
+static int started, stopping;
+static pthread_t pager;
+
+static unsigned long elapsed_us(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000UL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*
+ * Deliver a page, report to the TU that made it, and free it.
+ */
+static void page_deliver(struct page *pg) {
+    unsigned long sent = 0, failed = 0;
+    for (size_t i = 0; i < pg->n; i += PAGE_BATCH) {
+        size_t end = i + PAGE_BATCH < pg->n ? i + PAGE_BATCH : pg->n;
+        tu_batch_begin();
+        for (size_t j = i; j < end; j++) {
+            if (pg->tus[j] == pg->from) {
+                continue;
+            }
+            int ret = tu_page(pg->tus[j], pg->buf);
+            if (ret == 0) {
+                sent++;
+            } else if (ret == -1) {
+                failed++;
+            }
+        }
+        tu_batch_end();
+        for (size_t j = i; j < end; j++) {
+            tu_unref(pg->tus[j], "page_deliver: done with TU paged");
+        }
+    }
+
+    unsigned long us = elapsed_us(&pg->start);
+    STATS_INC(pages);
+    STATS_ADD(page_deliveries, sent);
+    STATS_ADD(page_failures, failed);
+    STATS_SET(page_us, us);
+    if (us > atomic_load_explicit(&pbx_stats.page_max_us, memory_order_relaxed)) {
+        STATS_SET(page_max_us, us);
+    }
+    debug("Paged %lu of %zu TUs in %lu us (%lu failed).", sent, pg->n, us, failed);
+
+    char temp[64];
+    int len = snprintf(temp, sizeof(temp), "PAGED %lu %lu\r\n", sent, us);
+    tu_send(pg->from, temp, len);
+    tu_unref(pg->from, "page_deliver: done with TU paging");
+    outq_buf_release(pg->buf);
+    free(pg->tus);
+    free(pg);
+}
+
+static void *page_thread(void *arg) {
+    pthread_mutex_lock(&page_lock);
+    while (1) {
+        while (head == NULL && !stopping) {
+            pthread_cond_wait(&page_cond, &page_lock);
+        }
+        if (head == NULL) {
+            break;
+        }
+        struct page *pg = head;
+        head = pg->next;
+        if (head == NULL) {
+            tail = NULL;
+        }
+        pthread_mutex_unlock(&page_lock);
+        page_deliver(pg);
+        pthread_mutex_lock(&page_lock);
+    }
+    pthread_mutex_unlock(&page_lock);
+    return NULL;
+}
+
+/*
+ * Start the pager thread if it is not running.  Must be called with
+ * page_lock held.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+static int start_pager(void) {
+    if (started) {
+        return 0;
+    }
+    // signals are for the threads that expect them, not the pager
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    int err = pthread_create(&pager, NULL, page_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (err != 0) {
+        return -1;
+    }
+    started = 1;
+    return 0;
+}
+
+int page_send(PBX *pbx, TU *from, const char *msg, size_t len) {
+    struct page *pg = malloc(sizeof(struct page));
+    OUTQ_BUF *buf = outq_buf_new(len + 7);
+    if (pg == NULL || buf == NULL) {
+        free(pg);
+        if (buf != NULL) {
+            outq_buf_release(buf);
+        }
+        return -1;
+    }
+    memcpy(buf->data, "PAGE ", 5);
+    memcpy(buf->data + 5, msg, len);
+    memcpy(buf->data + 5 + len, "\r\n", 2);
+    pg->buf = buf;
+    clock_gettime(CLOCK_MONOTONIC, &pg->start);
+    pg->n = pbx_snapshot(pbx, &pg->tus);
+    tu_ref(from, "page_send: TU paging");
+    pg->from = from;
+    pg->next = NULL;
+
+    pthread_mutex_lock(&page_lock);
+    if (stopping || start_pager() == -1) {
+        pthread_mutex_unlock(&page_lock);
+        for (size_t i = 0; i < pg->n; i++) {
+            tu_unref(pg->tus[i], "page_send: not paged");
+        }
+        pg->n = 0;  // Nobody is paged, but the TU is told
+        page_deliver(pg);
+        return -1;
+    }
+    if (tail != NULL) {
+        tail->next = pg;
+    } else {
+        head = pg;
+    }
+    tail = pg;
+    pthread_cond_signal(&page_cond);
+    pthread_mutex_unlock(&page_lock);
+    return 0;
+}
+
+void page_fini(void) {
+    pthread_mutex_lock(&page_lock);
+    int join = started;
+    stopping = 1;
+    pthread_cond_signal(&page_cond);
+    pthread_mutex_unlock(&page_lock);
+    if (join) {
+        pthread_join(pager, NULL);
+    }
+}
@@ -7,22 +7,58 @@
 #include <string.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <sys/socket.h>
 
 
 #include "pbx.h"
+#include "pbx_ext.h"
+#include "extalloc.h"
+#include "registry.h"
+#include "config.h"
+#include "hunt.h"
+#include "acd.h"
+#include "conf.h"
+#include "epoch.h"
+#include "tu_ext.h"
+#include "stats.h"
 #include "debug.h"
 
-#define MAX_EXTENSIONS PBX_MAX_EXTENSIONS
+size_t pbx_max_extensions = PBX_DEFAULT_EXTENSIONS;
+
+/*
+ * Registration of a TU under an extension.  Entries are found through the
+ * registry by pbx_dial() without the PBX mutex, so they are freed only
+ * after a grace period.
+ */
+struct pbx_entry {
+    TU *tu;                         // The TU registered
+    EXTNUM ext;                     // Its extension
+    int live;                       // Its index in the live array
+};
 
 struct pbx {
     pthread_mutex_t mutex;          // Mutex for synchronizing access
-    TU *extensions[MAX_EXTENSIONS];  // Array of TUs indexed by extension number
+    REGISTRY *registry;             // Entries indexed by extension number
+    size_t max_extensions;          // Maximum number of registered TUs
+    EXTALLOC *free_extensions;      // Numbers below max_extensions not in use
+    struct pbx_entry **live;        // Dense array of the entries
     int shutdown_in_progress;       // Flag to indicate shutdown
     pthread_cond_t shutdown_cond;   // Condition variable for shutdown
-    int active_tus;                 // Number of active TUs
+    int active_tus;                 // Number of active TUs (entries in live)
+    int unregistering;              // TUs unregistered but still being hung up
 };
 
+static void pbx_free_tables(PBX *pbx) {
+    if (pbx->free_extensions != NULL) {
+        extalloc_fini(pbx->free_extensions);
+    }
+    if (pbx->registry != NULL) {
+        registry_fini(pbx->registry);
+    }
+    free(pbx->live);
+}
+
 
 /*
  * Initialize a new PBX.
@@ -30,27 +66,51 @@ struct pbx {
  * @return the newly initialized PBX, or NULL if initialization fails.
  */
 
+/*
+ * Tell the hunt groups and the queues that a TU has become available or
+ * stopped being.
+ */
+static void pbx_availability(EXTNUM ext, int available) {
+    hunt_set_available(ext, available);
+    acd_set_available(ext, available);
+}
+
 PBX *pbx_init() {
     PBX *pbx = malloc(sizeof(PBX));
     if (pbx == NULL) {
         return NULL;
     }
 
+    pbx->max_extensions = pbx_max_extensions;
+    pbx->registry = registry_init(0);
+    pbx->free_extensions = extalloc_init(pbx->max_extensions);
+    pbx->live = malloc(pbx->max_extensions * sizeof(struct pbx_entry *));
+    if (pbx->registry == NULL || pbx->free_extensions == NULL || pbx->live == NULL) {
+        pbx_free_tables(pbx);
+        free(pbx);
+        return NULL;
+    }
+
     if (pthread_mutex_init(&pbx->mutex, NULL) != 0) {
+        pbx_free_tables(pbx);
         free(pbx);
         return NULL;
     }
 
     if (pthread_cond_init(&pbx->shutdown_cond, NULL) != 0) {
         pthread_mutex_destroy(&pbx->mutex);
+        pbx_free_tables(pbx);
         free(pbx);
         return NULL;
     }
 
     pbx->shutdown_in_progress = 0;
     pbx->active_tus = 0;
+    pbx->unregistering = 0;
 
-    memset(pbx->extensions, 0, sizeof(pbx->extensions));
+    // Hunt groups and queues keep track of the TUs available to take their calls
+    tu_set_availability_hook(pbx_availability);
+    tu_set_abandon_hook(acd_abandon);
 
     return pbx;
 }
@@ -64,27 +124,28 @@ void pbx_shutdown(PBX *pbx) {
     pbx->shutdown_in_progress = 1;
 
     // Shutdown all network connections to registered TUs
-    for (int i = 0; i < MAX_EXTENSIONS; i++) {
-        TU *tu = pbx->extensions[i];
-        if (tu != NULL) {
-            int fd = tu_fileno(tu);
-            if (fd >= 0) {
-                shutdown(fd, SHUT_RD);  // Shutdown reading end to cause client service threads to notice
-            }
+    for (int i = 0; i < pbx->active_tus; i++) {
+        int fd = tu_fileno(pbx->live[i]->tu);
+        if (fd >= 0) {
+            shutdown(fd, SHUT_RD);  // Shutdown reading end to cause client service threads to notice
         }
     }
 
     // Wait for all TUs to be unregistered
-    while (pbx->active_tus > 0) {
+    while (pbx->active_tus > 0 || pbx->unregistering > 0) {
         pthread_cond_wait(&pbx->shutdown_cond, &pbx->mutex);
     }
 
     pthread_mutex_unlock(&pbx->mutex);
 
+    // Wait for the references of unregistered TUs to be released
+    epoch_barrier();
+
     // Destroy mutex and condition variable
     pthread_mutex_destroy(&pbx->mutex);
     pthread_cond_destroy(&pbx->shutdown_cond);
 
+    pbx_free_tables(pbx);
     free(pbx);
 }
 
@@ -92,8 +153,76 @@ void pbx_shutdown(PBX *pbx) {
 
 
 
+/*
+ * Reserve an extension number chosen by a client.  Numbers in the range of
+ * the allocator are claimed from it, so that it does not hand them out.
+ * Must be called with the PBX mutex held.
+ *
+ * @return 0 if successful, -1 if the number is in use or invalid.
+ */
+static int pbx_claim(PBX *pbx, EXTNUM ext) {
+    if (ext < 0) {
+        return -1;
+    }
+    if ((uint64_t)ext < pbx->max_extensions) {
+        return extalloc_claim(pbx->free_extensions, (int)ext);
+    }
+    return registry_lookup(pbx->registry, ext) != NULL ? -1 : 0;
+}
+
+/*
+ * Release an extension number reserved with pbx_claim() or allocated.
+ * Must be called with the PBX mutex held.
+ */
+static void pbx_unclaim(PBX *pbx, EXTNUM ext) {
+    if (ext >= 0 && (uint64_t)ext < pbx->max_extensions) {
+        extalloc_put(pbx->free_extensions, (int)ext);
+    }
+}
+
+/*
+ * Register a TU under an extension that has been reserved for it.
+ * Must be called with the PBX mutex held.
+ *
+ * @return 0 if successful, -1 if memory could not be allocated or the
+ * maximum number of TUs are registered (the extension is then released).
+ */
+static int pbx_enter(PBX *pbx, TU *tu, EXTNUM ext) {
+    struct pbx_entry *e = malloc(sizeof(struct pbx_entry));
+    if ((size_t)pbx->active_tus == pbx->max_extensions || e == NULL ||
+        registry_insert(pbx->registry, ext, e) == -1) {
+        free(e);
+        pbx_unclaim(pbx, ext);
+        return -1;
+    }
+    e->tu = tu;
+    e->ext = ext;
+    e->live = pbx->active_tus;
+    pbx->live[pbx->active_tus++] = e;
+    STATS_INC(tus_registered);
+
+    tu_ref(tu, "Registering TU with PBX");
+    tu_set_number(tu, ext);
+    return 0;
+}
+
+/*
+ * Find the entry for a registered TU.  Must be called with the PBX mutex
+ * held.
+ *
+ * @return  The entry, or NULL if the TU is not registered.
+ */
+static struct pbx_entry *pbx_entry(PBX *pbx, TU *tu) {
+    struct pbx_entry *e = registry_lookup(pbx->registry, tu_number(tu));
+    return e != NULL && e->tu == tu ? e : NULL;
+}
+
 int pbx_register(PBX *pbx, TU *tu, int ext) {
-    if (pbx == NULL || tu == NULL || ext < 0 || ext >= MAX_EXTENSIONS) {
+    return pbx_register_number(pbx, tu, ext);
+}
+
+int pbx_register_number(PBX *pbx, TU *tu, EXTNUM ext) {
+    if (pbx == NULL || tu == NULL) {
         return -1;
     }
 
@@ -104,25 +233,92 @@ int pbx_register(PBX *pbx, TU *tu, int ext) {
         return -1;
     }
 
-    if (pbx->extensions[ext] != NULL) {
+    if (pbx_claim(pbx, ext) == -1) {
         pthread_mutex_unlock(&pbx->mutex);
-        return -1;  // Extension already in use
+        return -1;  // Extension already in use, or invalid
     }
 
-    pbx->extensions[ext] = tu;
-    pbx->active_tus++;
+    int ret = pbx_enter(pbx, tu, ext);
 
-    tu_ref(tu, "Registering TU with PBX");
-    tu_set_extension(tu, ext);
+    pthread_mutex_unlock(&pbx->mutex);
+
+    return ret;
+}
+
+int pbx_register_next(PBX *pbx, TU *tu) {
+    if (pbx == NULL || tu == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&pbx->mutex);
+
+    if (pbx->shutdown_in_progress) {
+        pthread_mutex_unlock(&pbx->mutex);
+        return -1;
+    }
+
+    int ext = extalloc_get(pbx->free_extensions);
+    if (ext == -1 || pbx_enter(pbx, tu, ext) == -1) {
+        pthread_mutex_unlock(&pbx->mutex);
+        warn("No free extension for new TU (%d registered).", pbx->active_tus);
+        return -1;
+    }
 
     pthread_mutex_unlock(&pbx->mutex);
 
-    return 0;
+    return ext;
 }
 
+int pbx_renumber(PBX *pbx, TU *tu, EXTNUM ext) {
+    if (pbx == NULL || tu == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&pbx->mutex);
+
+    struct pbx_entry *e = pbx_entry(pbx, tu);
+    if (e == NULL) {
+        pthread_mutex_unlock(&pbx->mutex);
+        return -1;  // TU is not registered
+    }
 
+    EXTNUM old = e->ext;
+    if (ext == old || pbx_claim(pbx, ext) == -1) {
+        // Just tell the client where it stands
+        tu_renumber(tu, old);
+        pthread_mutex_unlock(&pbx->mutex);
+        return ext == old ? 0 : -1;
+    }
 
+    // Enter the new number first, so that on failure nothing has changed
+    if (registry_insert(pbx->registry, ext, e) == -1 || tu_renumber(tu, ext) == -1) {
+        registry_remove(pbx->registry, ext);
+        pbx_unclaim(pbx, ext);
+        pthread_mutex_unlock(&pbx->mutex);
+        return -1;  // Not on hook, or out of memory
+    }
 
+    registry_remove(pbx->registry, old);
+    pbx_unclaim(pbx, old);
+    e->ext = ext;
+
+    pthread_mutex_unlock(&pbx->mutex);
+
+    return 0;
+}
+
+/*
+ * Drop the reference held by the PBX on a TU that has been unregistered,
+ * and free its entry, once the grace period for readers of the registry has
+ * ended.  A dialer that looked the TU up just before it was unregistered may
+ * have started a call to it meanwhile, so it is hung up again first.
+ */
+static void pbx_release(void *arg) {
+    struct pbx_entry *e = arg;
+    tu_hangup(e->tu);
+    tu_unref(e->tu, "Unregistering TU from PBX");
+    free(e);
+}
 
 int pbx_unregister(PBX *pbx, TU *tu) {
     if (pbx == NULL || tu == NULL) {
@@ -131,27 +327,40 @@ int pbx_unregister(PBX *pbx, TU *tu) {
 
     pthread_mutex_lock(&pbx->mutex);
 
-    int ext = tu_extension(tu);
-
-    if (ext < 0 || ext >= MAX_EXTENSIONS || pbx->extensions[ext] != tu) {
+    struct pbx_entry *e = pbx_entry(pbx, tu);
+    if (e == NULL) {
         pthread_mutex_unlock(&pbx->mutex);
         return -1;  // TU is not registered at this extension
     }
 
-    pbx->extensions[ext] = NULL;
-    pbx->active_tus--;
+    registry_remove(pbx->registry, e->ext);
+    pbx_unclaim(pbx, e->ext);
 
-    // Hang up the TU to cancel any call in progress
+    // Fill the hole in the dense array with its last entry
+    struct pbx_entry *last = pbx->live[--pbx->active_tus];
+    pbx->live[e->live] = last;
+    last->live = e->live;
+    STATS_DEC(tus_registered);
+    pbx->unregistering++;
+
+    pthread_mutex_unlock(&pbx->mutex);
+
+    // Hang up the TU to cancel any call in progress, after taking it out of
+    // the hunt groups and queues so that they stop choosing it.  This takes
+    // TU locks, and retiring may run the release of other TUs, so it is done
+    // without the PBX mutex, which other disconnects would queue behind.
+    tu_withdraw(tu);
     tu_hangup(tu);
 
-    // Release the reference held by the PBX
-    tu_unref(tu, "Unregistering TU from PBX");
+    // Release the reference held by the PBX once no dialer can still see it
+    epoch_retire(pbx_release, e);
 
     // Signal shutdown condition variable if shutdown is in progress
-    if (pbx->shutdown_in_progress && pbx->active_tus == 0) {
+    pthread_mutex_lock(&pbx->mutex);
+    pbx->unregistering--;
+    if (pbx->shutdown_in_progress && pbx->active_tus == 0 && pbx->unregistering == 0) {
         pthread_cond_signal(&pbx->shutdown_cond);
     }
-
     pthread_mutex_unlock(&pbx->mutex);
 
     return 0;
@@ -160,27 +369,191 @@ int pbx_unregister(PBX *pbx, TU *tu) {
 
 
 
+size_t pbx_snapshot(PBX *pbx, TU ***tusp) {
+    if (pbx == NULL || tusp == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pbx->mutex);
+
+    size_t n = pbx->active_tus;
+    TU **tus = malloc((n ? n : 1) * sizeof(TU *));
+    if (tus == NULL) {
+        pthread_mutex_unlock(&pbx->mutex);
+        *tusp = NULL;
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        tus[i] = pbx->live[i]->tu;
+        tu_ref(tus[i], "pbx_snapshot: listing registered TUs");
+    }
+
+    pthread_mutex_unlock(&pbx->mutex);
+
+    *tusp = tus;
+    return n;
+}
+
+void pbx_resync_availability(PBX *pbx) {
+    TU **tus;
+    size_t n = pbx_snapshot(pbx, &tus);
+    for (size_t i = 0; i < n; i++) {
+        tu_report_availability(tus[i]);
+        tu_unref(tus[i], "pbx_resync_availability: done with TU");
+    }
+    free(tus);
+}
+
+/*
+ * Find the TU registered under an extension and take a reference to it.
+ * Must be called within an epoch critical section.
+ *
+ * @return  The TU, or NULL if there is none.
+ */
+static TU *pbx_find(PBX *pbx, EXTNUM ext) {
+    if (ext < 0) {
+        return NULL;
+    }
+    struct pbx_entry *e = registry_lookup(pbx->registry, ext);
+    if (e != NULL && tu_try_ref(e->tu, "pbx_dial: looking up target")) {
+        return e->tu;
+    }
+    return NULL;
+}
+
+/*
+ * Dial a hunt group: ring the members that it chooses.  A group with no
+ * member available gives a busy signal, as an extension in use does.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+static int pbx_dial_group(PBX *pbx, TU *tu, EXTNUM group) {
+    EXTNUM exts[HUNT_MAX_RING_ALL];
+    int n = hunt_select(group, exts, HUNT_MAX_RING_ALL);
+    if (n == -1) {
+        // Removed since the dial plan was read: as an unknown number
+        tu_dial(tu, NULL);
+        return -1;
+    }
+
+    TU *members[HUNT_MAX_RING_ALL];
+    int found = 0;
+    epoch_enter();
+    for (int i = 0; i < n; i++) {
+        TU *m = pbx_find(pbx, exts[i]);
+        if (m == NULL) {
+            continue;
+        }
+        // A TU being renumbered is briefly found under both numbers
+        int dup = 0;
+        for (int j = 0; j < found && !dup; j++) {
+            dup = members[j] == m;
+        }
+        if (dup) {
+            tu_unref(m, "pbx_dial_group: found twice");
+        } else {
+            members[found++] = m;
+        }
+    }
+    epoch_exit();
+
+    // A single member is dialed as an extension, so that it is busy if taken meanwhile
+    int ret = found == 1 ? tu_dial(tu, members[0]) : tu_dial_group(tu, members, found);
+    for (int i = 0; i < found; i++) {
+        tu_unref(members[i], "pbx_dial_group: done with member");
+    }
+    return ret == -1 ? -1 : 0;
+}
+
+TU *pbx_lookup(PBX *pbx, EXTNUM ext) {
+    if (pbx == NULL) {
+        return NULL;
+    }
+    epoch_enter();
+    TU *tu = pbx_find(pbx, ext);
+    epoch_exit();
+    return tu;
+}
+
 int pbx_dial(PBX *pbx, TU *tu, int ext) {
+    return pbx_dial_number(pbx, tu, ext);
+}
+
+int pbx_dial_number(PBX *pbx, TU *tu, EXTNUM ext) {
+    char digits[24] = "";
+    int len = ext >= 0 ? snprintf(digits, sizeof(digits), "%" PRIext, ext) : 0;
+    return pbx_dial_digits(pbx, tu, digits, len);
+}
+
+/*
+ * Dial a number, or camp on the extension it rings.  Numbers that do not
+ * ring a single extension (groups, queues, pickups and conferences) are
+ * dialed either way.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+static int pbx_call(PBX *pbx, TU *tu, const char *digits, size_t len, int camp) {
     if (pbx == NULL || tu == NULL) {
         return -1;
     }
 
-    pthread_mutex_lock(&pbx->mutex);
+    // The configuration and registry are read without the PBX mutex.  The target
+    // cannot be freed until we leave the critical section, as unregistration
+    // only drops the reference held by the PBX after a grace period; we take
+    // our own reference to it for the call to tu_dial().
+    epoch_enter();
 
-    // Get the target TU
-    TU *target_tu = NULL;
+    DIALPLAN_MATCH m = { DP_ALIAS, dialplan_number(digits, len) };
+    const CONFIG *cf = config_get();
+    if (cf != NULL && dialplan_lookup(cf->dialplan, digits, len, &m) == 0) {
+        STATS_INC(dialplan_routed);
+    }
 
-    if (ext >= 0 && ext < MAX_EXTENSIONS) {
-        target_tu = pbx->extensions[ext];
+    if (m.action == DP_GROUP) {
+        epoch_exit();
+        return pbx_dial_group(pbx, tu, m.ext);
+    }
+    if (m.action == DP_QUEUE) {
+        epoch_exit();
+        if (acd_enter(m.ext, tu) == -1) {
+            // Removed since the dial plan was read: as an unknown number
+            tu_dial(tu, NULL);
+            return -1;
+        }
+        return 0;
     }
 
-    pthread_mutex_unlock(&pbx->mutex);
+    if (m.action == DP_CONFERENCE) {
+        epoch_exit();
+        return conf_join(m.ext, tu);
+    }
 
-    // Call tu_dial(), which handles the rest
-    if (tu_dial(tu, target_tu) == -1) {
-        return -1;
+    // Get the target TU
+    TU *target_tu = pbx_find(pbx, m.ext);
+
+    epoch_exit();
+
+    // Call tu_dial() (or tu_pickup_call() or tu_camp()), which handles the rest
+    int ret;
+    if (m.action == DP_PICKUP && target_tu != NULL) {
+        ret = tu_pickup_call(tu, target_tu);
+    } else if (camp) {
+        ret = tu_camp(tu, target_tu);
+    } else {
+        ret = tu_dial(tu, target_tu);
     }
 
-    return 0;
+    if (target_tu != NULL) {
+        tu_unref(target_tu, "pbx_dial: done with target");
+    }
+
+    return ret == -1 ? -1 : 0;
+}
+
+int pbx_dial_digits(PBX *pbx, TU *tu, const char *digits, size_t len) {
+    return pbx_call(pbx, tu, digits, len, 0);
 }
 
+int pbx_camp_digits(PBX *pbx, TU *tu, const char *digits, size_t len) {
+    return pbx_call(pbx, tu, digits, len, 1);
+}
@@ -0,0 +1,389 @@
+/*
+ * Presence: watching the state of extensions.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "presence.h"
+#include "pbx_ext.h"
+#include "registry.h"
+#include "outq.h"
+#include "epoch.h"
+#include "stats.h"
+#include "debug.h"
+
+/*
+ * Number of slots for the watchers of an extension at first, which doubles
+ * as they fill up.
+ */
+#define PRESENCE_INITIAL_SLOTS 4
+
+/*
+ * Value of delivered before the watchers of an extension have been told
+ * anything.
+ */
+#define PRESENCE_UNSENT (-2)
+
+/*
+ * The watchers of an extension.  A watcher is added by filling an empty
+ * slot, and removed by emptying its slot, both in place; senders skip empty
+ * slots.  The array is only replaced, by one twice as large, when it is full.
+ */
+struct presence_slots {
+    size_t cap;                     // Number of slots
+    _Atomic(TU *) tu[];             // Watchers, or NULL
+};
+
+/*
+ * An extension being watched.
+ */
+struct presence {
+    EXTNUM ext;                     // The extension
+    atomic_int state;               // Latest state reported
+    atomic_int pending;             // Scheduled for delivery by some thread
+    pthread_mutex_t lock;           // Serializes deliveries
+    int delivered;                  // State last sent to all the watchers
+    _Atomic(struct presence_slots *) slots;  // The watchers
+    size_t n;                       // Number of watchers
+    struct presence *next_due;      // Next extension scheduled, in the same thread
+    struct presence *next_free;     // Next extension to be freed, when unwatched
+};
+
+/*
+ * The extensions watched by a TU.  The TU is referenced once for all of
+ * them, and the reference is released after a grace period when it stops
+ * watching, as deliveries in progress may still find it.
+ */
+struct watcher {
+    TU *tu;
+    size_t n;                       // Number of extensions watched
+    EXTNUM exts[PRESENCE_MAX_WATCH];
+};
+
+/*
+ * Extensions watched, by number, read without a lock within epoch critical
+ * sections, and watchers, by the address of their TU.  Both registries are
+ * changed under presence_lock, and created with the first watcher.
+ */
+static pthread_mutex_t presence_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(REGISTRY *) watched = NULL;
+static REGISTRY *watchers = NULL;
+
+/*
+ * Number of extensions watched, so that state changes cost nothing when
+ * there are none.
+ */
+static atomic_ulong nwatched = 0;
+
+/*
+ * The extensions scheduled by the calling thread, in the order scheduled.
+ * The thread stays in an epoch critical section from the first report of a
+ * batch to the end of the batch, so that they remain valid.
+ */
+static __thread struct {
+    int active;                     // In a critical section for reports
+    struct presence *head, *tail;   // Extensions to deliver
+} due;
+
+static const char *state_name(int state) {
+    return state == PRESENCE_NONE ? "UNREGISTERED" : tu_state_names[state];
+}
+
+static struct presence_slots *slots_new(size_t cap) {
+    struct presence_slots *s = malloc(sizeof(struct presence_slots) + cap * sizeof(TU *));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->cap = cap;
+    for (size_t i = 0; i < cap; i++) {
+        atomic_init(&s->tu[i], NULL);
+    }
+    return s;
+}
+
+static void presence_free(void *arg) {
+    struct presence *e = arg;
+    free(atomic_load(&e->slots));
+    pthread_mutex_destroy(&e->lock);
+    free(e);
+}
+
+static void watcher_release(void *arg) {
+    tu_unref(arg, "presence_unwatch_all: done watching");
+}
+
+/*
+ * Send the state of an extension to its watchers, or to one of them.  Must
+ * be called within an epoch critical section, with the extension locked.
+ */
+static void presence_send(struct presence *e, int state, TU *only) {
+    char temp[64];
+    int len = snprintf(temp, sizeof(temp), "STATE %" PRIext " %s\r\n", e->ext, state_name(state));
+    if (only != NULL) {
+        if (tu_send(only, temp, len) == 0) {
+            STATS_INC(presence_events);
+        }
+        return;
+    }
+    OUTQ_BUF *buf = outq_buf_new(len);
+    if (buf == NULL) {
+        return;
+    }
+    memcpy(buf->data, temp, len);
+    unsigned long sent = 0;
+    struct presence_slots *s = atomic_load_explicit(&e->slots, memory_order_acquire);
+    for (size_t i = 0; i < s->cap; i++) {
+        TU *tu = atomic_load_explicit(&s->tu[i], memory_order_acquire);
+        if (tu != NULL && tu_send_shared(tu, buf) == 0) {
+            sent++;
+        }
+    }
+    outq_buf_release(buf);
+    STATS_ADD(presence_events, sent);
+}
+
+/*
+ * Create the registries if they do not exist.  Must be called with
+ * presence_lock held.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+static int presence_init(void) {
+    if (watchers == NULL) {
+        watchers = registry_init(0);
+    }
+    if (atomic_load_explicit(&watched, memory_order_relaxed) == NULL) {
+        atomic_store_explicit(&watched, registry_init(0), memory_order_release);
+    }
+    return watchers != NULL && atomic_load_explicit(&watched, memory_order_relaxed) != NULL ? 0 : -1;
+}
+
+/*
+ * Add a watcher to an extension, creating its entry if needed.  Must be
+ * called with presence_lock held.
+ *
+ * @param old  Set to the array of slots replaced, if any, which must be
+ * retired once the lock is released.
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+static int presence_add(REGISTRY *reg, EXTNUM ext, TU *tu, struct presence_slots **old) {
+    struct presence *e = registry_lookup(reg, ext);
+    if (e == NULL) {
+        e = malloc(sizeof(struct presence));
+        struct presence_slots *s = slots_new(PRESENCE_INITIAL_SLOTS);
+        if (e == NULL || s == NULL || pthread_mutex_init(&e->lock, NULL) != 0) {
+            free(s);
+            free(e);
+            return -1;
+        }
+        e->ext = ext;
+        atomic_init(&e->state, PRESENCE_NONE);
+        atomic_init(&e->pending, 0);
+        e->delivered = PRESENCE_UNSENT;
+        atomic_init(&e->slots, s);
+        e->n = 0;
+        if (registry_insert(reg, ext, e) == -1) {
+            presence_free(e);
+            return -1;
+        }
+        atomic_fetch_add(&nwatched, 1);
+    }
+
+    struct presence_slots *s = atomic_load_explicit(&e->slots, memory_order_relaxed);
+    if (e->n == s->cap) {
+        struct presence_slots *t = slots_new(s->cap * 2);
+        if (t == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < s->cap; i++) {
+            atomic_init(&t->tu[i], atomic_load_explicit(&s->tu[i], memory_order_relaxed));
+        }
+        atomic_store_explicit(&e->slots, t, memory_order_release);
+        *old = s;
+        s = t;
+    }
+    size_t i = 0;
+    while (atomic_load_explicit(&s->tu[i], memory_order_relaxed) != NULL) {
+        i++;
+    }
+    atomic_store_explicit(&s->tu[i], tu, memory_order_release);
+    e->n++;
+    return 0;
+}
+
+int presence_watch(PBX *pbx, TU *watcher, EXTNUM ext) {
+    if (ext < 0 || watcher == NULL) {
+        return -1;
+    }
+    struct presence_slots *old = NULL;
+    struct watcher *unused = NULL;
+    int ret = -1;
+    epoch_enter();
+    pthread_mutex_lock(&presence_lock);
+    if (presence_init() == 0) {
+        REGISTRY *reg = atomic_load_explicit(&watched, memory_order_relaxed);
+        struct watcher *w = registry_lookup(watchers, (uintptr_t)watcher);
+        if (w == NULL && (w = malloc(sizeof(struct watcher))) != NULL) {
+            w->tu = watcher;
+            w->n = 0;
+            if (registry_insert(watchers, (uintptr_t)watcher, w) == -1) {
+                free(w);
+                w = NULL;
+            } else {
+                tu_ref(watcher, "presence_watch: watching");
+            }
+        }
+        size_t i = 0;
+        while (w != NULL && i < w->n && w->exts[i] != ext) {
+            i++;
+        }
+        if (w != NULL && i < w->n) {
+            ret = 0;  // Already watching
+        } else if (w != NULL && w->n < PRESENCE_MAX_WATCH &&
+                   presence_add(reg, ext, watcher, &old) == 0) {
+            w->exts[w->n++] = ext;
+            STATS_INC(presence_watches);
+            ret = 0;
+        }
+        if (w != NULL && w->n == 0) {
+            // The TU was never added anywhere
+            registry_remove(watchers, (uintptr_t)watcher);
+            unused = w;
+        }
+    }
+    pthread_mutex_unlock(&presence_lock);
+    epoch_exit();
+    if (old != NULL) {
+        epoch_retire(free, old);
+    }
+    if (unused != NULL) {
+        tu_unref(unused->tu, "presence_watch: not watching");
+        free(unused);
+    }
+    if (ret == -1) {
+        return -1;
+    }
+
+    // Have the current state reported, then tell the new watcher
+    TU *tu = pbx_lookup(pbx, ext);
+    if (tu != NULL) {
+        tu_report_presence(tu);
+        tu_unref(tu, "presence_watch: done with TU watched");
+    }
+    epoch_enter();
+    struct presence *e = registry_lookup(atomic_load_explicit(&watched, memory_order_acquire), ext);
+    if (e != NULL) {
+        pthread_mutex_lock(&e->lock);
+        int state = atomic_load(&e->state);
+        if (e->delivered == PRESENCE_UNSENT) {
+            e->delivered = state;
+        }
+        presence_send(e, state, watcher);
+        pthread_mutex_unlock(&e->lock);
+    }
+    epoch_exit();
+    return 0;
+}
+
+void presence_unwatch_all(TU *watcher) {
+    if (atomic_load_explicit(&nwatched, memory_order_relaxed) == 0) {
+        return;
+    }
+    struct presence *freed = NULL;
+    epoch_enter();
+    pthread_mutex_lock(&presence_lock);
+    struct watcher *w = watchers != NULL ? registry_remove(watchers, (uintptr_t)watcher) : NULL;
+    REGISTRY *reg = atomic_load_explicit(&watched, memory_order_relaxed);
+    for (size_t i = 0; w != NULL && i < w->n; i++) {
+        struct presence *e = registry_lookup(reg, w->exts[i]);
+        struct presence_slots *s = atomic_load_explicit(&e->slots, memory_order_relaxed);
+        for (size_t j = 0; j < s->cap; j++) {
+            if (atomic_load_explicit(&s->tu[j], memory_order_relaxed) == watcher) {
+                atomic_store_explicit(&s->tu[j], NULL, memory_order_relaxed);
+                break;
+            }
+        }
+        if (--e->n == 0) {
+            registry_remove(reg, e->ext);
+            atomic_fetch_sub(&nwatched, 1);
+            e->next_free = freed;
+            freed = e;
+        }
+    }
+    pthread_mutex_unlock(&presence_lock);
+    epoch_exit();
+    if (w == NULL) {
+        return;
+    }
+
+    // Deliveries in progress may still be using them
+    while (freed != NULL) {
+        struct presence *e = freed;
+        freed = e->next_free;
+        epoch_retire(presence_free, e);
+    }
+    STATS_SUB(presence_watches, w->n);
+    epoch_retire(watcher_release, w->tu);
+    free(w);
+}
+
+void presence_changed(EXTNUM ext, int state) {
+    if (atomic_load_explicit(&nwatched, memory_order_relaxed) == 0 || ext < 0) {
+        return;
+    }
+    if (!due.active) {
+        epoch_enter();
+        due.active = 1;
+    }
+    REGISTRY *reg = atomic_load_explicit(&watched, memory_order_acquire);
+    struct presence *e = registry_lookup(reg, ext);
+    if (e == NULL) {
+        return;
+    }
+    atomic_store(&e->state, state);
+    if (atomic_exchange(&e->pending, 1) != 0) {
+        // Whoever scheduled it will deliver this state instead
+        STATS_INC(presence_coalesced);
+        return;
+    }
+    e->next_due = NULL;
+    if (due.tail != NULL) {
+        due.tail->next_due = e;
+    } else {
+        due.head = e;
+    }
+    due.tail = e;
+}
+
+int presence_due(void) {
+    return due.active;
+}
+
+void presence_flush(void) {
+    while (due.head != NULL) {
+        struct presence *e = due.head;
+        due.head = e->next_due;
+        if (due.head == NULL) {
+            due.tail = NULL;
+        }
+        // A change reported from here on schedules the extension again
+        pthread_mutex_lock(&e->lock);
+        atomic_store(&e->pending, 0);
+        int state = atomic_load(&e->state);
+        if (state != e->delivered) {
+            e->delivered = state;
+            presence_send(e, state, NULL);
+        } else {
+            STATS_INC(presence_coalesced);
+        }
+        pthread_mutex_unlock(&e->lock);
+    }
+    if (due.active) {
+        due.active = 0;
+        epoch_exit();
+    }
+}
@@ -0,0 +1,31 @@
+/*
+ * Token buckets.
+ */
+#include <limits.h>
+
+#include "ratelimit.h"
+
+void rate_init(RATE_BUCKET *b, unsigned long now) {
+    b->tokens = ULONG_MAX;  // Cut to the size of the bucket when first used
+    b->stamp = now;
+}
+
+int rate_take(RATE_BUCKET *b, unsigned long rate, unsigned long burst, unsigned long n,
+              unsigned long now) {
+    if (rate == 0) {
+        return 0;
+    }
+    unsigned long cap = burst * 1000;
+    unsigned long elapsed = now - b->stamp;
+    b->stamp = now;
+    if (b->tokens >= cap || elapsed >= (cap - b->tokens) / rate) {
+        b->tokens = cap;
+    } else {
+        b->tokens += elapsed * rate;
+    }
+    if (n > b->tokens / 1000) {
+        return -1;
+    }
+    b->tokens -= n * 1000;
+    return 0;
+}
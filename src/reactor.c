@@ -0,0 +1,198 @@
+/*
+ * Reactor: epoll-based event loop for servicing many clients per thread.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+
+#include "debug.h"
+#include "reactor.h"
+#include "service.h"
+
+#define REACTOR_MAX_EVENTS 64
+
+struct reactor {
+    int epfd;                       // epoll instance for the connections owned
+    int wakefd;                     // eventfd used to ask the thread to exit
+    pthread_t tid;                  // Thread running the event loop
+    SERVICE_CONN **ready;           // Connections with commands left over, in turn
+    size_t nready;                  // Number of them
+    size_t ready_size;              // Size of the array
+};
+
+static struct reactor *reactors;    // Array of reactors
+static int nreactors;               // Number of reactors in the array
+static unsigned int next_reactor;   // Reactor to receive the next connection
+
+
+/*
+ * Put a connection with commands left over at the end of the line for its
+ * next turn.
+ *
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+static int ready_add(struct reactor *r, SERVICE_CONN *conn) {
+    if (r->nready == r->ready_size) {
+        size_t size = r->ready_size ? 2 * r->ready_size : 64;
+        SERVICE_CONN **nr = realloc(r->ready, size * sizeof(SERVICE_CONN *));
+        if (nr == NULL) {
+            return -1;
+        }
+        r->ready = nr;
+        r->ready_size = size;
+    }
+    r->ready[r->nready++] = conn;
+    return 0;
+}
+
+/*
+ * Give a turn to each of the first n connections with commands left over,
+ * keeping those that still have some in line, in the same order, ahead of
+ * those put there since.
+ */
+static void ready_round(struct reactor *r, size_t n) {
+    size_t kept = 0;
+    for (size_t i = 0; i < r->nready; i++) {
+        SERVICE_CONN *conn = r->ready[i];
+        if (i < n) {
+            service_conn_run(conn);
+            if (!service_conn_pending(conn)) {
+                continue;
+            }
+        }
+        r->ready[kept++] = conn;
+    }
+    r->nready = kept;
+}
+
+/*
+ * Event loop run by each reactor thread.
+ *
+ * Each round services the connections with input, then gives another turn
+ * to those that had commands left over from an earlier round.  A connection
+ * with commands left over is not read from until it has none, so the kernel
+ * holds back the rest of a flood, and the reactor does not wait for events
+ * while any connection has some.
+ */
+static void *reactor_thread(void *arg) {
+    struct reactor *r = arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, r->nready > 0 ? 0 : -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+
+        size_t waiting = r->nready;
+        for (int i = 0; i < n; i++) {
+            SERVICE_CONN *conn = events[i].data.ptr;
+            if (conn == NULL) {
+                debug("Reactor %ld exiting", (long)(r - reactors));
+                return NULL;
+            }
+            if (service_conn_pending(conn)) {
+                continue;  // Waiting for its turn
+            }
+            if (service_conn_read(conn) == 0) {
+                epoll_ctl(r->epfd, EPOLL_CTL_DEL, service_conn_fileno(conn), NULL);
+                service_conn_close(conn);
+            } else if (service_conn_pending(conn) && ready_add(r, conn) == -1) {
+                // No room to keep its place in line: it has all its turns now
+                while (service_conn_pending(conn)) {
+                    service_conn_run(conn);
+                }
+            }
+        }
+        ready_round(r, waiting);
+    }
+    return NULL;
+}
+
+int reactor_start(int nthreads) {
+    if (nthreads <= 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads <= 0) {
+            nthreads = 1;
+        }
+    }
+
+    reactors = calloc(nthreads, sizeof(struct reactor));
+    if (reactors == NULL) {
+        return -1;
+    }
+
+    for (nreactors = 0; nreactors < nthreads; nreactors++) {
+        struct reactor *r = &reactors[nreactors];
+        r->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (r->epfd == -1) {
+            perror("epoll_create1");
+            reactor_stop();
+            return -1;
+        }
+        r->wakefd = eventfd(0, EFD_CLOEXEC);
+        if (r->wakefd == -1) {
+            perror("eventfd");
+            close(r->epfd);
+            reactor_stop();
+            return -1;
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &ev) == -1 ||
+            pthread_create(&r->tid, NULL, reactor_thread, r) != 0) {
+            perror("reactor_start");
+            close(r->wakefd);
+            close(r->epfd);
+            reactor_stop();
+            return -1;
+        }
+    }
+
+    debug("Started %d reactor threads", nreactors);
+    return 0;
+}
+
+int reactor_add(int fd) {
+    SERVICE_CONN *conn = service_conn_open(fd);
+    if (conn == NULL) {
+        return -1;
+    }
+
+    // Distribute connections among the reactors round-robin
+    struct reactor *r = &reactors[__atomic_fetch_add(&next_reactor, 1, __ATOMIC_RELAXED) % nreactors];
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn };
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+        service_conn_close(conn);
+        return -1;
+    }
+    return 0;
+}
+
+void reactor_stop(void) {
+    for (int i = 0; i < nreactors; i++) {
+        uint64_t one = 1;
+        if (write(reactors[i].wakefd, &one, sizeof(one)) == -1) {
+            perror("write");
+        }
+    }
+    for (int i = 0; i < nreactors; i++) {
+        pthread_join(reactors[i].tid, NULL);
+        close(reactors[i].wakefd);
+        close(reactors[i].epfd);
+        free(reactors[i].ready);
+    }
+    free(reactors);
+    reactors = NULL;
+    nreactors = 0;
+}
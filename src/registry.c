@@ -0,0 +1,246 @@
+/*
+ * Registry mapping 64-bit extension numbers to values.
+ */
+#include <stdlib.h>
+#include <stdatomic.h>
+
+
+#include "registry.h"
+#include "epoch.h"
+
+#define MIN_CAPACITY 64
+#define MIGRATE_STEP 32     // Slots moved to the new table per update
+
+/*
+ * A slot is empty until a key is stored in it.  Its key then never changes
+ * while the table is in use: removing the entry just clears the value, and
+ * the slot is reused only if the same key is inserted again.  So a reader
+ * that finds its key in a slot can never see the value of another key, and
+ * the removed entries are dropped when the table is next resized.
+ */
+struct slot {
+    _Atomic uint64_t key;
+    _Atomic(void *) value;
+};
+
+struct table {
+    size_t cap;                     // Number of slots (power of 2)
+    size_t used;                    // Slots with a key (live or removed)
+    struct slot slots[];
+};
+
+struct registry {
+    _Atomic(struct table *) cur;    // Table into which entries are inserted
+    _Atomic(struct table *) old;    // Table being migrated from, if any
+    size_t migrated;                // Slots of old already migrated
+    size_t count;                   // Number of live entries
+};
+
+static uint64_t hash(uint64_t k) {
+    // Finalizer of SplitMix64, which spreads sequential numbers well
+    k ^= k >> 30;
+    k *= 0xbf58476d1ce4e5b9ULL;
+    k ^= k >> 27;
+    k *= 0x94d049bb133111ebULL;
+    k ^= k >> 31;
+    return k;
+}
+
+static struct table *table_new(size_t cap) {
+    struct table *t = malloc(sizeof(struct table) + cap * sizeof(struct slot));
+    if (t == NULL) {
+        return NULL;
+    }
+    t->cap = cap;
+    t->used = 0;
+    for (size_t i = 0; i < cap; i++) {
+        atomic_init(&t->slots[i].key, REGISTRY_NO_KEY);
+        atomic_init(&t->slots[i].value, NULL);
+    }
+    return t;
+}
+
+/*
+ * Find the slot for a key: the one holding it, or else the empty slot that
+ * ends its probe sequence.
+ */
+static struct slot *table_find(struct table *t, uint64_t key) {
+    size_t mask = t->cap - 1;
+    for (size_t i = hash(key) & mask; ; i = (i + 1) & mask) {
+        struct slot *s = &t->slots[i];
+        uint64_t k = atomic_load_explicit(&s->key, memory_order_acquire);
+        if (k == key || k == REGISTRY_NO_KEY) {
+            return s;
+        }
+    }
+}
+
+static void *table_lookup(struct table *t, uint64_t key) {
+    struct slot *s = table_find(t, key);
+    if (atomic_load_explicit(&s->key, memory_order_relaxed) != key) {
+        return NULL;
+    }
+    return atomic_load_explicit(&s->value, memory_order_acquire);
+}
+
+/*
+ * Store an entry in a table, which must have room for it.
+ */
+static void table_store(struct table *t, uint64_t key, void *value) {
+    struct slot *s = table_find(t, key);
+    atomic_store_explicit(&s->value, value, memory_order_release);
+    if (atomic_load_explicit(&s->key, memory_order_relaxed) != key) {
+        t->used++;
+        // The value is stored first, so a reader that sees the key sees it
+        atomic_store_explicit(&s->key, key, memory_order_release);
+    }
+}
+
+REGISTRY *registry_init(size_t hint) {
+    REGISTRY *reg = malloc(sizeof(REGISTRY));
+    if (reg == NULL) {
+        return NULL;
+    }
+    size_t cap = MIN_CAPACITY;
+    while (cap < 2 * hint) {
+        cap *= 2;
+    }
+    struct table *t = table_new(cap);
+    if (t == NULL) {
+        free(reg);
+        return NULL;
+    }
+    atomic_init(&reg->cur, t);
+    atomic_init(&reg->old, NULL);
+    reg->migrated = 0;
+    reg->count = 0;
+    return reg;
+}
+
+void registry_fini(REGISTRY *reg) {
+    free(atomic_load(&reg->old));
+    free(atomic_load(&reg->cur));
+    free(reg);
+}
+
+size_t registry_count(REGISTRY *reg) {
+    return reg->count;
+}
+
+void *registry_lookup(REGISTRY *reg, uint64_t key) {
+    if (key == REGISTRY_NO_KEY) {
+        return NULL;
+    }
+    // The old table is set before the current one when a migration starts,
+    // and cleared only once it is over.  So loading them in the opposite
+    // order means that if no old table is seen, the current one holds all
+    // the entries; otherwise, an entry not yet migrated is still in the old.
+    struct table *cur = atomic_load_explicit(&reg->cur, memory_order_acquire);
+    struct table *old = atomic_load_explicit(&reg->old, memory_order_acquire);
+    void *v = table_lookup(cur, key);
+    if (v == NULL && old != NULL && old != cur) {
+        v = table_lookup(old, key);
+    }
+    return v;
+}
+
+/*
+ * Move some more entries from the old table to the current one, and retire
+ * the old table once it has been emptied.
+ *
+ * @param n  Maximum number of slots to examine.
+ */
+static void registry_migrate(REGISTRY *reg, size_t n) {
+    struct table *old = atomic_load_explicit(&reg->old, memory_order_relaxed);
+    if (old == NULL) {
+        return;
+    }
+    struct table *cur = atomic_load_explicit(&reg->cur, memory_order_relaxed);
+    for (; n > 0 && reg->migrated < old->cap; n--, reg->migrated++) {
+        struct slot *s = &old->slots[reg->migrated];
+        uint64_t k = atomic_load_explicit(&s->key, memory_order_relaxed);
+        void *v = atomic_load_explicit(&s->value, memory_order_relaxed);
+        if (k != REGISTRY_NO_KEY && v != NULL) {
+            table_store(cur, k, v);
+        }
+    }
+    if (reg->migrated == old->cap) {
+        atomic_store_explicit(&reg->old, NULL, memory_order_release);
+        epoch_retire(free, old);
+    }
+}
+
+/*
+ * Start moving to a larger table if the current one is too full.
+ *
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+static int registry_grow(REGISTRY *reg) {
+    struct table *cur = atomic_load_explicit(&reg->cur, memory_order_relaxed);
+    if (cur->used < cur->cap / 2) {
+        return 0;
+    }
+    if (atomic_load_explicit(&reg->old, memory_order_relaxed) != NULL) {
+        // Still migrating: finish that first (this should be rare)
+        registry_migrate(reg, SIZE_MAX);
+        if (cur->used < cur->cap / 2) {
+            return 0;
+        }
+    }
+    // Size the new table so that it stays at most a quarter full until
+    // the migration is complete, even if only insertions are done meanwhile
+    size_t need = 4 * (reg->count + cur->cap / MIGRATE_STEP + 1);
+    size_t cap = MIN_CAPACITY;
+    while (cap < need) {
+        cap *= 2;
+    }
+    struct table *t = table_new(cap);
+    if (t == NULL) {
+        return -1;
+    }
+    reg->migrated = 0;
+    atomic_store_explicit(&reg->old, cur, memory_order_release);
+    atomic_store_explicit(&reg->cur, t, memory_order_release);
+    return 0;
+}
+
+int registry_insert(REGISTRY *reg, uint64_t key, void *value) {
+    if (key == REGISTRY_NO_KEY || value == NULL || registry_lookup(reg, key) != NULL) {
+        return -1;
+    }
+    if (registry_grow(reg) == -1) {
+        return -1;
+    }
+    table_store(atomic_load_explicit(&reg->cur, memory_order_relaxed), key, value);
+    reg->count++;
+    registry_migrate(reg, MIGRATE_STEP);
+    return 0;
+}
+
+void *registry_remove(REGISTRY *reg, uint64_t key) {
+    if (key == REGISTRY_NO_KEY) {
+        return NULL;
+    }
+    void *v = NULL;
+    struct table *tables[2] = {
+        atomic_load_explicit(&reg->cur, memory_order_relaxed),
+        atomic_load_explicit(&reg->old, memory_order_relaxed)
+    };
+    for (int i = 0; i < 2; i++) {
+        if (tables[i] == NULL) {
+            continue;
+        }
+        struct slot *s = table_find(tables[i], key);
+        if (atomic_load_explicit(&s->key, memory_order_relaxed) == key) {
+            void *x = atomic_exchange_explicit(&s->value, NULL, memory_order_release);
+            if (x != NULL) {
+                v = x;
+            }
+        }
+    }
+    if (v != NULL) {
+        reg->count--;
+        registry_migrate(reg, MIGRATE_STEP);
+    }
+    return v;
+}
@@ -4,127 +4,372 @@
  * Manages interaction with a client telephone unit (TU).
  */
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
 #include <errno.h>
-#include <ctype.h>
+#include <time.h>
+#include <sys/socket.h>
 
 
+#include "admission.h"
+#include "command.h"
 #include "debug.h"
+#include "keepalive.h"
+#include "linebuf.h"
+#include "page.h"
 #include "pbx.h"
+#include "pbx_ext.h"
+#include "presence.h"
+#include "ratelimit.h"
 #include "server.h"
+#include "service.h"
+#include "stats.h"
+#include "timer.h"
+#include "tu_ext.h"
 
 
+atomic_size_t service_max_line = SERVICE_DEFAULT_MAXLINE;
+atomic_ulong service_keepalive_ms = SERVICE_DEFAULT_KEEPALIVE;
+atomic_ulong service_idle_ms = SERVICE_DEFAULT_IDLE;
+atomic_ulong service_cmd_rate = 0;
+atomic_ulong service_chat_rate = 0;
 
+/*
+ * State of a client connection.  It is freed once it has been closed and
+ * its idle timer, which holds a reference to it while armed, has let go.
+ */
+struct service_conn {
+    int fd;                        // File descriptor of the client connection
+    TU *tu;                        // TU for this client (referenced until freed)
+    LINEBUF *in;                   // Input not yet dispatched
+    atomic_int refs;               // One for the connection, one for the timer
+    atomic_int closing;            // Being closed
+    atomic_int ghost;              // Found dead (see keepalive.h)
+    atomic_ulong last_input;       // When input last arrived (milliseconds)
+    TIMER idle;                    // Reaps the connection if it stays silent
+    RATE_BUCKET cmds;              // Limits the rate of commands
+    RATE_BUCKET chat;              // Limits the rate of chat and page bytes
+};
 
+static unsigned long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
 
-void *pbx_client_service(void *arg) {
-    // Retrieve the file descriptor from arg
-    int client_fd = *(int *)arg;
-    free(arg);
+static void conn_release(SERVICE_CONN *conn) {
+    if (atomic_fetch_sub(&conn->refs, 1) != 1) {
+        return;
+    }
+    tu_unref(conn->tu, "Client connection closed");  // This also closes fd
+    linebuf_destroy(conn->in);
+    free(conn);
+    admission_release();
+}
 
-    // Detach the thread
-    pthread_detach(pthread_self());
+/*
+ * Shut down a connection that has been silent for too long, so that it is
+ * closed as if by its client, or arm the timer again for the rest of the
+ * time if input has arrived since it was armed.  The reference held by the
+ * timer is released, or kept if it is armed again.
+ */
+static void conn_idle(TIMER *t, unsigned long data) {
+    SERVICE_CONN *conn = (SERVICE_CONN *)((char *)t - offsetof(SERVICE_CONN, idle));
+    unsigned long limit = atomic_load_explicit(&service_idle_ms, memory_order_relaxed);
+    unsigned long quiet = now_ms() - atomic_load_explicit(&conn->last_input, memory_order_relaxed);
+    if (!atomic_load(&conn->closing) && limit > 0) {
+        if (quiet >= limit) {
+            debug("Extension %d silent for %lu ms, reaping it", tu_extension(conn->tu), quiet);
+            atomic_store(&conn->ghost, 1);
+            shutdown(conn->fd, SHUT_RDWR);
+        } else if (timer_arm(t, limit - quiet, 0) == 0) {
+            // Unless the connection has started closing meanwhile and has
+            // missed the timer, the reference is the timer's again
+            if (atomic_load(&conn->closing) && timer_cancel(t)) {
+                conn_release(conn);
+            }
+            return;
+        }
+    }
+    conn_release(conn);
+}
 
-    // Initialize a new TU with the client file descriptor
-    TU *tu = tu_init(client_fd);
-    if (tu == NULL) {
-        close(client_fd);
-        return NULL;
+/*
+ * Carry out a parsed command on behalf of a TU.
+ */
+static void service_command(TU *tu, int ext, const COMMAND *cp) {
+    COMMAND c = *cp;
+    debug("Received '%s' command from extension %d", command_name(c.cmd), ext);
+
+    int ret = 0;
+    switch (c.cmd) {
+        case CMD_PICKUP:
+            ret = tu_pickup(tu);
+            break;
+        case CMD_HANGUP:
+            ret = tu_hangup(tu);
+            break;
+        case CMD_DIAL:
+            ret = pbx_dial_digits(pbx, tu, c.arg, c.arg_len);
+            break;
+        case CMD_CHAT:
+            ret = tu_chat(tu, (char *)c.arg);
+            break;
+        case CMD_EXT:
+            ret = pbx_renumber(pbx, tu, c.ext);
+            break;
+        case CMD_CAMP:
+            ret = pbx_camp_digits(pbx, tu, c.arg, c.arg_len);
+            break;
+        case CMD_PAGE:
+            ret = page_send(pbx, tu, c.arg, c.arg_len);
+            break;
+        case CMD_WATCH:
+            ret = presence_watch(pbx, tu, c.ext);
+            break;
+        case CMD_PING:
+            ret = tu_send(tu, "PONG" EOL, sizeof("PONG" EOL) - 1);
+            break;
+        case CMD_STATS: {
+            char buf[4096];
+            size_t n = stats_format(buf, sizeof(buf));
+            ret = tu_send(tu, buf, n);
+            break;
+        }
+        default:
+            break;
     }
+    if (ret == -1) {
+        debug("Error handling '%s' command for extension %d", command_name(c.cmd), ext);
+    }
+}
 
-    // Register the TU with the PBX under an extension number
-    int ext = client_fd; 
-    if (pbx_register(pbx, tu, ext) == -1) {
-        tu_unref(tu, "Failed to register TU");
-        close(client_fd);
+/*
+ * Check a command against the rate limits of its connection.  "hangup" is
+ * always let through, so that a client over its limits can still end a
+ * call.
+ *
+ * @return 0 if the command may be carried out, -1 if it is to be dropped.
+ */
+static int service_conn_admit(SERVICE_CONN *conn, const COMMAND *c, unsigned long now) {
+    if (c->cmd == CMD_HANGUP) {
+        return 0;
+    }
+    unsigned long rate = atomic_load_explicit(&service_cmd_rate, memory_order_relaxed);
+    if (rate_take(&conn->cmds, rate, rate, 1, now) == -1) {
+        STATS_INC(cmds_dropped);
+        return -1;
+    }
+    if (c->cmd == CMD_CHAT || c->cmd == CMD_PAGE) {
+        // A message as long as a line can always get through, given time
+        rate = atomic_load_explicit(&service_chat_rate, memory_order_relaxed);
+        size_t burst = atomic_load_explicit(&service_max_line, memory_order_relaxed);
+        if (rate_take(&conn->chat, rate, rate > burst ? rate : burst, c->arg_len, now) == -1) {
+            STATS_INC(chats_throttled);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+SERVICE_CONN *service_conn_open(int fd) {
+    SERVICE_CONN *conn = malloc(sizeof(SERVICE_CONN));
+    if (conn == NULL) {
+        close(fd);
+        admission_release();
+        return NULL;
+    }
+    conn->in = linebuf_create(atomic_load_explicit(&service_max_line, memory_order_relaxed));
+    if (conn->in == NULL) {
+        free(conn);
+        close(fd);
+        admission_release();
         return NULL;
     }
 
-    // Open a FILE stream for buffered I/O
-    FILE *client_stream = fdopen(client_fd, "r");
-    if (client_stream == NULL) {
-        perror("fdopen");
-        pbx_unregister(pbx, tu);
-        tu_unref(tu, "Closing TU due to fdopen failure");
-        close(client_fd);
+    TU *tu = tu_init(fd);
+    if (tu == NULL) {
+        linebuf_destroy(conn->in);
+        free(conn);
+        close(fd);
+        admission_release();
         return NULL;
     }
 
-    char *line = NULL;
-    size_t len = 0;
+    if (pbx_register_next(pbx, tu) == -1) {
+        tu_unref(tu, "Failed to register TU");  // This also closes fd
+        linebuf_destroy(conn->in);
+        free(conn);
+        admission_release();
+        return NULL;
+    }
 
-    // Service loop
-    while (!feof(client_stream)) {
-        ssize_t nread = getline(&line, &len, client_stream);
-        if (nread == -1) {
-            break;  // EOF or error
+    conn->fd = fd;
+    conn->tu = tu;
+    atomic_init(&conn->refs, 1);
+    atomic_init(&conn->closing, 0);
+    atomic_init(&conn->ghost, 0);
+    atomic_init(&conn->last_input, now_ms());
+    timer_init(&conn->idle, conn_idle);
+    rate_init(&conn->cmds, now_ms());
+    rate_init(&conn->chat, now_ms());
+    keepalive_tune(fd);
+    unsigned long limit = atomic_load_explicit(&service_idle_ms, memory_order_relaxed);
+    if (limit > 0) {
+        atomic_fetch_add(&conn->refs, 1);
+        if (timer_arm(&conn->idle, limit, 0) == -1) {
+            atomic_fetch_sub(&conn->refs, 1);
         }
+    }
+    return conn;
+}
 
-        // Remove trailing "\r\n" or "\n"
-        char *cmd = line;
-        size_t cmd_len = nread;
-        while (cmd_len > 0 && (cmd[cmd_len - 1] == '\n' || cmd[cmd_len - 1] == '\r')) {
-            cmd[--cmd_len] = '\0';
-        }
+int service_conn_fileno(SERVICE_CONN *conn) {
+    return conn->fd;
+}
 
-        // Skip leading whitespace
-        while (isspace((unsigned char)*cmd)) {
-            cmd++;
+/*
+ * Dispatch the complete lines in the input buffer of a connection, up to a
+ * budget.  The lines beyond it, and a trailing partial line, stay in the
+ * buffer.
+ *
+ * The commands are carried out in order as a single batch, so the
+ * responses to all of them are flushed together once the last is done.
+ * Commands over the rate limits of the connection are dropped, and count
+ * against the budget all the same.
+ *
+ * @param budget  Maximum number of lines to dispatch, or 0 for all.
+ */
+static void service_conn_lines(SERVICE_CONN *conn, unsigned budget) {
+    char *cmd;
+    size_t len;
+    unsigned long now = now_ms();
+    unsigned n = 0;
+    tu_batch_begin();
+    while ((budget == 0 || n++ < budget) && (cmd = linebuf_next(conn->in, &len)) != NULL) {
+        int ext = tu_extension(conn->tu);
+        COMMAND c;
+        if (command_parse(cmd, len, &c) == -1) {
+            debug("Received invalid command from extension %d: %s", ext, cmd);
+            continue;
+        }
+        if (service_conn_admit(conn, &c, now) == -1) {
+            debug("Dropped '%s' command from extension %d over its rate limit",
+                  command_name(c.cmd), ext);
+            continue;
         }
+        service_command(conn->tu, ext, &c);
+    }
+    tu_batch_end();
+    unsigned rejected = linebuf_rejected(conn->in);
+    if (rejected > 0) {
+        debug("Rejected %u over-long line(s) from extension %d", rejected, tu_extension(conn->tu));
+        STATS_ADD(lines_rejected, rejected);
+    }
+}
 
-        // Parse and handle commands
-        if (strncmp(cmd, "pickup", 6) == 0 && (cmd[6] == '\0' || isspace((unsigned char)cmd[6]))) {
-            debug("Received 'pickup' command from extension %d", ext);
-            if (tu_pickup(tu) == -1) {
-                debug("Error handling 'pickup' command for extension %d", ext);
-            }
-        } else if (strncmp(cmd, "hangup", 6) == 0 && (cmd[6] == '\0' || isspace((unsigned char)cmd[6]))) {
-            debug("Received 'hangup' command from extension %d", ext);
-            if (tu_hangup(tu) == -1) {
-                debug("Error handling 'hangup' command for extension %d", ext);
-            }
-        } else if (strncmp(cmd, "dial", 4) == 0 && isspace((unsigned char)cmd[4])) {
-            // Extract extension number
-            char *ext_str = cmd + 4;
-            while (isspace((unsigned char)*ext_str)) {
-                ext_str++;
-            }
-            int dial_ext = atoi(ext_str);
-            debug("Received 'dial %d' command from extension %d", dial_ext, ext);
-            if (pbx_dial(pbx, tu, dial_ext) == -1) {
-                debug("Error handling 'dial %d' command for extension %d", dial_ext, ext);
-            }
-        } else if (strncmp(cmd, "chat", 4) == 0 && (cmd[4] == '\0' || isspace((unsigned char)cmd[4]))) {
-            // Extract chat message
-            char *msg = cmd + 4;
-            while (isspace((unsigned char)*msg)) {
-                msg++;
-            }
-            debug("Received 'chat' command from extension %d: %s", ext, msg);
-            if (tu_chat(tu, msg) == -1) {
-                debug("Error handling 'chat' command for extension %d", ext);
-            }
-        } else {
-            debug("Received invalid command from extension %d: %s", ext, cmd);
+/*
+ * Receive input on a client connection and dispatch the command lines
+ * that it completes.
+ *
+ * @param flags  Flags for recvmsg(): MSG_DONTWAIT to avoid blocking.
+ * @param budget  Maximum number of lines to dispatch, or 0 for all.
+ * @return  1 if the connection remains open, 0 if EOF or an error was seen.
+ */
+static int service_conn_recv(SERVICE_CONN *conn, int flags, unsigned budget) {
+    ssize_t nread = linebuf_recv(conn->in, conn->fd, flags);
+    if (nread == 0) {
+        return 0;  // EOF
+    }
+    if (nread < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 1;
+        }
+        debug("Error reading from extension %d (errno=%d)", tu_extension(conn->tu), errno);
+        if (errno == ETIMEDOUT) {
+            service_conn_lost(conn);
         }
+        return 0;
+    }
+    atomic_store_explicit(&conn->last_input, now_ms(), memory_order_relaxed);
+    service_conn_lines(conn, budget);
+    return 1;
+}
+
+int service_conn_read(SERVICE_CONN *conn) {
+    return service_conn_recv(conn, MSG_DONTWAIT, SERVICE_CMD_BUDGET);
+}
+
+size_t service_conn_input(SERVICE_CONN *conn, const char *data, size_t len) {
+    atomic_store_explicit(&conn->last_input, now_ms(), memory_order_relaxed);
+    size_t taken = 0;
+    do {
+        taken += linebuf_put(conn->in, data + taken, len - taken);
+        service_conn_lines(conn, SERVICE_CMD_BUDGET);
+        // Unless commands are left over, that made room for more
+    } while (taken < len && !service_conn_pending(conn));
+    return taken;
+}
+
+int service_conn_pending(SERVICE_CONN *conn) {
+    return linebuf_ready(conn->in);
+}
+
+void service_conn_run(SERVICE_CONN *conn) {
+    service_conn_lines(conn, SERVICE_CMD_BUDGET);
+}
+
+void service_conn_lost(SERVICE_CONN *conn) {
+    atomic_store(&conn->ghost, 1);
+}
+
+void service_conn_close(SERVICE_CONN *conn) {
+    atomic_store(&conn->closing, 1);
+    if (timer_cancel(&conn->idle)) {
+        conn_release(conn);
+    }
+    if (atomic_load(&conn->ghost)) {
+        keepalive_reaped();
     }
 
-    // Handle client disconnection as a hangup
-    debug("Client at extension %d disconnected", ext);
-    tu_hangup(tu);
+    // Handle client disconnection as a hangup, once the TU can no longer be
+    // chosen for calls (by hunt groups, queues or TUs camped on it)
+    debug("Client at extension %d disconnected", tu_extension(conn->tu));
+    tu_withdraw(conn->tu);
+    tu_hangup(conn->tu);
+    presence_unwatch_all(conn->tu);
+
+    // Unregister the TU and release our reference, which closes the fd once
+    // the idle timer has let go too
+    pbx_unregister(pbx, conn->tu);
+    conn_release(conn);
+}
+
 
-    // Clean up
-    if (line != NULL) {
-        free(line);
+void *pbx_client_service(void *arg) {
+    // Retrieve the file descriptor from arg
+    int client_fd = *(int *)arg;
+    free(arg);
+
+    // Detach the thread
+    pthread_detach(pthread_self());
+
+    // Create a TU for the client and register it with the PBX
+    SERVICE_CONN *conn = service_conn_open(client_fd);
+    if (conn == NULL) {
+        return NULL;
     }
-    fclose(client_stream);  // This also closes client_fd
 
-    // Unregister the TU and decrease its reference count
-    pbx_unregister(pbx, tu);
-    tu_unref(tu, "Client service thread exiting");
+    // Service loop
+    // Nothing else is serviced by this thread, so all commands received
+    // are carried out at once
+    while (service_conn_recv(conn, 0, 0)) {
+        continue;
+    }
 
+    service_conn_close(conn);
     return NULL;
 }
@@ -0,0 +1,74 @@
+/*
+ * Counters describing the operation of the PBX.
+ */
+#include <stdio.h>
+#include <stddef.h>
+
+
+#include "pbx.h"
+#include "stats.h"
+
+PBX_STATS pbx_stats;
+
+/*
+ * Names under which the counters are reported.
+ */
+static const struct {
+    const char *name;
+    size_t offset;
+} counters[] = {
+    { "notify_msgs",            offsetof(PBX_STATS, notify_msgs) },
+    { "notify_writes",          offsetof(PBX_STATS, notify_writes) },
+    { "notify_coalesced",       offsetof(PBX_STATS, notify_coalesced) },
+    { "lines_rejected",         offsetof(PBX_STATS, lines_rejected) },
+    { "tus_registered",         offsetof(PBX_STATS, tus_registered) },
+    { "dialplan_routed",        offsetof(PBX_STATS, dialplan_routed) },
+    { "config_reloads",         offsetof(PBX_STATS, config_reloads) },
+    { "config_reload_failures", offsetof(PBX_STATS, config_reload_failures) },
+    { "config_reload_us",       offsetof(PBX_STATS, config_reload_us) },
+    { "config_reload_max_us",   offsetof(PBX_STATS, config_reload_max_us) },
+    { "acd_waiting",            offsetof(PBX_STATS, acd_waiting) },
+    { "acd_dispatched",         offsetof(PBX_STATS, acd_dispatched) },
+    { "acd_abandoned",          offsetof(PBX_STATS, acd_abandoned) },
+    { "acd_wait_us",            offsetof(PBX_STATS, acd_wait_us) },
+    { "acd_wait_max_us",        offsetof(PBX_STATS, acd_wait_max_us) },
+    { "camp_waiting",           offsetof(PBX_STATS, camp_waiting) },
+    { "camp_completed",         offsetof(PBX_STATS, camp_completed) },
+    { "camp_rejected",          offsetof(PBX_STATS, camp_rejected) },
+    { "conf_rooms",             offsetof(PBX_STATS, conf_rooms) },
+    { "conf_members",           offsetof(PBX_STATS, conf_members) },
+    { "conf_chats",             offsetof(PBX_STATS, conf_chats) },
+    { "conf_deliveries",        offsetof(PBX_STATS, conf_deliveries) },
+    { "pages",                  offsetof(PBX_STATS, pages) },
+    { "page_deliveries",        offsetof(PBX_STATS, page_deliveries) },
+    { "page_failures",          offsetof(PBX_STATS, page_failures) },
+    { "page_us",                offsetof(PBX_STATS, page_us) },
+    { "page_max_us",            offsetof(PBX_STATS, page_max_us) },
+    { "presence_watches",       offsetof(PBX_STATS, presence_watches) },
+    { "presence_events",        offsetof(PBX_STATS, presence_events) },
+    { "presence_coalesced",     offsetof(PBX_STATS, presence_coalesced) },
+    { "timers",                 offsetof(PBX_STATS, timers) },
+    { "timeouts",               offsetof(PBX_STATS, timeouts) },
+    { "ghosts_reaped",          offsetof(PBX_STATS, ghosts_reaped) },
+    { "ghosts_per_minute",      offsetof(PBX_STATS, ghosts_per_minute) },
+    { "cmds_dropped",           offsetof(PBX_STATS, cmds_dropped) },
+    { "chats_throttled",        offsetof(PBX_STATS, chats_throttled) },
+    { "conns_open",             offsetof(PBX_STATS, conns_open) },
+    { "conns_max",              offsetof(PBX_STATS, conns_max) },
+    { "conns_accepted",         offsetof(PBX_STATS, conns_accepted) },
+    { "conn_rate_max",          offsetof(PBX_STATS, conn_rate_max) },
+    { "conns_rejected",         offsetof(PBX_STATS, conns_rejected) },
+    { "calls_setup",            offsetof(PBX_STATS, calls_setup) },
+    { "calls_setup_max",        offsetof(PBX_STATS, calls_setup_max) },
+};
+
+size_t stats_format(char *buf, size_t size) {
+    size_t len = 0;
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        atomic_ulong *c = (atomic_ulong *)((char *)&pbx_stats + counters[i].offset);
+        len += snprintf(len < size ? buf + len : NULL, len < size ? size - len : 0, "STATS %s %lu%s",
+                        counters[i].name, atomic_load_explicit(c, memory_order_relaxed), EOL);
+    }
+    len += snprintf(len < size ? buf + len : NULL, len < size ? size - len : 0, "STATS END%s", EOL);
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,245 @@
+/*
+ * Hierarchical timing wheel.
+ */
+#include <stdlib.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "timer.h"
+#include "stats.h"
+#include "debug.h"
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+
+/*
+ * Longest delay, in ticks.
+ */
+#define TIMER_MAX_TICKS ((1ULL << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1)
+
+/*
+ * The wheel.  Each slot is a circular list whose head is the slot itself.
+ * The timer lock protects the wheel and every timer armed.
+ */
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond;
+static TIMER wheel[TIMER_LEVELS][TIMER_SLOTS];
+static uint64_t now;                // Next tick to process
+static unsigned long narmed;        // Number of timers armed
+static int busy;                    // The thread is processing a tick
+static int started, stopping;
+static pthread_t ticker;
+
+static uint64_t clock_tick(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
+
+static struct timespec tick_time(uint64_t tick) {
+    uint64_t ms = tick * TIMER_TICK_MS;
+    return (struct timespec){ .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 };
+}
+
+/*
+ * Put an armed timer in the slot for the tick at which it expires: in the
+ * first level if that is less than TIMER_SLOTS ticks away, and otherwise in
+ * the lowest level whose range covers it.
+ */
+static void wheel_insert(TIMER *t) {
+    uint64_t when = t->expires > now ? t->expires : now;
+    uint64_t delta = when - now;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >> (TIMER_SLOT_BITS * (level + 1)) != 0) {
+        level++;
+    }
+    TIMER *head = &wheel[level][(when >> (TIMER_SLOT_BITS * level)) & TIMER_MASK];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void wheel_remove(TIMER *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+/*
+ * Move the timers in the slots of the higher levels that the current tick
+ * begins into the levels below.
+ */
+static void wheel_cascade(void) {
+    for (int level = 1; level < TIMER_LEVELS &&
+         ((now >> (TIMER_SLOT_BITS * (level - 1))) & TIMER_MASK) == 0; level++) {
+        TIMER *head = &wheel[level][(now >> (TIMER_SLOT_BITS * level)) & TIMER_MASK];
+        TIMER *t = head->next;
+        head->next = head->prev = head;
+        while (t != head) {
+            TIMER *next = t->next;
+            wheel_insert(t);
+            t = next;
+        }
+    }
+}
+
+/*
+ * Run the function of a timer that has expired, taking it out of the wheel.
+ * Must be called with the timer lock held, which is released meanwhile.
+ */
+static void timer_expire(TIMER *t) {
+    wheel_remove(t);
+    narmed--;
+    STATS_DEC(timers);
+    TIMER_FN fn = t->fn;
+    unsigned long data = t->data;
+    pthread_mutex_unlock(&timer_lock);
+    fn(t, data);
+    pthread_mutex_lock(&timer_lock);
+}
+
+/*
+ * Process the current tick.  Must be called with the timer lock held.
+ */
+static void timer_tick(void) {
+    busy = 1;
+    wheel_cascade();
+    TIMER *head = &wheel[0][now & TIMER_MASK];
+    while (head->next != head) {
+        timer_expire(head->next);
+    }
+    now++;
+    busy = 0;
+}
+
+static void *timer_thread(void *arg) {
+    pthread_mutex_lock(&timer_lock);
+    while (!stopping) {
+        if (narmed == 0) {
+            // nothing to do until a timer is armed, from the time it is
+            now = clock_tick();
+            pthread_cond_wait(&timer_cond, &timer_lock);
+        } else if (now > clock_tick()) {
+            struct timespec ts = tick_time(now);
+            pthread_cond_timedwait(&timer_cond, &timer_lock, &ts);
+        } else {
+            timer_tick();
+        }
+    }
+    pthread_mutex_unlock(&timer_lock);
+    return NULL;
+}
+
+/*
+ * Start the timer thread if it is not running.  Must be called with the
+ * timer lock held.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+static int start_ticker(void) {
+    if (started) {
+        return 0;
+    }
+    for (int i = 0; i < TIMER_LEVELS; i++) {
+        for (int j = 0; j < TIMER_SLOTS; j++) {
+            wheel[i][j].next = wheel[i][j].prev = &wheel[i][j];
+        }
+    }
+    now = clock_tick();
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    // signals are for the threads that expect them, not the timer thread
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    int err = pthread_create(&ticker, NULL, timer_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (err != 0) {
+        pthread_cond_destroy(&timer_cond);
+        return -1;
+    }
+    started = 1;
+    return 0;
+}
+
+void timer_init(TIMER *t, TIMER_FN fn) {
+    t->next = t->prev = NULL;
+    t->expires = 0;
+    t->fn = fn;
+    t->data = 0;
+}
+
+int timer_arm(TIMER *t, unsigned long ms, unsigned long data) {
+    uint64_t ticks = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (ticks > TIMER_MAX_TICKS) {
+        ticks = TIMER_MAX_TICKS;
+    }
+    pthread_mutex_lock(&timer_lock);
+    if (start_ticker() == -1) {
+        pthread_mutex_unlock(&timer_lock);
+        return -1;
+    }
+    int was_armed = t->next != NULL;
+    if (was_armed) {
+        wheel_remove(t);
+    } else {
+        if (narmed++ == 0) {
+            if (!busy) {
+                now = clock_tick();
+            }
+            pthread_cond_signal(&timer_cond);
+        }
+        STATS_INC(timers);
+    }
+    t->expires = clock_tick() + ticks;
+    t->data = data;
+    wheel_insert(t);
+    pthread_mutex_unlock(&timer_lock);
+    return was_armed;
+}
+
+int timer_cancel(TIMER *t) {
+    pthread_mutex_lock(&timer_lock);
+    int was_armed = t->next != NULL;
+    if (was_armed) {
+        wheel_remove(t);
+        narmed--;
+        STATS_DEC(timers);
+    }
+    pthread_mutex_unlock(&timer_lock);
+    return was_armed;
+}
+
+void timer_fini(void) {
+    pthread_mutex_lock(&timer_lock);
+    int join = started;
+    stopping = 1;
+    if (started) {
+        pthread_cond_signal(&timer_cond);
+    }
+    pthread_mutex_unlock(&timer_lock);
+    if (!join) {
+        return;
+    }
+    pthread_join(ticker, NULL);
+
+    pthread_mutex_lock(&timer_lock);
+    if (narmed > 0) {
+        debug("timer: Running %lu timers still armed.", narmed);
+    }
+    // functions run may arm other timers
+    while (narmed > 0) {
+        for (int i = 0; i < TIMER_LEVELS; i++) {
+            for (int j = 0; j < TIMER_SLOTS; j++) {
+                while (wheel[i][j].next != &wheel[i][j]) {
+                    timer_expire(wheel[i][j].next);
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&timer_lock);
+}
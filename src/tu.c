@@ -1,25 +1,455 @@
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 
 #include "pbx.h"
 #include "debug.h"
 #include "tu.h"
+#include "outq.h"
+#include "stats.h"
+#include "transport.h"
+#include "tu_ext.h"
+#include "conf.h"
+#include "presence.h"
+#include "timer.h"
+
+
+/*
+ * Output side of a TU: the queue of messages for its client and the file
+ * descriptor they are written to.  This is a separate object because it
+ * can outlive the TU: when a TU is destroyed with output still queued, the
+ * writer thread finishes sending it and then closes the file descriptor.
+ */
+struct tu_out {
+    pthread_mutex_t lock;   // Protects everything below; never held while
+                            // acquiring a TU mutex
+    int fd;                 // File descriptor of the client connection
+    OUTQ q;                 // Messages not yet written
+    int armed;              // Writer thread is waiting for fd to be writable
+    int registered;         // fd has been added to the writer's epoll set
+    int dead;               // Write error or slow consumer: discard output
+    int orphaned;           // TU destroyed: free once output is done
+    int pins;               // Number of operation batches referring to this
+};
+
+/*
+ * In a build with REF_TRACE defined, each TU records its most recent
+ * reference count changes, with the reasons given for them, and the TUs
+ * still alive at exit are reported by tu_trace_report().
+ */
+#ifdef REF_TRACE
+#define REF_TRACE_LEN 16
+
+struct ref_event {
+    const char *reason;     // Reason given by the caller
+    int delta;              // +1 or -1
+    int refs;               // Count after the change
+};
 
+struct ref_trace {
+    atomic_uint next;                       // Index of the next event
+    struct ref_event events[REF_TRACE_LEN]; // Most recent events
+    struct tu *prev, *next_tu;              // List of live TUs
+};
+#endif
 
 struct tu {
-    int ext;
+    EXTNUM ext;
     int fd;
-    int refs;
+    atomic_int refs;
     pthread_mutex_t mutex;
     struct tu *peer;
     TU_STATE state;
+    struct tu_out *out;
+    int listed;                 // Registered, so may take calls
+    int available;              // Availability last reported to the hook
+    struct tu_hunt *hunt;       // Call ringing a group, made or rung by this TU
+    struct tu *camped;          // TU this one is camped on, or NULL
+    int ncamp;                  // Number of TUs camped on this one
+    struct tu *camp[TU_MAX_CAMP];  // TUs camped on this one, first camped first
+    int camp_due;               // Scheduled for serving the TUs camped on it
+    struct tu *camp_next;       // Next TU scheduled, in the same thread
+    CONF_ROOM *room;            // Conference room this TU is in, or NULL
+    TIMER timer;                // Armed while the TU is in a state with a timeout
+    int timer_state;            // That state, or -1 if none
+    unsigned long timer_gen;    // Changed each time the TU enters or leaves it
+    int setup;                  // Counted in calls_setup (heard ring back last)
+#ifdef REF_TRACE
+    struct ref_trace trace;
+#endif
+};
+
+/*
+ * A call ringing several TUs at once (see tu_dial_group()).  It belongs to
+ * the calling TU, and is protected by its mutex.  Each TU rung has the
+ * caller as its peer and points to the call; the caller has no peer until
+ * one of them answers.  The caller holds a reference to each TU rung and
+ * each holds one to the caller, as between the two TUs of an ordinary call.
+ * A call waiting in a queue (see tu_queue()) rings no TU until it is offered
+ * to an agent, which is then its only member.
+ */
+struct tu_hunt {
+    const void *queue;          // Token of the queue entry, or NULL
+    int n;                      // Number of TUs still ringing
+    TU *members[];              // The TUs ringing, in the order rung
+};
+
+/*
+ * Timeouts of the states in which a TU is not left indefinitely.
+ */
+atomic_ulong tu_timeouts[TU_ERROR + 1] = {
+    [TU_RINGING] = TU_DEFAULT_RING_TIMEOUT,
+    [TU_DIAL_TONE] = TU_DEFAULT_DIAL_TIMEOUT,
+    [TU_BUSY_SIGNAL] = TU_DEFAULT_BUSY_TIMEOUT,
 };
 
+/*
+ * Transport that has taken over delivery of output to clients, if any.
+ */
+static TU_TRANSPORT transport = NULL;
+
+void tu_set_transport(TU_TRANSPORT fn) {
+    transport = fn;
+}
+
+/*
+ * Function told when TUs become available for calls or stop being, if any.
+ */
+static TU_AVAILABILITY_HOOK availability_hook = NULL;
+
+void tu_set_availability_hook(TU_AVAILABILITY_HOOK fn) {
+    availability_hook = fn;
+}
+
+/*
+ * Function told when TUs waiting in queues hang up, if any.
+ */
+static TU_ABANDON_HOOK abandon_hook = NULL;
+
+void tu_set_abandon_hook(TU_ABANDON_HOOK fn) {
+    abandon_hook = fn;
+}
+
+/*
+ * The writer thread flushes output queues whose client sockets were full.
+ */
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+static int writer_epfd = -1;
+
+#define WRITER_MAX_EVENTS 64
+
+/*
+ * Notifications produced by a TU operation are queued while the TU mutexes
+ * are held, but are not written until the operation has released them.
+ * The outputs touched are recorded in a per-thread batch that is flushed
+ * when the outermost operation completes, so that all the messages for one
+ * client go out in a single sendmsg().
+ */
+#define TU_BATCH_MAX 16
+
+static __thread struct {
+    int depth;                          // Nesting depth of TU operations
+    int n;                              // Number of outputs recorded
+    struct tu_out *outs[TU_BATCH_MAX];  // Outputs with messages to flush
+    struct tu *camps;                   // TUs gone on hook with TUs camped on them
+} batch;
+
+static void *writer_thread(void *arg);
+static void camp_serve(TU *target);
+static void tu_expire(TIMER *t, unsigned long gen);
+
+static void tu_out_free(struct tu_out *out) {
+    outq_fini(&out->q);
+    close(out->fd);
+    pthread_mutex_destroy(&out->lock);
+    free(out);
+}
+
+/*
+ * Check whether an output can be freed.  Must be called with out->lock held.
+ */
+static int tu_out_done(struct tu_out *out) {
+    return out->orphaned && !out->armed && out->pins == 0;
+}
+
+static void writer_start(void) {
+    writer_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (writer_epfd == -1) {
+        perror("epoll_create1");
+        return;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, writer_thread, NULL) != 0) {
+        perror("pthread_create");
+        close(writer_epfd);
+        writer_epfd = -1;
+        return;
+    }
+    pthread_detach(tid);
+}
+
+/*
+ * Ask the writer thread to flush an output queue once its socket is
+ * writable.  Must be called with out->lock held.
+ */
+static void tu_out_arm(struct tu_out *out) {
+    pthread_once(&writer_once, writer_start);
+    if (out->dead || out->armed || writer_epfd < 0) {
+        return;
+    }
+    struct epoll_event ev = { .events = EPOLLOUT | EPOLLONESHOT, .data.ptr = out };
+    int op = out->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(writer_epfd, op, out->fd, &ev) == -1) {
+        debug("tu_out_arm: epoll_ctl failed for FD %d (errno=%d), discarding output.", out->fd, errno);
+        out->dead = 1;
+        outq_fini(&out->q);
+        return;
+    }
+    out->registered = 1;
+    out->armed = 1;
+}
+
+/*
+ * Write as much queued output as possible without blocking.  If some is
+ * left, the writer thread finishes the job when the socket drains.
+ * Must be called with out->lock held.
+ */
+static void tu_out_flush(struct tu_out *out) {
+    if (out->dead || out->armed || out->q.count == 0) {
+        return;
+    }
+    OUTQ_COUNTS counts = { 0, 0 };
+    ssize_t n = outq_send(&out->q, out->fd, &counts);
+    STATS_ADD(notify_writes, counts.writes);
+    if (counts.msgs > counts.writes) {
+        STATS_ADD(notify_coalesced, counts.msgs - counts.writes);
+    }
+    if (n < 0) {
+        debug("tu_out_flush: Error writing to FD %d (errno=%d), discarding output.", out->fd, errno);
+        out->dead = 1;
+        outq_fini(&out->q);
+        return;
+    }
+    if (out->q.bytes > 0) {
+        tu_out_arm(out);
+    }
+}
+
+static void *writer_thread(void *arg) {
+    struct epoll_event events[WRITER_MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(writer_epfd, events, WRITER_MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return NULL;
+        }
+        for (int i = 0; i < n; i++) {
+            struct tu_out *out = events[i].data.ptr;
+            pthread_mutex_lock(&out->lock);
+            out->armed = 0;
+            tu_out_flush(out);
+            int done = tu_out_done(out);
+            pthread_mutex_unlock(&out->lock);
+            if (done) {
+                tu_out_free(out);
+            }
+        }
+    }
+    return NULL;
+}
+
+void tu_batch_begin(void) {
+    batch.depth++;
+}
+
+void tu_batch_end(void) {
+    if (--batch.depth > 0) {
+        return;
+    }
+    for (int i = 0; i < batch.n; i++) {
+        struct tu_out *out = batch.outs[i];
+        pthread_mutex_lock(&out->lock);
+        out->pins--;
+        tu_out_flush(out);
+        int done = tu_out_done(out);
+        pthread_mutex_unlock(&out->lock);
+        if (done) {
+            tu_out_free(out);
+        }
+    }
+    batch.n = 0;
+
+    // Ring back the TUs camped on TUs that went on hook, now that no TU
+    // mutex is held
+    while (batch.camps != NULL) {
+        TU *tu = batch.camps;
+        batch.camps = tu->camp_next;
+        batch.depth++;
+        camp_serve(tu);
+        tu_batch_end();
+    }
+
+    // Tell the watchers of the TUs whose state changed
+    if (presence_due()) {
+        batch.depth++;
+        presence_flush();
+        tu_batch_end();
+    }
+}
+
+/*
+ * Queue a message for the client of a TU.  This never blocks, so it may be
+ * called while holding TU mutexes.  The message is written once the current
+ * TU operation completes, or later by an installed transport or the writer
+ * thread.
+ *
+ * @param buf  If not NULL, a shared message queued by reference instead
+ * of msg and len.
+ * @return 0 if successful, -1 if the message was discarded.
+ */
+static int tu_write_buf(TU *tu, const char *msg, size_t len, OUTQ_BUF *buf) {
+    struct tu_out *out = tu->out;
+    if (buf != NULL) {
+        len = buf->len;
+    }
+    pthread_mutex_lock(&out->lock);
+    if (out->dead) {
+        pthread_mutex_unlock(&out->lock);
+        return -1;
+    }
+    if (out->q.bytes + len > atomic_load_explicit(&outq_hiwat, memory_order_relaxed)) {
+        // The client is not reading its notifications: disconnect it, which
+        // causes its service loop to see EOF and unregister the TU.
+        warn("Disconnecting slow consumer at FD %d (%zu bytes queued).", out->fd, out->q.bytes);
+        out->dead = 1;
+        outq_fini(&out->q);
+        shutdown(out->fd, SHUT_RDWR);
+        pthread_mutex_unlock(&out->lock);
+        return -1;
+    }
+    if ((buf != NULL ? outq_push_buf(&out->q, buf) : outq_push(&out->q, msg, len)) == -1) {
+        pthread_mutex_unlock(&out->lock);
+        return -1;
+    }
+    STATS_INC(notify_msgs);
+    if (out->armed) {
+        // The writer thread already owns the queue
+        pthread_mutex_unlock(&out->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    if (transport != NULL && transport(tu, out->fd) == 0) {
+        return 0;
+    }
+
+    // Record the output in the batch of the current operation
+    for (int i = 0; i < batch.n; i++) {
+        if (batch.outs[i] == out) {
+            return 0;
+        }
+    }
+    pthread_mutex_lock(&out->lock);
+    if (batch.depth > 0 && batch.n < TU_BATCH_MAX) {
+        out->pins++;
+        batch.outs[batch.n++] = out;
+    } else {
+        tu_out_arm(out);  // Too much in this batch: let the writer do it
+    }
+    pthread_mutex_unlock(&out->lock);
+    return 0;
+}
+
+static int tu_write(TU *tu, const char *msg, size_t len) {
+    return tu_write_buf(tu, msg, len, NULL);
+}
+
+size_t tu_output_drain(TU *tu, char *buf, size_t max) {
+    struct tu_out *out = tu->out;
+    OUTQ_COUNTS counts = { 0, 0 };
+    pthread_mutex_lock(&out->lock);
+    size_t n = out->dead ? 0 : outq_drain(&out->q, buf, max, &counts);
+    pthread_mutex_unlock(&out->lock);
+    STATS_ADD(notify_writes, counts.writes);
+    if (counts.msgs > counts.writes) {
+        STATS_ADD(notify_coalesced, counts.msgs - counts.writes);
+    }
+    return n;
+}
+
+#ifdef REF_TRACE
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+static TU *live_tus = NULL;
+
+static void ref_trace(TU *tu, const char *reason, int delta, int refs) {
+    unsigned i = atomic_fetch_add_explicit(&tu->trace.next, 1, memory_order_relaxed);
+    struct ref_event *ev = &tu->trace.events[i % REF_TRACE_LEN];
+    ev->reason = reason;
+    ev->delta = delta;
+    ev->refs = refs;
+}
+
+static void ref_trace_init(TU *tu) {
+    atomic_init(&tu->trace.next, 0);
+    pthread_mutex_lock(&live_lock);
+    tu->trace.prev = NULL;
+    tu->trace.next_tu = live_tus;
+    if (live_tus != NULL) {
+        live_tus->trace.prev = tu;
+    }
+    live_tus = tu;
+    pthread_mutex_unlock(&live_lock);
+    ref_trace(tu, "tu_init", 1, 1);
+}
+
+static void ref_trace_fini(TU *tu) {
+    pthread_mutex_lock(&live_lock);
+    if (tu->trace.prev != NULL) {
+        tu->trace.prev->trace.next_tu = tu->trace.next_tu;
+    } else {
+        live_tus = tu->trace.next_tu;
+    }
+    if (tu->trace.next_tu != NULL) {
+        tu->trace.next_tu->trace.prev = tu->trace.prev;
+    }
+    pthread_mutex_unlock(&live_lock);
+}
+
+void tu_trace_report(void) {
+    pthread_mutex_lock(&live_lock);
+    for (TU *tu = live_tus; tu != NULL; tu = tu->trace.next_tu) {
+        fprintf(stderr, "TU %p (ext %" PRIext ", fd %d) still has %d reference(s); recent changes:\n",
+                (void *)tu, tu->ext, tu->fd, atomic_load(&tu->refs));
+        unsigned end = atomic_load(&tu->trace.next);
+        unsigned start = end > REF_TRACE_LEN ? end - REF_TRACE_LEN : 0;
+        for (unsigned i = start; i < end; i++) {
+            struct ref_event *ev = &tu->trace.events[i % REF_TRACE_LEN];
+            fprintf(stderr, "    %+d -> %d  %s\n", ev->delta, ev->refs, ev->reason);
+        }
+    }
+    pthread_mutex_unlock(&live_lock);
+}
+#else
+#define ref_trace(tu, reason, delta, refs)
+#define ref_trace_init(tu)
+#define ref_trace_fini(tu)
+
+void tu_trace_report(void) {
+}
+#endif
+
 TU *tu_init(int fd) {
     if (fd < 0) {
         // invalid file descriptor
@@ -33,35 +463,99 @@ TU *tu_init(int fd) {
         return NULL;
     }
 
+    // set up the output queue
+    tu->out = calloc(1, sizeof(struct tu_out));
+    if (tu->out == NULL) {
+        free(tu);
+        return NULL;
+    }
+    if (pthread_mutex_init(&tu->out->lock, NULL) != 0) {
+        free(tu->out);
+        free(tu);
+        return NULL;
+    }
+    tu->out->fd = fd;
+    outq_init(&tu->out->q);
+
     // initialize the mutex
     if (pthread_mutex_init(&tu->mutex, NULL) != 0) {
         // Mutex initialization failed
+        pthread_mutex_destroy(&tu->out->lock);
+        free(tu->out);
         free(tu);
         return NULL;
     }
 
     // initialize TU fields
-    tu->refs = 1;            // initial reference count
+    atomic_init(&tu->refs, 1);  // initial reference count
     tu->fd = fd;             // store the file descriptor
     tu->ext = -1;            // extension number to be set later
     tu->state = TU_ON_HOOK;  // initial state
     tu->peer = NULL;         // no peer initially
-
+    tu->listed = 0;          // not registered yet
+    tu->available = 0;
+    tu->hunt = NULL;
+    tu->camped = NULL;
+    tu->ncamp = 0;
+    tu->camp_due = 0;
+    tu->camp_next = NULL;
+    tu->room = NULL;
+    timer_init(&tu->timer, tu_expire);
+    tu->timer_state = -1;
+    tu->timer_gen = 0;
+    tu->setup = 0;
+    ref_trace_init(tu);
 
     return tu;
 }
 
+/*
+ * Reference counts are atomic, as references are taken and released by
+ * threads that do not hold the TU mutex.  Taking a reference needs no
+ * ordering, since the caller already has access to the TU; releasing one
+ * uses release ordering, and the thread that releases the last reference
+ * then acquires, so that all accesses to the TU by other threads happen
+ * before it is destroyed.
+ */
 void tu_ref(TU *tu, char *reason) {
     if(tu == NULL)
         return;
-    tu->refs++;
+    int refs = atomic_fetch_add_explicit(&tu->refs, 1, memory_order_relaxed) + 1;
+    ref_trace(tu, reason, 1, refs);
+    (void)refs;
 }
+
+int tu_try_ref(TU *tu, char *reason) {
+    if (tu == NULL)
+        return 0;
+    int refs = atomic_load_explicit(&tu->refs, memory_order_relaxed);
+    do {
+        if (refs == 0)
+            return 0;  // Being destroyed
+    } while (!atomic_compare_exchange_weak_explicit(&tu->refs, &refs, refs + 1,
+                                                    memory_order_acquire, memory_order_relaxed));
+    ref_trace(tu, reason, 1, refs + 1);
+    return 1;
+}
+
 void tu_unref(TU *tu, char *reason) {
     if(tu == NULL)
         return;
-    tu->refs--;
-    if(tu->refs == 0){
-        close(tu->fd);
+    int refs = atomic_fetch_sub_explicit(&tu->refs, 1, memory_order_release) - 1;
+    ref_trace(tu, reason, -1, refs);
+    if(refs == 0){
+        atomic_thread_fence(memory_order_acquire);
+        ref_trace_fini(tu);
+        if (tu->setup)
+            STATS_DEC(calls_setup);
+        // the output side (and the fd) goes away once its queue is flushed
+        struct tu_out *out = tu->out;
+        pthread_mutex_lock(&out->lock);
+        out->orphaned = 1;
+        int done = tu_out_done(out);
+        pthread_mutex_unlock(&out->lock);
+        if (done)
+            tu_out_free(out);
         pthread_mutex_destroy(&tu->mutex);
         free(tu);
     } 
@@ -78,18 +572,119 @@ int tu_extension(TU *tu) {
     if(tu == NULL){
         return -1;
     }
-    int tu_ext = tu->ext;
-    return tu_ext;
+    EXTNUM tu_ext = tu->ext;
+    return tu_ext <= INT_MAX ? (int)tu_ext : -1;
 }
-int tu_set_extension(TU *tu, int ext) {
-    if(tu == NULL || ext > PBX_MAX_EXTENSIONS || ext < 0){
+
+EXTNUM tu_number(TU *tu) {
+    if (tu == NULL) {
+        return -1;
+    }
+    return tu->ext;
+}
+/*
+ * Report to the hook that a TU is no longer available, if it was.  Must be
+ * called with the TU mutex held.
+ */
+static void set_unavailable(TU *x) {
+    if (x->available) {
+        x->available = 0;
+        if (availability_hook != NULL) {
+            availability_hook(x->ext, 0);
+        }
+    }
+}
+
+/*
+ * Report to the hook any change in the availability of a TU, which is
+ * available while it is registered and on hook.  Must be called with the
+ * TU mutex held.
+ */
+static void update_availability(TU *x) {
+    if (x->listed && x->state == TU_ON_HOOK) {
+        if (!x->available) {
+            x->available = 1;
+            if (availability_hook != NULL) {
+                availability_hook(x->ext, 1);
+            }
+            // the TUs camped on it are rung back when the batch ends
+            if (x->ncamp > 0 && !x->camp_due) {
+                x->camp_due = 1;
+                tu_ref(x, "update_availability: serving TUs camped on it");
+                x->camp_next = batch.camps;
+                batch.camps = x;
+            }
+        }
+    } else {
+        set_unavailable(x);
+    }
+}
+
+/*
+ * Report the state of a TU to its watchers, if it is registered.  Must be
+ * called with the TU mutex held.
+ */
+static void update_presence(TU *x) {
+    if (x->listed) {
+        presence_changed(x->ext, x->state);
+    }
+}
+
+/*
+ * Arm the timer of a TU that has entered a state with a timeout, or cancel
+ * it if the TU has left that state.  A TU camped on another waits without a
+ * timeout.  The timer holds a reference to the TU while it is armed.  Must
+ * be called with the TU mutex held.
+ */
+static void update_timer(TU *x) {
+    unsigned long ms = x->camped == NULL ?
+        atomic_load_explicit(&tu_timeouts[x->state], memory_order_relaxed) : 0;
+    int timed = ms > 0 ? (int)x->state : -1;
+    if (timed == x->timer_state) {
+        return;  // still the same wait
+    }
+    x->timer_state = timed;
+    x->timer_gen++;
+    if (timed != -1) {
+        tu_ref(x, "update_timer: timer armed");
+        int ret = timer_arm(&x->timer, ms, x->timer_gen);
+        if (ret != 0) {
+            tu_unref(x, ret == 1 ? "update_timer: timer armed again" : "update_timer: timer not armed");
+        }
+    } else if (timer_cancel(&x->timer)) {
+        tu_unref(x, "update_timer: timer cancelled");
+    }
+}
+
+/*
+ * Count a TU in calls_setup while it hears ring back, which admission
+ * control limits (see admission.h).  Must be called with the TU mutex held.
+ */
+static void update_setup(TU *x) {
+    int setup = x->state == TU_RING_BACK;
+    if (setup != x->setup) {
+        x->setup = setup;
+        if (setup) {
+            STATS_INC(calls_setup);
+        } else {
+            STATS_DEC(calls_setup);
+        }
+    }
+}
+
+static int do_set_number(TU *tu, EXTNUM ext) {
+    if(tu == NULL || ext < 0){
         return -1;
     }
     pthread_mutex_lock(&tu->mutex);
+    set_unavailable(tu);
     tu->ext = ext;
+    tu->listed = 1;
+    update_availability(tu);
+    update_presence(tu);
     char temp[256];
-    snprintf(temp, sizeof(temp), "ON HOOK %d%s", tu->ext, EOL);
-    write(tu->fd, temp, strlen(temp));
+    snprintf(temp, sizeof(temp), "ON HOOK %" PRIext "%s", tu->ext, EOL);
+    tu_write(tu, temp, strlen(temp));
     pthread_mutex_unlock(&tu->mutex);
     return 0;
 }
@@ -102,14 +697,18 @@ static int notify_state(TU *x) {
         return -1;
     }
 
-    debug("notify_state: Notifying TU at extension %d of its state.", x->ext);
+    debug("notify_state: Notifying TU at extension %" PRIext " of its state.", x->ext);
+    update_availability(x);
+    update_presence(x);
+    update_timer(x);
+    update_setup(x);
 
     const char *msg = NULL;
     char temp[256];
 
     // determine msg based on state
     if (x->state == TU_ON_HOOK) {
-        snprintf(temp, sizeof(temp), "ON HOOK %d\r\n", x->ext);
+        snprintf(temp, sizeof(temp), "ON HOOK %" PRIext "\r\n", x->ext);
         msg = temp;
     } else if (x->state == TU_RINGING) {
         msg = "RINGING\r\n";
@@ -120,12 +719,14 @@ static int notify_state(TU *x) {
     } else if (x->state == TU_BUSY_SIGNAL) {
         msg = "BUSY SIGNAL\r\n";
     } else if (x->state == TU_CONNECTED) {
-        int e;
+        EXTNUM e;
         if (x->peer)
             e = x->peer->ext;
+        else if (x->room)
+            e = conf_number(x->room);
         else
             e = -1;
-        snprintf(temp, sizeof(temp), "CONNECTED %d\r\n", e);
+        snprintf(temp, sizeof(temp), "CONNECTED %" PRIext "\r\n", e);
         msg = temp;
     } else if (x->state == TU_ERROR) {
         msg = "ERROR\r\n";
@@ -134,36 +735,20 @@ static int notify_state(TU *x) {
     }
 
     if (!msg) {
-        debug("notify_state: No message determined for TU at extension %d.", x->ext);
+        debug("notify_state: No message determined for TU at extension %" PRIext ".", x->ext);
         return -1;
     }
 
-    // this is as robust as possible
-    size_t remaining = strlen(msg);
-    const char *ptr = msg;
-    while (remaining > 0) {
-        ssize_t written = write(x->fd, ptr, remaining);
-        if (written < 0) {
-            if (errno == EINTR) {
-                debug("notify_state: Write interrupted by signal, retrying.");
-                continue;
-            }
-            debug("notify_state: Error writing to FD %d for TU at ext %d (errno=%d).", x->fd, x->ext, errno);
-            return -1;
-        }
-        if (written == 0) {
-            debug("notify_state: Unexpected EOF on write to FD %d for TU at ext %d.", x->fd, x->ext);
-            return -1;
-        }
-        remaining -= written;
-        ptr += written;
+    if (tu_write(x, msg, strlen(msg)) < 0) {
+        debug("notify_state: Output discarded for TU at ext %" PRIext ".", x->ext);
+        return -1;
     }
 
-    debug("notify_state: Successfully notified TU at extension %d.", x->ext);
+    debug("notify_state: Successfully notified TU at extension %" PRIext ".", x->ext);
     return 0;
 }
 
-int tu_dial(TU *tu, TU *target) {
+static int do_dial(TU *tu, TU *target) {
     debug("tu_dial: Entered function.");
 
     // check input parameters
@@ -176,7 +761,9 @@ int tu_dial(TU *tu, TU *target) {
         // target is NULL and TU in DIAL_TONE
         debug("tu_dial: target is NULL and TU is DIAL_TONE, transitioning to ERROR.");
         pthread_mutex_lock(&tu->mutex);
-        tu->state = TU_ERROR;
+        if (tu->state == TU_DIAL_TONE) {
+            tu->state = TU_ERROR;
+        }
         int ret = notify_state(tu);
         pthread_mutex_unlock(&tu->mutex);
         if (ret < 0) {
@@ -212,6 +799,17 @@ int tu_dial(TU *tu, TU *target) {
     }
 
 
+    // only a TU with dial tone can dial
+    if (tu->state != TU_DIAL_TONE) {
+        debug("tu_dial: TU ext=%" PRIext " has no dial tone, no state change.", tu->ext);
+        if (notify_state(tu) < 0) {
+            debug("tu_dial: Failed to notify TU of its state.");
+        }
+        if (first_lock != second_lock) pthread_mutex_unlock(&second_lock->mutex);
+        pthread_mutex_unlock(&first_lock->mutex);
+        return 0;
+    }
+
     // check target state
     if (target->peer != NULL || target->state != TU_ON_HOOK) {
         debug("tu_dial: Target TU is not ON_HOOK or has a peer, switching caller to BUSY_SIGNAL.");
@@ -268,122 +866,723 @@ int tu_dial(TU *tu, TU *target) {
 }
 
 
-int tu_pickup(TU *tu) {
-    debug("tu_pickup: Entered function.");
-
-    if (tu == NULL) {
-        debug("tu_pickup: TU pointer is NULL!");
-        return -1;
+/*
+ * Lock TUs, all distinct, in order of address to avoid deadlock.  The array
+ * is sorted in place.
+ */
+static void lock_all(TU **locks, int n) {
+    for (int i = 1; i < n; i++) {
+        for (int j = i; j > 0 && locks[j] < locks[j - 1]; j--) {
+            TU *t = locks[j];
+            locks[j] = locks[j - 1];
+            locks[j - 1] = t;
+        }
     }
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_lock(&locks[i]->mutex);
+    }
+}
 
-    pthread_mutex_lock(&tu->mutex);
-    TU_STATE state = tu->state;
-    TU *peer = tu->peer;
-    debug("tu_pickup: TU ext=%d initial state=%d peer=%p", tu->ext, state, (void*)peer);
-
-    // handle states
-    switch (state) {
-        case TU_ON_HOOK:
-            // transition to DIAL_TONE
-            tu->state = TU_DIAL_TONE;
-            debug("tu_pickup: Transitioning TU ext=%d from ON_HOOK to DIAL_TONE.", tu->ext);
-            if (notify_state(tu) < 0) {
-                debug("tu_pickup: Failed to notify TU ext=%d of DIAL_TONE state.", tu->ext);
-            }
-            pthread_mutex_unlock(&tu->mutex);
-            return 0;
-
-        case TU_RINGING:
-            // unlock tu before locking both TU and peer
-            pthread_mutex_unlock(&tu->mutex);
-
-            // determine lock order to avoid deadlock
-            TU *first_lock;
-            TU *second_lock;
-
-            if (tu < peer) {
-                first_lock = tu;
-                second_lock = peer;
-            } else {
-                first_lock = peer;
-                second_lock = tu;
-            }
+static void unlock_all(TU **locks, int n) {
+    for (int i = n - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&locks[i]->mutex);
+    }
+}
 
-            pthread_mutex_lock(&first_lock->mutex);
-            if (first_lock != second_lock)
-                pthread_mutex_lock(&second_lock->mutex);
+/*
+ * Lock the peer of a TU whose mutex is held, respecting lock order.  The
+ * TU's mutex may have to be released meanwhile, so the caller must check
+ * afterward that the call has not changed.  A reference to the peer keeps
+ * it alive until unlock_peer().
+ */
+static void lock_peer(TU *tu, TU *peer) {
+    tu_ref(peer, "lock_peer: locking peer");
+    if (peer < tu) {
+        pthread_mutex_unlock(&tu->mutex);
+        pthread_mutex_lock(&peer->mutex);
+        pthread_mutex_lock(&tu->mutex);
+    } else {
+        pthread_mutex_lock(&peer->mutex);
+    }
+}
 
+static void unlock_peer(TU *tu, TU *peer) {
+    pthread_mutex_unlock(&peer->mutex);
+    pthread_mutex_unlock(&tu->mutex);
+    tu_unref(peer, "unlock_peer: done with peer");
+}
 
-            // both TUs are in the expected RINGING/RING_BACK states
-            debug("tu_pickup: Transitioning TU ext=%d and Peer ext=%d to CONNECTED state.", tu->ext, peer->ext);
-            tu->state = TU_CONNECTED;
-            peer->state = TU_CONNECTED;
+static int do_dial_group(TU *tu, TU **members, int n) {
+    if (tu == NULL || n < 0 || n > TU_MAX_RING) {
+        debug("tu_dial_group: Invalid arguments.");
+        return -1;
+    }
+    struct tu_hunt *h = malloc(sizeof(struct tu_hunt) + n * sizeof(TU *));
+    if (h == NULL) {
+        return -1;
+    }
+    h->queue = NULL;
+    h->n = 0;
+
+    TU *locks[TU_MAX_RING + 1];
+    int nlocks = 0;
+    locks[nlocks++] = tu;
+    for (int i = 0; i < n; i++) {
+        if (members[i] != tu) {
+            locks[nlocks++] = members[i];
+        }
+    }
+    lock_all(locks, nlocks);
 
-            // notify both TUs
-            if (notify_state(tu) < 0) {
-                debug("tu_pickup: Failed to notify TU ext=%d of CONNECTED state.", tu->ext);
+    if (tu->state != TU_DIAL_TONE) {
+        debug("tu_dial_group: TU ext=%" PRIext " has no dial tone, no state change.", tu->ext);
+        free(h);
+    } else {
+        // ring every member still free
+        for (int i = 0; i < n; i++) {
+            TU *m = members[i];
+            if (m == tu || m->peer != NULL || m->state != TU_ON_HOOK) {
+                continue;
             }
-            if (notify_state(peer) < 0) {
-                debug("tu_pickup: Failed to notify Peer ext=%d of CONNECTED state.", peer->ext);
+            m->state = TU_RINGING;
+            m->peer = tu;
+            m->hunt = h;
+            tu_ref(tu, "tu_dial_group: member gains peer");
+            tu_ref(m, "tu_dial_group: caller rings member");
+            h->members[h->n++] = m;
+            if (notify_state(m) < 0) {
+                debug("tu_dial_group: Failed to notify TU ext=%" PRIext " of RINGING state.", m->ext);
             }
+        }
+        if (h->n == 0) {
+            debug("tu_dial_group: No member free, switching caller to BUSY_SIGNAL.");
+            free(h);
+            tu->state = TU_BUSY_SIGNAL;
+        } else {
+            debug("tu_dial_group: TU ext=%" PRIext " rings %d TUs.", tu->ext, h->n);
+            tu->hunt = h;
+            tu->state = TU_RING_BACK;
+        }
+    }
+    if (notify_state(tu) < 0) {
+        debug("tu_dial_group: Failed to notify TU ext=%" PRIext ".", tu->ext);
+    }
 
-            if (first_lock != second_lock)
-                pthread_mutex_unlock(&second_lock->mutex);
-            pthread_mutex_unlock(&first_lock->mutex);
+    unlock_all(locks, nlocks);
+    return 0;
+}
 
+/*
+ * Lock the caller of a call ringing a group, and every TU it still rings.
+ * The caller must be referenced and no TU mutex held.  The TUs rung are
+ * referenced while they are locked, and recorded in locks (which must have
+ * room for TU_MAX_RING + 1 TUs) for hunt_unlock().
+ *
+ * @return  The number of TUs locked, or 0 (with none locked) if the caller
+ * is no longer ringing a group.
+ */
+static int hunt_lock(TU *caller, TU **locks) {
+    while (1) {
+        pthread_mutex_lock(&caller->mutex);
+        struct tu_hunt *h = caller->hunt;
+        if (h == NULL) {
+            pthread_mutex_unlock(&caller->mutex);
             return 0;
+        }
+        int n = h->n;
+        TU *members[TU_MAX_RING];
+        memcpy(members, h->members, n * sizeof(TU *));
+        for (int i = 0; i < n; i++) {
+            tu_ref(members[i], "hunt_lock: locking group member");
+        }
+        pthread_mutex_unlock(&caller->mutex);
 
-        default:
-            // all other states, just notify current state, no state change
-            debug("tu_pickup: TU ext=%d is in state=%d, no state change on pickup.", tu->ext, state);
-            if (notify_state(tu) < 0)
-                debug("tu_pickup: Failed to notify TU ext=%d in default state case.", tu->ext);
-            pthread_mutex_unlock(&tu->mutex);
-            return 0;
+        locks[0] = caller;
+        memcpy(&locks[1], members, n * sizeof(TU *));
+        lock_all(locks, n + 1);
+
+        // the members hold references, so they cannot have been reused
+        h = caller->hunt;
+        if (h != NULL && h->n == n && memcmp(h->members, members, n * sizeof(TU *)) == 0) {
+            return n + 1;
+        }
+        unlock_all(locks, n + 1);
+        for (int i = 0; i < n; i++) {
+            tu_unref(members[i], "hunt_lock: call changed, retrying");
+        }
     }
 }
 
+static void hunt_unlock(TU *caller, TU **locks, int n) {
+    unlock_all(locks, n);
+    for (int i = 0; i < n; i++) {
+        if (locks[i] != caller) {
+            tu_unref(locks[i], "hunt_unlock: done with group member");
+        }
+    }
+}
 
-int tu_hangup(TU *tu) {
-    debug("tu_hangup: Function start.");
-
-    if (tu == NULL) {
-        debug("tu_hangup: TU is NULL, cannot proceed.");
-        return -1;
+/*
+ * Stop ringing a member of a group.  Both it and the caller must be locked,
+ * and referenced otherwise than by the call.
+ */
+static void hunt_ring_off(TU *m, TU *caller) {
+    m->state = TU_ON_HOOK;
+    m->peer = NULL;
+    m->hunt = NULL;
+    tu_unref(caller, "hunt_ring_off: member loses peer");
+    tu_unref(m, "hunt_ring_off: caller stops ringing member");
+    if (notify_state(m) < 0) {
+        debug("hunt_ring_off: Failed to notify TU ext=%" PRIext " of ON_HOOK state.", m->ext);
     }
+}
 
-    TU_STATE state = tu->state;
-    TU *conn_peer = tu->peer;
-    debug("tu_hangup: TU ext=%d initial state=%d, peer=%p", tu->ext, state, (void*)conn_peer);
+/*
+ * Answer, from a member of a group, the call ringing it.  The caller must be
+ * referenced and no TU mutex held.
+ */
+static int hunt_answer(TU *tu, TU *caller) {
+    TU *locks[TU_MAX_RING + 1];
+    int n = hunt_lock(caller, locks);
+    struct tu_hunt *h = n > 0 ? caller->hunt : NULL;
+    int i = 0;
+    while (h != NULL && i < h->n && h->members[i] != tu) {
+        i++;
+    }
+    if (h == NULL || i == h->n) {
+        // answered by another member or abandoned meanwhile
+        if (n > 0) {
+            hunt_unlock(caller, locks, n);
+        }
+        pthread_mutex_lock(&tu->mutex);
+        debug("tu_pickup: Call ringing TU ext=%" PRIext " ended before it could be answered.", tu->ext);
+        if (notify_state(tu) < 0) {
+            debug("tu_pickup: Failed to notify TU ext=%" PRIext ".", tu->ext);
+        }
+        pthread_mutex_unlock(&tu->mutex);
+        return 0;
+    }
 
-    switch (state) {
-        case TU_CONNECTED:
-        case TU_RINGING:
-        case TU_RING_BACK: {
+    debug("tu_pickup: TU ext=%" PRIext " answers group call from ext=%" PRIext ".", tu->ext, caller->ext);
+    for (int j = 0; j < h->n; j++) {
+        if (h->members[j] != tu) {
+            hunt_ring_off(h->members[j], caller);
+        }
+    }
+    caller->hunt = NULL;
+    tu->hunt = NULL;
+    free(h);
+
+    // the references between the caller and the member answering remain
+    caller->peer = tu;
+    tu->state = TU_CONNECTED;
+    caller->state = TU_CONNECTED;
+    if (notify_state(tu) < 0) {
+        debug("tu_pickup: Failed to notify TU ext=%" PRIext " of CONNECTED state.", tu->ext);
+    }
+    if (notify_state(caller) < 0) {
+        debug("tu_pickup: Failed to notify caller ext=%" PRIext " of CONNECTED state.", caller->ext);
+    }
 
-            debug("tu_hangup: Handling hangup with peer ext=%d in state=%d.", conn_peer->ext, state);
+    hunt_unlock(caller, locks, n);
+    return 0;
+}
 
-            TU *first_lock;
-            TU *second_lock;
-            if (tu < conn_peer) {
-                first_lock = tu;
-                second_lock = conn_peer;
-            } else {
-                first_lock = conn_peer;
-                second_lock = tu;
+/*
+ * Hang up a call ringing a group, from the caller, which must be referenced.
+ * No TU mutex may be held.
+ *
+ * @return 0 if successful, 1 if the call was no longer ringing.
+ */
+static int hunt_abandon(TU *caller) {
+    TU *locks[TU_MAX_RING + 1];
+    int n = hunt_lock(caller, locks);
+    if (n == 0) {
+        return 1;
+    }
+    struct tu_hunt *h = caller->hunt;
+    debug("tu_hangup: TU ext=%" PRIext " abandons call ringing %d TUs.", caller->ext, h->n);
+    for (int i = 0; i < h->n; i++) {
+        hunt_ring_off(h->members[i], caller);
+    }
+    // still waiting in a queue, rather than offered to an agent
+    const void *token = h->n == 0 ? h->queue : NULL;
+    caller->hunt = NULL;
+    free(h);
+
+    caller->state = TU_ON_HOOK;
+    if (notify_state(caller) < 0) {
+        debug("tu_hangup: Failed to notify TU ext=%" PRIext " of ON_HOOK state.", caller->ext);
+    }
+
+    hunt_unlock(caller, locks, n);
+    if (token != NULL && abandon_hook != NULL) {
+        abandon_hook(caller, token);
+    }
+    return 0;
+}
+
+/*
+ * Hang up, from a member of a group, the call ringing it.  The TU mutex
+ * must be held, and is released.  The caller gets dial tone back once no
+ * member is left ringing.
+ *
+ * @return 0 if successful, 1 if the call changed meanwhile.
+ */
+static int hunt_leave(TU *tu) {
+    TU *caller = tu->peer;
+    lock_peer(tu, caller);
+
+    struct tu_hunt *h = tu->hunt;
+    if (tu->state != TU_RINGING || tu->peer != caller || h == NULL || caller->hunt != h) {
+        unlock_peer(tu, caller);
+        return 1;
+    }
+    int i = 0;
+    while (h->members[i] != tu) {
+        i++;
+    }
+    memmove(&h->members[i], &h->members[i + 1], (h->n - i - 1) * sizeof(TU *));
+    h->n--;
+    debug("tu_hangup: TU ext=%" PRIext " stops ringing, %d TUs left.", tu->ext, h->n);
+    hunt_ring_off(tu, caller);
+
+    if (h->n == 0) {
+        caller->hunt = NULL;
+        free(h);
+        caller->state = TU_DIAL_TONE;
+        if (notify_state(caller) < 0) {
+            debug("tu_hangup: Failed to notify caller ext=%" PRIext " of DIAL_TONE state.", caller->ext);
+        }
+    }
+
+    unlock_peer(tu, caller);
+    return 0;
+}
+
+/*
+ * Check whether a TU is waiting in a queue with a given token.  Must be
+ * called with the TU mutex held.
+ */
+static int queue_waiting(TU *tu, const void *token) {
+    return tu->state == TU_RING_BACK && tu->hunt != NULL && tu->hunt->queue == token &&
+           tu->hunt->n == 0;
+}
+
+static int do_queue(TU *tu, const void *token) {
+    if (tu == NULL || token == NULL) {
+        debug("tu_queue: Invalid arguments.");
+        return -1;
+    }
+    // room for the agent the call is offered to
+    struct tu_hunt *h = malloc(sizeof(struct tu_hunt) + sizeof(TU *));
+    if (h == NULL) {
+        return -1;
+    }
+    h->queue = token;
+    h->n = 0;
+
+    pthread_mutex_lock(&tu->mutex);
+    int ret = 0;
+    if (tu->state == TU_DIAL_TONE) {
+        debug("tu_queue: TU ext=%" PRIext " waits for an agent.", tu->ext);
+        tu->hunt = h;
+        tu->state = TU_RING_BACK;
+    } else {
+        debug("tu_queue: TU ext=%" PRIext " has no dial tone, no state change.", tu->ext);
+        free(h);
+        ret = -1;
+    }
+    if (notify_state(tu) < 0) {
+        debug("tu_queue: Failed to notify TU ext=%" PRIext ".", tu->ext);
+    }
+    pthread_mutex_unlock(&tu->mutex);
+    return ret;
+}
+
+static int do_queue_update(TU *tu, const void *token, int position) {
+    pthread_mutex_lock(&tu->mutex);
+    int ret = -1;
+    if (queue_waiting(tu, token)) {
+        char temp[32];
+        snprintf(temp, sizeof(temp), "QUEUED %d%s", position, EOL);
+        tu_write(tu, temp, strlen(temp));
+        ret = 0;
+    }
+    pthread_mutex_unlock(&tu->mutex);
+    return ret;
+}
+
+static int do_queue_connect(TU *tu, const void *token, TU *agent) {
+    TU *locks[2] = { tu, agent };
+    int nlocks = agent != tu ? 2 : 1;
+    lock_all(locks, nlocks);
+
+    int ret;
+    if (!queue_waiting(tu, token)) {
+        ret = -1;
+    } else if (agent == tu || agent->state != TU_ON_HOOK || agent->peer != NULL) {
+        ret = 1;
+    } else {
+        debug("tu_queue_connect: TU ext=%" PRIext " is offered to agent ext=%" PRIext ".", tu->ext, agent->ext);
+        struct tu_hunt *h = tu->hunt;
+        agent->state = TU_RINGING;
+        agent->peer = tu;
+        agent->hunt = h;
+        tu_ref(tu, "tu_queue_connect: agent gains peer");
+        tu_ref(agent, "tu_queue_connect: caller rings agent");
+        h->members[h->n++] = agent;
+        if (notify_state(agent) < 0) {
+            debug("tu_queue_connect: Failed to notify TU ext=%" PRIext " of RINGING state.", agent->ext);
+        }
+        ret = 0;
+    }
+
+    unlock_all(locks, nlocks);
+    return ret;
+}
+
+static void do_queue_cancel(TU *tu, const void *token) {
+    pthread_mutex_lock(&tu->mutex);
+    if (queue_waiting(tu, token)) {
+        debug("tu_queue_cancel: TU ext=%" PRIext " stops waiting, switching to BUSY_SIGNAL.", tu->ext);
+        free(tu->hunt);
+        tu->hunt = NULL;
+        tu->state = TU_BUSY_SIGNAL;
+        if (notify_state(tu) < 0) {
+            debug("tu_queue_cancel: Failed to notify TU ext=%" PRIext ".", tu->ext);
+        }
+    }
+    pthread_mutex_unlock(&tu->mutex);
+}
+
+/*
+ * Remove the i-th TU camped on a target, which must be locked.
+ */
+static void camp_remove(TU *target, int i) {
+    memmove(&target->camp[i], &target->camp[i + 1], (target->ncamp - i - 1) * sizeof(TU *));
+    target->ncamp--;
+    STATS_DEC(camp_waiting);
+}
+
+/*
+ * Find a TU among those camped on a target, which must be locked.
+ *
+ * @return  Its index, or -1 if it is not camped on the target.
+ */
+static int camp_index(TU *target, TU *tu) {
+    for (int i = 0; i < target->ncamp; i++) {
+        if (target->camp[i] == tu) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Put a TU that dials or camps in a call with a target on hook.  Both must
+ * be locked.
+ */
+static void camp_connect(TU *tu, TU *target) {
+    tu->peer = target;
+    target->peer = tu;
+    tu->state = TU_RING_BACK;
+    target->state = TU_RINGING;
+    if (notify_state(tu) < 0) {
+        debug("tu_camp: Failed to notify TU ext=%" PRIext " of RING_BACK state.", tu->ext);
+    }
+    if (notify_state(target) < 0) {
+        debug("tu_camp: Failed to notify TU ext=%" PRIext " of RINGING state.", target->ext);
+    }
+}
+
+static int do_camp(TU *tu, TU *target) {
+    if (tu == NULL) {
+        return -1;
+    }
+    if (target == NULL || target == tu) {
+        // as if dialed
+        return do_dial(tu, target);
+    }
+
+    TU *locks[2] = { tu, target };
+    lock_all(locks, 2);
+
+    int ret = 0;
+    if ((tu->state != TU_DIAL_TONE && tu->state != TU_BUSY_SIGNAL) || tu->camped != NULL) {
+        debug("tu_camp: TU ext=%" PRIext " cannot camp, no state change.", tu->ext);
+        if (notify_state(tu) < 0) {
+            debug("tu_camp: Failed to notify TU ext=%" PRIext ".", tu->ext);
+        }
+    } else if (target->listed && target->state == TU_ON_HOOK && target->peer == NULL &&
+               target->ncamp == 0) {
+        debug("tu_camp: TU ext=%" PRIext " is free, ringing it.", target->ext);
+        tu_ref(tu, "tu_camp: originator gains peer");
+        tu_ref(target, "tu_camp: target gains peer");
+        camp_connect(tu, target);
+    } else if (!target->listed || target->ncamp == TU_MAX_CAMP) {
+        debug("tu_camp: Cannot camp on TU ext=%" PRIext ", switching to BUSY_SIGNAL.", target->ext);
+        STATS_INC(camp_rejected);
+        tu->state = TU_BUSY_SIGNAL;
+        if (notify_state(tu) < 0) {
+            debug("tu_camp: Failed to notify TU ext=%" PRIext ".", tu->ext);
+        }
+        ret = -1;
+    } else {
+        debug("tu_camp: TU ext=%" PRIext " camps on TU ext=%" PRIext ".", tu->ext, target->ext);
+        target->camp[target->ncamp++] = tu;
+        tu->camped = target;
+        tu_ref(tu, "tu_camp: camped on target");
+        tu_ref(target, "tu_camp: target gains waiter");
+        STATS_INC(camp_waiting);
+        tu->state = TU_BUSY_SIGNAL;
+        if (notify_state(tu) < 0) {
+            debug("tu_camp: Failed to notify TU ext=%" PRIext ".", tu->ext);
+        }
+        char temp[64];
+        snprintf(temp, sizeof(temp), "CAMPED %" PRIext "%s", target->ext, EOL);
+        tu_write(tu, temp, strlen(temp));
+    }
+
+    unlock_all(locks, 2);
+    return ret;
+}
+
+/*
+ * Ring back the first TU camped on a target that has gone on hook.  The
+ * target must be referenced (the reference is released) and no TU mutex
+ * held.
+ */
+static void camp_serve(TU *target) {
+    pthread_mutex_lock(&target->mutex);
+    target->camp_due = 0;
+    while (target->listed && target->state == TU_ON_HOOK && target->ncamp > 0) {
+        TU *tu = target->camp[0];
+        tu_ref(tu, "camp_serve: locking TU camped");
+        pthread_mutex_unlock(&target->mutex);
+
+        TU *locks[2] = { tu, target };
+        lock_all(locks, 2);
+        if (target->listed && target->state == TU_ON_HOOK && target->peer == NULL &&
+            target->ncamp > 0 && target->camp[0] == tu) {
+            debug("tu_camp: TU ext=%" PRIext " is free, ringing back TU ext=%" PRIext ".",
+                  target->ext, tu->ext);
+            camp_remove(target, 0);
+            tu->camped = NULL;
+            STATS_INC(camp_completed);
+            // the references held while camped are now those of the call
+            camp_connect(tu, target);
+        }
+        unlock_all(locks, 2);
+        tu_unref(tu, "camp_serve: done with TU camped");
+        pthread_mutex_lock(&target->mutex);
+    }
+    pthread_mutex_unlock(&target->mutex);
+    tu_unref(target, "camp_serve: done serving TUs camped");
+}
+
+/*
+ * Stop a TU waiting for the target it is camped on.  No TU mutex may be
+ * held.
+ */
+static void camp_leave(TU *tu) {
+    pthread_mutex_lock(&tu->mutex);
+    TU *target = tu->camped;
+    if (target == NULL) {
+        pthread_mutex_unlock(&tu->mutex);
+        return;
+    }
+    tu_ref(target, "camp_leave: locking target");
+    pthread_mutex_unlock(&tu->mutex);
+
+    TU *locks[2] = { tu, target };
+    lock_all(locks, 2);
+    if (tu->camped == target) {
+        debug("tu_hangup: TU ext=%" PRIext " stops camping on TU ext=%" PRIext ".", tu->ext, target->ext);
+        camp_remove(target, camp_index(target, tu));
+        tu->camped = NULL;
+        tu_unref(tu, "camp_leave: no longer camped on target");
+        tu_unref(target, "camp_leave: target loses waiter");
+    }
+    unlock_all(locks, 2);
+    tu_unref(target, "camp_leave: done with target");
+}
+
+/*
+ * Release every TU camped on a target that is being unregistered, and so
+ * cannot be camped on any more.  No TU mutex may be held.
+ */
+static void camp_release(TU *target) {
+    pthread_mutex_lock(&target->mutex);
+    while (target->ncamp > 0) {
+        TU *tu = target->camp[target->ncamp - 1];
+        tu_ref(tu, "camp_release: locking TU camped");
+        pthread_mutex_unlock(&target->mutex);
+
+        TU *locks[2] = { tu, target };
+        lock_all(locks, 2);
+        int i = camp_index(target, tu);
+        if (i >= 0) {
+            debug("tu_withdraw: TU ext=%" PRIext " no longer camped on TU ext=%" PRIext ".", tu->ext, target->ext);
+            camp_remove(target, i);
+            tu->camped = NULL;
+            tu_unref(tu, "camp_release: no longer camped on target");
+            tu_unref(target, "camp_release: target loses waiter");
+            if (notify_state(tu) < 0) {
+                debug("tu_withdraw: Failed to notify TU ext=%" PRIext ".", tu->ext);
             }
+        }
+        unlock_all(locks, 2);
+        tu_unref(tu, "camp_release: done with TU camped");
+        pthread_mutex_lock(&target->mutex);
+    }
+    pthread_mutex_unlock(&target->mutex);
+}
+
+static int do_pickup(TU *tu) {
+    debug("tu_pickup: Entered function.");
+
+    if (tu == NULL) {
+        debug("tu_pickup: TU pointer is NULL!");
+        return -1;
+    }
+
+    pthread_mutex_lock(&tu->mutex);
+    TU_STATE state = tu->state;
+    TU *peer = tu->peer;
+    debug("tu_pickup: TU ext=%" PRIext " initial state=%d peer=%p", tu->ext, state, (void*)peer);
+
+    // handle states
+    switch (state) {
+        case TU_ON_HOOK:
+            // transition to DIAL_TONE
+            tu->state = TU_DIAL_TONE;
+            debug("tu_pickup: Transitioning TU ext=%" PRIext " from ON_HOOK to DIAL_TONE.", tu->ext);
+            if (notify_state(tu) < 0) {
+                debug("tu_pickup: Failed to notify TU ext=%" PRIext " of DIAL_TONE state.", tu->ext);
+            }
+            pthread_mutex_unlock(&tu->mutex);
+            return 0;
+
+        case TU_RINGING:
+            if (tu->hunt != NULL) {
+                // one of the TUs rung by a group call: the others stop ringing
+                tu_ref(peer, "tu_pickup: answering group call");
+                pthread_mutex_unlock(&tu->mutex);
+                int ret = hunt_answer(tu, peer);
+                tu_unref(peer, "tu_pickup: done with group caller");
+                return ret;
+            }
+
+            // lock the peer too, and make sure the call is still ringing
+            lock_peer(tu, peer);
+            if (tu->state != TU_RINGING || tu->peer != peer || tu->hunt != NULL) {
+                unlock_peer(tu, peer);
+                return do_pickup(tu);
+            }
+
+            // both TUs are in the expected RINGING/RING_BACK states
+            debug("tu_pickup: Transitioning TU ext=%" PRIext " and Peer ext=%" PRIext " to CONNECTED state.", tu->ext, peer->ext);
+            tu->state = TU_CONNECTED;
+            peer->state = TU_CONNECTED;
+
+            // notify both TUs
+            if (notify_state(tu) < 0) {
+                debug("tu_pickup: Failed to notify TU ext=%" PRIext " of CONNECTED state.", tu->ext);
+            }
+            if (notify_state(peer) < 0) {
+                debug("tu_pickup: Failed to notify Peer ext=%" PRIext " of CONNECTED state.", peer->ext);
+            }
+
+            unlock_peer(tu, peer);
+            return 0;
+
+        default:
+            // all other states, just notify current state, no state change
+            debug("tu_pickup: TU ext=%" PRIext " is in state=%d, no state change on pickup.", tu->ext, state);
+            if (notify_state(tu) < 0)
+                debug("tu_pickup: Failed to notify TU ext=%" PRIext " in default state case.", tu->ext);
+            pthread_mutex_unlock(&tu->mutex);
+            return 0;
+    }
+}
+
+
+/*
+ * Hang up a TU.
+ *
+ * @param gen  If not NULL, the TU is hung up because it has been left too
+ * long in a state with a timeout, and only if it is still in that state:
+ * *gen is the value of its timer_gen when the timer was armed.
+ */
+static int do_hangup(TU *tu, const unsigned long *gen) {
+    debug("tu_hangup: Function start.");
+
+    if (tu == NULL) {
+        debug("tu_hangup: TU is NULL, cannot proceed.");
+        return -1;
+    }
+
+    pthread_mutex_lock(&tu->mutex);
+    if (gen != NULL && tu->timer_gen != *gen) {
+        debug("tu_hangup: TU ext=%" PRIext " has left the state that timed out.", tu->ext);
+        pthread_mutex_unlock(&tu->mutex);
+        return 0;
+    }
+    TU_STATE state = tu->state;
+    TU *conn_peer = tu->peer;
+    debug("tu_hangup: TU ext=%" PRIext " initial state=%d, peer=%p", tu->ext, state, (void*)conn_peer);
+
+    // camped on a TU, while its busy signal lasts
+    if (tu->camped != NULL) {
+        pthread_mutex_unlock(&tu->mutex);
+        camp_leave(tu);
+        return do_hangup(tu, gen);
+    }
+
+    // in a conference: leave it, which concerns no other TU
+    if (tu->room != NULL) {
+        CONF_ROOM *room = tu->room;
+        conf_exit(room, tu);
+        tu->room = NULL;
+        tu->state = TU_ON_HOOK;
+        if (notify_state(tu) < 0) {
+            debug("tu_hangup: notify_state failed for TU ext=%" PRIext " leaving conference.", tu->ext);
+        }
+        pthread_mutex_unlock(&tu->mutex);
+        conf_retire(NULL, tu);
+        conf_release(room);
+        return 0;
+    }
 
-            pthread_mutex_lock(&first_lock->mutex);
-            if (first_lock != second_lock) {
-                pthread_mutex_lock(&second_lock->mutex);
+    // calls ringing a group, from either end
+    if (state == TU_RING_BACK && tu->hunt != NULL) {
+        pthread_mutex_unlock(&tu->mutex);
+        return hunt_abandon(tu) == 0 ? 0 : do_hangup(tu, gen);
+    }
+    if (state == TU_RINGING && tu->hunt != NULL) {
+        return hunt_leave(tu) == 0 ? 0 : do_hangup(tu, gen);
+    }
+
+    switch (state) {
+        case TU_CONNECTED:
+        case TU_RINGING:
+        case TU_RING_BACK: {
+
+            debug("tu_hangup: Handling hangup with peer ext=%" PRIext " in state=%d.", conn_peer->ext, state);
+
+            // lock the peer too; if the call changed meanwhile, start over
+            lock_peer(tu, conn_peer);
+            if (tu->state != state || tu->peer != conn_peer || tu->hunt != NULL) {
+                unlock_peer(tu, conn_peer);
+                return do_hangup(tu, gen);
             }
 
-            TU_STATE recheck_state = tu->state;
-            debug("tu_hangup: After locking, TU ext=%d state=%d, peer ext=%d state=%d",
-                  tu->ext, recheck_state, conn_peer->ext, conn_peer->state);
+            debug("tu_hangup: After locking, TU ext=%" PRIext " state=%d, peer ext=%" PRIext " state=%d",
+                  tu->ext, state, conn_peer->ext, conn_peer->state);
 
-            if (recheck_state == TU_RING_BACK) {
-                debug("tu_hangup: TU ext=%d and peer ext=%d: both going ON_HOOK.", tu->ext, conn_peer->ext);
+            if (state == TU_RING_BACK) {
+                debug("tu_hangup: TU ext=%" PRIext " and peer ext=%" PRIext ": both going ON_HOOK.", tu->ext, conn_peer->ext);
 
                 tu->state = TU_ON_HOOK;
                 tu->peer = NULL;
@@ -395,20 +1594,16 @@ int tu_hangup(TU *tu) {
 
                 int ret_tu_notify = notify_state(tu);
                 if (ret_tu_notify < 0) {
-                    debug("tu_hangup: notify_state failed for TU ext=%d after ON_HOOK (ringback).", tu->ext);
+                    debug("tu_hangup: notify_state failed for TU ext=%" PRIext " after ON_HOOK (ringback).", tu->ext);
                 }
 
                 int ret_peer_notify = notify_state(conn_peer);
                 if (ret_peer_notify < 0) {
-                    debug("tu_hangup: notify_state failed for peer ext=%d after ON_HOOK (ringback).", conn_peer->ext);
+                    debug("tu_hangup: notify_state failed for peer ext=%" PRIext " after ON_HOOK (ringback).", conn_peer->ext);
                 }
+            } else {
+                debug("tu_hangup: TU ext=%" PRIext " and peer ext=%" PRIext ": transitioning to ON_HOOK and DIAL_TONE.", tu->ext, conn_peer->ext);
 
-                if (first_lock != second_lock) pthread_mutex_unlock(&second_lock->mutex);
-                pthread_mutex_unlock(&first_lock->mutex);
-                return 0;
-            } else if (recheck_state == TU_RINGING || recheck_state == TU_CONNECTED) {
-                debug("tu_hangup: TU ext=%d and peer ext=%d: transitioning to ON_HOOK and DIAL_TONE.", tu->ext, conn_peer->ext);
-                
                 tu->state = TU_ON_HOOK;
                 tu->peer = NULL;
                 conn_peer->state = TU_DIAL_TONE;
@@ -419,52 +1614,37 @@ int tu_hangup(TU *tu) {
 
                 int ret_tu_notify = notify_state(tu);
                 if (ret_tu_notify < 0) {
-                    debug("tu_hangup: notify_state failed for TU ext=%d after ON_HOOK set.", tu->ext);
+                    debug("tu_hangup: notify_state failed for TU ext=%" PRIext " after ON_HOOK set.", tu->ext);
                 }
 
                 int ret_peer_notify = notify_state(conn_peer);
                 if (ret_peer_notify < 0) {
-                    debug("tu_hangup: notify_state failed for peer ext=%d after DIAL_TONE set.", conn_peer->ext);
-                }
-
-                if (first_lock != second_lock) pthread_mutex_unlock(&second_lock->mutex);
-                pthread_mutex_unlock(&first_lock->mutex);
-                return 0;
-            }
-
-            debug("tu_hangup: None of the expected states matched after re-check for TU ext=%d.", tu->ext);
-            {
-                int ret_notify_fallback = notify_state(tu);
-                if (ret_notify_fallback < 0) {
-                    debug("tu_hangup: notify_state failed in fallback scenario for TU ext=%d.", tu->ext);
+                    debug("tu_hangup: notify_state failed for peer ext=%" PRIext " after DIAL_TONE set.", conn_peer->ext);
                 }
             }
 
-            if (first_lock != second_lock) pthread_mutex_unlock(&second_lock->mutex);
-            pthread_mutex_unlock(&first_lock->mutex);
-            return -1;
+            unlock_peer(tu, conn_peer);
+            return 0;
         }
 
         case TU_DIAL_TONE:
         case TU_BUSY_SIGNAL:
         case TU_ERROR: {
-            debug("tu_hangup: TU ext=%d in simple state=%d, transitioning to ON_HOOK.", tu->ext, state);
-            pthread_mutex_lock(&tu->mutex);
+            debug("tu_hangup: TU ext=%" PRIext " in simple state=%d, transitioning to ON_HOOK.", tu->ext, state);
             tu->state = TU_ON_HOOK;
             int ret_notify = notify_state(tu);
             if (ret_notify < 0) {
-                debug("tu_hangup: notify_state failed after ON_HOOK set in simple states for ext=%d.", tu->ext);
+                debug("tu_hangup: notify_state failed after ON_HOOK set in simple states for ext=%" PRIext ".", tu->ext);
             }
             pthread_mutex_unlock(&tu->mutex);
             return 0;
         }
 
         default: {
-            debug("tu_hangup: TU ext=%d in unhandled state=%d, just notify current state.", tu->ext, state);
-            pthread_mutex_lock(&tu->mutex);
+            debug("tu_hangup: TU ext=%" PRIext " in unhandled state=%d, just notify current state.", tu->ext, state);
             int ret_notify = notify_state(tu);
             if (ret_notify < 0) {
-                debug("tu_hangup: notify_state failed in default state scenario for TU ext=%d.", tu->ext);
+                debug("tu_hangup: notify_state failed in default state scenario for TU ext=%" PRIext ".", tu->ext);
             }
             pthread_mutex_unlock(&tu->mutex);
             return 0;
@@ -473,13 +1653,7 @@ int tu_hangup(TU *tu) {
 }
 
 
-
-
-
-
-
-
-int tu_chat(TU *tu, char *msg) {
+static int do_chat(TU *tu, char *msg) {
     if (tu == NULL) {
         debug("tu_chat: TU is NULL.");
         return -1;
@@ -489,8 +1663,33 @@ int tu_chat(TU *tu, char *msg) {
     pthread_mutex_lock(&tu->mutex);
     TU *conn_peer = tu->peer;
 
+    if (tu->room != NULL) {
+        // in a conference: the message goes to the other members without
+        // any of their mutexes, and the room is kept while it is sent
+        CONF_ROOM *room = tu->room;
+        conf_hold(room);
+        if (notify_state(tu) < 0) {
+            debug("tu_chat: Failed to notify TU ext=%" PRIext " after chat.", tu->ext);
+        }
+        pthread_mutex_unlock(&tu->mutex);
+        int ret = conf_chat(room, tu, msg);
+        conf_release(room);
+        return ret;
+    }
 
-    // TU is connected. we need to lock the peer as well for safe I/O
+    if (tu->state != TU_CONNECTED || conn_peer == NULL) {
+        // not connected: nothing is sent, the TU is just told its state
+        debug("tu_chat: TU ext=%" PRIext " is not connected, chat not sent.", tu->ext);
+        if (notify_state(tu) < 0) {
+            debug("tu_chat: Failed to notify TU ext=%" PRIext " of its state.", tu->ext);
+        }
+        pthread_mutex_unlock(&tu->mutex);
+        return -1;
+    }
+
+    // TU is connected. we need to lock the peer as well.  keep the peer
+    // alive while our own lock may have to be dropped to respect lock order.
+    tu_ref(conn_peer, "tu_chat: locking peer");
     TU *first_lock;
     TU *second_lock;
 
@@ -502,69 +1701,367 @@ int tu_chat(TU *tu, char *msg) {
         second_lock = tu;
     }
 
-
-
     if (first_lock == tu) {
-        if (second_lock != first_lock) {
-            pthread_mutex_lock(&second_lock->mutex);
-        }
+        pthread_mutex_lock(&second_lock->mutex);
     } else {
         // first_lock must be peer
         pthread_mutex_unlock(&tu->mutex);
         pthread_mutex_lock(&first_lock->mutex);
-        if (first_lock != second_lock) {
-            pthread_mutex_lock(&second_lock->mutex);
+        pthread_mutex_lock(&second_lock->mutex);
+    }
+
+    // now we hold both locks. make sure the call was not torn down meanwhile
+    int ret = 0;
+    if (tu->peer != conn_peer || tu->state != TU_CONNECTED) {
+        debug("tu_chat: Call of TU ext=%" PRIext " ended before chat could be sent.", tu->ext);
+        ret = -1;
+    } else {
+        // sized from the message, as a line may be as long as "-l" allows
+        size_t len = strlen("CHAT ") + strlen(msg) + strlen(EOL);
+        char *temp = malloc(len + 1);
+        if (temp == NULL) {
+            debug("tu_chat: No memory for chat to peer ext=%" PRIext ".", conn_peer->ext);
+            ret = -1;
+        } else {
+            snprintf(temp, len + 1, "CHAT %s%s", msg, EOL);
+            if (tu_write(conn_peer, temp, len) < 0) {
+                debug("tu_chat: Chat to peer ext=%" PRIext " discarded.", conn_peer->ext);
+                ret = -1;
+            }
+            free(temp);
         }
     }
 
-    // now we hold both locks. tu and peer
-    char temp[1024];
-    snprintf(temp, sizeof(temp), "CHAT %s\r\n", msg);
+    // notify the calling TU of its state
+    if (notify_state(tu) < 0) {
+        debug("tu_chat: Failed to notify TU ext=%" PRIext " after chat.", tu->ext);
+    }
+
+    pthread_mutex_unlock(&second_lock->mutex);
+    pthread_mutex_unlock(&first_lock->mutex);
+    tu_unref(conn_peer, "tu_chat: done with peer");
 
-    size_t remaining = strlen(temp);
-    const char *ptr = temp;
-    while (remaining > 0) {
-        ssize_t written = write(conn_peer->fd, ptr, remaining);
-        if (written < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
-            debug("tu_chat: Error writing to peer ext=%d fd=%d (errno=%d).", conn_peer->ext, conn_peer->fd, errno);
-            // notify TU of its own state before returning
-            if (notify_state(tu) < 0) {
-                debug("tu_chat: Failed to notify TU ext=%d after chat write error.", tu->ext);
-            }
+    return ret;
+}
+
+static int do_pickup_call(TU *tu, TU *target) {
+    if (tu == NULL || target == NULL) {
+        debug("tu_pickup_call: TU or target is NULL.");
+        return -1;
+    }
 
-            if (first_lock != second_lock) pthread_mutex_unlock(&second_lock->mutex);
-            pthread_mutex_unlock(&first_lock->mutex);
-            return -1;
+    // find the caller ringing the target, and keep it alive while the
+    // target's lock is dropped to respect lock order
+    TU *caller = NULL;
+    if (target != tu) {
+        pthread_mutex_lock(&target->mutex);
+        if (target->state == TU_RINGING && target->peer != tu) {
+            caller = target->peer;
+            tu_ref(caller, "tu_pickup_call: locking caller");
         }
-        if (written == 0) {
-            debug("tu_chat: Unexpected EOF on write to peer ext=%d fd=%d.", conn_peer->ext, conn_peer->fd);
-            // notify TU of its own state before returning
-            if (notify_state(tu) < 0) {
-                debug("tu_chat: Failed to notify TU ext=%d after EOF on write.", tu->ext);
-            }
+        pthread_mutex_unlock(&target->mutex);
+    }
 
-            if (first_lock != second_lock) pthread_mutex_unlock(&second_lock->mutex);
-            pthread_mutex_unlock(&first_lock->mutex);
-            return -1;
+    if (caller == NULL) {
+        debug("tu_pickup_call: No call ringing at TU ext=%" PRIext ".", target->ext);
+        pthread_mutex_lock(&tu->mutex);
+        if (tu->state == TU_DIAL_TONE) {
+            tu->state = TU_ERROR;
+        }
+        if (notify_state(tu) < 0) {
+            debug("tu_pickup_call: Failed to notify TU ext=%" PRIext ".", tu->ext);
         }
-        remaining -= written;
-        ptr += written;
+        pthread_mutex_unlock(&tu->mutex);
+        return -1;
     }
 
-    // chat message successfully sent to the peer.
-    // notify the calling TU of its state
+    TU *locks[3] = { tu, target, caller };
+    lock_all(locks, 3);
+
+    // make sure nothing changed while no lock was held
+    int ret = 0;
+    if (tu->state == TU_DIAL_TONE && target->state == TU_RINGING && target->peer == caller &&
+        caller->state == TU_RING_BACK && caller->peer == target) {
+        debug("tu_pickup_call: TU ext=%" PRIext " answers call from ext=%" PRIext " ringing at ext=%" PRIext ".",
+              tu->ext, caller->ext, target->ext);
+        caller->peer = tu;
+        tu->peer = caller;
+        target->peer = NULL;
+        tu_ref(tu, "tu_pickup_call: answering TU gains peer");
+        tu_unref(target, "tu_pickup_call: ringing TU loses peer");
+
+        tu->state = TU_CONNECTED;
+        caller->state = TU_CONNECTED;
+        target->state = TU_ON_HOOK;
+
+        if (notify_state(tu) < 0) {
+            debug("tu_pickup_call: Failed to notify TU ext=%" PRIext " of CONNECTED state.", tu->ext);
+        }
+        if (notify_state(caller) < 0) {
+            debug("tu_pickup_call: Failed to notify caller ext=%" PRIext " of CONNECTED state.", caller->ext);
+        }
+        if (notify_state(target) < 0) {
+            debug("tu_pickup_call: Failed to notify TU ext=%" PRIext " of ON_HOOK state.", target->ext);
+        }
+    } else {
+        debug("tu_pickup_call: Call ringing at TU ext=%" PRIext " ended before it could be answered.", target->ext);
+        if (tu->state == TU_DIAL_TONE) {
+            tu->state = TU_ERROR;
+        }
+        if (notify_state(tu) < 0) {
+            debug("tu_pickup_call: Failed to notify TU ext=%" PRIext ".", tu->ext);
+        }
+        ret = -1;
+    }
+
+    unlock_all(locks, 3);
+    tu_unref(caller, "tu_pickup_call: done with caller");
+
+    return ret;
+}
+
+static int do_renumber(TU *tu, EXTNUM ext) {
+    if (tu == NULL || ext < 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&tu->mutex);
+    int ret = 0;
+    if (tu->state == TU_ON_HOOK) {
+        set_unavailable(tu);  // under the old number; notify_state() reports the new
+        presence_changed(tu->ext, PRESENCE_NONE);
+        tu->ext = ext;
+    } else {
+        debug("tu_renumber: TU ext=%" PRIext " is not on hook, extension not changed.", tu->ext);
+        ret = -1;
+    }
     if (notify_state(tu) < 0) {
-        debug("tu_chat: Failed to notify TU ext=%d after successful chat.", tu->ext);
+        debug("tu_renumber: Failed to notify TU ext=%" PRIext ".", tu->ext);
     }
+    pthread_mutex_unlock(&tu->mutex);
+    return ret;
+}
 
-    if (first_lock != second_lock) pthread_mutex_unlock(&second_lock->mutex);
-    pthread_mutex_unlock(&first_lock->mutex);
+static int do_join(TU *tu, CONF_ROOM *room) {
+    if (tu == NULL || room == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&tu->mutex);
+    void *old = NULL;
+    int ret = -1;
+    if (tu->state == TU_DIAL_TONE) {
+        ret = conf_enter(room, tu, &old);
+        if (ret == 0) {
+            tu->room = room;
+            tu->state = TU_CONNECTED;
+        } else {
+            debug("tu_join: Conference %" PRIext " is full.", conf_number(room));
+            tu->state = TU_BUSY_SIGNAL;
+        }
+    } else {
+        debug("tu_join: TU ext=%" PRIext " has no dial tone, no state change.", tu->ext);
+    }
+    if (notify_state(tu) < 0) {
+        debug("tu_join: Failed to notify TU ext=%" PRIext ".", tu->ext);
+    }
+    pthread_mutex_unlock(&tu->mutex);
+    conf_retire(old, NULL);
+    return ret;
+}
 
-    return 0;
+/*
+ * The TU operations proper.  Each runs as one batch, so the notifications
+ * it produces are written only after all the TU mutexes have been released.
+ */
+
+int tu_set_extension(TU *tu, int ext) {
+    return tu_set_number(tu, ext);
+}
+
+int tu_set_number(TU *tu, EXTNUM ext) {
+    tu_batch_begin();
+    int ret = do_set_number(tu, ext);
+    tu_batch_end();
+    return ret;
 }
 
+int tu_dial(TU *tu, TU *target) {
+    tu_batch_begin();
+    int ret = do_dial(tu, target);
+    tu_batch_end();
+    return ret;
+}
 
+int tu_pickup(TU *tu) {
+    tu_batch_begin();
+    int ret = do_pickup(tu);
+    tu_batch_end();
+    return ret;
+}
 
+int tu_hangup(TU *tu) {
+    tu_batch_begin();
+    int ret = do_hangup(tu, NULL);
+    tu_batch_end();
+    return ret;
+}
+
+/*
+ * Hang up a TU whose timer has expired, unless it has left the state that
+ * was timed meanwhile, and release the reference held by the timer.
+ */
+static void tu_expire(TIMER *t, unsigned long gen) {
+    TU *tu = (TU *)((char *)t - offsetof(struct tu, timer));
+    pthread_mutex_lock(&tu->mutex);
+    int due = tu->timer_gen == gen;
+    if (due) {
+        debug("tu_expire: TU ext=%" PRIext " left in state %s too long, hanging up.",
+              tu->ext, tu_state_names[tu->state]);
+    }
+    pthread_mutex_unlock(&tu->mutex);
+    if (due) {
+        STATS_INC(timeouts);
+        tu_batch_begin();
+        do_hangup(tu, &gen);
+        tu_batch_end();
+    }
+    tu_unref(tu, "tu_expire: timer expired");
+}
+
+int tu_chat(TU *tu, char *msg) {
+    tu_batch_begin();
+    int ret = do_chat(tu, msg);
+    tu_batch_end();
+    return ret;
+}
+
+int tu_pickup_call(TU *tu, TU *target) {
+    tu_batch_begin();
+    int ret = do_pickup_call(tu, target);
+    tu_batch_end();
+    return ret;
+}
+
+int tu_renumber(TU *tu, EXTNUM ext) {
+    tu_batch_begin();
+    int ret = do_renumber(tu, ext);
+    tu_batch_end();
+    return ret;
+}
+
+int tu_dial_group(TU *tu, TU **members, int n) {
+    tu_batch_begin();
+    int ret = do_dial_group(tu, members, n);
+    tu_batch_end();
+    return ret;
+}
+
+int tu_camp(TU *tu, TU *target) {
+    tu_batch_begin();
+    int ret = do_camp(tu, target);
+    tu_batch_end();
+    return ret;
+}
+
+int tu_join(TU *tu, CONF_ROOM *room) {
+    tu_batch_begin();
+    int ret = do_join(tu, room);
+    tu_batch_end();
+    return ret;
+}
+
+int tu_queue(TU *tu, const void *token) {
+    tu_batch_begin();
+    int ret = do_queue(tu, token);
+    tu_batch_end();
+    return ret;
+}
+
+int tu_queue_update(TU *tu, const void *token, int position) {
+    tu_batch_begin();
+    int ret = do_queue_update(tu, token, position);
+    tu_batch_end();
+    return ret;
+}
+
+int tu_queue_connect(TU *tu, const void *token, TU *agent) {
+    tu_batch_begin();
+    int ret = do_queue_connect(tu, token, agent);
+    tu_batch_end();
+    return ret;
+}
+
+void tu_queue_cancel(TU *tu, const void *token) {
+    tu_batch_begin();
+    do_queue_cancel(tu, token);
+    tu_batch_end();
+}
+
+void tu_withdraw(TU *tu) {
+    if (tu == NULL) {
+        return;
+    }
+    tu_batch_begin();
+    pthread_mutex_lock(&tu->mutex);
+    if (tu->listed) {
+        presence_changed(tu->ext, PRESENCE_NONE);
+    }
+    tu->listed = 0;
+    set_unavailable(tu);
+    pthread_mutex_unlock(&tu->mutex);
+    camp_release(tu);
+    tu_batch_end();
+}
+
+void tu_report_presence(TU *tu) {
+    if (tu == NULL) {
+        return;
+    }
+    tu_batch_begin();
+    pthread_mutex_lock(&tu->mutex);
+    update_presence(tu);
+    pthread_mutex_unlock(&tu->mutex);
+    tu_batch_end();
+}
+
+void tu_report_availability(TU *tu) {
+    if (tu == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&tu->mutex);
+    if (tu->available && availability_hook != NULL) {
+        availability_hook(tu->ext, 1);
+    }
+    pthread_mutex_unlock(&tu->mutex);
+}
+
+int tu_send(TU *tu, const char *msg, size_t len) {
+    if (tu == NULL) {
+        return -1;
+    }
+    tu_batch_begin();
+    int ret = tu_write(tu, msg, len);
+    tu_batch_end();
+    return ret;
+}
+
+int tu_send_shared(TU *tu, OUTQ_BUF *buf) {
+    if (tu == NULL) {
+        return -1;
+    }
+    tu_batch_begin();
+    int ret = tu_write_buf(tu, NULL, 0, buf);
+    tu_batch_end();
+    return ret;
+}
+
+int tu_page(TU *tu, OUTQ_BUF *buf) {
+    if (tu == NULL) {
+        return -1;
+    }
+    tu_batch_begin();
+    pthread_mutex_lock(&tu->mutex);
+    int ret = tu->state == TU_ON_HOOK ? tu_write_buf(tu, NULL, 0, buf) : 1;
+    pthread_mutex_unlock(&tu->mutex);
+    tu_batch_end();
+    return ret;
+}
@@ -0,0 +1,757 @@
+/*
+ * io_uring transport backend.
+ *
+ * liburing is not required: the rings are set up directly with the
+ * io_uring_setup(2), io_uring_enter(2) and io_uring_register(2) system calls.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+
+#include "admission.h"
+#include "debug.h"
+#include "service.h"
+#include "transport.h"
+#include "uring.h"
+
+#define URING_ENTRIES 256           // Submission queue entries
+#define URING_NBUFS 256             // Provided receive buffers (power of 2)
+#define URING_BUFSZ 2048            // Size of each receive buffer
+#define URING_BGID 0                // Buffer group ID of the receive buffers
+#define URING_SENDSZ 4096           // Maximum size of a single send
+
+/*
+ * Kinds of request, encoded in the low bits of the user_data of each SQE.
+ * The remaining bits hold a pointer to the object the request is for.
+ */
+#define UD_ACCEPT 1
+#define UD_RECV   2
+#define UD_SEND   3
+#define UD_CANCEL 4
+#define UD_MASK   7UL
+
+/*
+ * Output being sent to a client.
+ */
+struct usend {
+    struct uconn *conn;             // Client the output is for
+    size_t len;                     // Number of bytes
+    char data[URING_SENDSZ];        // The output itself
+};
+
+/*
+ * Input received on a client connection that did not fit in its line
+ * buffer, kept in its receive buffer until the client's next turn.
+ */
+struct uheld {
+    struct uheld *next;             // Input received after this
+    unsigned bid;                   // Receive buffer holding it
+    unsigned off, len;              // Part of the buffer not yet taken
+};
+
+/*
+ * State kept for each client connection.
+ */
+struct uconn {
+    int fd;                         // File descriptor of the connection
+    SERVICE_CONN *svc;              // Connection as known to the service code
+    int recv_armed;                 // A receive is outstanding
+    int closed;                     // EOF seen and TU unregistered
+    int inflight;                   // Number of sends submitted, not completed
+    TU *tu;                         // TU whose output queue is to be drained
+    struct uconn *next_dirty;       // Link in the list of clients with output
+    int dirty;                      // Client is on the dirty list
+    struct uconn *next_ready;       // Link in the line of clients with commands left over
+    int ready;                      // Client is in that line
+    int paused;                     // Its receive is being cancelled meanwhile
+    int single;                     // Received from one buffer at a time
+    struct uheld *held;             // Input held back, first received first
+    struct uheld **held_tail;
+};
+
+/*
+ * The io_uring instance and everything associated with it.  There is just
+ * one of these, used only by the thread running uring_serve().
+ */
+static struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries, sq_local_tail;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+    struct io_uring_buf_ring *br;   // Ring of provided receive buffers
+    size_t br_size;
+    char *bufs;                     // Storage for the receive buffers
+    unsigned short br_tail;
+    int multishot_accept;           // Kernel supports multishot accept
+    int multishot_recv;             // Kernel supports multishot receive
+} ring;
+
+static pthread_t uring_thread;
+static struct uconn **conns;        // Client connections indexed by fd
+static int conns_size;
+static int nconns;                  // Number of open client connections
+static int nsends;                  // Number of sends not yet completed
+static int accept_armed;            // An accept is outstanding
+static struct uconn *dirty;         // Clients with output to be submitted
+static struct uconn *ready;         // Clients with commands left over, in turn
+static struct uconn **ready_tail = &ready;
+
+static void conn_release(struct uconn *c);
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Release the io_uring instance and its memory.
+ */
+static void ring_exit(void) {
+    if (ring.sqes != NULL && ring.sqes != MAP_FAILED) {
+        munmap(ring.sqes, ring.sqes_size);
+    }
+    if (ring.cq_ptr != NULL && ring.cq_ptr != MAP_FAILED && ring.cq_ptr != ring.sq_ptr) {
+        munmap(ring.cq_ptr, ring.cq_size);
+    }
+    if (ring.sq_ptr != NULL && ring.sq_ptr != MAP_FAILED) {
+        munmap(ring.sq_ptr, ring.sq_size);
+    }
+    if (ring.br != NULL && ring.br != MAP_FAILED) {
+        munmap(ring.br, ring.br_size);
+    }
+    free(ring.bufs);
+    if (ring.fd >= 0) {
+        close(ring.fd);
+    }
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+/*
+ * Check that the kernel supports an operation, according to a probe.
+ */
+static int op_supported(struct io_uring_probe *probe, int op) {
+    return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+}
+
+/*
+ * Set up the io_uring instance and register the provided receive buffers.
+ *
+ * @return 0 if successful, -1 if io_uring or a required feature is not
+ * available.
+ */
+static int ring_init(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (ring.fd < 0) {
+        debug("io_uring_setup failed (errno=%d)", errno);
+        return -1;
+    }
+
+    // Map the submission and completion rings
+    ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_size > ring.sq_size) {
+            ring.sq_size = ring.cq_size;
+        }
+        ring.cq_size = ring.sq_size;
+    }
+    ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED) {
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ptr = ring.sq_ptr;
+    } else {
+        ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ptr == MAP_FAILED) {
+            goto fail;
+        }
+    }
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        goto fail;
+    }
+    ring.sq_head = (unsigned *)((char *)ring.sq_ptr + p.sq_off.head);
+    ring.sq_tail = (unsigned *)((char *)ring.sq_ptr + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)((char *)ring.sq_ptr + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)((char *)ring.sq_ptr + p.sq_off.array);
+    ring.sq_entries = p.sq_entries;
+    ring.sq_local_tail = *ring.sq_tail;
+    ring.cq_head = (unsigned *)((char *)ring.cq_ptr + p.cq_off.head);
+    ring.cq_tail = (unsigned *)((char *)ring.cq_ptr + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)((char *)ring.cq_ptr + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)((char *)ring.cq_ptr + p.cq_off.cqes);
+
+    // Check that the operations we use are supported
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    if (probe == NULL) {
+        goto fail;
+    }
+    if (sys_io_uring_register(ring.fd, IORING_REGISTER_PROBE, probe, 256) < 0 ||
+        !op_supported(probe, IORING_OP_ACCEPT) || !op_supported(probe, IORING_OP_RECV) ||
+        !op_supported(probe, IORING_OP_SEND) || !op_supported(probe, IORING_OP_ASYNC_CANCEL)) {
+        debug("io_uring does not support the required operations");
+        free(probe);
+        goto fail;
+    }
+    free(probe);
+
+    // Set up and register the ring of provided receive buffers
+    ring.br_size = URING_NBUFS * sizeof(struct io_uring_buf);
+    ring.br = mmap(NULL, ring.br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring.bufs = malloc((size_t)URING_NBUFS * URING_BUFSZ);
+    if (ring.br == MAP_FAILED || ring.bufs == NULL) {
+        goto fail;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)ring.br;
+    reg.ring_entries = URING_NBUFS;
+    reg.bgid = URING_BGID;
+    if (sys_io_uring_register(ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        debug("io_uring provided buffer rings not supported (errno=%d)", errno);
+        goto fail;
+    }
+    ring.br_tail = 0;
+    for (int i = 0; i < URING_NBUFS; i++) {
+        struct io_uring_buf *b = &ring.br->bufs[i];
+        b->addr = (unsigned long)(ring.bufs + (size_t)i * URING_BUFSZ);
+        b->len = URING_BUFSZ;
+        b->bid = i;
+    }
+    ring.br_tail = URING_NBUFS;
+    __atomic_store_n(&ring.br->tail, ring.br_tail, __ATOMIC_RELEASE);
+
+    // Multishot requests are tried first; we fall back if they are refused
+    ring.multishot_accept = 1;
+    ring.multishot_recv = 1;
+    return 0;
+
+ fail:
+    ring_exit();
+    return -1;
+}
+
+/*
+ * Return a provided buffer to the kernel once its contents have been consumed.
+ */
+static void buf_recycle(unsigned bid) {
+    struct io_uring_buf *b = &ring.br->bufs[ring.br_tail & (URING_NBUFS - 1)];
+    b->addr = (unsigned long)(ring.bufs + (size_t)bid * URING_BUFSZ);
+    b->len = URING_BUFSZ;
+    b->bid = bid;
+    ring.br_tail++;
+    __atomic_store_n(&ring.br->tail, ring.br_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Number of SQEs that have been prepared but not yet consumed by the kernel.
+ */
+static unsigned sq_pending(void) {
+    return ring.sq_local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Get a free SQE, submitting the queued ones first if the queue is full.
+ */
+static struct io_uring_sqe *get_sqe(void) {
+    while (sq_pending() >= ring.sq_entries) {
+        if (sys_io_uring_enter(ring.fd, sq_pending(), 0, 0) < 0 && errno != EINTR &&
+            errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            return NULL;
+        }
+    }
+    unsigned idx = ring.sq_local_tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[idx] = idx;
+    ring.sq_local_tail++;
+    __atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+static void arm_accept(int server_fd) {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server_fd;
+    if (ring.multishot_accept) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    sqe->user_data = UD_ACCEPT;
+    accept_armed = 1;
+}
+
+static void arm_recv(struct uconn *c) {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    if (ring.multishot_recv && !c->single) {
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+    }
+    sqe->user_data = (unsigned long)c | UD_RECV;
+    c->recv_armed = 1;
+    c->paused = 0;
+}
+
+/*
+ * Stop receiving on a connection with commands left over, until they have
+ * had their turns: a single-shot receive is just not armed again, and a
+ * multishot one is cancelled (input it delivers meanwhile is still taken).
+ * From then on, the connection is received from one buffer at a time, so
+ * that the input taken while it has commands left over always fits in its
+ * buffer.
+ */
+static void pause_recv(struct uconn *c) {
+    int multishot = ring.multishot_recv && !c->single;
+    c->single = 1;
+    if (!c->recv_armed || c->paused || !multishot) {
+        return;
+    }
+    struct io_uring_sqe *sqe = get_sqe();
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (unsigned long)c | UD_RECV;
+    sqe->user_data = UD_CANCEL;
+    c->paused = 1;
+}
+
+/*
+ * Put a client with commands left over at the end of the line for its next
+ * turn.
+ */
+static void mark_ready(struct uconn *c) {
+    if (!c->ready) {
+        c->ready = 1;
+        c->next_ready = NULL;
+        *ready_tail = c;
+        ready_tail = &c->next_ready;
+    }
+}
+
+/*
+ * Hold back input that a client's line buffer has no room for, or that
+ * follows input held back already.  The receive buffer is kept until the
+ * input has been taken.
+ *
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+static int hold_input(struct uconn *c, unsigned bid, unsigned off, unsigned len) {
+    struct uheld *h = malloc(sizeof(struct uheld));
+    if (h == NULL) {
+        return -1;
+    }
+    h->next = NULL;
+    h->bid = bid;
+    h->off = off;
+    h->len = len;
+    if (c->held == NULL) {
+        c->held_tail = &c->held;
+    }
+    *c->held_tail = h;
+    c->held_tail = &h->next;
+    return 0;
+}
+
+/*
+ * Give a client its turn: dispatch the commands it has left over, or else
+ * the input held back for it.
+ */
+static void conn_turn(struct uconn *c) {
+    if (service_conn_pending(c->svc) || c->held == NULL) {
+        service_conn_run(c->svc);
+        return;
+    }
+    struct uheld *h = c->held;
+    size_t n = service_conn_input(c->svc, ring.bufs + (size_t)h->bid * URING_BUFSZ + h->off, h->len);
+    h->off += n;
+    h->len -= n;
+    if (h->len == 0) {
+        c->held = h->next;
+        buf_recycle(h->bid);
+        free(h);
+    }
+}
+
+/*
+ * Give a turn to each client in line, in order.  Those that still have
+ * commands left over go back in line; the others are received from again.
+ */
+static void run_ready(void) {
+    struct uconn *c = ready;
+    ready = NULL;
+    ready_tail = &ready;
+    while (c != NULL) {
+        struct uconn *next = c->next_ready;
+        c->ready = 0;
+        if (c->closed) {
+            conn_release(c);
+        } else {
+            conn_turn(c);
+            if (service_conn_pending(c->svc) || c->held != NULL) {
+                mark_ready(c);
+            } else if (!c->recv_armed) {
+                arm_recv(c);
+            }
+        }
+        c = next;
+    }
+}
+
+static void mark_dirty(struct uconn *c) {
+    if (!c->dirty) {
+        c->dirty = 1;
+        c->next_dirty = dirty;
+        dirty = c;
+    }
+}
+
+/*
+ * Transport function installed in the TU module.  Output queued on the
+ * io_uring thread is drained and submitted as a batch at the end of the
+ * current round of completions.  Output queued by any other thread is left
+ * to the TU module's own writer.
+ */
+static int uring_transport(TU *tu, int fd) {
+    if (!pthread_equal(pthread_self(), uring_thread) || fd < 0 || fd >= conns_size ||
+        conns[fd] == NULL || conns[fd]->closed) {
+        return -1;
+    }
+    conns[fd]->tu = tu;
+    mark_dirty(conns[fd]);
+    return 0;
+}
+
+/*
+ * Drain the output queue of each client with output into a chain of linked
+ * sends, so that it is delivered in order.  A client with sends still in
+ * flight keeps its output queued until the earlier chain has completed.
+ */
+static void submit_sends(void) {
+    struct uconn *c = dirty;
+    dirty = NULL;
+    while (c != NULL) {
+        struct uconn *next = c->next_dirty;
+        c->dirty = 0;
+        if (c->closed) {
+            conn_release(c);
+        } else if (c->inflight == 0 && c->tu != NULL) {
+            struct io_uring_sqe *prev = NULL;
+            while (1) {
+                if (sq_pending() >= ring.sq_entries) {
+                    // Never submit half a chain: continue in the next round
+                    mark_dirty(c);
+                    break;
+                }
+                struct usend *s = malloc(sizeof(struct usend));
+                if (s == NULL) {
+                    break;
+                }
+                s->conn = c;
+                s->len = tu_output_drain(c->tu, s->data, URING_SENDSZ);
+                if (s->len == 0) {
+                    free(s);
+                    break;
+                }
+                struct io_uring_sqe *sqe = get_sqe();
+                if (sqe == NULL) {
+                    free(s);
+                    break;
+                }
+                if (prev != NULL) {
+                    prev->flags |= IOSQE_IO_LINK;
+                }
+                sqe->opcode = IORING_OP_SEND;
+                sqe->fd = c->fd;
+                sqe->addr = (unsigned long)s->data;
+                sqe->len = s->len;
+                sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+                sqe->user_data = (unsigned long)s | UD_SEND;
+                c->inflight++;
+                nsends++;
+                prev = sqe;
+            }
+        }
+        c = next;
+    }
+}
+
+/*
+ * Free a connection once it has been closed and has no sends in flight.
+ */
+static void conn_release(struct uconn *c) {
+    if (!c->closed || c->inflight > 0 || c->recv_armed || c->dirty || c->ready) {
+        return;
+    }
+    free(c);
+}
+
+static void conn_close(struct uconn *c) {
+    if (c->closed) {
+        return;
+    }
+    c->closed = 1;
+    conns[c->fd] = NULL;
+    nconns--;
+    service_conn_close(c->svc);  // This closes the file descriptor
+    while (c->held != NULL) {
+        struct uheld *h = c->held;
+        c->held = h->next;
+        buf_recycle(h->bid);
+        free(h);
+    }
+    conn_release(c);
+}
+
+static void handle_accept(int server_fd, int stopping, struct io_uring_cqe *cqe) {
+    int fd = cqe->res;
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        accept_armed = 0;
+        if (fd == -EINVAL && ring.multishot_accept) {
+            debug("Multishot accept not supported, falling back to single-shot");
+            ring.multishot_accept = 0;
+        }
+        if (!stopping) {
+            arm_accept(server_fd);
+        }
+    }
+    if (fd < 0) {
+        if (fd != -ECANCELED && fd != -EINVAL) {
+            debug("accept failed (errno=%d)", -fd);
+        }
+        return;
+    }
+    if (stopping) {
+        close(fd);
+        return;
+    }
+    if (admission_admit(fd) == -1) {
+        return;
+    }
+
+    // Grow the table of connections if necessary
+    if (fd >= conns_size) {
+        int size = conns_size ? conns_size : 1024;
+        while (size <= fd) {
+            size *= 2;
+        }
+        struct uconn **nc = realloc(conns, size * sizeof(struct uconn *));
+        if (nc == NULL) {
+            close(fd);
+            admission_release();
+            return;
+        }
+        memset(nc + conns_size, 0, (size - conns_size) * sizeof(struct uconn *));
+        conns = nc;
+        conns_size = size;
+    }
+
+    struct uconn *c = calloc(1, sizeof(struct uconn));
+    if (c == NULL) {
+        close(fd);
+        admission_release();
+        return;
+    }
+    c->fd = fd;
+    conns[fd] = c;  // Before registration, so that "ON HOOK" goes through the ring
+    c->svc = service_conn_open(fd);
+    if (c->svc == NULL) {
+        // Nothing is written to a TU whose registration fails, so the
+        // connection is not on the dirty list.
+        conns[fd] = NULL;
+        free(c);
+        return;
+    }
+    nconns++;
+    arm_recv(c);
+}
+
+static void handle_recv(struct io_uring_cqe *cqe) {
+    struct uconn *c = (struct uconn *)(cqe->user_data & ~UD_MASK);
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    if (!more) {
+        c->recv_armed = 0;
+    }
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        int keep = 0;
+        if (cqe->res > 0 && !c->closed) {
+            const char *data = ring.bufs + (size_t)bid * URING_BUFSZ;
+            size_t len = cqe->res;
+            size_t n = c->held == NULL ? service_conn_input(c->svc, data, len) : 0;
+            if (n < len) {
+                keep = hold_input(c, bid, n, len - n) == 0;
+                while (!keep && n < len) {
+                    // No memory to hold it back: take it now
+                    service_conn_run(c->svc);
+                    n += service_conn_input(c->svc, data + n, len - n);
+                }
+            }
+            if (service_conn_pending(c->svc) || c->held != NULL) {
+                mark_ready(c);
+                pause_recv(c);
+            }
+        }
+        if (!keep) {
+            buf_recycle(bid);
+        }
+    }
+
+    if (c->closed) {
+        conn_release(c);
+        return;
+    }
+    if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -EINVAL &&
+                          cqe->res != -ECANCELED)) {
+        if (cqe->res == -ETIMEDOUT) {
+            service_conn_lost(c->svc);
+        }
+        // The commands received before the end are still carried out
+        while (service_conn_pending(c->svc) || c->held != NULL) {
+            conn_turn(c);
+        }
+        conn_close(c);
+        return;
+    }
+    if (!more) {
+        if (cqe->res == -EINVAL && ring.multishot_recv) {
+            debug("Multishot receive not supported, falling back to single-shot");
+            ring.multishot_recv = 0;
+        }
+        if (!c->ready) {
+            arm_recv(c);
+        }
+    }
+}
+
+static void handle_send(struct io_uring_cqe *cqe) {
+    struct usend *s = (struct usend *)(cqe->user_data & ~UD_MASK);
+    struct uconn *c = s->conn;
+    if (cqe->res < 0) {
+        debug("send to fd %d failed (errno=%d)", c->fd, -cqe->res);
+    }
+    free(s);
+    nsends--;
+    c->inflight--;
+    if (c->closed) {
+        conn_release(c);
+    } else if (c->inflight == 0) {
+        mark_dirty(c);  // Pick up anything queued while the chain was in flight
+    }
+}
+
+int uring_serve(int server_fd, volatile sig_atomic_t *stop) {
+    if (ring_init() == -1) {
+        return -1;
+    }
+    uring_thread = pthread_self();
+    tu_set_transport(uring_transport);
+    debug("Using io_uring transport");
+
+    int stopping = 0;
+    arm_accept(server_fd);
+    while (1) {
+        run_ready();
+        if (*stop && !stopping) {
+            // Stop accepting, and shut down the client connections so that
+            // each outstanding receive sees EOF and unregisters its TU.
+            stopping = 1;
+            struct io_uring_sqe *sqe = get_sqe();
+            if (sqe != NULL) {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = UD_ACCEPT;
+                sqe->user_data = UD_CANCEL;
+            }
+            for (int fd = 0; fd < conns_size; fd++) {
+                if (conns[fd] != NULL) {
+                    shutdown(fd, SHUT_RD);
+                }
+            }
+        }
+        submit_sends();
+        // The accept must have completed as well, or the listening socket
+        // stays referenced by the ring after we return.
+        if (stopping && nconns == 0 && nsends == 0 && !accept_armed) {
+            break;
+        }
+
+        // Clients with commands left over are not kept waiting for events
+        if (sys_io_uring_enter(ring.fd, sq_pending(), ready != NULL ? 0 : 1,
+                               IORING_ENTER_GETEVENTS) < 0 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            break;
+        }
+
+        // Process all available completions
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            switch (cqe->user_data & UD_MASK) {
+                case UD_ACCEPT:
+                    handle_accept(server_fd, stopping, cqe);
+                    break;
+                case UD_RECV:
+                    handle_recv(cqe);
+                    break;
+                case UD_SEND:
+                    handle_send(cqe);
+                    break;
+                default:
+                    break;
+            }
+            head++;
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+            tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    tu_set_transport(NULL);
+    ring_exit();
+    free(conns);
+    conns = NULL;
+    conns_size = 0;
+    return 0;
+}
@@ -11,6 +11,8 @@
 #include <errno.h>
 #include <time.h>
 #include <string.h>
+#include <stdarg.h>
+#include <poll.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -18,14 +20,19 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 
 #include <criterion/criterion.h>
 #include <pthread.h>
 
 #include "__test_includes.h"
+#include "conf.h"
+#include "service.h"
 
 static int server_pid;
 
+#define TEST_CONFIG_FILE "/tmp/pbx_test.conf"
+
 static void wait_for_server() {
     int ret;
     int i = 0;
@@ -50,12 +57,31 @@ static void wait_for_no_server() {
     } while(1);
 }
 
-static void init() {
+/*
+ * Start the server, reading a configuration file holding the given text
+ * unless that is NULL, with the given further arguments (a NULL-terminated
+ * array, or NULL for none).
+ */
+static void start_server_args(char *conf, char **args) {
     server_pid = 0;
     wait_for_no_server();
+    if(conf != NULL) {
+	FILE *f = fopen(TEST_CONFIG_FILE, "w");
+	cr_assert_not_null(f, "Could not write %s\n", TEST_CONFIG_FILE);
+	fputs(conf, f);
+	fclose(f);
+    }
     fprintf(stderr, "***Starting server...");
     if((server_pid = fork()) == 0) {
-	execlp("bin/pbx", "pbx", "-p", SERVER_PORT_STR, NULL);
+	char *argv[16] = { "pbx", "-p", SERVER_PORT_STR };
+	int argc = 3;
+	if(conf != NULL) {
+	    argv[argc++] = "-c";
+	    argv[argc++] = TEST_CONFIG_FILE;
+	}
+	while(args != NULL && *args != NULL && argc < 15)
+	    argv[argc++] = *args++;
+	execvp("bin/pbx", argv);
 	fprintf(stderr, "Failed to exec server\n");
 	abort();
     }
@@ -64,6 +90,39 @@ static void init() {
     wait_for_server();
 }
 
+/*
+ * Start the server, reading a configuration file holding the given text
+ * unless that is NULL, in the given mode (see "-m") unless that is NULL.
+ */
+static void start_server(char *conf, char *mode) {
+    char *args[] = { "-m", mode, NULL };
+    start_server_args(conf, mode != NULL ? args : NULL);
+}
+
+static void init() {
+    start_server(NULL, NULL);
+}
+
+static void init_epoll() {
+    start_server(NULL, "epoll");
+}
+
+static void init_uring() {
+    start_server(NULL, "uring");
+}
+
+/*
+ * Replace the configuration file of a running server and have it reloaded.
+ */
+static void reload_config(char *conf) {
+    FILE *f = fopen(TEST_CONFIG_FILE, "w");
+    cr_assert_not_null(f, "Could not write %s\n", TEST_CONFIG_FILE);
+    fputs(conf, f);
+    fclose(f);
+    kill(server_pid, SIGUSR1);
+    usleep(300000);
+}
+
 static void fini(int chk) {
     int ret;
     cr_assert(server_pid != 0, "No server was started!\n");
@@ -84,6 +143,156 @@ static void killall() {
     system("killall -s KILL pbx /usr/lib/valgrind/memcheck-amd64-linux > /dev/null 2>&1");
 }
 
+/*
+ * The tests of the features beyond the states tracked by the script tester
+ * (hunt groups, queues, conferences and so on) talk to the server through
+ * these, a line at a time.
+ */
+#define CLIENT_WAIT_MSEC 2000
+#define CLIENT_LINE_MAX 4096
+
+typedef struct client {
+    int fd;                        // Connection to the server
+    int ext;                       // Extension given by the first "ON HOOK"
+    size_t len;                    // Bytes received and not yet returned
+    char buf[CLIENT_LINE_MAX];     // Received bytes, NUL-terminated
+    char line[CLIENT_LINE_MAX];    // Last line returned
+} CLIENT;
+
+/*
+ * Connect to the server, without reading anything.
+ */
+static void client_connect(CLIENT *c) {
+    struct sockaddr_in sa;
+    memset(c, 0, sizeof(*c));
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(SERVER_PORT);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    cr_assert(c->fd >= 0, "socket: %s\n", strerror(errno));
+    cr_assert_eq(connect(c->fd, (struct sockaddr *)&sa, sizeof(sa)), 0,
+		 "connect: %s\n", strerror(errno));
+}
+
+/*
+ * Read the next line from the server, without the EOL.
+ * Returns the line, or NULL on EOF or if none arrives within msec.
+ */
+static char *client_line(CLIENT *c, int msec) {
+    char *eol;
+    c->buf[c->len] = '\0';
+    while((eol = strstr(c->buf, EOL)) == NULL) {
+	struct pollfd pfd = { c->fd, POLLIN, 0 };
+	if(poll(&pfd, 1, msec) != 1)
+	    return NULL;
+	cr_assert(c->len < sizeof(c->buf) - 1, "Line too long from the server\n");
+	ssize_t n = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+	if(n <= 0)
+	    return NULL;
+	c->len += n;
+	c->buf[c->len] = '\0';
+    }
+    size_t n = eol - c->buf;
+    memcpy(c->line, c->buf, n);
+    c->line[n] = '\0';
+    n += strlen(EOL);
+    memmove(c->buf, c->buf + n, c->len - n);
+    c->len -= n;
+    return c->line;
+}
+
+/*
+ * Send a command line to the server.
+ */
+static void client_send(CLIENT *c, char *fmt, ...) {
+    char buf[CLIENT_LINE_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf) - strlen(EOL), fmt, ap);
+    va_end(ap);
+    strcpy(buf + n, EOL);
+    n += strlen(EOL);
+    cr_assert_eq(write(c->fd, buf, n), n, "write: %s\n", strerror(errno));
+}
+
+/*
+ * Check that the next line from the server is the one given.
+ */
+static void client_expect(CLIENT *c, char *fmt, ...) {
+    char want[CLIENT_LINE_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(want, sizeof(want), fmt, ap);
+    va_end(ap);
+    char *line = client_line(c, CLIENT_WAIT_MSEC);
+    cr_assert_not_null(line, "Expected \"%s\" from extension %d, got nothing\n", want, c->ext);
+    cr_assert_str_eq(line, want, "Expected \"%s\" from extension %d, got \"%s\"\n",
+		     want, c->ext, line);
+}
+
+/*
+ * Check that nothing arrives from the server for msec.
+ */
+static void client_quiet(CLIENT *c, int msec) {
+    char *line = client_line(c, msec);
+    cr_assert(line == NULL, "Expected nothing from extension %d, got \"%s\"\n", c->ext, line);
+}
+
+/*
+ * Connect to the server and read the initial "ON HOOK".
+ */
+static void client_open(CLIENT *c) {
+    client_connect(c);
+    char *line = client_line(c, CLIENT_WAIT_MSEC);
+    cr_assert_not_null(line, "No ON HOOK on connecting\n");
+    cr_assert(sscanf(line, "ON HOOK %d", &c->ext) == 1, "Expected ON HOOK, got \"%s\"\n", line);
+}
+
+static void client_close(CLIENT *c) {
+    close(c->fd);
+    c->fd = -1;
+}
+
+/*
+ * Connect n clients to a server just started, which gives them extensions
+ * 0 to n-1.
+ */
+static void open_clients(CLIENT *c, int n) {
+    for(int i = 0; i < n; i++) {
+	client_open(&c[i]);
+	cr_assert_eq(c[i].ext, i, "expected extension %d, was %d\n", i, c[i].ext);
+    }
+}
+
+/*
+ * Take a client on hook off hook.
+ */
+static void offhook(CLIENT *c) {
+    client_send(c, "pickup");
+    client_expect(c, "DIAL TONE");
+}
+
+/*
+ * Get the value of a counter from the statistics of the server.
+ */
+static long stat_value(char *name) {
+    CLIENT c;
+    char key[64];
+    long value, ret = -1;
+    client_open(&c);
+    client_send(&c, "stats");
+    char *line;
+    while((line = client_line(&c, CLIENT_WAIT_MSEC)) != NULL && strcmp(line, "STATS END")) {
+	if(sscanf(line, "STATS %63s %ld", key, &value) == 2 && !strcmp(key, name))
+	    ret = value;
+    }
+    cr_assert_not_null(line, "Statistics not ended by STATS END\n");
+    cr_assert(ret != -1, "No counter %s in the statistics\n", name);
+    client_close(&c);
+    return ret;
+}
+
 
 #define SUITE basecode_suite
 
@@ -183,3 +392,1136 @@ Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
     fini(0);
 }
 #undef TEST_NAME
+
+#define TEST_NAME dial_on_hook_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_DIAL_CMD,        1,           TU_ON_HOOK,     TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+#define TEST_NAME dial_connected_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        1,           TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   TEN_MSEC },
+    {   0,  TU_AWAIT_CMD,      -1,           TU_CONNECTED,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        2,           TU_CONNECTED,   TEN_MSEC },
+    {   2,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+/*
+ * The same calls, served by the epoll reactor rather than a thread per client.
+ */
+#define TEST_NAME epoll_dial_answer_test
+Test(SUITE, TEST_NAME, .init = init_epoll, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(dial_answer_test), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+#define TEST_NAME epoll_dial_disconnect_test
+Test(SUITE, TEST_NAME, .init = init_epoll, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(dial_disconnect_test), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+#define TEST_NAME epoll_dial_connected_test
+Test(SUITE, TEST_NAME, .init = init_epoll, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(dial_connected_test), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+#undef SUITE
+#define SUITE input_suite
+
+/*
+ * Connect two clients and put them in a call with each other.
+ */
+static void call_clients(CLIENT *c) {
+    open_clients(c, 2);
+    offhook(&c[0]);
+    client_send(&c[0], "dial 1");
+    client_expect(&c[0], "RING BACK");
+    client_expect(&c[1], "RINGING");
+    client_send(&c[1], "pickup");
+    client_expect(&c[1], "CONNECTED 0");
+    client_expect(&c[0], "CONNECTED 1");
+}
+
+static void init_line_limit() {
+    char *args[] = { "-l", "64", NULL };
+    start_server_args(NULL, args);
+}
+
+static void init_epoll_line_limit() {
+    char *args[] = { "-m", "epoll", "-l", "64", NULL };
+    start_server_args(NULL, args);
+}
+
+/*
+ * A line longer than the limit is dropped, and the lines around it are
+ * carried out.
+ */
+static void line_limit_test() {
+    CLIENT c[2];
+    char longer[200];
+    call_clients(c);
+    memset(longer, 'x', sizeof(longer) - 1);
+    longer[sizeof(longer) - 1] = '\0';
+    client_send(&c[0], "chat %s", longer);
+    client_send(&c[0], "chat short enough");
+    client_expect(&c[0], "CONNECTED 1");
+    client_expect(&c[1], "CHAT short enough");
+    client_quiet(&c[0], 100);
+    client_quiet(&c[1], 100);
+    cr_assert_eq(stat_value("lines_rejected"), 1, "expected 1 line rejected\n");
+}
+
+Test(SUITE, thread_line_limit_test, .init = init_line_limit, .fini = killall, .timeout = 30) {
+    line_limit_test();
+    fini(0);
+}
+
+Test(SUITE, epoll_line_limit_test, .init = init_epoll_line_limit, .fini = killall, .timeout = 30) {
+    line_limit_test();
+    fini(0);
+}
+
+/*
+ * An extension number is taken only if it is all decimal digits and fits in
+ * 63 bits; otherwise the client is just told the one it has.
+ */
+Test(SUITE, strict_ext_test, .init = init, .fini = killall, .timeout = 30) {
+    CLIENT c[1];
+    char *bad[] = {
+	"ext 12a", "ext -5", "ext +5", "ext 0x10", "ext 7 8", "ext  ",
+	"ext 9223372036854775808", "ext 18446744073709551621",
+	"ext 99999999999999999999", NULL
+    };
+    open_clients(c, 1);
+    for(int i = 0; bad[i] != NULL; i++) {
+	client_send(&c[0], "%s", bad[i]);
+	client_expect(&c[0], "ON HOOK 0");
+    }
+    // Not commands at all: ignored
+    client_send(&c[0], "ext5");
+    client_send(&c[0], "extx 5");
+    client_send(&c[0], "ext");
+    client_send(&c[0], "ping");
+    client_expect(&c[0], "PONG");
+    // Trailing whitespace is allowed
+    client_send(&c[0], "ext 5 ");
+    client_expect(&c[0], "ON HOOK 5");
+    fini(0);
+}
+
+#undef SUITE
+#define SUITE ext_suite
+
+Test(SUITE, renumber_test, .init = init, .fini = killall, .timeout = 30) {
+    CLIENT c[4];
+    open_clients(c, 3);
+    client_send(&c[0], "ext 100");
+    client_expect(&c[0], "ON HOOK 100");
+    // An extension taken, or a client off hook, keeps its number
+    client_send(&c[1], "ext 100");
+    client_expect(&c[1], "ON HOOK 1");
+    offhook(&c[2]);
+    client_send(&c[2], "ext 200");
+    client_expect(&c[2], "DIAL TONE");
+    // The old number is free for the next client, the new one rings
+    client_open(&c[3]);
+    cr_assert_eq(c[3].ext, 0, "expected extension 0, was %d\n", c[3].ext);
+    client_send(&c[2], "dial 100");
+    client_expect(&c[2], "RING BACK");
+    client_expect(&c[0], "RINGING");
+    client_send(&c[0], "pickup");
+    client_expect(&c[0], "CONNECTED 2");
+    client_expect(&c[2], "CONNECTED 100");
+    client_send(&c[2], "hangup");
+    client_expect(&c[2], "ON HOOK 2");
+    client_expect(&c[0], "DIAL TONE");
+    fini(0);
+}
+
+/*
+ * Extension numbers are 64-bit: 2^32 is not extension 0.
+ */
+Test(SUITE, wide_ext_test, .init = init, .fini = killall, .timeout = 30) {
+    CLIENT c[3];
+    open_clients(c, 3);
+    client_send(&c[1], "ext 4294967296");
+    client_expect(&c[1], "ON HOOK 4294967296");
+    client_send(&c[2], "ext 9223372036854775807");
+    client_expect(&c[2], "ON HOOK 9223372036854775807");
+    client_send(&c[0], "watch 9223372036854775807");
+    client_expect(&c[0], "STATE 9223372036854775807 ON HOOK");
+    offhook(&c[2]);
+    client_expect(&c[0], "STATE 9223372036854775807 DIAL TONE");
+    client_send(&c[2], "dial 4294967296");
+    client_expect(&c[2], "RING BACK");
+    client_expect(&c[1], "RINGING");
+    client_expect(&c[0], "STATE 9223372036854775807 RING BACK");
+    client_send(&c[1], "pickup");
+    client_expect(&c[1], "CONNECTED 9223372036854775807");
+    client_expect(&c[2], "CONNECTED 4294967296");
+    client_expect(&c[0], "STATE 9223372036854775807 CONNECTED");
+    client_send(&c[1], "hangup");
+    client_expect(&c[1], "ON HOOK 4294967296");
+    client_expect(&c[2], "DIAL TONE");
+    client_expect(&c[0], "STATE 9223372036854775807 DIAL TONE");
+    // Once given up, a wide number is no longer dialable
+    client_send(&c[1], "ext 7");
+    client_expect(&c[1], "ON HOOK 7");
+    client_send(&c[2], "dial 4294967296");
+    client_expect(&c[2], "ERROR");
+    fini(0);
+}
+
+#undef SUITE
+#define SUITE dialplan_suite
+
+static void init_dialplan() {
+    start_server("alias 411 1\n"
+		 "route 9 2\n"
+		 "alias 911 0\n"
+		 "map 8 0\n"
+		 "pickup *7\n", NULL);
+}
+
+/*
+ * Have a client with dial tone dial a number, check which client rings,
+ * and hang up.
+ */
+static void dial_rings(CLIENT *from, char *number, CLIENT *to) {
+    client_send(from, "dial %s", number);
+    client_expect(from, "RING BACK");
+    client_expect(to, "RINGING");
+    client_send(from, "hangup");
+    client_expect(from, "ON HOOK %d", from->ext);
+    client_expect(to, "ON HOOK %d", to->ext);
+    offhook(from);
+}
+
+Test(SUITE, prefix_route_test, .init = init_dialplan, .fini = killall, .timeout = 30) {
+    CLIENT c[3];
+    open_clients(c, 3);
+    offhook(&c[0]);
+    dial_rings(&c[0], "411", &c[1]);
+    // Any number starting with 9 goes to 2, except a longer rule
+    dial_rings(&c[0], "9", &c[2]);
+    dial_rings(&c[0], "95551234", &c[2]);
+    client_send(&c[0], "hangup");
+    client_expect(&c[0], "ON HOOK 0");
+    offhook(&c[1]);
+    dial_rings(&c[1], "911", &c[0]);
+    client_send(&c[1], "hangup");
+    client_expect(&c[1], "ON HOOK 1");
+    offhook(&c[0]);
+    // 8 + N rings N
+    dial_rings(&c[0], "82", &c[2]);
+    // Numbers no rule matches are extensions
+    dial_rings(&c[0], "1", &c[1]);
+    client_send(&c[0], "dial 41");
+    client_expect(&c[0], "ERROR");
+    cr_assert_eq(stat_value("dialplan_routed"), 5, "expected 5 numbers routed\n");
+    fini(0);
+}
+
+Test(SUITE, pickup_test, .init = init_dialplan, .fini = killall, .timeout = 30) {
+    CLIENT c[3];
+    open_clients(c, 3);
+    offhook(&c[0]);
+    client_send(&c[0], "dial 1");
+    client_expect(&c[0], "RING BACK");
+    client_expect(&c[1], "RINGING");
+    // Extension 2 answers the call ringing at 1
+    offhook(&c[2]);
+    client_send(&c[2], "dial *71");
+    client_expect(&c[2], "CONNECTED 0");
+    client_expect(&c[0], "CONNECTED 2");
+    client_expect(&c[1], "ON HOOK 1");
+    client_send(&c[0], "chat picked up");
+    client_expect(&c[0], "CONNECTED 2");
+    client_expect(&c[2], "CHAT picked up");
+    // Nothing rings at 1 any more
+    offhook(&c[1]);
+    client_send(&c[1], "dial *71");
+    client_expect(&c[1], "ERROR");
+    fini(0);
+}
+
+#undef SUITE
+#define SUITE hunt_suite
+
+/*
+ * Extension 0 calls the groups; extensions 1, 2 and 3 are the members.
+ */
+static void init_hunt() {
+    start_server("group 700 ringall 1 2 3\n"
+		 "group 701 roundrobin 1 2 3\n"
+		 "group 702 lru 1 2 3\n", NULL);
+}
+
+/*
+ * Have extension 0 dial a group and check that member m rings, then hang
+ * up both.
+ */
+static void hunt_rings(CLIENT *c, int group, int m) {
+    client_send(&c[0], "pickup");
+    client_expect(&c[0], "DIAL TONE");
+    client_send(&c[0], "dial %d", group);
+    client_expect(&c[0], "RING BACK");
+    client_expect(&c[m], "RINGING");
+    client_send(&c[m], "hangup");
+    client_expect(&c[m], "ON HOOK %d", m);
+    client_expect(&c[0], "DIAL TONE");
+    client_send(&c[0], "hangup");
+    client_expect(&c[0], "ON HOOK 0");
+}
+
+Test(SUITE, ring_all_test, .init = init_hunt, .fini = killall, .timeout = 30) {
+    CLIENT c[4];
+    open_clients(c, 4);
+    client_send(&c[0], "pickup");
+    client_expect(&c[0], "DIAL TONE");
+    client_send(&c[0], "dial 700");
+    client_expect(&c[0], "RING BACK");
+    for(int i = 1; i < 4; i++)
+	client_expect(&c[i], "RINGING");
+    // The first to pick up takes the call, the others stop ringing
+    client_send(&c[2], "pickup");
+    client_expect(&c[2], "CONNECTED 0");
+    client_expect(&c[0], "CONNECTED 2");
+    client_expect(&c[1], "ON HOOK 1");
+    client_expect(&c[3], "ON HOOK 3");
+    client_send(&c[1], "pickup");
+    client_expect(&c[1], "DIAL TONE");
+    client_quiet(&c[2], 100);
+    fini(0);
+}
+
+Test(SUITE, round_robin_test, .init = init_hunt, .fini = killall, .timeout = 30) {
+    CLIENT c[4];
+    open_clients(c, 4);
+    int order[] = { 1, 2, 3, 1, 2 };
+    for(int i = 0; i < 5; i++)
+	hunt_rings(c, 701, order[i]);
+    // A member off hook is skipped
+    client_send(&c[3], "pickup");
+    client_expect(&c[3], "DIAL TONE");
+    hunt_rings(c, 701, 1);
+    hunt_rings(c, 701, 2);
+    hunt_rings(c, 701, 1);
+    fini(0);
+}
+
+Test(SUITE, lru_test, .init = init_hunt, .fini = killall, .timeout = 30) {
+    CLIENT c[4];
+    open_clients(c, 4);
+    // Members become available in the order 3, 1, 2
+    int idle[] = { 3, 1, 2 };
+    for(int i = 0; i < 3; i++) {
+	client_send(&c[idle[i]], "pickup");
+	client_expect(&c[idle[i]], "DIAL TONE");
+	client_send(&c[idle[i]], "hangup");
+	client_expect(&c[idle[i]], "ON HOOK %d", idle[i]);
+    }
+    // Each member rung goes to the back of the line
+    int order[] = { 3, 1, 2, 3, 1 };
+    for(int i = 0; i < 5; i++)
+	hunt_rings(c, 702, order[i]);
+    fini(0);
+}
+
+Test(SUITE, busy_group_test, .init = init_hunt, .fini = killall, .timeout = 30) {
+    CLIENT c[4];
+    open_clients(c, 4);
+    for(int i = 1; i < 4; i++) {
+	client_send(&c[i], "pickup");
+	client_expect(&c[i], "DIAL TONE");
+    }
+    int groups[] = { 700, 701, 702 };
+    for(int i = 0; i < 3; i++) {
+	client_send(&c[0], "pickup");
+	client_expect(&c[0], "DIAL TONE");
+	client_send(&c[0], "dial %d", groups[i]);
+	client_expect(&c[0], "BUSY SIGNAL");
+	client_send(&c[0], "hangup");
+	client_expect(&c[0], "ON HOOK 0");
+    }
+    fini(0);
+}
+
+#undef SUITE
+#define SUITE acd_suite
+
+/*
+ * Extensions 1 and 2 are the agents of queue 800; the others call it.
+ */
+#define ACD_CONFIG "queue 800 1 2\n"
+
+static void init_acd() {
+    start_server(ACD_CONFIG, NULL);
+}
+
+/*
+ * Have a client with dial tone call the queue, and check its position.
+ */
+static void acd_call(CLIENT *c, int position) {
+    client_send(c, "dial 800");
+    client_expect(c, "RING BACK");
+    client_expect(c, "QUEUED %d", position);
+}
+
+Test(SUITE, longest_idle_agent_test, .init = init_acd, .fini = killall, .timeout = 30) {
+    CLIENT c[3];
+    open_clients(c, 3);
+    // Agent 1 has been idle for less time than agent 2
+    offhook(&c[1]);
+    client_send(&c[1], "hangup");
+    client_expect(&c[1], "ON HOOK 1");
+    offhook(&c[0]);
+    acd_call(&c[0], 1);
+    client_expect(&c[2], "RINGING");
+    client_send(&c[2], "pickup");
+    client_expect(&c[2], "CONNECTED 0");
+    client_expect(&c[0], "CONNECTED 2");
+    client_quiet(&c[1], 100);
+    fini(0);
+}
+
+Test(SUITE, longest_waiting_caller_test, .init = init_acd, .fini = killall, .timeout = 30) {
+    CLIENT c[5];
+    open_clients(c, 5);
+    offhook(&c[1]);
+    offhook(&c[2]);
+    // The callers are told their places in the order they called
+    for(int i = 3; i <= 4; i++) {
+	offhook(&c[i]);
+	acd_call(&c[i], i - 2);
+    }
+    offhook(&c[0]);
+    acd_call(&c[0], 3);
+    // The first agent to become idle gets the caller waiting longest
+    client_send(&c[2], "hangup");
+    client_expect(&c[2], "ON HOOK 2");
+    client_expect(&c[2], "RINGING");
+    client_send(&c[2], "pickup");
+    client_expect(&c[2], "CONNECTED 3");
+    client_expect(&c[3], "CONNECTED 2");
+    client_send(&c[1], "hangup");
+    client_expect(&c[1], "ON HOOK 1");
+    client_expect(&c[1], "RINGING");
+    client_send(&c[1], "pickup");
+    client_expect(&c[1], "CONNECTED 4");
+    client_expect(&c[4], "CONNECTED 1");
+    fini(0);
+}
+
+Test(SUITE, abandoned_test, .init = init_acd, .fini = killall, .timeout = 30) {
+    CLIENT c[4];
+    open_clients(c, 4);
+    offhook(&c[1]);
+    offhook(&c[2]);
+    offhook(&c[3]);
+    acd_call(&c[3], 1);
+    cr_assert_eq(stat_value("acd_waiting"), 1, "expected 1 caller waiting\n");
+    client_send(&c[3], "hangup");
+    client_expect(&c[3], "ON HOOK 3");
+    // The caller leaves the queue as it hangs up
+    cr_assert_eq(stat_value("acd_abandoned"), 1, "expected 1 call abandoned\n");
+    cr_assert_eq(stat_value("acd_waiting"), 0, "expected no caller waiting\n");
+    // The agent becoming idle does not ring for the caller gone
+    client_send(&c[1], "hangup");
+    client_expect(&c[1], "ON HOOK 1");
+    client_quiet(&c[1], 200);
+    cr_assert_eq(stat_value("acd_abandoned"), 1, "expected 1 call abandoned\n");
+    cr_assert_eq(stat_value("acd_dispatched"), 0, "expected no call dispatched\n");
+    fini(0);
+}
+
+Test(SUITE, reload_test, .init = init_acd, .fini = killall, .timeout = 30) {
+    CLIENT c[5];
+    open_clients(c, 5);
+    offhook(&c[1]);
+    offhook(&c[2]);
+    offhook(&c[3]);
+    acd_call(&c[3], 1);
+    offhook(&c[4]);
+    acd_call(&c[4], 2);
+    // The queue remains: the callers keep their places
+    reload_config("# reloaded\n" ACD_CONFIG);
+    offhook(&c[0]);
+    acd_call(&c[0], 3);
+    client_send(&c[1], "hangup");
+    client_expect(&c[1], "ON HOOK 1");
+    client_expect(&c[1], "RINGING");
+    client_send(&c[1], "pickup");
+    client_expect(&c[1], "CONNECTED 3");
+    client_expect(&c[3], "CONNECTED 1");
+    // The queue is removed: the callers still waiting get a busy signal
+    reload_config("group 700 ringall 1 2\n");
+    client_expect(&c[4], "BUSY SIGNAL");
+    client_expect(&c[0], "BUSY SIGNAL");
+    cr_assert_eq(stat_value("acd_waiting"), 0, "expected no caller waiting\n");
+    fini(0);
+}
+
+#undef SUITE
+#define SUITE camp_suite
+
+/*
+ * Have extension 1 call extension 2, so that both are busy, and extension
+ * 0 camp on extension 1.
+ */
+static void camp_on_busy(CLIENT *c) {
+    offhook(&c[1]);
+    client_send(&c[1], "dial 2");
+    client_expect(&c[1], "RING BACK");
+    client_expect(&c[2], "RINGING");
+    client_send(&c[2], "pickup");
+    client_expect(&c[2], "CONNECTED 1");
+    client_expect(&c[1], "CONNECTED 2");
+    offhook(&c[0]);
+    client_send(&c[0], "dial 1");
+    client_expect(&c[0], "BUSY SIGNAL");
+    client_send(&c[0], "camp 1");
+    client_expect(&c[0], "BUSY SIGNAL");
+    client_expect(&c[0], "CAMPED 1");
+}
+
+/*
+ * Have extension 1 hang up, and check that extension 0 is rung back.
+ */
+static void camp_rung_back(CLIENT *c) {
+    client_send(&c[1], "hangup");
+    client_expect(&c[1], "ON HOOK 1");
+    client_expect(&c[2], "DIAL TONE");
+    client_expect(&c[0], "RING BACK");
+    client_expect(&c[1], "RINGING");
+    client_send(&c[1], "pickup");
+    client_expect(&c[1], "CONNECTED 0");
+    client_expect(&c[0], "CONNECTED 1");
+}
+
+Test(SUITE, camp_ring_back_test, .init = init, .fini = killall, .timeout = 30) {
+    CLIENT c[3];
+    open_clients(c, 3);
+    camp_on_busy(c);
+    camp_rung_back(c);
+    cr_assert_eq(stat_value("camp_completed"), 1, "expected 1 camp-on completed\n");
+    cr_assert_eq(stat_value("camp_waiting"), 0, "expected no TU camped\n");
+    fini(0);
+}
+
+static void init_camp_timeout() {
+    start_server("timeout busy 300\n", NULL);
+}
+
+Test(SUITE, camp_no_timeout_test, .init = init_camp_timeout, .fini = killall, .timeout = 30) {
+    CLIENT c[4];
+    open_clients(c, 4);
+    camp_on_busy(c);
+    // A busy signal without camping on times out
+    offhook(&c[3]);
+    client_send(&c[3], "dial 1");
+    client_expect(&c[3], "BUSY SIGNAL");
+    client_expect(&c[3], "ON HOOK 3");
+    // The TU camped on waits as long as it takes
+    client_quiet(&c[0], 700);
+    camp_rung_back(c);
+    fini(0);
+}
+
+#undef SUITE
+#define SUITE conf_suite
+
+/*
+ * Dialing 88 followed by a room number joins that conference room.
+ */
+static void init_conf() {
+    start_server("conference 88\n", NULL);
+}
+
+static void room_join(CLIENT *c, int room) {
+    offhook(c);
+    client_send(c, "dial 88%d", room);
+    client_expect(c, "CONNECTED %d", room);
+}
+
+Test(SUITE, conf_chat_test, .init = init_conf, .fini = killall, .timeout = 30) {
+    CLIENT c[4];
+    open_clients(c, 4);
+    for(int i = 0; i < 3; i++)
+	room_join(&c[i], 5);
+    room_join(&c[3], 6);
+    cr_assert_eq(stat_value("conf_rooms"), 2, "expected 2 rooms\n");
+    cr_assert_eq(stat_value("conf_members"), 4, "expected 4 members\n");
+    // Chat goes to every other member of the room, not back to the sender
+    client_send(&c[0], "chat hello room");
+    client_expect(&c[0], "CONNECTED 5");
+    client_expect(&c[1], "CHAT hello room");
+    client_expect(&c[2], "CHAT hello room");
+    client_quiet(&c[0], 100);
+    client_quiet(&c[3], 100);
+    // A member hanging up leaves the room
+    client_send(&c[1], "hangup");
+    client_expect(&c[1], "ON HOOK 1");
+    client_send(&c[2], "chat after");
+    client_expect(&c[2], "CONNECTED 5");
+    client_expect(&c[0], "CHAT after");
+    client_quiet(&c[1], 100);
+    cr_assert_eq(stat_value("conf_members"), 3, "expected 3 members\n");
+    // The last member leaving closes the room
+    client_close(&c[3]);
+    usleep(200000);
+    cr_assert_eq(stat_value("conf_rooms"), 1, "expected 1 room\n");
+    fini(0);
+}
+
+static void init_long_chat() {
+    start_server("conference 88\n"
+		 "limit line 4000\n", NULL);
+}
+
+Test(SUITE, long_chat_test, .init = init_long_chat, .fini = killall, .timeout = 30) {
+    CLIENT c[4];
+    open_clients(c, 4);
+    char msg[3001];
+    memset(msg, 'x', sizeof(msg) - 1);
+    msg[sizeof(msg) - 1] = '\0';
+    // Chat as long as a line may be reaches the peer whole, in a call...
+    offhook(&c[0]);
+    client_send(&c[0], "dial 1");
+    client_expect(&c[0], "RING BACK");
+    client_expect(&c[1], "RINGING");
+    client_send(&c[1], "pickup");
+    client_expect(&c[1], "CONNECTED 0");
+    client_expect(&c[0], "CONNECTED 1");
+    client_send(&c[0], "chat %s", msg);
+    client_expect(&c[0], "CONNECTED 1");
+    client_expect(&c[1], "CHAT %s", msg);
+    client_send(&c[1], "chat short");
+    client_expect(&c[1], "CONNECTED 0");
+    client_expect(&c[0], "CHAT short");
+    // ...and in a conference
+    room_join(&c[2], 5);
+    room_join(&c[3], 5);
+    client_send(&c[2], "chat %s", msg);
+    client_expect(&c[2], "CONNECTED 5");
+    client_expect(&c[3], "CHAT %s", msg);
+    fini(0);
+}
+
+/*
+ * Enough file descriptors for a full room, on both sides.
+ */
+static void init_conf_full() {
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    cr_assert(rl.rlim_max >= 2 * CONF_MAX_MEMBERS + 64,
+	      "Too few file descriptors for a full room\n");
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    init_conf();
+}
+
+Test(SUITE, conf_full_test, .init = init_conf_full, .fini = killall, .timeout = 60) {
+    int n = CONF_MAX_MEMBERS + 1;
+    CLIENT *c = calloc(n, sizeof(CLIENT));
+    cr_assert_not_null(c, "Out of memory\n");
+    for(int i = 0; i < n; i++) {
+	client_open(&c[i]);
+	client_send(&c[i], "pickup");
+	client_send(&c[i], "dial 887");
+    }
+    for(int i = 0; i < CONF_MAX_MEMBERS; i++) {
+	client_expect(&c[i], "DIAL TONE");
+	client_expect(&c[i], "CONNECTED 7");
+    }
+    // One more than the room holds gets a busy signal
+    client_expect(&c[n - 1], "DIAL TONE");
+    client_expect(&c[n - 1], "BUSY SIGNAL");
+    cr_assert_eq(stat_value("conf_members"), CONF_MAX_MEMBERS, "expected a full room\n");
+    // A member leaving frees a place
+    client_send(&c[0], "hangup");
+    client_expect(&c[0], "ON HOOK %d", c[0].ext);
+    client_send(&c[n - 1], "hangup");
+    client_expect(&c[n - 1], "ON HOOK %d", c[n - 1].ext);
+    room_join(&c[n - 1], 7);
+    for(int i = 0; i < n; i++)
+	client_close(&c[i]);
+    free(c);
+    fini(0);
+}
+
+#undef SUITE
+#define SUITE page_suite
+
+/*
+ * Check that the next line is the report of a page delivered to n TUs.
+ */
+static void paged(CLIENT *c, int n) {
+    int sent;
+    long us;
+    char *line = client_line(c, CLIENT_WAIT_MSEC);
+    cr_assert_not_null(line, "Expected PAGED from extension %d, got nothing\n", c->ext);
+    cr_assert(sscanf(line, "PAGED %d %ld", &sent, &us) == 2,
+	      "Expected PAGED, got \"%s\"\n", line);
+    cr_assert_eq(sent, n, "expected page delivered to %d, was %d\n", n, sent);
+    cr_assert(us >= 0, "expected delivery time, was %ld us\n", us);
+}
+
+Test(SUITE, page_on_hook_test, .init = init, .fini = killall, .timeout = 30) {
+    CLIENT c[6];
+    open_clients(c, 6);
+    offhook(&c[2]);
+    offhook(&c[3]);
+    client_send(&c[3], "dial 4");
+    client_expect(&c[3], "RING BACK");
+    client_expect(&c[4], "RINGING");
+    client_send(&c[4], "pickup");
+    client_expect(&c[4], "CONNECTED 3");
+    client_expect(&c[3], "CONNECTED 4");
+    // Only the extensions on hook other than the pager are paged
+    client_send(&c[0], "page fire drill at noon");
+    client_expect(&c[1], "PAGE fire drill at noon");
+    client_expect(&c[5], "PAGE fire drill at noon");
+    paged(&c[0], 2);
+    for(int i = 0; i < 6; i++)
+	client_quiet(&c[i], 100);
+    cr_assert_eq(stat_value("pages"), 1, "expected 1 page\n");
+    cr_assert_eq(stat_value("page_deliveries"), 2, "expected 2 pages delivered\n");
+    // Let the connection that read the statistics go before paging again
+    usleep(200000);
+    // A page does not change the state of the TUs paged
+    client_send(&c[1], "pickup");
+    client_expect(&c[1], "DIAL TONE");
+    client_send(&c[3], "hangup");
+    client_expect(&c[3], "ON HOOK 3");
+    client_expect(&c[4], "DIAL TONE");
+    client_send(&c[5], "page all clear");
+    client_expect(&c[0], "PAGE all clear");
+    client_expect(&c[3], "PAGE all clear");
+    paged(&c[5], 2);
+    cr_assert_eq(stat_value("pages"), 2, "expected 2 pages\n");
+    cr_assert_eq(stat_value("page_deliveries"), 4, "expected 4 pages delivered\n");
+    fini(0);
+}
+
+#undef SUITE
+#define SUITE watch_suite
+
+Test(SUITE, watch_notify_test, .init = init, .fini = killall, .timeout = 30) {
+    CLIENT c[3];
+    open_clients(c, 3);
+    client_send(&c[0], "watch 1");
+    client_expect(&c[0], "STATE 1 ON HOOK");
+    client_send(&c[0], "watch 50");
+    client_expect(&c[0], "STATE 50 UNREGISTERED");
+    offhook(&c[1]);
+    client_expect(&c[0], "STATE 1 DIAL TONE");
+    client_send(&c[1], "dial 2");
+    client_expect(&c[1], "RING BACK");
+    client_expect(&c[2], "RINGING");
+    client_expect(&c[0], "STATE 1 RING BACK");
+    // Extension 2 is not watched
+    client_send(&c[2], "pickup");
+    client_expect(&c[2], "CONNECTED 1");
+    client_expect(&c[1], "CONNECTED 2");
+    client_expect(&c[0], "STATE 1 CONNECTED");
+    client_close(&c[1]);
+    client_expect(&c[0], "STATE 1 UNREGISTERED");
+    fini(0);
+}
+
+Test(SUITE, watch_coalesce_test, .init = init, .fini = killall, .timeout = 30) {
+    CLIENT c[3];
+    open_clients(c, 3);
+    client_send(&c[0], "watch 1");
+    client_expect(&c[0], "STATE 1 ON HOOK");
+    // Changes made by one batch of commands are reported as the last
+    client_send(&c[1], "pickup" EOL "dial 2");
+    client_expect(&c[1], "DIAL TONE");
+    client_expect(&c[1], "RING BACK");
+    client_expect(&c[2], "RINGING");
+    client_expect(&c[0], "STATE 1 RING BACK");
+    client_quiet(&c[0], 100);
+    cr_assert_gt(stat_value("presence_coalesced"), 0, "expected changes coalesced\n");
+    fini(0);
+}
+
+Test(SUITE, watch_disconnect_test, .init = init, .fini = killall, .timeout = 30) {
+    CLIENT c[3];
+    open_clients(c, 3);
+    for(int i = 0; i < 2; i++) {
+	for(int j = 1; j < 3; j++) {
+	    client_send(&c[i], "watch %d", j);
+	    client_expect(&c[i], "STATE %d ON HOOK", j);
+	}
+    }
+    cr_assert_eq(stat_value("presence_watches"), 4, "expected 4 watches\n");
+    // A watcher going away drops all its watches
+    client_close(&c[0]);
+    usleep(200000);
+    cr_assert_eq(stat_value("presence_watches"), 2, "expected 2 watches\n");
+    offhook(&c[2]);
+    client_expect(&c[1], "STATE 2 DIAL TONE");
+    client_close(&c[1]);
+    usleep(200000);
+    cr_assert_eq(stat_value("presence_watches"), 0, "expected no watch\n");
+    fini(0);
+}
+
+#undef SUITE
+#define SUITE timeout_suite
+
+static void init_timeout() {
+    start_server("timeout ringing 400\n"
+		 "timeout dialtone 600\n"
+		 "timeout busy 300\n", NULL);
+}
+
+static long now_msec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+Test(SUITE, ringing_timeout_test, .init = init_timeout, .fini = killall, .timeout = 30) {
+    CLIENT c[2];
+    open_clients(c, 2);
+    offhook(&c[0]);
+    client_send(&c[0], "dial 1");
+    client_expect(&c[0], "RING BACK");
+    client_expect(&c[1], "RINGING");
+    long t = now_msec();
+    // No answer: the callee stops ringing, the caller gets dial tone back
+    client_expect(&c[1], "ON HOOK 1");
+    client_expect(&c[0], "DIAL TONE");
+    t = now_msec() - t;
+    cr_assert(t > 300 && t < 1000, "ringing timed out after %ld ms\n", t);
+    fini(0);
+}
+
+Test(SUITE, dialtone_busy_timeout_test, .init = init_timeout, .fini = killall, .timeout = 30) {
+    CLIENT c[2];
+    open_clients(c, 2);
+    long t = now_msec();
+    offhook(&c[0]);
+    client_expect(&c[0], "ON HOOK 0");
+    t = now_msec() - t;
+    cr_assert(t > 500 && t < 1200, "dial tone timed out after %ld ms\n", t);
+    offhook(&c[1]);
+    offhook(&c[0]);
+    client_send(&c[0], "dial 1");
+    client_expect(&c[0], "BUSY SIGNAL");
+    t = now_msec();
+    client_expect(&c[0], "ON HOOK 0");
+    t = now_msec() - t;
+    cr_assert(t > 200 && t < 900, "busy signal timed out after %ld ms\n", t);
+    fini(0);
+}
+
+Test(SUITE, timeout_cancel_test, .init = init_timeout, .fini = killall, .timeout = 30) {
+    CLIENT c[2];
+    open_clients(c, 2);
+    offhook(&c[0]);
+    client_send(&c[0], "dial 1");
+    client_expect(&c[0], "RING BACK");
+    client_expect(&c[1], "RINGING");
+    // Answered just before the ringing would have timed out
+    usleep(300000);
+    client_send(&c[1], "pickup");
+    client_expect(&c[1], "CONNECTED 0");
+    client_expect(&c[0], "CONNECTED 1");
+    client_quiet(&c[0], 500);
+    client_quiet(&c[1], 500);
+    client_send(&c[0], "chat still there");
+    client_expect(&c[0], "CONNECTED 1");
+    client_expect(&c[1], "CHAT still there");
+    cr_assert_eq(stat_value("timeouts"), 0, "expected no timeout\n");
+    fini(0);
+}
+
+#undef SUITE
+#define SUITE keepalive_suite
+
+static void init_keepalive() {
+    start_server("timeout idle 500\n"
+		 "timeout keepalive 5000\n", NULL);
+}
+
+Test(SUITE, idle_reap_test, .init = init_keepalive, .fini = killall, .timeout = 30) {
+    CLIENT c[2];
+    open_clients(c, 2);
+    // A client that pings stays, while a silent one is dropped
+    for(int i = 0; i < 8; i++) {
+	client_send(&c[1], "ping");
+	client_expect(&c[1], "PONG");
+	usleep(200000);
+    }
+    cr_assert(client_line(&c[0], 1000) == NULL, "expected extension 0 dropped\n");
+    client_close(&c[0]);
+    cr_assert_eq(stat_value("ghosts_reaped"), 1, "expected 1 connection reaped\n");
+    // The extension of the connection dropped is no longer registered
+    offhook(&c[1]);
+    client_send(&c[1], "dial 0");
+    client_expect(&c[1], "ERROR");
+    client_send(&c[1], "hangup");
+    client_expect(&c[1], "ON HOOK 1");
+    client_send(&c[1], "ping");
+    client_expect(&c[1], "PONG");
+    cr_assert_eq(stat_value("ghosts_reaped"), 1, "expected 1 connection reaped\n");
+    fini(0);
+}
+
+#undef SUITE
+#define SUITE ratelimit_suite
+
+static void init_ratelimit() {
+    start_server("limit commands 20\n"
+		 "limit chat 2000\n", NULL);
+}
+
+/*
+ * Send n pings at once, and count the answers until the server goes quiet.
+ */
+static int pongs(CLIENT *c, int n) {
+    char buf[1024] = "";
+    for(int i = 1; i < n; i++)
+	strcat(buf, "ping" EOL);
+    strcat(buf, "ping");
+    client_send(c, "%s", buf);
+    int got = 0;
+    char *line;
+    while((line = client_line(c, 500)) != NULL) {
+	cr_assert_str_eq(line, "PONG", "expected PONG, got \"%s\"\n", line);
+	got++;
+    }
+    return got;
+}
+
+Test(SUITE, command_drop_test, .init = init_ratelimit, .fini = killall, .timeout = 30) {
+    CLIENT c[3];
+    open_clients(c, 3);
+    // A second's worth of commands is carried out, the rest dropped
+    int got = pongs(&c[0], 100);
+    cr_assert(got >= 20 && got <= 25, "expected about 20 PONGs, got %d\n", got);
+    long dropped = stat_value("cmds_dropped");
+    cr_assert_eq(dropped, 100 - got, "expected %d commands dropped, was %ld\n", 100 - got, dropped);
+    // Other connections are not held back
+    cr_assert_eq(pongs(&c[1], 15), 15, "expected 15 PONGs\n");
+    // Hangup always goes through
+    offhook(&c[2]);
+    client_send(&c[2], "dial 0");
+    client_expect(&c[2], "RING BACK");
+    client_expect(&c[0], "RINGING");
+    pongs(&c[2], 30);
+    client_send(&c[2], "hangup");
+    client_expect(&c[2], "ON HOOK 2");
+    client_expect(&c[0], "ON HOOK 0");
+    fini(0);
+}
+
+Test(SUITE, chat_throttle_test, .init = init_ratelimit, .fini = killall, .timeout = 30) {
+    CLIENT c[2];
+    open_clients(c, 2);
+    offhook(&c[0]);
+    client_send(&c[0], "dial 1");
+    client_expect(&c[0], "RING BACK");
+    client_expect(&c[1], "RINGING");
+    client_send(&c[1], "pickup");
+    client_expect(&c[1], "CONNECTED 0");
+    client_expect(&c[0], "CONNECTED 1");
+    char msg[901];
+    memset(msg, 'x', sizeof(msg) - 1);
+    msg[sizeof(msg) - 1] = '\0';
+    // Only a second's worth of chat bytes gets through
+    for(int i = 0; i < 5; i++)
+	client_send(&c[0], "chat %s", msg);
+    client_expect(&c[1], "CHAT %s", msg);
+    client_expect(&c[1], "CHAT %s", msg);
+    client_quiet(&c[1], 500);
+    cr_assert_eq(stat_value("chats_throttled"), 3, "expected 3 chats throttled\n");
+    cr_assert_eq(stat_value("cmds_dropped"), 0, "expected no command dropped\n");
+    fini(0);
+}
+
+#undef SUITE
+#define SUITE admission_suite
+
+/*
+ * Connect to the server, and tell whether it refused the connection with
+ * "BUSY" and closed it, rather than admitting it.
+ */
+static int client_refused(CLIENT *c) {
+    client_connect(c);
+    char *line = client_line(c, CLIENT_WAIT_MSEC);
+    cr_assert_not_null(line, "Nothing on connecting\n");
+    if(strcmp(line, "BUSY")) {
+	cr_assert(sscanf(line, "ON HOOK %d", &c->ext) == 1, "Expected ON HOOK, got \"%s\"\n", line);
+	return 0;
+    }
+    char b;
+    struct pollfd pfd = { c->fd, POLLIN, 0 };
+    cr_assert(poll(&pfd, 1, CLIENT_WAIT_MSEC) == 1 && read(c->fd, &b, 1) == 0,
+	      "Connection refused but not closed\n");
+    client_close(c);
+    return 1;
+}
+
+static void init_max_conns() {
+    start_server("limit connections 3\n", NULL);
+}
+
+Test(SUITE, max_conns_test, .init = init_max_conns, .fini = killall, .timeout = 30) {
+    CLIENT c[4];
+    open_clients(c, 3);
+    cr_assert(client_refused(&c[3]), "expected the fourth connection refused\n");
+    // Closing one makes room for another
+    client_close(&c[2]);
+    usleep(200000);
+    cr_assert_eq(stat_value("conns_rejected"), 1, "expected 1 connection rejected\n");
+    cr_assert(!client_refused(&c[2]), "expected the connection admitted\n");
+    fini(0);
+}
+
+static void init_max_setup() {
+    start_server("limit setup 1\n", NULL);
+}
+
+Test(SUITE, max_setup_test, .init = init_max_setup, .fini = killall, .timeout = 30) {
+    CLIENT c[3];
+    open_clients(c, 2);
+    offhook(&c[0]);
+    client_send(&c[0], "dial 1");
+    client_expect(&c[0], "RING BACK");
+    client_expect(&c[1], "RINGING");
+    cr_assert(client_refused(&c[2]), "expected a connection refused during call setup\n");
+    client_send(&c[1], "pickup");
+    client_expect(&c[1], "CONNECTED 0");
+    client_expect(&c[0], "CONNECTED 1");
+    cr_assert_eq(stat_value("calls_setup"), 0, "expected no call in setup\n");
+    cr_assert_eq(stat_value("conns_rejected"), 1, "expected 1 connection rejected\n");
+    fini(0);
+}
+
+static void init_conn_rate() {
+    start_server("limit accept 5\n", NULL);
+}
+
+Test(SUITE, conn_rate_test, .init = init_conn_rate, .fini = killall, .timeout = 30) {
+    CLIENT c[10];
+    // Connections over the burst of 5 in a second are refused
+    int refused = 0;
+    for(int i = 0; i < 10; i++)
+	refused += client_refused(&c[i]);
+    cr_assert(refused >= 4 && refused <= 5, "expected 5 connections refused, was %d\n", refused);
+    sleep(1);
+    cr_assert_eq(stat_value("conns_rejected"), refused, "expected %d connections rejected\n", refused);
+    fini(0);
+}
+
+#undef SUITE
+#define SUITE fairness_suite
+
+#define PIPELINE_CMDS (300 * SERVICE_CMD_BUDGET)
+
+/*
+ * Write n copies of a command line at once.
+ */
+static void client_pipeline(CLIENT *c, char *cmd, int n) {
+    size_t len = strlen(cmd) + strlen(EOL);
+    char *buf = malloc(n * len + 1);
+    cr_assert_not_null(buf, "Out of memory\n");
+    for(int i = 0; i < n; i++)
+	sprintf(buf + i * len, "%s%s", cmd, EOL);
+    for(size_t off = 0; off < n * len; ) {
+	ssize_t w = write(c->fd, buf + off, n * len - off);
+	cr_assert(w > 0, "write: %s\n", strerror(errno));
+	off += w;
+    }
+    free(buf);
+}
+
+/*
+ * A client pipelining many times the commands carried out in one turn has
+ * them all carried out in order, while another client is answered in
+ * between; the commands pending when a client closes are still carried out.
+ */
+static void pipeline_test() {
+    CLIENT c[3];
+    open_clients(c, 3);
+    client_pipeline(&c[0], "ping", PIPELINE_CMDS);
+    client_pipeline(&c[0], "pickup", 1);
+    client_pipeline(&c[0], "ping", PIPELINE_CMDS);
+    client_send(&c[1], "ping");
+    client_expect(&c[1], "PONG");
+    for(int i = 0; i < PIPELINE_CMDS; i++)
+	client_expect(&c[0], "PONG");
+    client_expect(&c[0], "DIAL TONE");
+    for(int i = 0; i < PIPELINE_CMDS; i++)
+	client_expect(&c[0], "PONG");
+    client_pipeline(&c[2], "ping", PIPELINE_CMDS);
+    shutdown(c[2].fd, SHUT_WR);
+    int got = 0;
+    char *line;
+    while((line = client_line(&c[2], CLIENT_WAIT_MSEC)) != NULL) {
+	if(!strcmp(line, "PONG"))
+	    got++;
+	else
+	    cr_assert_str_eq(line, "ON HOOK 2", "expected PONG, got \"%s\"\n", line);
+    }
+    cr_assert_eq(got, PIPELINE_CMDS, "expected %d PONGs, got %d\n", PIPELINE_CMDS, got);
+}
+
+Test(SUITE, epoll_pipeline_test, .init = init_epoll, .fini = killall, .timeout = 30) {
+    pipeline_test();
+    fini(0);
+}
+
+Test(SUITE, uring_pipeline_test, .init = init_uring, .fini = killall, .timeout = 30) {
+    pipeline_test();
+    fini(0);
+}
@@ -0,0 +1,116 @@
+/*
+ * Microbenchmark for client command parsing.
+ *
+ * Parses a realistic mix of command lines repeatedly, first with the
+ * strncmp()/atoi() chain that the service loop used to contain, then with
+ * command_parse(), and reports the number of commands parsed per second.
+ *
+ * Usage: util/cmdbench [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+
+#include "command.h"
+
+/*
+ * Mix of commands, roughly as seen from the call generators: each call is
+ * a pickup, a dial and a hangup on each side, with some chat in between.
+ */
+static const char *mix[] = {
+    "pickup",
+    "dial 12",
+    "chat hello there",
+    "chat how are you doing today?",
+    "pickup",
+    "chat fine thanks",
+    "dial 4095",
+    "chat bye",
+    "hangup",
+    "hangup",
+    "dial x12",
+    "chat",
+};
+
+#define NMIX (sizeof(mix) / sizeof(mix[0]))
+
+/*
+ * The previous parser, reduced to producing the same result as
+ * command_parse() instead of dispatching.
+ */
+static int old_parse(char *cmd, COMMAND *cp) {
+    while (isspace((unsigned char)*cmd)) {
+        cmd++;
+    }
+    cp->ext = -1;
+    cp->arg = NULL;
+    if (strncmp(cmd, "pickup", 6) == 0 && (cmd[6] == '\0' || isspace((unsigned char)cmd[6]))) {
+        cp->cmd = CMD_PICKUP;
+    } else if (strncmp(cmd, "hangup", 6) == 0 && (cmd[6] == '\0' || isspace((unsigned char)cmd[6]))) {
+        cp->cmd = CMD_HANGUP;
+    } else if (strncmp(cmd, "dial", 4) == 0 && isspace((unsigned char)cmd[4])) {
+        char *ext_str = cmd + 4;
+        while (isspace((unsigned char)*ext_str)) {
+            ext_str++;
+        }
+        cp->cmd = CMD_DIAL;
+        cp->ext = atoi(ext_str);
+    } else if (strncmp(cmd, "chat", 4) == 0 && (cmd[4] == '\0' || isspace((unsigned char)cmd[4]))) {
+        char *msg = cmd + 4;
+        while (isspace((unsigned char)*msg)) {
+            msg++;
+        }
+        cp->cmd = CMD_CHAT;
+        cp->arg = msg;
+    } else {
+        cp->cmd = CMD_INVALID;
+        return -1;
+    }
+    return 0;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    long iters = argc > 1 ? atol(argv[1]) : 2000000;
+    char lines[NMIX][64];
+    size_t lens[NMIX];
+    for (size_t i = 0; i < NMIX; i++) {
+        strcpy(lines[i], mix[i]);
+        lens[i] = strlen(mix[i]);
+    }
+
+    COMMAND c;
+    volatile long sink = 0;
+
+    double t0 = now();
+    for (long n = 0; n < iters; n++) {
+        for (size_t i = 0; i < NMIX; i++) {
+            old_parse(lines[i], &c);
+            sink += c.cmd + c.ext;
+        }
+    }
+    double t_old = now() - t0;
+
+    t0 = now();
+    for (long n = 0; n < iters; n++) {
+        for (size_t i = 0; i < NMIX; i++) {
+            command_parse(lines[i], lens[i], &c);
+            sink += c.cmd + c.ext;
+        }
+    }
+    double t_new = now() - t0;
+
+    double total = (double)iters * NMIX;
+    printf("strncmp/atoi:   %12.0f commands/s\n", total / t_old);
+    printf("command_parse:  %12.0f commands/s\n", total / t_new);
+    printf("speedup:        %12.2fx\n", t_old / t_new);
+    return 0;
+}
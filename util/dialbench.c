@@ -0,0 +1,176 @@
+/*
+ * Contention benchmark for the extension table lookup done by pbx_dial().
+ *
+ * Reader threads look up random extensions in a table while writer threads
+ * continually register and unregister entries, as after a network flap.
+ * This is done first with every access under a single mutex, as pbx_dial()
+ * used to do, then with atomic slots read inside an epoch critical section
+ * and entries freed through epoch_retire(), as it does now.  For each, the
+ * lookup rate and the median and 99th percentile lookup latency are reported.
+ *
+ * Usage: util/dialbench [readers] [writers] [seconds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+
+#include "epoch.h"
+
+#define TABLE_SIZE 4096
+#define SAMPLE_EVERY 64
+#define MAX_SAMPLES (1 << 20)
+
+/*
+ * Stand-in for a TU.
+ */
+struct entry {
+    int ext;
+};
+
+static _Atomic(struct entry *) table[TABLE_SIZE];
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int running;
+static int use_epoch;
+
+struct reader {
+    pthread_t tid;
+    unsigned long lookups;
+    unsigned long found;
+    unsigned nsamples;
+    unsigned *samples;              // Sampled latencies (ns)
+};
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int lookup(unsigned ext) {
+    int found = 0;
+    if (use_epoch) {
+        epoch_enter();
+        struct entry *e = atomic_load_explicit(&table[ext], memory_order_acquire);
+        if (e != NULL) {
+            found = e->ext == (int)ext;
+        }
+        epoch_exit();
+    } else {
+        pthread_mutex_lock(&table_lock);
+        struct entry *e = atomic_load_explicit(&table[ext], memory_order_relaxed);
+        if (e != NULL) {
+            found = e->ext == (int)ext;
+        }
+        pthread_mutex_unlock(&table_lock);
+    }
+    return found;
+}
+
+static void *reader_thread(void *arg) {
+    struct reader *r = arg;
+    unsigned seed = (unsigned)(uintptr_t)r;
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        unsigned ext = rand_r(&seed) % TABLE_SIZE;
+        if (r->lookups % SAMPLE_EVERY == 0 && r->nsamples < MAX_SAMPLES) {
+            unsigned long t0 = now_ns();
+            r->found += lookup(ext);
+            r->samples[r->nsamples++] = now_ns() - t0;
+        } else {
+            r->found += lookup(ext);
+        }
+        r->lookups++;
+    }
+    return NULL;
+}
+
+static void *writer_thread(void *arg) {
+    unsigned seed = (unsigned)(uintptr_t)arg;
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        unsigned ext = rand_r(&seed) % TABLE_SIZE;
+        struct entry *n = malloc(sizeof(struct entry));
+        n->ext = ext;
+        pthread_mutex_lock(&table_lock);
+        struct entry *old = atomic_exchange(&table[ext], n);
+        pthread_mutex_unlock(&table_lock);
+        if (old != NULL) {
+            if (use_epoch) {
+                epoch_retire(free, old);
+            } else {
+                free(old);  // No reader can hold it: they use the mutex
+            }
+        }
+    }
+    return NULL;
+}
+
+static int cmp_unsigned(const void *a, const void *b) {
+    unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(const char *name, int nreaders, int nwriters, double seconds) {
+    struct reader *readers = calloc(nreaders, sizeof(struct reader));
+    pthread_t *writers = calloc(nwriters, sizeof(pthread_t));
+    for (int i = 0; i < nreaders; i++) {
+        readers[i].samples = malloc(MAX_SAMPLES * sizeof(unsigned));
+    }
+
+    atomic_store(&running, 1);
+    for (int i = 0; i < nreaders; i++) {
+        pthread_create(&readers[i].tid, NULL, reader_thread, &readers[i]);
+    }
+    for (int i = 0; i < nwriters; i++) {
+        pthread_create(&writers[i], NULL, writer_thread, (void *)(uintptr_t)(i + 1));
+    }
+    struct timespec ts = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+    nanosleep(&ts, NULL);
+    atomic_store(&running, 0);
+
+    unsigned long lookups = 0;
+    size_t nsamples = 0;
+    for (int i = 0; i < nreaders; i++) {
+        pthread_join(readers[i].tid, NULL);
+        lookups += readers[i].lookups;
+        nsamples += readers[i].nsamples;
+    }
+    for (int i = 0; i < nwriters; i++) {
+        pthread_join(writers[i], NULL);
+    }
+    epoch_barrier();
+
+    unsigned *all = malloc((nsamples + 1) * sizeof(unsigned));
+    size_t k = 0;
+    for (int i = 0; i < nreaders; i++) {
+        for (unsigned j = 0; j < readers[i].nsamples; j++) {
+            all[k++] = readers[i].samples[j];
+        }
+        free(readers[i].samples);
+    }
+    qsort(all, nsamples, sizeof(unsigned), cmp_unsigned);
+    printf("%-8s %14.0f lookups/s   p50 %6u ns   p99 %6u ns\n", name, lookups / seconds,
+           nsamples ? all[nsamples / 2] : 0, nsamples ? all[nsamples * 99 / 100] : 0);
+    free(all);
+    free(readers);
+    free(writers);
+
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        free(atomic_exchange(&table[i], NULL));
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int nreaders = argc > 1 ? atoi(argv[1]) : 4;
+    int nwriters = argc > 2 ? atoi(argv[2]) : 2;
+    double seconds = argc > 3 ? atof(argv[3]) : 2.0;
+
+    printf("%d readers, %d writers, %.1f s each\n", nreaders, nwriters, seconds);
+    use_epoch = 0;
+    run("mutex", nreaders, nwriters, seconds);
+    use_epoch = 1;
+    run("epoch", nreaders, nwriters, seconds);
+    return 0;
+}
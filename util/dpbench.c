@@ -0,0 +1,158 @@
+/*
+ * Lookup benchmark for the dial plan.
+ *
+ * A dial plan of 100000 rules (by default) is compiled: aliases for
+ * eight-digit numbers, routes for seven-digit prefixes, maps for six-digit
+ * prefixes, and a pickup code.  Random numbers, most of which match a rule,
+ * are then routed through the compiled trie, and through a scan of the rule
+ * list for the longest matching prefix, as a simple table would be searched.
+ * The compile time and the lookup rates are reported.
+ *
+ * Usage: util/dpbench [rules] [lookups]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+#include "dialplan.h"
+
+#define NUMBERS 4096
+#define NUMBER_LEN 16
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Route a number by scanning every rule.
+ */
+static int scan_lookup(const DIALPLAN_RULE *rules, size_t n, const char *digits,
+                       size_t len, DIALPLAN_MATCH *m) {
+    size_t best = 0;
+    int found = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t plen = strlen(rules[i].prefix);
+        if (plen > len || plen <= best || memcmp(rules[i].prefix, digits, plen) != 0) {
+            continue;
+        }
+        EXTNUM ext = rules[i].ext;
+        if (rules[i].action == DP_ALIAS && plen != len) {
+            continue;
+        }
+        if (rules[i].action == DP_MAP || rules[i].action == DP_PICKUP) {
+            EXTNUM x = dialplan_number(digits + plen, len - plen);
+            if (x < 0) {
+                continue;
+            }
+            ext = rules[i].action == DP_MAP ? ext + x : x;
+        }
+        best = plen;
+        m->action = rules[i].action;
+        m->ext = ext;
+        found = 1;
+    }
+    return found ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    size_t nrules = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    unsigned long lookups = argc > 2 ? strtoul(argv[2], NULL, 10) : 10000000;
+    if (nrules < 10 || nrules > 1000000) {
+        fprintf(stderr, "Usage: %s [rules (10 to 1000000)] [lookups]\n", argv[0]);
+        return 1;
+    }
+
+    // Rules with distinct prefixes: 6/10 aliases, 3/10 routes, 1/10 maps
+    DIALPLAN_RULE *rules = malloc(nrules * sizeof(DIALPLAN_RULE));
+    char *text = malloc(nrules * NUMBER_LEN);
+    if (rules == NULL || text == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (size_t i = 0; i < nrules; i++) {
+        char *p = text + i * NUMBER_LEN;
+        if (i == 0) {
+            strcpy(p, "*7");
+            rules[i].action = DP_PICKUP;
+        } else if (i % 10 < 6) {
+            snprintf(p, NUMBER_LEN, "2%07lu", (unsigned long)(i * 7919 % 10000000));
+            rules[i].action = DP_ALIAS;
+        } else if (i % 10 < 9) {
+            snprintf(p, NUMBER_LEN, "3%06lu", (unsigned long)(i * 7 % 1000000));
+            rules[i].action = DP_ROUTE;
+        } else {
+            snprintf(p, NUMBER_LEN, "4%05lu", (unsigned long)(i / 10));
+            rules[i].action = DP_MAP;
+        }
+        rules[i].prefix = p;
+        rules[i].ext = i;
+    }
+
+    unsigned long t0 = now_ns();
+    DIALPLAN *dp = dialplan_compile(rules, nrules, NULL);
+    unsigned long t1 = now_ns();
+    if (dp == NULL) {
+        fprintf(stderr, "Failed to compile dial plan\n");
+        return 1;
+    }
+    printf("%zu rules compiled in %.1f ms\n", dialplan_rules(dp), (t1 - t0) / 1e6);
+
+    // Numbers to dial: mostly the prefixes of rules, extended as they allow
+    static char numbers[NUMBERS][NUMBER_LEN];
+    static size_t lens[NUMBERS];
+    srandom(1);
+    for (int i = 0; i < NUMBERS; i++) {
+        size_t r = random() % nrules;
+        if (i % 8 == 0) {
+            snprintf(numbers[i], NUMBER_LEN, "5%06ld", random() % 1000000);
+        } else if (rules[r].action == DP_ALIAS) {
+            snprintf(numbers[i], NUMBER_LEN, "%s", rules[r].prefix);
+        } else {
+            snprintf(numbers[i], NUMBER_LEN, "%s%03ld", rules[r].prefix, random() % 1000);
+        }
+        lens[i] = strlen(numbers[i]);
+    }
+
+    // Check that both agree before timing them
+    for (int i = 0; i < NUMBERS; i++) {
+        DIALPLAN_MATCH a, b;
+        int ra = dialplan_lookup(dp, numbers[i], lens[i], &a);
+        int rb = scan_lookup(rules, nrules, numbers[i], lens[i], &b);
+        if (ra != rb || (ra == 0 && (a.action != b.action || a.ext != b.ext))) {
+            fprintf(stderr, "Mismatch routing %s\n", numbers[i]);
+            return 1;
+        }
+    }
+
+    unsigned long matched = 0;
+    DIALPLAN_MATCH m;
+    t0 = now_ns();
+    for (unsigned long i = 0; i < lookups; i++) {
+        matched += dialplan_lookup(dp, numbers[i % NUMBERS], lens[i % NUMBERS], &m) == 0;
+    }
+    t1 = now_ns();
+    double secs = (t1 - t0) / 1e9;
+    printf("%-6s %12.0f lookups/s  %8.1f ns/lookup  (%lu matched)\n",
+           "trie", lookups / secs, secs * 1e9 / lookups, matched);
+
+    // The scan is so much slower that a small fraction of the lookups will do
+    unsigned long scans = lookups / 10000 ? lookups / 10000 : 1;
+    matched = 0;
+    t0 = now_ns();
+    for (unsigned long i = 0; i < scans; i++) {
+        matched += scan_lookup(rules, nrules, numbers[i % NUMBERS], lens[i % NUMBERS], &m) == 0;
+    }
+    t1 = now_ns();
+    secs = (t1 - t0) / 1e9;
+    printf("%-6s %12.0f lookups/s  %8.1f ns/lookup  (%lu matched)\n",
+           "scan", scans / secs, secs * 1e9 / scans, matched);
+
+    dialplan_free(dp);
+    free(rules);
+    free(text);
+    return 0;
+}
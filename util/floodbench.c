@@ -0,0 +1,214 @@
+/*
+ * Fairness benchmark for a running PBX server.
+ *
+ * Light clients each send "ping" and wait for "PONG", over and over with a
+ * short pause in between, first on their own and then alongside flooding
+ * clients that pipeline "ping" as fast as the server takes it.  For each
+ * run, the median, 99th percentile and longest round-trip time of the light
+ * clients are reported, with the rate at which the flooders were served.
+ * Run the server with a single reactor (e.g. "bin/pbx -p 9999 -m epoll -t 1")
+ * so that all the clients share one thread.
+ *
+ * Usage: util/floodbench <port> [light clients] [flooders] [seconds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define MAX_SAMPLES (1 << 16)
+#define PAUSE_US 2000
+#define FLOOD_CHUNK 1000            // Pings sent in each write by a flooder
+
+static int port;
+static atomic_int running;
+static atomic_ulong flood_pongs;
+static atomic_int flood_dropped;    // Flooders disconnected by the server
+
+struct light {
+    pthread_t tid;
+    int fd;
+    unsigned nsamples;
+    unsigned *samples;              // Round-trip times (us)
+};
+
+struct flooder {
+    pthread_t writer, reader;
+    int fd;
+};
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Connect to the server and wait for the "ON HOOK" line.
+ */
+static int client_connect(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    char buf[64];
+    size_t n = 0;
+    while (n == 0 || buf[n - 1] != '\n') {
+        ssize_t r = recv(fd, buf + n, sizeof(buf) - n, 0);
+        if (r <= 0 || strncmp(buf, "ON HOOK", r < 7 ? r : 7) != 0) {
+            fprintf(stderr, "Connection refused by the server\n");
+            exit(EXIT_FAILURE);
+        }
+        n += r;
+    }
+    return fd;
+}
+
+static void *light_thread(void *arg) {
+    struct light *l = arg;
+    char buf[64];
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        unsigned long t0 = now_ns();
+        if (send(l->fd, "ping\r\n", 6, 0) != 6) {
+            break;
+        }
+        size_t n = 0;
+        while (n < 6) {
+            ssize_t r = recv(l->fd, buf + n, sizeof(buf) - n, 0);
+            if (r <= 0) {
+                return NULL;
+            }
+            n += r;
+        }
+        if (l->nsamples < MAX_SAMPLES) {
+            l->samples[l->nsamples++] = (now_ns() - t0) / 1000;
+        }
+        usleep(PAUSE_US);
+    }
+    return NULL;
+}
+
+static void *flood_writer(void *arg) {
+    struct flooder *f = arg;
+    static char chunk[FLOOD_CHUNK * 6];
+    for (int i = 0; i < FLOOD_CHUNK; i++) {
+        memcpy(chunk + i * 6, "ping\r\n", 6);
+    }
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        if (send(f->fd, chunk, sizeof(chunk), MSG_NOSIGNAL) <= 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *flood_reader(void *arg) {
+    struct flooder *f = arg;
+    char buf[65536];
+    ssize_t r;
+    while ((r = recv(f->fd, buf, sizeof(buf), 0)) > 0) {
+        if (atomic_load_explicit(&running, memory_order_relaxed)) {
+            atomic_fetch_add_explicit(&flood_pongs, r / 6, memory_order_relaxed);
+        }
+    }
+    if (atomic_load_explicit(&running, memory_order_relaxed)) {
+        atomic_fetch_add(&flood_dropped, 1);
+    }
+    return NULL;
+}
+
+static int cmp_unsigned(const void *a, const void *b) {
+    unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(const char *name, int nlight, int nflood, double seconds) {
+    struct light *lights = calloc(nlight, sizeof(struct light));
+    struct flooder *flooders = calloc(nflood, sizeof(struct flooder));
+    for (int i = 0; i < nlight; i++) {
+        lights[i].fd = client_connect();
+        lights[i].samples = malloc(MAX_SAMPLES * sizeof(unsigned));
+    }
+    for (int i = 0; i < nflood; i++) {
+        flooders[i].fd = client_connect();
+    }
+
+    atomic_store(&running, 1);
+    atomic_store(&flood_pongs, 0);
+    atomic_store(&flood_dropped, 0);
+    for (int i = 0; i < nflood; i++) {
+        pthread_create(&flooders[i].writer, NULL, flood_writer, &flooders[i]);
+        pthread_create(&flooders[i].reader, NULL, flood_reader, &flooders[i]);
+    }
+    usleep(200000);  // Let the flood build up
+    for (int i = 0; i < nlight; i++) {
+        pthread_create(&lights[i].tid, NULL, light_thread, &lights[i]);
+    }
+    struct timespec ts = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+    nanosleep(&ts, NULL);
+    unsigned long pongs = atomic_load(&flood_pongs);
+    atomic_store(&running, 0);
+
+    size_t nsamples = 0;
+    for (int i = 0; i < nlight; i++) {
+        shutdown(lights[i].fd, SHUT_WR);  // Lets a thread waiting for a PONG see EOF
+        pthread_join(lights[i].tid, NULL);
+        close(lights[i].fd);
+        nsamples += lights[i].nsamples;
+    }
+    for (int i = 0; i < nflood; i++) {
+        shutdown(flooders[i].fd, SHUT_RDWR);  // Unblocks the writer if the server has stopped reading
+        pthread_join(flooders[i].writer, NULL);
+        pthread_join(flooders[i].reader, NULL);
+        close(flooders[i].fd);
+    }
+
+    unsigned *all = malloc((nsamples + 1) * sizeof(unsigned));
+    size_t k = 0;
+    for (int i = 0; i < nlight; i++) {
+        for (unsigned j = 0; j < lights[i].nsamples; j++) {
+            all[k++] = lights[i].samples[j];
+        }
+        free(lights[i].samples);
+    }
+    qsort(all, nsamples, sizeof(unsigned), cmp_unsigned);
+    printf("%-8s p50 %7u us   p99 %7u us   max %7u us   %8zu pings   flood %10.0f cmds/s",
+           name, nsamples ? all[nsamples / 2] : 0, nsamples ? all[nsamples * 99 / 100] : 0,
+           nsamples ? all[nsamples - 1] : 0, nsamples, pongs / (seconds + 0.2));
+    int dropped = atomic_load(&flood_dropped);
+    printf(dropped ? "   (%d flooders disconnected)\n" : "\n", dropped);
+    free(all);
+    free(lights);
+    free(flooders);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <port> [light clients] [flooders] [seconds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    port = atoi(argv[1]);
+    int nlight = argc > 2 ? atoi(argv[2]) : 32;
+    int nflood = argc > 3 ? atoi(argv[3]) : 1;
+    double seconds = argc > 4 ? atof(argv[4]) : 3.0;
+
+    printf("%d light clients, %d flooders, %.1f s each\n", nlight, nflood, seconds);
+    run("alone", nlight, 0, seconds);
+    run("flooded", nlight, nflood, seconds);
+    return 0;
+}